@@ -0,0 +1,1384 @@
+/*
+ * jpeg_parse.c
+ * 
+ * Implementation of jpeg_parse.h
+ * 
+ * See the header for further information.
+ */
+
+#include "jpeg_parse.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JPEG_SCAN_SSE2
+#endif
+
+#if defined(__GNUC__) && defined(JPEG_SCAN_SSE2) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define JPEG_SCAN_AVX2
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JPEG_SCAN_NEON
+#endif
+
+/*
+ * Parser states.
+ * 
+ * PREMARK is the state between markers, where the next byte must be
+ * the 0xFF pre-marker byte.  MARKER is after at least one 0xFF byte has
+ * been read and the actual marker byte is expected.  LEN1 and LEN2 are
+ * waiting for the first and second bytes of the marker length.  PAYLOAD
+ * is skipping over the marker data payload.  ENTROPY is skipping over
+ * compressed data after an SOS marker, and ENTROPY_FF is after at least
+ * one 0xFF byte has been read within compressed data.
+ */
+#define PSTATE_PREMARK    (0)
+#define PSTATE_MARKER     (1)
+#define PSTATE_LEN1       (2)
+#define PSTATE_LEN2       (3)
+#define PSTATE_PAYLOAD    (4)
+#define PSTATE_ENTROPY    (5)
+#define PSTATE_ENTROPY_FF (6)
+
+/*
+ * Special error message that a marker callback returns to stop the
+ * parser without an actual error.
+ */
+const char jpeg_stop_msg[] = "Parser stopped!";
+
+/*
+ * Compute the JPEG_MF flags of marker byte c as a constant expression,
+ * so that the classification table can be built at compile time.
+ */
+#define JPEG_MF_ISRST(c) (((c) >= JPEG_RST_MIN) && ((c) <= JPEG_RST_MAX))
+
+#define JPEG_MF_ISSTANDALONE(c) \
+  (((c) == JPEG_TEM) || JPEG_MF_ISRST(c) || \
+    ((c) == JPEG_SOI) || ((c) == JPEG_EOI))
+
+#define JPEG_MF_ISSOF(c) \
+  (((c) >= JPEG_SOF_0) && ((c) <= JPEG_SOF_15) && \
+    ((c) != JPEG_DHT) && ((c) != JPEG_JPG) && ((c) != JPEG_DAC))
+
+#define JPEG_MF_OF(c) ( \
+  ((c) == JPEG_PREMARK) ? 0 : ( \
+    (JPEG_MF_ISSTANDALONE(c) ? JPEG_MF_STANDALONE : JPEG_MF_PAYLOAD) | \
+    ((JPEG_MF_ISRST(c) || ((c) == JPEG_DNL)) ? JPEG_MF_IMMEDIATE : 0) | \
+    (JPEG_MF_ISRST(c) ? JPEG_MF_RST : 0) | \
+    (JPEG_MF_ISSOF(c) ? JPEG_MF_SOF : 0)))
+
+#define JPEG_MF_ROW(r) \
+  JPEG_MF_OF((r) +  0), JPEG_MF_OF((r) +  1), JPEG_MF_OF((r) +  2), \
+  JPEG_MF_OF((r) +  3), JPEG_MF_OF((r) +  4), JPEG_MF_OF((r) +  5), \
+  JPEG_MF_OF((r) +  6), JPEG_MF_OF((r) +  7), JPEG_MF_OF((r) +  8), \
+  JPEG_MF_OF((r) +  9), JPEG_MF_OF((r) + 10), JPEG_MF_OF((r) + 11), \
+  JPEG_MF_OF((r) + 12), JPEG_MF_OF((r) + 13), JPEG_MF_OF((r) + 14), \
+  JPEG_MF_OF((r) + 15)
+
+/*
+ * Marker classification flags, indexed by marker byte.
+ */
+const unsigned char jpeg_marker_flags[256] = {
+  JPEG_MF_ROW(0x00),
+  JPEG_MF_ROW(0x10),
+  JPEG_MF_ROW(0x20),
+  JPEG_MF_ROW(0x30),
+  JPEG_MF_ROW(0x40),
+  JPEG_MF_ROW(0x50),
+  JPEG_MF_ROW(0x60),
+  JPEG_MF_ROW(0x70),
+  JPEG_MF_ROW(0x80),
+  JPEG_MF_ROW(0x90),
+  JPEG_MF_ROW(0xA0),
+  JPEG_MF_ROW(0xB0),
+  JPEG_MF_ROW(0xC0),
+  JPEG_MF_ROW(0xD0),
+  JPEG_MF_ROW(0xE0),
+  JPEG_MF_ROW(0xF0)
+};
+
+/*
+ * Printable marker names, indexed by marker byte.
+ */
+const char *const jpeg_marker_names[256] = {
+  [JPEG_TEM]          = "TEM",
+  [JPEG_SOF_0]        = "SOF(0)",
+  [JPEG_SOF_1]        = "SOF(1)",
+  [JPEG_SOF_2]        = "SOF(2)",
+  [JPEG_SOF_3]        = "SOF(3)",
+  [JPEG_DHT]          = "DHT",
+  [JPEG_SOF_5]        = "SOF(5)",
+  [JPEG_SOF_6]        = "SOF(6)",
+  [JPEG_SOF_7]        = "SOF(7)",
+  [JPEG_SOF_9]        = "SOF(9)",
+  [JPEG_SOF_10]       = "SOF(10)",
+  [JPEG_SOF_11]       = "SOF(11)",
+  [JPEG_DAC]          = "DAC",
+  [JPEG_SOF_13]       = "SOF(13)",
+  [JPEG_SOF_14]       = "SOF(14)",
+  [JPEG_SOF_15]       = "SOF(15)",
+  [JPEG_RST_MIN]      = "RST(0)",
+  [JPEG_RST_MIN + 1]  = "RST(1)",
+  [JPEG_RST_MIN + 2]  = "RST(2)",
+  [JPEG_RST_MIN + 3]  = "RST(3)",
+  [JPEG_RST_MIN + 4]  = "RST(4)",
+  [JPEG_RST_MIN + 5]  = "RST(5)",
+  [JPEG_RST_MIN + 6]  = "RST(6)",
+  [JPEG_RST_MIN + 7]  = "RST(7)",
+  [JPEG_SOI]          = "SOI",
+  [JPEG_EOI]          = "EOI",
+  [JPEG_SOS]          = "SOS",
+  [JPEG_DQT]          = "DQT",
+  [JPEG_DNL]          = "DNL",
+  [JPEG_DRI]          = "DRI",
+  [JPEG_DHP]          = "DHP",
+  [JPEG_EXP]          = "EXP",
+  [JPEG_APP_MIN]      = "APP(0)",
+  [JPEG_APP_MIN + 1]  = "APP(1)",
+  [JPEG_APP_MIN + 2]  = "APP(2)",
+  [JPEG_APP_MIN + 3]  = "APP(3)",
+  [JPEG_APP_MIN + 4]  = "APP(4)",
+  [JPEG_APP_MIN + 5]  = "APP(5)",
+  [JPEG_APP_MIN + 6]  = "APP(6)",
+  [JPEG_APP_MIN + 7]  = "APP(7)",
+  [JPEG_APP_MIN + 8]  = "APP(8)",
+  [JPEG_APP_MIN + 9]  = "APP(9)",
+  [JPEG_APP_MIN + 10] = "APP(10)",
+  [JPEG_APP_MIN + 11] = "APP(11)",
+  [JPEG_APP_MIN + 12] = "APP(12)",
+  [JPEG_APP_MIN + 13] = "APP(13)",
+  [JPEG_APP_MIN + 14] = "APP(14)",
+  [JPEG_APP_MIN + 15] = "APP(15)",
+  [JPEG_COM]          = "COM"
+};
+
+/* Function prototypes */
+static size_t jpeg_scanScalar(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst);
+#ifdef JPEG_SCAN_SSE2
+static size_t jpeg_scanSSE2(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst);
+#endif
+#ifdef JPEG_SCAN_AVX2
+static size_t jpeg_scanAVX2(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst);
+#endif
+#ifdef JPEG_SCAN_NEON
+static size_t jpeg_scanNEON(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst);
+#endif
+static int jpeg_parserMarker(JPEG_PARSER *pp);
+static size_t jpeg_parserRun(
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len);
+static const char *jpeg_pullMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+
+/*
+ * Return whether the given marker is a stand-alone JPEG marker.
+ * 
+ * A stand-alone JPEG marker carries no data and has no data length
+ * following it.
+ * 
+ * c is the marker byte, which must be in range 0x00-0xFE.
+ * 
+ * Parameters:
+ * 
+ *   c - the marker byte to check
+ * 
+ * Return:
+ * 
+ *   non-zero if this is a stand-alone marker, zero if not
+ */
+int jpeg_isStandAlone(int c) {
+  
+  /* Check parameter */
+  if ((c < 0) || (c > 0xfe)) {
+    abort();
+  }
+  
+  /* Look up the marker */
+  return ((jpeg_marker_flags[c] & JPEG_MF_STANDALONE) != 0);
+}
+
+/*
+ * Return whether a given marker is an "immediate" JPEG marker.
+ * 
+ * Immediate markers can occur within compressed data.  These are the
+ * RST markers and the DNL marker.  The special zero-escape marker is
+ * not considered an immediate because it is not a real marker.
+ * 
+ * c is the marker byte, which must be in range 0x00-0xFE.
+ * 
+ * Parameters:
+ * 
+ *   c - the marker byte to check
+ * 
+ * Return:
+ * 
+ *   non-zero if this is an immediate marker, zero if not
+ */
+int jpeg_isImmediate(int c) {
+  
+  /* Check parameter */
+  if ((c < 0) || (c > 0xfe)) {
+    abort();
+  }
+  
+  /* Look up the marker */
+  return ((jpeg_marker_flags[c] & JPEG_MF_IMMEDIATE) != 0);
+}
+
+/*
+ * Return whether a given marker is a Start Of Frame marker.
+ * 
+ * These are 0xC0 through 0xCF, except for DHT, JPG, and DAC, which
+ * share the range.
+ * 
+ * c is the marker byte, which must be in range 0x00-0xFE.
+ * 
+ * Parameters:
+ * 
+ *   c - the marker byte to check
+ * 
+ * Return:
+ * 
+ *   non-zero if this is an SOF marker, zero if not
+ */
+int jpeg_isSOF(int c) {
+  
+  /* Check parameter */
+  if ((c < 0) || (c > 0xfe)) {
+    abort();
+  }
+  
+  /* Look up the marker */
+  return ((jpeg_marker_flags[c] & JPEG_MF_SOF) != 0);
+}
+
+/*
+ * Portable scalar compressed data search kernel.
+ * 
+ * This uses memchr() to find each 0xFF byte.  See JPEG_SCAN_FN for the
+ * interface.
+ */
+static size_t jpeg_scanScalar(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst) {
+  
+  const unsigned char *p = NULL;
+  const unsigned char *pEnd = NULL;
+  const unsigned char *pHit = NULL;
+  int c = 0;
+  
+  /* Check parameters */
+  if ((pBuf == NULL) && (len > 0)) {
+    abort();
+  }
+  
+  /* Go through each 0xFF byte */
+  p = pBuf;
+  pEnd = pBuf + len;
+  while (p < pEnd) {
+    
+    /* Find the next 0xFF byte, or skip everything if none */
+    pHit = (const unsigned char *) memchr(
+              p, JPEG_PREMARK, (size_t) (pEnd - p));
+    if (pHit == NULL) {
+      return len;
+    }
+    
+    /* Stop if the following byte isn't in the buffer */
+    if (pHit + 1 >= pEnd) {
+      break;
+    }
+    
+    /* Skip stuffed zeros and, if requested, restart markers; stop at
+     * anything else */
+    c = pHit[1];
+    if ((c == 0) || (skip_rst && (jpeg_marker_flags[c] & JPEG_MF_RST))) {
+      p = pHit + 2;
+    } else {
+      break;
+    }
+  }
+  
+  /* Return the position we stopped at */
+  if (p >= pEnd) {
+    return len;
+  }
+  return (size_t) (pHit - pBuf);
+}
+
+#ifdef JPEG_SCAN_SSE2
+/*
+ * SSE2 compressed data search kernel.
+ * 
+ * Data is checked 64 bytes at a time for any 0xFF byte.  When there is
+ * one, each 16-byte group is compared against the bytes shifted by one
+ * position so that stuffed zeros and restart markers are filtered out
+ * without leaving the vector registers.  See JPEG_SCAN_FN for the
+ * interface.
+ */
+static size_t jpeg_scanSSE2(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst) {
+  
+  size_t i = 0;
+  size_t k = 0;
+  unsigned int m = 0;
+  __m128i vff, vzero, vrmask, vrst;
+  __m128i va, vb, vok;
+  
+  /* Check parameters */
+  if ((pBuf == NULL) && (len > 0)) {
+    abort();
+  }
+  
+  /* Set up constants */
+  vff = _mm_set1_epi8((char) JPEG_PREMARK);
+  vzero = _mm_setzero_si128();
+  vrmask = _mm_set1_epi8((char) 0xf8);
+  vrst = _mm_set1_epi8((char) JPEG_RST_MIN);
+  
+  /* Go through the buffer in 64-byte chunks, as long as the byte after
+   * each chunk is also in the buffer */
+  for( ; len - i > 64; i += 64) {
+    
+    /* Skip the chunk if it has no 0xFF bytes at all, which is by far
+     * the most common case */
+    va = _mm_or_si128(
+          _mm_or_si128(
+            _mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) (pBuf + i)), vff),
+            _mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) (pBuf + i + 16)), vff)),
+          _mm_or_si128(
+            _mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) (pBuf + i + 32)), vff),
+            _mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) (pBuf + i + 48)), vff)));
+    if (_mm_movemask_epi8(va) == 0) {
+      continue;
+    }
+    
+    /* Filter each 16-byte group in the chunk */
+    for(k = i; k < i + 64; k += 16) {
+      va = _mm_loadu_si128((const __m128i *) (pBuf + k));
+      vb = _mm_loadu_si128((const __m128i *) (pBuf + k + 1));
+      
+      vok = _mm_cmpeq_epi8(vb, vzero);
+      if (skip_rst) {
+        vok = _mm_or_si128(vok,
+                _mm_cmpeq_epi8(_mm_and_si128(vb, vrmask), vrst));
+      }
+      
+      m = (unsigned int) _mm_movemask_epi8(
+            _mm_andnot_si128(vok, _mm_cmpeq_epi8(va, vff)));
+      if (m != 0) {
+        return k + (size_t) __builtin_ctz(m);
+      }
+    }
+  }
+  
+  /* Use the scalar kernel for whatever is left */
+  return i + jpeg_scanScalar(pBuf + i, len - i, skip_rst);
+}
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+/*
+ * AVX2 compressed data search kernel.
+ * 
+ * This works the same way as the SSE2 kernel, except with 32-byte
+ * groups.  It is only used if the processor supports AVX2 at runtime.
+ * See JPEG_SCAN_FN for the interface.
+ */
+__attribute__((target("avx2")))
+static size_t jpeg_scanAVX2(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst) {
+  
+  size_t i = 0;
+  size_t k = 0;
+  unsigned int m = 0;
+  __m256i vff, vzero, vrmask, vrst;
+  __m256i va, vb, vok;
+  
+  /* Check parameters */
+  if ((pBuf == NULL) && (len > 0)) {
+    abort();
+  }
+  
+  /* Set up constants */
+  vff = _mm256_set1_epi8((char) JPEG_PREMARK);
+  vzero = _mm256_setzero_si256();
+  vrmask = _mm256_set1_epi8((char) 0xf8);
+  vrst = _mm256_set1_epi8((char) JPEG_RST_MIN);
+  
+  /* Go through the buffer in 64-byte chunks, as long as the byte after
+   * each chunk is also in the buffer */
+  for( ; len - i > 64; i += 64) {
+    
+    /* Skip the chunk if it has no 0xFF bytes at all */
+    va = _mm256_or_si256(
+          _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) (pBuf + i)), vff),
+          _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) (pBuf + i + 32)), vff));
+    if (_mm256_movemask_epi8(va) == 0) {
+      continue;
+    }
+    
+    /* Filter each 32-byte group in the chunk */
+    for(k = i; k < i + 64; k += 32) {
+      va = _mm256_loadu_si256((const __m256i *) (pBuf + k));
+      vb = _mm256_loadu_si256((const __m256i *) (pBuf + k + 1));
+      
+      vok = _mm256_cmpeq_epi8(vb, vzero);
+      if (skip_rst) {
+        vok = _mm256_or_si256(vok,
+                _mm256_cmpeq_epi8(_mm256_and_si256(vb, vrmask), vrst));
+      }
+      
+      m = (unsigned int) _mm256_movemask_epi8(
+            _mm256_andnot_si256(vok, _mm256_cmpeq_epi8(va, vff)));
+      if (m != 0) {
+        return k + (size_t) __builtin_ctz(m);
+      }
+    }
+  }
+  
+  /* Use the scalar kernel for whatever is left */
+  return i + jpeg_scanScalar(pBuf + i, len - i, skip_rst);
+}
+#endif
+
+#ifdef JPEG_SCAN_NEON
+/*
+ * NEON compressed data search kernel.
+ * 
+ * This works the same way as the SSE2 kernel with 16-byte groups.
+ * NEON has no byte mask instruction, so a 64-bit mask with four bits
+ * per byte is formed with a narrowing shift instead.  See JPEG_SCAN_FN
+ * for the interface.
+ */
+static size_t jpeg_scanNEON(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst) {
+  
+  size_t i = 0;
+  uint64_t m = 0;
+  uint8x16_t vff, vzero, vrmask, vrst;
+  uint8x16_t va, vb, vok;
+  
+  /* Check parameters */
+  if ((pBuf == NULL) && (len > 0)) {
+    abort();
+  }
+  
+  /* Set up constants */
+  vff = vdupq_n_u8(JPEG_PREMARK);
+  vzero = vdupq_n_u8(0);
+  vrmask = vdupq_n_u8(0xf8);
+  vrst = vdupq_n_u8(JPEG_RST_MIN);
+  
+  /* Go through the buffer in 16-byte groups, as long as the byte after
+   * each group is also in the buffer */
+  for( ; len - i > 16; i += 16) {
+    
+    /* Skip the group if it has no 0xFF bytes */
+    va = vceqq_u8(vld1q_u8(pBuf + i), vff);
+    m = vget_lane_u64(vreinterpret_u64_u8(
+          vshrn_n_u16(vreinterpretq_u16_u8(va), 4)), 0);
+    if (m == 0) {
+      continue;
+    }
+    
+    /* Filter out stuffed zeros and restart markers */
+    vb = vld1q_u8(pBuf + i + 1);
+    vok = vceqq_u8(vb, vzero);
+    if (skip_rst) {
+      vok = vorrq_u8(vok, vceqq_u8(vandq_u8(vb, vrmask), vrst));
+    }
+    
+    va = vbicq_u8(va, vok);
+    m = vget_lane_u64(vreinterpret_u64_u8(
+          vshrn_n_u16(vreinterpretq_u16_u8(va), 4)), 0);
+    if (m != 0) {
+      return i + (size_t) (__builtin_ctzll(m) >> 2);
+    }
+  }
+  
+  /* Use the scalar kernel for whatever is left */
+  return i + jpeg_scanScalar(pBuf + i, len - i, skip_rst);
+}
+#endif
+
+/*
+ * Choose the fastest compressed data search kernel that is supported
+ * by the processor the program is currently running on.
+ * 
+ * Return:
+ * 
+ *   the search kernel
+ */
+JPEG_SCAN_FN jpeg_scanSelect(void) {
+  
+  JPEG_SCAN_FN f = &jpeg_scanScalar;
+
+#ifdef JPEG_SCAN_SSE2
+  f = &jpeg_scanSSE2;
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    f = &jpeg_scanAVX2;
+  }
+#endif
+
+#ifdef JPEG_SCAN_NEON
+  f = &jpeg_scanNEON;
+#endif
+  
+  return f;
+}
+
+/*
+ * Initialize a parser so that it is ready to parse a stream from its
+ * beginning.
+ * 
+ * To parse starting at a marker somewhere in the middle of a stream,
+ * set the offset field of the parser to the stream offset of the first
+ * byte that will be passed after initialization.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser to initialize
+ * 
+ *   fMarker - the callback that markers are reported to
+ * 
+ *   pCustom - custom data pointer passed through to the callback
+ * 
+ *   immed - non-zero to report immediate markers within compressed data
+ *   to the callback, zero to skip over them
+ */
+void jpeg_parserInit(
+    JPEG_PARSER    * pp,
+    JPEG_MARKER_FN   fMarker,
+    void           * pCustom,
+    int              immed) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || (fMarker == NULL)) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pp, 0, sizeof(JPEG_PARSER));
+  
+  pp->state = PSTATE_PREMARK;
+  pp->marker = 0;
+  pp->eoi_read = 0;
+  pp->immed = immed;
+  pp->remain = 0;
+  pp->head_len = 0;
+  pp->pay_len = 0;
+  pp->offset = 0;
+  pp->mark_pos = 0;
+  pp->fMarker = fMarker;
+  pp->pCustom = pCustom;
+  pp->fScan = jpeg_scanSelect();
+  pp->pErr = NULL;
+  pp->pause = 0;
+}
+
+/*
+ * Process the marker byte that was just read for the marker beginning
+ * at mark_pos.
+ * 
+ * The marker byte must already be stored in the marker field of the
+ * parser.  Stand-alone markers are reported right away.  Otherwise, the
+ * parser moves on to reading the marker length.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the callback raised an error
+ */
+static int jpeg_parserMarker(JPEG_PARSER *pp) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* If this is a stand-alone marker, report it and return to waiting
+   * for the next marker; else, read the length */
+  if (jpeg_marker_flags[pp->marker] & JPEG_MF_STANDALONE) {
+    pp->pErr = pp->fMarker(pp->pCustom, pp->marker, 0, pp->mark_pos);
+    if (pp->pErr != NULL) {
+      return 0;
+    }
+    
+    if (pp->marker == JPEG_EOI) {
+      pp->eoi_read = 1;
+    } else {
+      pp->eoi_read = 0;
+    }
+    pp->state = PSTATE_PREMARK;
+    
+  } else {
+    pp->head_len = 0;
+    pp->state = PSTATE_LEN1;
+  }
+  
+  return 1;
+}
+
+/*
+ * Run the parser over a block of input data until the block is used
+ * up, the parser stops on an error, or the pause flag is set by the
+ * callback.
+ * 
+ * The stream offset of the parser is advanced by the number of bytes
+ * consumed.  If the parser has already stopped on an error, nothing is
+ * consumed.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser
+ * 
+ *   pBuf - the block of data
+ * 
+ *   len - the number of bytes in the block
+ * 
+ * Return:
+ * 
+ *   the number of bytes consumed
+ */
+static size_t jpeg_parserRun(
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len) {
+  
+  const unsigned char *p = NULL;
+  const unsigned char *pEnd = NULL;
+  size_t skip = 0;
+  size_t n = 0;
+  int c = 0;
+  
+  /* Check parameters */
+  if ((pp == NULL) || ((pBuf == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Go through the block until done, stopped, or paused */
+  p = pBuf;
+  pEnd = pBuf + len;
+  while ((p < pEnd) && (pp->pErr == NULL) && (!(pp->pause))) {
+    switch (pp->state) {
+      
+      case PSTATE_PREMARK:
+        /* Expecting the pre-marker byte */
+        if (*p != JPEG_PREMARK) {
+          pp->pErr = "Missing pre-marker byte!";
+          break;
+        }
+        pp->mark_pos = pp->offset + (int64_t) (p - pBuf);
+        pp->state = PSTATE_MARKER;
+        p++;
+        break;
+      
+      case PSTATE_MARKER:
+        /* Skip any additional pre-marker bytes, keeping track of the
+         * last one; anything else is the marker byte */
+        c = *p;
+        if (c == JPEG_PREMARK) {
+          pp->mark_pos = pp->offset + (int64_t) (p - pBuf);
+          p++;
+          break;
+        }
+        p++;
+        
+        pp->marker = c;
+        jpeg_parserMarker(pp);
+        break;
+      
+      case PSTATE_LEN1:
+        /* First length byte */
+        pp->remain = (((long) *p) << 8);
+        pp->state = PSTATE_LEN2;
+        p++;
+        break;
+      
+      case PSTATE_LEN2:
+        /* Second length byte, which completes a length that must be at
+         * least two to account for the two length bytes */
+        pp->remain |= ((long) *p);
+        p++;
+        if (pp->remain < 2) {
+          pp->pErr = "Marker length less than two!";
+          break;
+        }
+        
+        /* Subtract two from marker length because we've already read
+         * the length bytes */
+        pp->remain -= 2;
+        pp->pay_len = pp->remain;
+        pp->state = PSTATE_PAYLOAD;
+        break;
+      
+      case PSTATE_PAYLOAD:
+        /* Skip over as much of the data payload as is in this block */
+        skip = (size_t) (pEnd - p);
+        if ((long) skip > pp->remain) {
+          skip = (size_t) pp->remain;
+        }
+        
+        /* Keep the start of the payload for the callback */
+        if (pp->head_len < JPEG_HEAD_MAX) {
+          n = JPEG_HEAD_MAX - pp->head_len;
+          if (n > skip) {
+            n = skip;
+          }
+          memcpy(&((pp->head)[pp->head_len]), p, n);
+          pp->head_len += (int) n;
+        }
+        
+        p += skip;
+        pp->remain -= (long) skip;
+        
+        /* If we have skipped the whole payload, the marker is done; an
+         * SOS marker is followed by compressed data */
+        if (pp->remain < 1) {
+          pp->pErr = pp->fMarker(pp->pCustom, pp->marker, 0, pp->mark_pos);
+          if (pp->pErr != NULL) {
+            break;
+          }
+          
+          pp->eoi_read = 0;
+          pp->head_len = 0;
+          pp->pay_len = 0;
+          if (pp->marker == JPEG_SOS) {
+            pp->state = PSTATE_ENTROPY;
+          } else {
+            pp->state = PSTATE_PREMARK;
+          }
+        }
+        break;
+      
+      case PSTATE_ENTROPY:
+        /* Search for the next 0xFF byte in compressed data that isn't
+         * just a stuffed zero (or a restart marker, if we aren't
+         * reporting those); if there is none in this block, we can skip
+         * the rest of the block */
+        skip = pp->fScan(p, (size_t) (pEnd - p), !(pp->immed));
+        if (skip >= (size_t) (pEnd - p)) {
+          p = pEnd;
+          break;
+        }
+        
+        p += skip;
+        pp->mark_pos = pp->offset + (int64_t) (p - pBuf);
+        pp->state = PSTATE_ENTROPY_FF;
+        p++;
+        break;
+      
+      case PSTATE_ENTROPY_FF:
+        /* Read the potential marker byte, skipping over any additional
+         * pre-marker bytes */
+        c = *p;
+        if (c == JPEG_PREMARK) {
+          pp->mark_pos = pp->offset + (int64_t) (p - pBuf);
+          p++;
+          break;
+        }
+        p++;
+        
+        /* If the marker is zero, then ignore it and continue because
+         * this is simply an escape for 0xFF bytes within compressed
+         * data; if the marker is immediate, then report it if requested
+         * and proceed; if the marker is non-immediate, then the
+         * compressed data is over and this is the next marker
+         * 
+         * We also check for the immediate DNL and raise an error in
+         * that case because it's rarely used and it carries a data
+         * payload, which we don't support here for immediates */
+        if (c == 0) {
+          pp->state = PSTATE_ENTROPY;
+          
+        } else if (jpeg_marker_flags[c] & JPEG_MF_IMMEDIATE) {
+          if (pp->immed) {
+            pp->pErr = pp->fMarker(pp->pCustom, c, 1, pp->mark_pos);
+            if (pp->pErr != NULL) {
+              break;
+            }
+          }
+          if (c == JPEG_DNL) {
+            pp->pErr = "DNL markers not supported!";
+            break;
+          }
+          pp->state = PSTATE_ENTROPY;
+          
+        } else {
+          pp->marker = c;
+          jpeg_parserMarker(pp);
+        }
+        break;
+      
+      default:
+        /* Unrecognized state */
+        abort();
+    }
+  }
+  
+  /* Update the stream offset */
+  pp->offset += (int64_t) (p - pBuf);
+  
+  return (size_t) (p - pBuf);
+}
+
+/*
+ * Pass the next block of input data through the parser.
+ * 
+ * Blocks must be passed in stream order, and may be of any length.
+ * The parser keeps its state from block to block, so it doesn't matter
+ * where the block boundaries fall.  The callback is invoked for each
+ * marker that is completed within this block.
+ * 
+ * If the parser has already stopped on an error, this call fails
+ * without doing anything.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser
+ * 
+ *   pBuf - the block of data
+ * 
+ *   len - the number of bytes in the block
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the parser stopped on an error, in
+ *   which case pErr in the parser has the error message
+ */
+int jpeg_parserFeed(
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || ((pBuf == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Run the parser over the whole block */
+  jpeg_parserRun(pp, pBuf, len);
+  
+  /* Return whether successful */
+  if (pp->pErr != NULL) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Inform the parser that the end of input has been reached.
+ * 
+ * This checks that the stream did not end in the middle of something,
+ * and that the last marker read was EOI.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser
+ * 
+ * Return:
+ * 
+ *   non-zero if the stream ended properly, zero if not, in which case
+ *   pErr in the parser has the error message
+ */
+int jpeg_parserFinish(JPEG_PARSER *pp) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Fail if parser already stopped */
+  if (pp->pErr != NULL) {
+    return 0;
+  }
+  
+  /* Check that the stream ended at a proper place */
+  switch (pp->state) {
+    
+    case PSTATE_PREMARK:
+      /* Make sure that the last marker we read was EOI */
+      if (!(pp->eoi_read)) {
+        pp->pErr = "Missing EOI marker!";
+      }
+      break;
+    
+    case PSTATE_MARKER:
+      pp->pErr = "Missing marker byte!";
+      break;
+    
+    case PSTATE_LEN1:
+      pp->pErr = "Missing marker length!";
+      break;
+    
+    case PSTATE_LEN2:
+      pp->pErr = "Partial marker length!";
+      break;
+    
+    case PSTATE_PAYLOAD:
+      /* Truncated payload counts as entering compressed data for SOS,
+       * and as the last marker not being EOI otherwise */
+      if (pp->marker == JPEG_SOS) {
+        pp->pErr = "EOF in compressed stream!";
+      } else {
+        pp->pErr = "Missing EOI marker!";
+      }
+      break;
+    
+    case PSTATE_ENTROPY:
+    case PSTATE_ENTROPY_FF:
+      pp->pErr = "EOF in compressed stream!";
+      break;
+    
+    default:
+      /* Unrecognized state */
+      abort();
+  }
+  
+  /* Return whether successful */
+  if (pp->pErr != NULL) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Run the parser over a whole stdio stream, reading it in blocks.
+ * 
+ * The stream is read from its current position until end of file, or
+ * until limit bytes have been read, and each block is passed to
+ * jpeg_parserFeed().  This does not call
+ * jpeg_parserFinish(), so the caller can do that once it is ready.
+ * 
+ * If there is a read error, the parser is stopped with the error
+ * message "I/O error!" in pErr.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parser
+ * 
+ *   pIn - the stream to read
+ * 
+ *   pBuf - the buffer to read blocks into
+ * 
+ *   block_size - the size of the buffer in bytes, which must be at
+ *   least one
+ * 
+ *   limit - the most bytes to read, or -1 to read until end of file
+ * 
+ * Return:
+ * 
+ *   non-zero if the stream was read and parsed, zero if the
+ *   parser stopped on an error, in which case pErr in the parser has
+ *   the error message
+ */
+int jpeg_parserRead(
+    JPEG_PARSER   * pp,
+    FILE          * pIn,
+    unsigned char * pBuf,
+    size_t          block_size,
+    int64_t         limit) {
+  
+  size_t want = 0;
+  size_t got = 0;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pIn == NULL) || (pBuf == NULL) ||
+      (block_size < 1) || (limit < -1)) {
+    abort();
+  }
+  
+  /* Read and parse each block until a partial block or the limit */
+  while ((pp->pErr == NULL) && (limit != 0)) {
+    
+    /* Read the next block, no further than the limit */
+    want = block_size;
+    if ((limit > 0) && ((uint64_t) limit < (uint64_t) want)) {
+      want = (size_t) limit;
+    }
+    got = fread(pBuf, 1, want, pIn);
+    if (limit > 0) {
+      limit -= (int64_t) got;
+    }
+    
+    /* Parse whatever we got */
+    if (got > 0) {
+      if (!jpeg_parserFeed(pp, pBuf, got)) {
+        break;
+      }
+    }
+    
+    /* A partial block means either EOF or an I/O error */
+    if (got < want) {
+      if (ferror(pIn)) {
+        pp->pErr = "I/O error!";
+      }
+      break;
+    }
+  }
+  
+  /* Return whether successful */
+  if (pp->pErr != NULL) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Marker callback used by the pull interface.
+ * 
+ * The marker is copied into the event of the JPEG_PULL and the parser
+ * is paused so that jpeg_pullNext() can return it.
+ */
+static const char *jpeg_pullMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos) {
+  
+  JPEG_PULL *pl = NULL;
+  
+  /* Get the pull parser */
+  pl = (JPEG_PULL *) pCustom;
+  
+  /* Capture the event */
+  pl->ev.c = c;
+  pl->ev.immed = immed;
+  pl->ev.pos = pos;
+  pl->ev.head_len = pl->parser.head_len;
+  pl->ev.pay_len = pl->parser.pay_len;
+  memcpy(pl->ev.head, pl->parser.head, (size_t) pl->parser.head_len);
+  pl->have = 1;
+  
+  /* Pause the parser so the event can be returned */
+  pl->parser.pause = 1;
+  
+  return NULL;
+}
+
+/*
+ * Initialize a pull parser so that it is ready to parse a stream from
+ * its beginning.
+ * 
+ * As with jpeg_parserInit(), to start at a marker in the middle of a
+ * stream, set parser.offset to the stream offset of the first byte that
+ * will be supplied.
+ * 
+ * Parameters:
+ * 
+ *   pl - the pull parser to initialize
+ * 
+ *   immed - non-zero to return immediate markers within compressed data
+ *   as events, zero to skip over them
+ */
+void jpeg_pullInit(JPEG_PULL *pl, int immed) {
+  
+  /* Check parameter */
+  if (pl == NULL) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pl, 0, sizeof(JPEG_PULL));
+  
+  jpeg_parserInit(&(pl->parser), &jpeg_pullMarker, pl, immed);
+  pl->pData = NULL;
+  pl->len = 0;
+  pl->have = 0;
+  pl->ended = 0;
+}
+
+/*
+ * Supply the next block of the stream to a pull parser.
+ * 
+ * This may only be called after jpeg_pullNext() has returned
+ * JPEG_PULL_MORE, or before the first call to it.  The block is not
+ * copied, so it must remain valid until jpeg_pullNext() returns
+ * JPEG_PULL_MORE again.
+ * 
+ * Parameters:
+ * 
+ *   pl - the pull parser
+ * 
+ *   pBuf - the block of data
+ * 
+ *   len - the number of bytes in the block
+ */
+void jpeg_pullSupply(
+    JPEG_PULL           * pl,
+    const unsigned char * pBuf,
+    size_t                len) {
+  
+  /* Check parameters */
+  if ((pl == NULL) || ((pBuf == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Check state */
+  if ((pl->len > 0) || pl->ended) {
+    abort();
+  }
+  
+  /* Set the block */
+  pl->pData = pBuf;
+  pl->len = len;
+}
+
+/*
+ * Inform a pull parser that there is no more data in the stream.
+ * 
+ * Parameters:
+ * 
+ *   pl - the pull parser
+ */
+void jpeg_pullEnd(JPEG_PULL *pl) {
+  
+  /* Check parameter */
+  if (pl == NULL) {
+    abort();
+  }
+  
+  /* Set the flag */
+  pl->ended = 1;
+}
+
+/*
+ * Get the next marker event from a pull parser.
+ * 
+ * JPEG_PULL_DONE and JPEG_PULL_ERROR are final; once either has been
+ * returned, every following call returns the same thing.
+ * 
+ * Parameters:
+ * 
+ *   pl - the pull parser
+ * 
+ *   pev - the event structure to fill in when an event is returned
+ * 
+ * Return:
+ * 
+ *   JPEG_PULL_EVENT if an event was stored in pev, JPEG_PULL_MORE if
+ *   the supplied data has been used up, JPEG_PULL_DONE if the stream
+ *   has ended properly, or JPEG_PULL_ERROR if the stream has an error,
+ *   in which case parser.pErr has the error message
+ */
+int jpeg_pullNext(JPEG_PULL *pl, JPEG_EVENT *pev) {
+  
+  size_t n = 0;
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pev == NULL)) {
+    abort();
+  }
+  
+  /* Fail if parser already stopped */
+  if (pl->parser.pErr != NULL) {
+    return JPEG_PULL_ERROR;
+  }
+  
+  /* Run the parser until it reports a marker or runs out of data */
+  while (pl->len > 0) {
+    pl->parser.pause = 0;
+    n = jpeg_parserRun(&(pl->parser), pl->pData, pl->len);
+    pl->pData += n;
+    pl->len -= n;
+    
+    if (pl->have) {
+      pl->have = 0;
+      memcpy(pev, &(pl->ev), sizeof(JPEG_EVENT));
+      return JPEG_PULL_EVENT;
+    }
+    
+    if (pl->parser.pErr != NULL) {
+      return JPEG_PULL_ERROR;
+    }
+  }
+  
+  /* If the stream hasn't ended, we need more data */
+  if (!(pl->ended)) {
+    return JPEG_PULL_MORE;
+  }
+  
+  /* Check that the stream ended properly; the finish check is the same
+   * every time, so it doesn't matter if this is called again */
+  if (!jpeg_parserFinish(&(pl->parser))) {
+    return JPEG_PULL_ERROR;
+  }
+  return JPEG_PULL_DONE;
+}
+
+/*
+ * Initialize a file mapping structure to the unmapped state.
+ * 
+ * jpeg_unmapFile() may safely be called on the structure afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pm - the structure to initialize
+ */
+void jpeg_mapInit(JPEG_MAP *pm) {
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pm, 0, sizeof(JPEG_MAP));
+  pm->fd = -1;
+  pm->pData = NULL;
+  pm->len = 0;
+}
+
+/*
+ * Map a whole file into memory for reading.
+ * 
+ * The mapping is read-only and advised for sequential access.  An
+ * empty file is "mapped" with a NULL data pointer and a length of zero.
+ * 
+ * The structure must have been initialized with jpeg_mapInit().  Use
+ * jpeg_unmapFile() to release the mapping, even if this function fails.
+ * 
+ * Parameters:
+ * 
+ *   pm - the structure to hold the mapping
+ * 
+ *   pPath - the path of the file to map
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message if the file
+ *   could not be mapped
+ */
+const char *jpeg_mapFile(JPEG_MAP *pm, const char *pPath) {
+  
+  struct stat st;
+  void *pv = NULL;
+  
+  /* Check parameters */
+  if ((pm == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  pm->pData = NULL;
+  pm->len = 0;
+  
+  /* Open the file and get its size */
+  pm->fd = open(pPath, O_RDONLY);
+  if (pm->fd < 0) {
+    return "Can't open input file!";
+  }
+  
+  if (fstat(pm->fd, &st)) {
+    return "Can't get input file size!";
+  }
+  
+  if (!S_ISREG(st.st_mode)) {
+    return "Input file must be a regular file to map!";
+  }
+  
+  if ((st.st_size < 0) || ((uintmax_t) st.st_size > (uintmax_t) SIZE_MAX)) {
+    return "Input file too large to map!";
+  }
+  pm->len = (size_t) st.st_size;
+  
+  /* Nothing to map if file is empty */
+  if (pm->len < 1) {
+    return NULL;
+  }
+  
+  /* Map the file */
+  pv = mmap(NULL, pm->len, PROT_READ, MAP_SHARED, pm->fd, 0);
+  if (pv == MAP_FAILED) {
+    pm->len = 0;
+    return "Can't map input file!";
+  }
+  pm->pData = (unsigned char *) pv;
+  
+  /* Advise sequential access so the kernel reads ahead aggressively;
+   * this is only a hint, so ignore failure */
+  posix_madvise(pv, pm->len, POSIX_MADV_SEQUENTIAL);
+  
+  return NULL;
+}
+
+/*
+ * Release a file mapping made with jpeg_mapFile().
+ * 
+ * This may be called on a structure that jpeg_mapFile() failed on, or
+ * that has already been released, in which case it does nothing more
+ * than necessary.
+ * 
+ * Parameters:
+ * 
+ *   pm - the file mapping to release
+ */
+void jpeg_unmapFile(JPEG_MAP *pm) {
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  /* Unmap data if mapped */
+  if (pm->pData != NULL) {
+    munmap((void *) pm->pData, pm->len);
+    pm->pData = NULL;
+    pm->len = 0;
+  }
+  
+  /* Close file if open */
+  if (pm->fd >= 0) {
+    close(pm->fd);
+    pm->fd = -1;
+  }
+}
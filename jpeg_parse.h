@@ -0,0 +1,392 @@
+#ifndef JPEG_PARSE_H_INCLUDED
+#define JPEG_PARSE_H_INCLUDED
+
+/*
+ * jpeg_parse.h
+ * 
+ * Incremental JPEG marker parser shared by the M-JPEG tools.
+ * 
+ * The parser is push-style: pass the stream to it in blocks of any
+ * size with jpeg_parserFeed() and it reports each marker to a callback
+ * along with its stream offset.  It keeps its state between blocks, so
+ * markers may straddle block boundaries, and it never copies or seeks
+ * the data.  Compressed data is skipped with a vectorized search.
+ * 
+ * For callers that would rather drive the loop themselves, the pull
+ * interface (JPEG_PULL) wraps the same parser and hands back one marker
+ * event at a time from the data it has been supplied.
+ * 
+ * jpeg_mapFile() maps a whole file for the parser to run over in place,
+ * and jpeg_parserRead() runs the parser over a stdio stream in blocks.
+ * 
+ * Compilation:
+ * 
+ *   Compile jpeg_parse.c along with the program that uses it.  libjpeg
+ *   is *not* required.
+ * 
+ *   Compile with 64-bit file offset support if you're going to try this
+ *   on huge M-JPEG files.  Define _FILE_OFFSET_BITS=64
+ * 
+ *   On x86, the compressed data search uses SSE2, and also AVX2 when
+ *   compiled with GCC or Clang and the processor supports it at
+ *   runtime.  On ARM, NEON is used when available.  Otherwise, a
+ *   portable scalar search is used.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The unsigned byte value used to signal markers.
+ */
+#define JPEG_PREMARK (0xff)
+
+/*
+ * JPEG marker definitions.
+ */
+#define JPEG_TEM      (0x01)    /* Temporary for arithmetic coding */
+
+#define JPEG_SOF_0    (0xC0)    /* Start Of Frame, Type 0 */
+#define JPEG_SOF_1    (0xC1)    /* Start Of Frame, Type 1 */
+#define JPEG_SOF_2    (0xC2)    /* Start Of Frame, Type 2 */
+#define JPEG_SOF_3    (0xC3)    /* Start Of Frame, Type 3 */
+
+#define JPEG_SOF_5    (0xC5)    /* Start Of Frame, Type 5 */
+#define JPEG_SOF_6    (0xC6)    /* Start Of Frame, Type 6 */
+#define JPEG_SOF_7    (0xC7)    /* Start Of Frame, Type 7 */
+
+#define JPEG_SOF_9    (0xC9)    /* Start Of Frame, Type 9 */
+#define JPEG_SOF_10   (0xCA)    /* Start Of Frame, Type 10 */
+#define JPEG_SOF_11   (0xCB)    /* Start Of Frame, Type 11 */
+
+#define JPEG_SOF_13   (0xCD)    /* Start Of Frame, Type 13 */
+#define JPEG_SOF_14   (0xCE)    /* Start Of Frame, Type 14 */
+#define JPEG_SOF_15   (0xCF)    /* Start Of Frame, Type 15 */
+
+#define JPEG_DHT      (0xC4)    /* Define Huffman Table */
+#define JPEG_JPG      (0xC8)    /* Reserved for JPEG extensions */
+#define JPEG_DAC      (0xCC)    /* Define Arithmetic Coding cond. */
+#define JPEG_DQT      (0xDB)    /* Define Quantization Tables */
+#define JPEG_DRI      (0xDD)    /* Define Restart Interval */
+#define JPEG_DHP      (0xDE)    /* Define Hierarchical Progression */
+#define JPEG_EXP      (0xDF)    /* Expand Reference Components */
+#define JPEG_COM      (0xFE)    /* Comment */
+
+#define JPEG_APP_MIN  (0xE0)    /* Application-specific data zero */
+#define JPEG_APP_MAX  (0xEF)    /* Application-specific data fifteen */
+
+#define JPEG_RST_MIN  (0xD0)    /* Restart Marker zero */
+#define JPEG_RST_MAX  (0xD7)    /* Restart Marker seven */
+#define JPEG_SOI      (0xD8)    /* Start Of Image */
+#define JPEG_EOI      (0xD9)    /* End Of Image */
+#define JPEG_SOS      (0xDA)    /* Start Of Scan */
+#define JPEG_DNL      (0xDC)    /* Define Number Of Lines */
+
+/*
+ * The maximum number of bytes at the start of each marker payload that
+ * the parser keeps for the marker callback.
+ */
+#define JPEG_HEAD_MAX (8)
+
+/*
+ * Marker classification flags, as stored in jpeg_marker_flags.
+ * 
+ * Every marker byte from 0x00 to 0xFE is either STANDALONE, meaning it
+ * carries no data and has no length following it, or PAYLOAD, meaning
+ * a length and data payload follow it.  IMMEDIATE markers are the ones
+ * that can occur within compressed data, which are the RST markers and
+ * DNL.  RST marks RST0-RST7, and SOF marks the Start Of Frame markers.
+ * The byte 0xFF is not a marker and has no flags.
+ */
+#define JPEG_MF_STANDALONE (0x01)
+#define JPEG_MF_PAYLOAD    (0x02)
+#define JPEG_MF_IMMEDIATE  (0x04)
+#define JPEG_MF_RST        (0x08)
+#define JPEG_MF_SOF        (0x10)
+
+/*
+ * Marker classification table, built at compile time.
+ * 
+ * jpeg_marker_flags[c] has the JPEG_MF flags for marker byte c, so
+ * classifying a marker is a single lookup.
+ * 
+ * jpeg_marker_names[c] is a printable name for marker byte c, such as
+ * "SOI" or "APP(1)", or NULL if the marker has no defined meaning.
+ */
+extern const unsigned char jpeg_marker_flags[256];
+extern const char *const jpeg_marker_names[256];
+
+/*
+ * Callback function type used by the parser to report markers.
+ * 
+ * pCustom is the custom data pointer that was passed when the parser
+ * was initialized.  c is the marker byte.  immed is non-zero if this is
+ * an immediate marker within compressed data, zero otherwise.  pos is
+ * the byte offset within the stream of the 0xFF byte immediately
+ * before the marker byte.
+ * 
+ * Immediate markers are only reported if the parser was initialized to
+ * report them.  Each other marker is reported once its length and data
+ * payload (if any) have been skipped.  The first bytes of the payload
+ * are kept in the parser while the marker is being reported.
+ * 
+ * The callback returns NULL to continue parsing, or else a pointer to a
+ * static error message string, which stops the parser with that error.
+ * The special JPEG_STOP error can be returned to stop the parser when
+ * the callback doesn't need to see any more of the stream.
+ */
+typedef const char *(*JPEG_MARKER_FN)(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+
+/*
+ * Special error message that a marker callback returns to stop the
+ * parser without an actual error.
+ * 
+ * When this happens, pErr in the parser is set to JPEG_STOP, so compare
+ * the pointer against JPEG_STOP to tell it apart from a real error.
+ */
+extern const char jpeg_stop_msg[];
+#define JPEG_STOP (jpeg_stop_msg)
+
+/*
+ * Function type for compressed data search kernels.
+ * 
+ * The kernel searches the len bytes at pBuf for the first 0xFF byte
+ * that the parser needs to look at.  0xFF bytes that are followed by a
+ * zero byte are stuffed zeros and are skipped.  If skip_rst is
+ * non-zero, 0xFF bytes followed by an RST0-RST7 marker byte are also
+ * skipped.  A 0xFF byte in the last position is never skipped, since
+ * the byte after it is not in the buffer.
+ * 
+ * The return value is the offset within the buffer of the 0xFF byte
+ * that was found, or len if the rest of the buffer can be skipped.
+ */
+typedef size_t (*JPEG_SCAN_FN)(
+    const unsigned char * pBuf,
+    size_t                len,
+    int                   skip_rst);
+
+/*
+ * Incremental JPEG marker parser state.
+ * 
+ * Use jpeg_parserInit() to initialize, then pass each block of input
+ * data in order to jpeg_parserFeed(), and finally call
+ * jpeg_parserFinish() once the end of input is reached.
+ */
+typedef struct {
+  
+  /*
+   * The current parser state, one of the PSTATE constants that are
+   * private to jpeg_parse.c.
+   */
+  int state;
+  
+  /*
+   * The marker byte currently being processed.
+   */
+  int marker;
+  
+  /*
+   * Flag set when the most recently completed marker was EOI.
+   */
+  int eoi_read;
+  
+  /*
+   * Flag set if immediate markers are reported to the callback.
+   */
+  int immed;
+  
+  /*
+   * The number of payload bytes remaining to skip in PAYLOAD state.
+   */
+  long remain;
+  
+  /*
+   * The first head_len bytes of the payload of the current marker, up
+   * to JPEG_HEAD_MAX.  When the callback is reporting a marker with a
+   * payload, these are the start of that payload; otherwise, head_len
+   * is zero.
+   */
+  unsigned char head[JPEG_HEAD_MAX];
+  int head_len;
+  
+  /*
+   * The length of the payload of the current marker, not counting the
+   * two length bytes.  When the callback is reporting a marker without
+   * a payload, this is zero.
+   */
+  long pay_len;
+  
+  /*
+   * The byte offset within the stream of the next byte that will be
+   * passed to the parser.
+   */
+  int64_t offset;
+  
+  /*
+   * The byte offset of the 0xFF byte immediately before the marker
+   * currently being processed.
+   */
+  int64_t mark_pos;
+  
+  /*
+   * The callback and its custom data pointer.
+   */
+  JPEG_MARKER_FN fMarker;
+  void *pCustom;
+  
+  /*
+   * The compressed data search kernel selected for this processor.
+   */
+  JPEG_SCAN_FN fScan;
+  
+  /*
+   * The error message if the parser has stopped on an error, or NULL.
+   */
+  const char *pErr;
+  
+  /*
+   * Set by the pull interface to make the parser return from feeding
+   * right after the marker that was just reported.
+   */
+  int pause;
+  
+} JPEG_PARSER;
+
+/*
+ * Return codes of jpeg_pullNext().
+ */
+#define JPEG_PULL_EVENT (1)   /* An event was returned */
+#define JPEG_PULL_MORE  (2)   /* More data must be supplied */
+#define JPEG_PULL_DONE  (3)   /* The stream ended properly */
+#define JPEG_PULL_ERROR (4)   /* The stream has an error */
+
+/*
+ * A marker event returned by the pull interface.
+ * 
+ * The fields have the same meaning as the arguments of JPEG_MARKER_FN,
+ * and the start of the marker payload (if any) is copied in, since the
+ * parser has moved on by the time the event is returned.
+ */
+typedef struct {
+  
+  /*
+   * The marker byte, whether it was an immediate marker within
+   * compressed data, and the offset of the 0xFF byte before it.
+   */
+  int c;
+  int immed;
+  int64_t pos;
+  
+  /*
+   * The first head_len bytes of the marker payload, up to
+   * JPEG_HEAD_MAX, and the full length of the payload.
+   */
+  unsigned char head[JPEG_HEAD_MAX];
+  int head_len;
+  long pay_len;
+  
+} JPEG_EVENT;
+
+/*
+ * Pull-style parser.
+ * 
+ * Use jpeg_pullInit() to initialize, then call jpeg_pullNext() in a
+ * loop.  Each time it returns JPEG_PULL_MORE, pass the next block of
+ * the stream with jpeg_pullSupply(), or call jpeg_pullEnd() if there is
+ * no more data.  A supplied block must stay valid until jpeg_pullNext()
+ * asks for more.
+ */
+typedef struct {
+  
+  /*
+   * The underlying parser.  If jpeg_pullNext() returns JPEG_PULL_ERROR,
+   * pErr in the parser has the error message.
+   */
+  JPEG_PARSER parser;
+  
+  /*
+   * The part of the supplied block that the parser hasn't consumed yet.
+   */
+  const unsigned char *pData;
+  size_t len;
+  
+  /*
+   * The event captured by the parser callback, and whether there is
+   * one waiting to be returned.
+   */
+  JPEG_EVENT ev;
+  int have;
+  
+  /*
+   * Set once jpeg_pullEnd() has been called.
+   */
+  int ended;
+  
+} JPEG_PULL;
+
+/*
+ * A file that has been mapped into memory.
+ */
+typedef struct {
+  
+  /*
+   * The file descriptor of the open file, or -1.
+   */
+  int fd;
+  
+  /*
+   * Pointer to the mapped file data, or NULL if nothing mapped.
+   */
+  unsigned char *pData;
+  
+  /*
+   * The length of the file in bytes.
+   */
+  size_t len;
+  
+} JPEG_MAP;
+
+/* Marker classification */
+int jpeg_isStandAlone(int c);
+int jpeg_isImmediate(int c);
+int jpeg_isSOF(int c);
+
+/* Push interface */
+JPEG_SCAN_FN jpeg_scanSelect(void);
+void jpeg_parserInit(
+    JPEG_PARSER    * pp,
+    JPEG_MARKER_FN   fMarker,
+    void           * pCustom,
+    int              immed);
+int jpeg_parserFeed(
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len);
+int jpeg_parserFinish(JPEG_PARSER *pp);
+int jpeg_parserRead(
+    JPEG_PARSER   * pp,
+    FILE          * pIn,
+    unsigned char * pBuf,
+    size_t          block_size,
+    int64_t         limit);
+
+/* Pull interface */
+void jpeg_pullInit(JPEG_PULL *pl, int immed);
+void jpeg_pullSupply(
+    JPEG_PULL           * pl,
+    const unsigned char * pBuf,
+    size_t                len);
+void jpeg_pullEnd(JPEG_PULL *pl);
+int jpeg_pullNext(JPEG_PULL *pl, JPEG_EVENT *pev);
+
+/* File mapping */
+void jpeg_mapInit(JPEG_MAP *pm);
+const char *jpeg_mapFile(JPEG_MAP *pm, const char *pPath);
+void jpeg_unmapFile(JPEG_MAP *pm);
+
+#endif
@@ -5,12 +5,33 @@
  * 
  * Syntax:
  * 
- *   jpgtrace [path]
+ *   jpgtrace [options] [path]
  * 
  * Parameters:
  * 
  *   [path] - the path of the JPEG file to trace
  * 
+ * Options:
+ * 
+ *   -b [mib] - size of the read blocks in MiB, in range 1 to 256; the
+ *   default is 4
+ * 
+ *   --mmap - map the whole input file into memory and parse it in place
+ *   instead of reading it in blocks
+ * 
+ *   -f [format] - the output format, either "text" (the default),
+ *   "csv", or "ndjson"
+ * 
+ *   --summary - print one record per frame instead of one per marker
+ * 
+ *   --frames [A..B] - only trace frames A through B, counting from zero,
+ *   which are looked up in the index; a single frame number traces just
+ *   that frame
+ * 
+ *   -i [index] - the index of the file made by mjpg_index, in any of
+ *   its formats, for --frames; the default is [path] with ".index"
+ *   suffixed
+ * 
  * Operation:
  * 
  *   This program works both with normal JPEG files and also with Motion
@@ -21,147 +42,425 @@
  *   All of the markers contained in the JPEG file are printed to
  *   standard output.
  * 
+ *   In the text format, each marker is printed on its own line by name,
+ *   with a blank line before the start of each frame after the first,
+ *   and the number of frames is printed at the end.
+ * 
+ *   The csv and ndjson formats are meant for other programs to read.
+ *   The csv format has a header line naming the columns, followed by
+ *   one line per record.  The ndjson format has one JSON object per
+ *   line.  Each marker record has these fields:
+ * 
+ *     frame - the frame number, counting from zero at the first SOI,
+ *     or -1 for markers before the first SOI
+ * 
+ *     offset - byte offset of the 0xFF byte before the marker
+ * 
+ *     marker - the marker byte, in decimal
+ * 
+ *     name - the marker name, such as "SOI" or "APP(0)", or empty (null
+ *     in ndjson) if the marker has no defined meaning
+ * 
+ *     immediate - 1 (true in ndjson) for restart markers within
+ *     compressed data, 0 (false) otherwise
+ * 
+ *     length - the length of the marker payload, not counting the two
+ *     length bytes, or zero for markers without a payload
+ * 
+ *   With --summary, there is one record per frame instead, which in the
+ *   text format is printed as a line of its own.  Each frame record has
+ *   these fields:
+ * 
+ *     frame - the frame number, counting from zero
+ * 
+ *     offset - byte offset of the SOI marker
+ * 
+ *     length - length of the frame in bytes, up to the end of its EOI
+ *     marker, or up to the next SOI if the frame has no EOI
+ * 
+ *     markers - the number of markers, not counting restart markers
+ * 
+ *     scans - the number of SOS markers
+ * 
+ *     restarts - the number of restart markers within compressed data
+ * 
+ *     payload - the total length of all the marker payloads
+ * 
+ *   Markers before the first SOI are not part of any frame, and are
+ *   left out of the summary.
+ * 
+ *   With --frames, the offsets of the frames are looked up in the index,
+ *   and only the bytes from the start of frame A up to the start of the
+ *   frame after B (or the end of the file, if B is the last frame) are
+ *   read and traced.  Frame numbers in the output are the same as when
+ *   tracing the whole file.  The first frame must start with an SOI
+ *   marker at the offset given in the index.  The text format reports
+ *   the number of frames that were traced.
+ * 
+ *   Output is collected in a large buffer and written in big blocks,
+ *   since tracing a long recording can print tens of millions of
+ *   records.
+ * 
+ *   The input file is read sequentially in large blocks and the parser
+ *   runs directly over each block in memory.  Compressed data is
+ *   skipped with a vectorized search that passes over stuffed zero
+ *   bytes in bulk, stopping only at markers.
+ * 
+ *   With --mmap, the input file is instead mapped into memory with
+ *   sequential access advice, and the parser runs over the mapped bytes
+ *   directly.  The input must be a regular file that fits within the
+ *   address space.
+ * 
  * Compilation:
  * 
- *   This program uses its own parser.  libjpeg is *not* required.
+ *   This program uses the parser in jpeg_parse.c and the index reader
+ *   in mjpg_idx.c, which must be compiled along with it.  libjpeg is
+ *   *not* required.  See jpeg_parse.h for further compilation notes.
  * 
  *   Compile with 64-bit file offset support if you're going to try this
  *   on huge M-JPEG files.  Define _FILE_OFFSET_BITS=64
+ * 
+ *   For example:
+ * 
+ *     cc -O2 -D_FILE_OFFSET_BITS=64 -o jpgtrace \
+ *       jpgtrace.c jpeg_parse.c mjpg_idx.c
  */
 
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "jpeg_parse.h"
+#include "mjpg_idx.h"
 
 /*
- * The unsigned byte value used to signal markers.
+ * The default, minimum, and maximum read block sizes in MiB.
  */
-#define JPEG_PREMARK (0xff)
+#define BLOCK_MIB_DEFAULT (4)
+#define BLOCK_MIB_MIN     (1)
+#define BLOCK_MIB_MAX     (256)
 
 /*
- * JPEG marker definitions.
+ * Output formats.
  */
-#define JPEG_TEM      (0x01)    /* Temporary for arithmetic coding */
-
-#define JPEG_SOF_0    (0xC0)    /* Start Of Frame, Type 0 */
-#define JPEG_SOF_1    (0xC1)    /* Start Of Frame, Type 1 */
-#define JPEG_SOF_2    (0xC2)    /* Start Of Frame, Type 2 */
-#define JPEG_SOF_3    (0xC3)    /* Start Of Frame, Type 3 */
+#define TRACE_TEXT   (1)
+#define TRACE_CSV    (2)
+#define TRACE_NDJSON (3)
 
-#define JPEG_SOF_5    (0xC5)    /* Start Of Frame, Type 5 */
-#define JPEG_SOF_6    (0xC6)    /* Start Of Frame, Type 6 */
-#define JPEG_SOF_7    (0xC7)    /* Start Of Frame, Type 7 */
+/*
+ * The size in bytes of the buffer that output is collected in before it
+ * is written to standard output.
+ */
+#define OUT_BUF_SIZE (4L * 1024L * 1024L)
 
-#define JPEG_SOF_9    (0xC9)    /* Start Of Frame, Type 9 */
-#define JPEG_SOF_10   (0xCA)    /* Start Of Frame, Type 10 */
-#define JPEG_SOF_11   (0xCB)    /* Start Of Frame, Type 11 */
+/*
+ * The longest single piece of output, which is one record.
+ */
+#define OUT_RECORD_MAX (256)
 
-#define JPEG_SOF_13   (0xCD)    /* Start Of Frame, Type 13 */
-#define JPEG_SOF_14   (0xCE)    /* Start Of Frame, Type 14 */
-#define JPEG_SOF_15   (0xCF)    /* Start Of Frame, Type 15 */
+/*
+ * Buffered writer for standard output.
+ * 
+ * The first error is remembered and everything after it is ignored, so
+ * that errors only need to be checked once at the end.
+ */
+typedef struct {
+  
+  /*
+   * The output file, which is unbuffered at the stdio level.
+   */
+  FILE *fp;
+  
+  /*
+   * The output buffer, and the number of bytes waiting in it.
+   */
+  unsigned char *pBuf;
+  size_t fill;
+  
+  /*
+   * Set if there was a write error.
+   */
+  int err;
+  
+} OUT_WRITER;
 
-#define JPEG_DHT      (0xC4)    /* Define Huffman Table */
-#define JPEG_DAC      (0xCC)    /* Define Arithmetic Coding cond. */
-#define JPEG_DQT      (0xDB)    /* Define Quantization Tables */
-#define JPEG_DRI      (0xDD)    /* Define Restart Interval */
-#define JPEG_DHP      (0xDE)    /* Define Hierarchical Progression */
-#define JPEG_EXP      (0xDF)    /* Expand Reference Components */
-#define JPEG_COM      (0xFE)    /* Comment */
+/*
+ * State used by the marker callback while tracing.
+ */
+typedef struct {
+  
+  /*
+   * The output writer, the TRACE format, and whether only per-frame
+   * summaries are reported.
+   */
+  OUT_WRITER *pw;
+  int format;
+  int summary;
+  
+  /*
+   * The parser, so the callback can get at marker payload lengths.
+   */
+  const JPEG_PARSER *pParser;
+  
+  /*
+   * The number of frames that have been found so far, including frames
+   * before the first one traced.
+   */
+  long frame_count;
+  
+  /*
+   * The frame number of the first frame traced.
+   */
+  long first;
+  
+  /*
+   * With --frames, the offset where the first SOI must be reported, or
+   * -1 once it has been checked or if there is nothing to check.
+   */
+  int64_t expect;
+  
+  /*
+   * For --summary, set while within a frame, and the totals so far for
+   * that frame.
+   */
+  int in_frame;
+  int64_t frame_offset;
+  long markers;
+  long scans;
+  long restarts;
+  int64_t payload;
+  
+} TRACE_STATE;
 
-#define JPEG_APP_MIN  (0xE0)    /* Application-specific data zero */
-#define JPEG_APP_MAX  (0xEF)    /* Application-specific data fifteen */
+/* Function prototypes */
+static void outInit(OUT_WRITER *pw, FILE *fp);
+static void outFree(OUT_WRITER *pw);
+static void outReserve(OUT_WRITER *pw, size_t len);
+static void outStr(OUT_WRITER *pw, const char *pStr);
+static void outInt(OUT_WRITER *pw, int64_t v);
+static int outFlush(OUT_WRITER *pw);
+static void reportMarker(
+    TRACE_STATE * ps,
+    int           c,
+    int           immed,
+    int64_t       pos);
+static void reportFrame(TRACE_STATE *ps, int64_t end);
+static const char *traceMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+static int parseInt(const char *pStr, long *pv);
+static int parseFrames(const char *pStr, long *pa, long *pb);
 
-#define JPEG_RST_MIN  (0xD0)    /* Restart Marker zero */
-#define JPEG_RST_MAX  (0xD7)    /* Restart Marker seven */
-#define JPEG_SOI      (0xD8)    /* Start Of Image */
-#define JPEG_EOI      (0xD9)    /* End Of Image */
-#define JPEG_SOS      (0xDA)    /* Start Of Scan */
-#define JPEG_DNL      (0xDC)    /* Define Number Of Lines */
+/*
+ * Initialize an output writer.
+ * 
+ * The file is switched to unbuffered mode at the stdio level, since the
+ * writer does its own buffering.  This must be done before any other
+ * output to the file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer to initialize
+ * 
+ *   fp - the output file
+ */
+static void outInit(OUT_WRITER *pw, FILE *fp) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (fp == NULL)) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pw, 0, sizeof(OUT_WRITER));
+  pw->fp = fp;
+  pw->fill = 0;
+  pw->err = 0;
+  
+  pw->pBuf = (unsigned char *) malloc((size_t) OUT_BUF_SIZE);
+  if (pw->pBuf == NULL) {
+    abort();
+  }
+  
+  /* Turn off stdio buffering */
+  if (setvbuf(fp, NULL, _IONBF, 0)) {
+    pw->err = 1;
+  }
+}
 
-/* Function prototypes */
-static int jpeg_isStandAlone(int c);
-static int jpeg_isImmediate(int c);
-static void reportMarker(int c, int immed);
+/*
+ * Release an output writer.
+ * 
+ * Anything still in the buffer is discarded, so call outFlush() first
+ * to keep it.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer to release
+ */
+static void outFree(OUT_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Release buffer */
+  if (pw->pBuf != NULL) {
+    free(pw->pBuf);
+    pw->pBuf = NULL;
+  }
+  pw->fill = 0;
+}
 
 /*
- * Return whether the given marker is a stand-alone JPEG marker.
+ * Make sure there is room for at least len more bytes in the output
+ * buffer, writing out the buffer if necessary.
+ * 
+ * After a write error, the buffer is simply emptied, so that output can
+ * still be added to it but goes nowhere.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer
  * 
- * A stand-alone JPEG marker carries no data and has no data length
- * following it.
+ *   len - the number of bytes, at most OUT_RECORD_MAX
+ */
+static void outReserve(OUT_WRITER *pw, size_t len) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (len > OUT_RECORD_MAX)) {
+    abort();
+  }
+  
+  /* Write out the buffer if there isn't enough room */
+  if (len > (size_t) OUT_BUF_SIZE - pw->fill) {
+    if (!(pw->err)) {
+      if (fwrite(pw->pBuf, 1, pw->fill, pw->fp) != pw->fill) {
+        pw->err = 1;
+      }
+    }
+    pw->fill = 0;
+  }
+}
+
+/*
+ * Add a string to the output.
  * 
- * c is the marker byte, which must be in range 0x00-0xFE.
+ * The caller must have reserved room for it with outReserve().
  * 
  * Parameters:
  * 
- *   c - the marker byte to check
+ *   pw - the writer
  * 
- * Return:
+ *   pStr - the string to add
+ */
+static void outStr(OUT_WRITER *pw, const char *pStr) {
+  
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pStr == NULL)) {
+    abort();
+  }
+  
+  /* Add the string */
+  len = strlen(pStr);
+  if (len > (size_t) OUT_BUF_SIZE - pw->fill) {
+    abort();
+  }
+  memcpy(pw->pBuf + pw->fill, pStr, len);
+  pw->fill += len;
+}
+
+/*
+ * Add a signed decimal integer to the output.
  * 
- *   non-zero if this is a stand-alone marker, zero if not
+ * The caller must have reserved room for it with outReserve().
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer
+ * 
+ *   v - the integer to add
  */
-static int jpeg_isStandAlone(int c) {
+static void outInt(OUT_WRITER *pw, int64_t v) {
   
-  int result = 0;
+  char digits[24];
+  uint64_t u = 0;
+  int i = 0;
   
   /* Check parameter */
-  if ((c < 0) || (c > 0xfe)) {
+  if (pw == NULL) {
     abort();
   }
   
-  /* Check for stand-alone types */
-  if ((c == JPEG_TEM) || ((c >= JPEG_RST_MIN) && (c <= JPEG_RST_MAX)) ||
-      (c == JPEG_SOI) || (c == JPEG_EOI)) {
-    result = 1;
-  
+  /* Get the magnitude, adding the sign if negative */
+  if (v < 0) {
+    outStr(pw, "-");
+    u = ((uint64_t) (-(v + 1))) + 1;
   } else {
-    result = 0;
+    u = (uint64_t) v;
   }
   
-  /* Return result */
-  return result;
+  /* Generate the digits in reverse order */
+  i = (int) sizeof(digits);
+  do {
+    i--;
+    digits[i] = (char) ('0' + (int) (u % 10));
+    u /= 10;
+  } while (u > 0);
+  
+  /* Add the digits */
+  if ((size_t) ((int) sizeof(digits) - i) >
+        (size_t) OUT_BUF_SIZE - pw->fill) {
+    abort();
+  }
+  memcpy(pw->pBuf + pw->fill, &(digits[i]),
+          (size_t) ((int) sizeof(digits) - i));
+  pw->fill += (size_t) ((int) sizeof(digits) - i);
 }
 
 /*
- * Return whether a given marker is an "immediate" JPEG marker.
- * 
- * Immediate markers can occur within compressed data.  These are the
- * RST markers and the DNL marker.  The special zero-escape marker is
- * not considered an immediate because it is not a real marker.
- * 
- * c is the marker byte, which must be in range 0x00-0xFE.
+ * Write everything in the buffer to the output file.
  * 
  * Parameters:
  * 
- *   c - the marker byte to check
+ *   pw - the writer
  * 
  * Return:
  * 
- *   non-zero if this is an immediate marker, zero if not
+ *   non-zero if successful, zero if there has been a write error at
+ *   any point
  */
-static int jpeg_isImmediate(int c) {
-  
-  int result = 0;
+static int outFlush(OUT_WRITER *pw) {
   
   /* Check parameter */
-  if ((c < 0) || (c > 0xfe)) {
+  if (pw == NULL) {
     abort();
   }
   
-  /* Check for immediate types */
-  if ((c == JPEG_DNL) || ((c >= JPEG_RST_MIN) && (c <= JPEG_RST_MAX))) {
-    result = 1;
-  
-  } else {
-    result = 0;
+  /* Write the buffer */
+  if ((!(pw->err)) && (pw->fill > 0)) {
+    if (fwrite(pw->pBuf, 1, pw->fill, pw->fp) != pw->fill) {
+      pw->err = 1;
+    }
+  }
+  pw->fill = 0;
+  if ((!(pw->err)) && fflush(pw->fp)) {
+    pw->err = 1;
   }
   
-  /* Return result */
-  return result;
+  return !(pw->err);
 }
 
 /*
- * Report a given marker.
+ * Report a given marker in the output format.
  * 
  * c is the marker byte, which must be in range 0x00-0xFE.  immed is a
  * flag indicating whether this is an immediate marker within compressed
@@ -169,139 +468,363 @@ static int jpeg_isImmediate(int c) {
  * 
  * Parameters:
  * 
+ *   ps - the trace state
+ * 
  *   c - the marker byte
  * 
  *   immed - non-zero if immediate marker within data, zero otherwise
+ * 
+ *   pos - the offset of the 0xFF byte before the marker
  */
-static void reportMarker(int c, int immed) {
+static void reportMarker(
+    TRACE_STATE * ps,
+    int           c,
+    int           immed,
+    int64_t       pos) {
+  
+  OUT_WRITER *pw = NULL;
+  const char *pName = NULL;
+  char hex[8];
   
   /* Check parameters */
-  if ((c < 0) || (c > 0xfe)) {
+  if ((ps == NULL) || (c < 0) || (c > 0xfe)) {
     abort();
   }
+  pw = ps->pw;
+  pName = jpeg_marker_names[c];
   
-  /* Report either marker or immediate */
-  if (immed) {
-    printf("Immediate ");
-  } else {
-    printf("Marker ");
-  }
+  outReserve(pw, OUT_RECORD_MAX);
   
-  /* Print the name of the marker if recognized, otherwise the value */
-  switch (c) {
-    
-    case JPEG_TEM:
-      printf("TEM");
-      break;
-    
-    case JPEG_SOF_0:
-      printf("SOF(0)");
-      break;
-    
-    case JPEG_SOF_1:
-      printf("SOF(1)");
-      break;
-    
-    case JPEG_SOF_2:
-      printf("SOF(2)");
-      break;
-    
-    case JPEG_SOF_3:
-      printf("SOF(3)");
-      break;
-    
-    case JPEG_SOF_5:
-      printf("SOF(5)");
-      break;
-    
-    case JPEG_SOF_6:
-      printf("SOF(6)");
-      break;
-    
-    case JPEG_SOF_7:
-      printf("SOF(7)");
-      break;
-    
-    case JPEG_SOF_9:
-      printf("SOF(9)");
-      break;
-    
-    case JPEG_SOF_10:
-      printf("SOF(10)");
-      break;
-    
-    case JPEG_SOF_11:
-      printf("SOF(11)");
-      break;
-    
-    case JPEG_SOF_13:
-      printf("SOF(13)");
-      break;
-    
-    case JPEG_SOF_14:
-      printf("SOF(14)");
-      break;
-    
-    case JPEG_SOF_15:
-      printf("SOF(15)");
-      break;
-    
-    case JPEG_DHT:
-      printf("DHT");
-      break;
+  if (ps->format == TRACE_TEXT) {
+    /* Report either marker or immediate, with the name of the marker if
+     * recognized, otherwise the value */
+    if (immed) {
+      outStr(pw, "Immediate ");
+    } else {
+      outStr(pw, "Marker ");
+    }
     
-    case JPEG_DAC:
-      printf("DAC");
-      break;
+    if (pName == NULL) {
+      sprintf(hex, "0x%02X", (unsigned int) c);
+      pName = hex;
+    }
+    outStr(pw, pName);
+    outStr(pw, "\n");
     
-    case JPEG_DQT:
-      printf("DQT");
-      break;
+  } else if (ps->format == TRACE_CSV) {
+    /* Comma-separated fields in the order of the header */
+    outInt(pw, ((int64_t) ps->frame_count) - 1);
+    outStr(pw, ",");
+    outInt(pw, pos);
+    outStr(pw, ",");
+    outInt(pw, c);
+    outStr(pw, ",");
+    if (pName != NULL) {
+      outStr(pw, pName);
+    }
+    if (immed) {
+      outStr(pw, ",1,");
+    } else {
+      outStr(pw, ",0,");
+    }
+    outInt(pw, ps->pParser->pay_len);
+    outStr(pw, "\n");
     
-    case JPEG_DRI:
-      printf("DRI");
-      break;
+  } else if (ps->format == TRACE_NDJSON) {
+    /* One JSON object; marker names never need escaping */
+    outStr(pw, "{\"frame\":");
+    outInt(pw, ((int64_t) ps->frame_count) - 1);
+    outStr(pw, ",\"offset\":");
+    outInt(pw, pos);
+    outStr(pw, ",\"marker\":");
+    outInt(pw, c);
+    if (pName != NULL) {
+      outStr(pw, ",\"name\":\"");
+      outStr(pw, pName);
+      outStr(pw, "\"");
+    } else {
+      outStr(pw, ",\"name\":null");
+    }
+    if (immed) {
+      outStr(pw, ",\"immediate\":true");
+    } else {
+      outStr(pw, ",\"immediate\":false");
+    }
+    outStr(pw, ",\"length\":");
+    outInt(pw, ps->pParser->pay_len);
+    outStr(pw, "}\n");
     
-    case JPEG_DHP:
-      printf("DHP");
-      break;
+  } else {
+    abort();
+  }
+}
+
+/*
+ * Report the summary of the frame currently being traced in the output
+ * format, and leave the frame.
+ * 
+ * Parameters:
+ * 
+ *   ps - the trace state, which must be within a frame
+ * 
+ *   end - the offset of the end of the frame
+ */
+static void reportFrame(TRACE_STATE *ps, int64_t end) {
+  
+  OUT_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (!(ps->in_frame))) {
+    abort();
+  }
+  pw = ps->pw;
+  
+  outReserve(pw, OUT_RECORD_MAX);
+  
+  if (ps->format == TRACE_TEXT) {
+    outStr(pw, "Frame ");
+    outInt(pw, ((int64_t) ps->frame_count) - 1);
+    outStr(pw, ": offset ");
+    outInt(pw, ps->frame_offset);
+    outStr(pw, ", length ");
+    outInt(pw, end - ps->frame_offset);
+    outStr(pw, ", markers ");
+    outInt(pw, ps->markers);
+    outStr(pw, ", scans ");
+    outInt(pw, ps->scans);
+    outStr(pw, ", restarts ");
+    outInt(pw, ps->restarts);
+    outStr(pw, ", payload ");
+    outInt(pw, ps->payload);
+    outStr(pw, "\n");
     
-    case JPEG_EXP:
-      printf("EXP");
-      break;
+  } else if (ps->format == TRACE_CSV) {
+    outInt(pw, ((int64_t) ps->frame_count) - 1);
+    outStr(pw, ",");
+    outInt(pw, ps->frame_offset);
+    outStr(pw, ",");
+    outInt(pw, end - ps->frame_offset);
+    outStr(pw, ",");
+    outInt(pw, ps->markers);
+    outStr(pw, ",");
+    outInt(pw, ps->scans);
+    outStr(pw, ",");
+    outInt(pw, ps->restarts);
+    outStr(pw, ",");
+    outInt(pw, ps->payload);
+    outStr(pw, "\n");
     
-    case JPEG_COM:
-      printf("COM");
-      break;
+  } else if (ps->format == TRACE_NDJSON) {
+    outStr(pw, "{\"frame\":");
+    outInt(pw, ((int64_t) ps->frame_count) - 1);
+    outStr(pw, ",\"offset\":");
+    outInt(pw, ps->frame_offset);
+    outStr(pw, ",\"length\":");
+    outInt(pw, end - ps->frame_offset);
+    outStr(pw, ",\"markers\":");
+    outInt(pw, ps->markers);
+    outStr(pw, ",\"scans\":");
+    outInt(pw, ps->scans);
+    outStr(pw, ",\"restarts\":");
+    outInt(pw, ps->restarts);
+    outStr(pw, ",\"payload\":");
+    outInt(pw, ps->payload);
+    outStr(pw, "}\n");
     
-    case JPEG_SOI:
-      printf("SOI");
-      break;
+  } else {
+    abort();
+  }
+  
+  ps->in_frame = 0;
+}
+
+/*
+ * Marker callback used while tracing.
+ * 
+ * SOI markers start a new frame and increment the frame count, watching
+ * for overflow.  Unless only frame summaries are reported, the marker
+ * is reported, with a line break before each SOI marker other than the
+ * first in the text format.  For summaries, the marker is added to the
+ * totals of the current frame, which is reported at its EOI, or at the
+ * next SOI if it has no EOI.
+ * 
+ * See JPEG_MARKER_FN for the interface.  pCustom is the TRACE_STATE.
+ */
+static const char *traceMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos) {
+  
+  TRACE_STATE *ps = NULL;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pos < 0)) {
+    abort();
+  }
+  ps = (TRACE_STATE *) pCustom;
+  
+  /* With --frames, the first marker must be the SOI the index says */
+  if (ps->expect >= 0) {
+    if (immed || (c != JPEG_SOI) || (pos != ps->expect)) {
+      return "Index doesn't match input file!";
+    }
+    ps->expect = -1;
+  }
+  
+  /* If marker is SOI, then finish any frame that is still open, add a
+   * line break in the text format if this is not the first frame, and
+   * start a new frame */
+  if ((!immed) && (c == JPEG_SOI)) {
+    if (ps->summary && ps->in_frame) {
+      reportFrame(ps, pos);
+    }
     
-    case JPEG_EOI:
-      printf("EOI");
-      break;
+    if ((!(ps->summary)) && (ps->format == TRACE_TEXT) &&
+        (ps->frame_count > ps->first)) {
+      outReserve(ps->pw, 1);
+      outStr(ps->pw, "\n");
+    }
     
-    case JPEG_SOS:
-      printf("SOS");
-      break;
+    if (ps->frame_count < LONG_MAX) {
+      ps->frame_count++;
+    }
     
-    case JPEG_DNL:
-      printf("DNL");
-      break;
+    ps->in_frame = 1;
+    ps->frame_offset = pos;
+    ps->markers = 0;
+    ps->scans = 0;
+    ps->restarts = 0;
+    ps->payload = 0;
+  }
+  
+  /* Report the marker, or add it to the frame summary */
+  if (!(ps->summary)) {
+    reportMarker(ps, c, immed, pos);
     
-    default:
-      if ((c >= JPEG_APP_MIN) && (c <= JPEG_APP_MAX)) {
-        printf("APP(%d)", (c - JPEG_APP_MIN));
-      } else if ((c >= JPEG_RST_MIN) && (c <= JPEG_RST_MAX)) {
-        printf("RST(%d)", (c - JPEG_RST_MIN));
-      } else {
-        printf("0x%02X\n", (unsigned int) c);
+  } else if (ps->in_frame) {
+    if (immed) {
+      if (jpeg_marker_flags[c] & JPEG_MF_RST) {
+        ps->restarts++;
+      }
+    } else {
+      ps->markers++;
+      if (c == JPEG_SOS) {
+        ps->scans++;
       }
+    }
+    ps->payload += (int64_t) ps->pParser->pay_len;
+    
+    if ((!immed) && (c == JPEG_EOI)) {
+      reportFrame(ps, pos + 2);
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Parse a string as a non-negative decimal integer.
+ * 
+ * The string must be non-empty and contain only decimal digits.
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pv - receives the parsed value if successful
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid integer
+ *   or the value overflows
+ */
+static int parseInt(const char *pStr, long *pv) {
+  
+  long v = 0;
+  int d = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* Must not be empty */
+  if (*pStr == 0) {
+    return 0;
+  }
+  
+  /* Parse digits, watching for overflow */
+  for( ; *pStr != 0; pStr++) {
+    if ((*pStr < '0') || (*pStr > '9')) {
+      return 0;
+    }
+    d = *pStr - '0';
+    if (v > (LONG_MAX - d) / 10) {
+      return 0;
+    }
+    v = (v * 10) + d;
+  }
+  
+  *pv = v;
+  return 1;
+}
+
+/*
+ * Parse a frame range for --frames.
+ * 
+ * The range is either two frame numbers separated by "..", which may be
+ * the same but can't be in descending order, or a single frame number.
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pa - receives the first frame number
+ * 
+ *   pb - receives the last frame number
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid range
+ */
+static int parseFrames(const char *pStr, long *pa, long *pb) {
+  
+  char buf[32];
+  const char *pSep = NULL;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pa == NULL) || (pb == NULL)) {
+    abort();
+  }
+  
+  /* A single frame number is a range of one frame */
+  pSep = strstr(pStr, "..");
+  if (pSep == NULL) {
+    if (!parseInt(pStr, pa)) {
+      return 0;
+    }
+    *pb = *pa;
+    return 1;
+  }
+  
+  /* Parse the first number from a copy, then the second in place */
+  len = (size_t) (pSep - pStr);
+  if (len >= sizeof(buf)) {
+    return 0;
+  }
+  memcpy(buf, pStr, len);
+  buf[len] = (char) 0;
+  
+  if ((!parseInt(buf, pa)) || (!parseInt(pSep + 2, pb))) {
+    return 0;
+  }
+  if (*pb < *pa) {
+    return 0;
   }
   
-  /* Next line */
-  printf("\n");
+  return 1;
 }
 
 /*
@@ -328,13 +851,40 @@ static void reportMarker(int c, int immed) {
 int main(int argc, char *argv[]) {
   
   int x = 0;
-  int c = 0;
-  int c2 = 0;
   int status = 1;
-  int eoi_read = 0;
-  long mark_len = 0;
-  long frame_count = 0;
+  int use_mmap = 0;
+  int format = TRACE_TEXT;
+  int summary = 0;
+  int write_err = 0;
+  int ranged = 0;
+  int at_end = 1;
+  long block_mib = BLOCK_MIB_DEFAULT;
+  long frame_a = 0;
+  long frame_b = 0;
+  int64_t start = 0;
+  int64_t end = -1;
+  size_t block_size = 0;
   FILE *fp = NULL;
+  const char *pErr = NULL;
+  const char *pParseErr = NULL;
+  const char *pInPath = NULL;
+  const char *pIdxArg = NULL;
+  char *pIdxPath = NULL;
+  unsigned char *pBuf = NULL;
+  JPEG_PARSER parser;
+  JPEG_MAP mf;
+  MJPG_IDX idx;
+  MJPG_IDX_FRAME fr;
+  TRACE_STATE tst;
+  OUT_WRITER ow;
+  
+  /* Initialize structures */
+  memset(&parser, 0, sizeof(JPEG_PARSER));
+  jpeg_mapInit(&mf);
+  memset(&tst, 0, sizeof(TRACE_STATE));
+  memset(&ow, 0, sizeof(OUT_WRITER));
+  mjpg_idxInit(&idx);
+  memset(&fr, 0, sizeof(MJPG_IDX_FRAME));
   
   /* Check parameters */
   if (argc < 0) {
@@ -349,276 +899,289 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* We need exactly one parameter beyond the module name */
-  if (argc != 2) {
-    fprintf(stderr, "Expecting exactly one parameter!\n");
-    status = 0;
-  }
-  
-  /* Open the provided file for reading */
-  if (status) {
-    fp = fopen(argv[1], "rb");
-    if (fp == NULL) {
-      fprintf(stderr, "Can't open input file!\n");
-      status = 0;
-    }
-  }
-  
-  /* Read and report all markers */
-  while (status) {
-    
-    /* Read a byte, leaving loop if EOF */
-    c = getc(fp);
-    if (c == EOF) {
-      if (feof(fp)) {
-        /* We are done reading all the markers -- make sure we read at
-         * least one marker and that the last marker we read was EOI */
-        if (eoi_read) {
-          break;
-        } else {
-          fprintf(stderr, "Missing EOI marker!\n");
-          status = 0;
-        }
+  /* Parse any options */
+  for(x = 1; status && (x < argc); x++) {
+    if (strcmp(argv[x], "-b") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing block size!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &block_mib)) ||
+                  (block_mib < BLOCK_MIB_MIN) ||
+                  (block_mib > BLOCK_MIB_MAX)) {
+        fprintf(stderr, "Invalid block size!\n");
+        status = 0;
+      }
+      x++;
       
+    } else if (strcmp(argv[x], "--mmap") == 0) {
+      use_mmap = 1;
+      
+    } else if (strcmp(argv[x], "-f") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing output format!\n");
+        status = 0;
+      } else if (strcmp(argv[x + 1], "text") == 0) {
+        format = TRACE_TEXT;
+      } else if (strcmp(argv[x + 1], "csv") == 0) {
+        format = TRACE_CSV;
+      } else if (strcmp(argv[x + 1], "ndjson") == 0) {
+        format = TRACE_NDJSON;
       } else {
-        /* I/O error */
-        fprintf(stderr, "I/O error!\n");
+        fprintf(stderr, "Unknown output format!\n");
         status = 0;
       }
-    }
-    
-    /* The byte we read must be 0xff, or the file is invalid */
-    if (status) {
-      if (c != JPEG_PREMARK) {
-        fprintf(stderr, "Missing pre-marker byte!\n");
+      x++;
+      
+    } else if (strcmp(argv[x], "--summary") == 0) {
+      summary = 1;
+      
+    } else if (strcmp(argv[x], "--frames") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing frame range!\n");
+        status = 0;
+      } else if (!parseFrames(argv[x + 1], &frame_a, &frame_b)) {
+        fprintf(stderr, "Invalid frame range!\n");
         status = 0;
       }
-    }
-    
-    /* Read a sequence of zero or more 0xff bytes, until we get the
-     * actual marker byte; an EOF is an error here */
-    while (status) {
+      ranged = 1;
+      x++;
       
-      /* Read another byte */
-      c = getc(fp);
-      if (c == EOF) {
-        if (feof(fp)) {
-          /* EOF not allowed here */
-          fprintf(stderr, "Missing marker byte!\n");
-          status = 0;
-          
-        } else {
-          /* I/O error */
-          fprintf(stderr, "I/O error!\n");
-          status = 0;
-        }
+    } else if (strcmp(argv[x], "-i") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing index path!\n");
+        status = 0;
+      } else {
+        pIdxArg = argv[x + 1];
       }
+      x++;
       
-      /* We're done if we got anything besides the pre-marker */
-      if (status && (c != JPEG_PREMARK)) {
-        break;
+    } else {
+      break;
+    }
+  }
+  
+  /* We need exactly one parameter beyond the options */
+  if (status && (x != argc - 1)) {
+    fprintf(stderr, "Expecting exactly one parameter!\n");
+    status = 0;
+  }
+  if (status) {
+    pInPath = argv[x];
+  }
+  
+  /* An index is only used for --frames */
+  if (status && (pIdxArg != NULL) && (!ranged)) {
+    fprintf(stderr, "-i requires --frames!\n");
+    status = 0;
+  }
+  
+  /* With --frames, look up the range of bytes to trace in the index;
+   * the range runs to the start of the frame after the last one, or to
+   * the end of the file if the last one is the last frame */
+  if (status && ranged) {
+    if (pIdxArg != NULL) {
+      pErr = mjpg_idxOpen(&idx, pIdxArg);
+    } else {
+      pIdxPath = (char *) malloc(strlen(pInPath) + 7);
+      if (pIdxPath == NULL) {
+        abort();
       }
+      strcpy(pIdxPath, pInPath);
+      strcat(pIdxPath, ".index");
+      pErr = mjpg_idxOpen(&idx, pIdxPath);
     }
     
-    /* If marker is SOI and this is not first frame, add a line break */
-    if (status && (c == JPEG_SOI) && (frame_count > 0)) {
-      printf("\n");
+    if ((pErr == NULL) && (frame_b >= idx.count)) {
+      pErr = "Frame range goes past end of index!";
     }
-    
-    /* Report the marker we just read */
-    if (status) {
-      reportMarker(c, 0);
+    if (pErr == NULL) {
+      pErr = mjpg_idxFrame(&idx, frame_a, &fr);
+      start = fr.offset;
     }
-    
-    /* If the marker is SOI, then increment frame count, watching for
-     * overflow */
-    if (status && (c == JPEG_SOI)) {
-      if (frame_count < LONG_MAX) {
-        frame_count++;
+    if ((pErr == NULL) && (frame_b < idx.count - 1)) {
+      pErr = mjpg_idxFrame(&idx, frame_b + 1, &fr);
+      end = fr.offset;
+      at_end = 0;
+      if ((pErr == NULL) && (end <= start)) {
+        pErr = "Invalid index file!";
       }
     }
     
-    /* If this is not a stand-alone marker, read two bytes to get the
-     * length of the data payload; else, zero out marker length */
-    if (status) {
-      if (!jpeg_isStandAlone(c)) {
-        
-        /* Read the first length byte */
-        c2 = getc(fp);
-        if (c2 == EOF) {
-          if (feof(fp)) {
-            /* EOF not allowed here */
-            fprintf(stderr, "Missing marker length!\n");
-            status = 0;
-            
-          } else {
-            /* I/O error */
-            fprintf(stderr, "I/O error!\n");
-            status = 0;
-          }
-        }
-        
-        /* Set marker length with first length byte */
-        if (status) {
-          mark_len = (((long) c2) << 8);
-        }
-        
-        /* Read the second length byte */
-        if (status) {
-          c2 = getc(fp);
-          if (c2 == EOF) {
-            if (feof(fp)) {
-              /* EOF not allowed here */
-              fprintf(stderr, "Partial marker length!\n");
-              status = 0;
-              
-            } else {
-              /* I/O error */
-              fprintf(stderr, "I/O error!\n");
-              status = 0;
-            }
-          }
-        }
-        
-        /* Get complete marker length, which must be at least two to
-         * account for the two length bytes */
-        if (status) {
-          mark_len |= ((long) c2);
-          if (mark_len < 2) {
-            fprintf(stderr, "Marker length less than two!\n");
-            status = 0;
-          }
-        }
-        
-        /* Subtract two from marker length because we've already read
-         * the length bytes */
-        if (status) {
-          mark_len -= 2;
-        }
-        
-      } else {
-        /* Stand-alone marker -- set marker length to zero */
-        mark_len = 0;
-      }
+    if (pErr != NULL) {
+      fprintf(stderr, "%s\n", pErr);
+      status = 0;
     }
-    
-    /* If there is a data payload, skip over it */
-    if (status && (mark_len > 0)) {
-      if (fseeko(fp, (off_t) mark_len, SEEK_CUR)) {
-        fprintf(stderr, "Seek failed!\n");
+  }
+  
+  /* Allocate the read buffer, unless we are mapping the file */
+  if (status && (!use_mmap)) {
+    block_size = ((size_t) block_mib) * 1024 * 1024;
+    pBuf = (unsigned char *) malloc(block_size);
+    if (pBuf == NULL) {
+      abort();
+    }
+  }
+  
+  /* Open the provided file for reading, or map it into memory */
+  if (status) {
+    if (use_mmap) {
+      pErr = jpeg_mapFile(&mf, pInPath);
+      if (pErr != NULL) {
+        fprintf(stderr, "%s\n", pErr);
+        status = 0;
+      }
+      
+    } else {
+      fp = fopen(pInPath, "rb");
+      if (fp == NULL) {
+        fprintf(stderr, "Can't open input file!\n");
         status = 0;
       }
     }
-    
-    /* If we just read an SOS marker, we need to skip over compressed
-     * data, reporting any embedded markers along the way */
-    if (status && (c == JPEG_SOS)) {
-      while (status) {
-        
-        /* Read a character */
-        c2 = getc(fp);
-        if (c2 == EOF) {
-          if (feof(fp)) {
-            /* EOF not allowed here */
-            fprintf(stderr, "EOF in compressed stream!\n");
-            status = 0;
-            
-          } else {
-            /* I/O error */
-            fprintf(stderr, "I/O error!\n");
-            status = 0;
-          }
-        }
-        
-        /* If we read anything but JPEG_PREMARK, go to next character */
-        if (status && (c2 != JPEG_PREMARK)) {
-          continue;
-        }
-        
-        /* We read the JPEG_PREMARK character -- keep reading until we
-         * get the potential marker character */
-        while (status) {
-          
-          /* Read a character */
-          c2 = getc(fp);
-          if (c2 == EOF) {
-            if (feof(fp)) {
-              /* EOF not allowed here */
-              fprintf(stderr, "EOF in compressed stream!\n");
-              status = 0;
-            
-            } else {
-              /* I/O error */
-              fprintf(stderr, "I/O error!\n");
-              status = 0;
-            }
-          }
-          
-          /* We are done if we read something besides the pre-marker */
-          if (status && (c2 != JPEG_PREMARK)) {
-            break;
-          }
-        }
-        
-        /* If the marker is zero, then ignore it and continue because
-         * this is simply an escape for 0xFF bytes within compressed
-         * data; if the marker is immediate, then report it as immediate
-         * and proceed; if the marker is non-immediate, then backtrack
-         * to the last 0xFF byte and we're done
-         * 
-         * We also check for the immediate DNL and raise an error in
-         * that case because it's rarely used and it carries a data
-         * payload, which we don't support here for immediates */
-        if (status && (c2 != 0)) {
-          if (jpeg_isImmediate(c2)) {
-            /* Immediate -- report the immediate */
-            reportMarker(c2, 1);
-            
-            /* Fail if DNL */
-            if (c2 == JPEG_DNL) {
-              fprintf(stderr, "DNL markers not supported!\n");
-              status = 0;
-            }
-          
-          } else {
-            /* Not immediate -- backtrack two bytes to the last 0xFF
-             * character and then we're done */
-            if (fseeko(fp, (off_t) -2, SEEK_CUR)) {
-              fprintf(stderr, "Seek failed!\n");
-              status = 0;
-            }
-            break;
-          }
-        }
+  }
+  
+  /* Make sure a range lies within the mapping, or seek to its start */
+  if (status && ranged) {
+    if (use_mmap) {
+      if ((start > (int64_t) mf.len) ||
+          ((!at_end) && (end > (int64_t) mf.len))) {
+        fprintf(stderr, "Index doesn't match input file!\n");
+        status = 0;
+      }
+      
+    } else {
+      if (fseeko(fp, (off_t) start, SEEK_SET)) {
+        fprintf(stderr, "Can't seek input file!\n");
+        status = 0;
       }
     }
-    
-    /* Set EOI flag if we just read EOF, else clear it */
-    if (status) {
-      if (c == JPEG_EOI) {
-        eoi_read = 1;
+  }
+  
+  /* Set up the output, with a header line for csv */
+  if (status) {
+    outInit(&ow, stdout);
+    if (format == TRACE_CSV) {
+      outReserve(&ow, OUT_RECORD_MAX);
+      if (summary) {
+        outStr(&ow, "frame,offset,length,markers,scans,restarts,payload\n");
       } else {
-        eoi_read = 0;
+        outStr(&ow, "frame,offset,marker,name,immediate,length\n");
       }
     }
   }
   
-  /* Report statistics */
+  /* Initialize the parser, reporting immediate markers too */
   if (status) {
-    printf("\n");
-    if (frame_count < LONG_MAX) {
-      printf("Number of images: %ld\n", frame_count);
+    tst.pw = &ow;
+    tst.format = format;
+    tst.summary = summary;
+    tst.pParser = &parser;
+    tst.frame_count = frame_a;
+    tst.first = frame_a;
+    tst.expect = -1;
+    if (ranged) {
+      tst.expect = start;
+    }
+    tst.in_frame = 0;
+    jpeg_parserInit(&parser, &traceMarker, &tst, 1);
+    parser.offset = start;
+  }
+  
+  /* If the file is mapped, run the mapping (or the range) through the
+   * parser; parser errors are reported once the output is written */
+  if (status && use_mmap) {
+    if (at_end) {
+      end = (int64_t) mf.len;
+    }
+    if (!jpeg_parserFeed(&parser, mf.pData + start,
+                          (size_t) (end - start))) {
+      pParseErr = parser.pErr;
+      status = 0;
+    }
+  }
+  
+  /* Otherwise, read the input (or the range) in blocks and run each
+   * through the parser */
+  if (status && (!use_mmap)) {
+    if (!jpeg_parserRead(&parser, fp, pBuf, block_size,
+                          at_end ? -1 : (end - start))) {
+      pParseErr = parser.pErr;
+      status = 0;
+    }
+  }
+  
+  /* A range that stops short of the end of the file must have been read
+   * in full, and there is no end of stream to check, but a last frame
+   * without an EOI runs up to the end of the range and is still open;
+   * otherwise, make sure the stream ended properly */
+  if (status && (!at_end)) {
+    if (parser.offset != end) {
+      pParseErr = "Index doesn't match input file!";
+      status = 0;
+    } else if (tst.summary && tst.in_frame) {
+      reportFrame(&tst, end);
+    }
+    
+  } else if (status) {
+    if (!jpeg_parserFinish(&parser)) {
+      pParseErr = parser.pErr;
+      status = 0;
+    }
+  }
+  
+  /* Report statistics in the text format */
+  if (status && (format == TRACE_TEXT)) {
+    outReserve(&ow, OUT_RECORD_MAX);
+    outStr(&ow, "\n");
+    if (tst.frame_count < LONG_MAX) {
+      outStr(&ow, "Number of images: ");
+      outInt(&ow, tst.frame_count - tst.first);
+      outStr(&ow, "\n");
     } else {
-      printf("Number of images: (overflow!)\n");
+      outStr(&ow, "Number of images: (overflow!)\n");
     }
   }
   
+  /* Write out everything that was reported, so that it comes before
+   * any error message, and then report errors */
+  if (ow.pBuf != NULL) {
+    if (!outFlush(&ow)) {
+      write_err = 1;
+    }
+  }
+  if (pParseErr != NULL) {
+    fprintf(stderr, "%s\n", pParseErr);
+  }
+  if (write_err) {
+    fprintf(stderr, "I/O error on write!\n");
+    status = 0;
+  }
+  
   /* Close JPEG file if open */
   if (fp != NULL) {
     fclose(fp);
     fp = NULL;
   }
   
+  /* Release JPEG file mapping if mapped */
+  jpeg_unmapFile(&mf);
+  
+  /* Free read buffer if allocated */
+  if (pBuf != NULL) {
+    free(pBuf);
+    pBuf = NULL;
+  }
+  
+  /* Release output writer */
+  outFree(&ow);
+  
+  /* Close index if open */
+  mjpg_idxClose(&idx);
+  if (pIdxPath != NULL) {
+    free(pIdxPath);
+    pIdxPath = NULL;
+  }
+  
   /* Invert status and return */
   if (status) {
     status = 0;
@@ -0,0 +1,984 @@
+/*
+ * mjpg_bench.c
+ * 
+ * Benchmark the M-JPEG tools on a synthetic raw Motion-JPEG stream.
+ * 
+ * Syntax:
+ * 
+ *   mjpg_bench [options] [path]
+ * 
+ * Parameters:
+ * 
+ *   [path] - the path to write the synthetic stream to; if it already
+ *   exists, it is overwritten, along with [path] with ".index" suffixed
+ * 
+ * Options:
+ * 
+ *   -n [frames] - the number of frames, in range 1 to 1000000; the
+ *   default is 1000
+ * 
+ *   -s [kib] - the size of the compressed data of each frame in KiB, in
+ *   range 1 to 65536; the default is 256
+ * 
+ *   --rst [bytes] - put an RST marker after every [bytes] bytes of
+ *   compressed data, in range 0 to 16777216, with a DRI marker in each
+ *   frame; the default is 0, which means no restart markers
+ * 
+ *   --stuff [n] - the number of stuffed 0xFF 0x00 pairs in every 1000
+ *   bytes of compressed data, in range 0 to 500; the default is 4,
+ *   which is about what real compressed data has
+ * 
+ *   --app [bytes] - the length of an APP1 payload in each frame, in
+ *   range 0 to 65533; the default is 0, which means no APP1 marker
+ * 
+ *   --com [bytes] - the length of a COM payload in each frame, in range
+ *   0 to 65533; the default is 0, which means no COM marker
+ * 
+ *   --seed [n] - the seed of the random compressed data; the default
+ *   is 1
+ * 
+ *   -r [runs] - the number of times to run each benchmark, in range 1
+ *   to 100; the default is 3
+ * 
+ *   -j [n] - the number of worker threads for the parallel benchmark
+ *   of mjpg_index, in range 2 to 64; the default is 4
+ * 
+ *   --bin [dir] - the directory with the mjpg_index and jpgtrace
+ *   programs to benchmark; the default is the current directory
+ * 
+ *   --gen - only write the stream, without running any benchmarks
+ * 
+ * Operation:
+ * 
+ *   First, the synthetic stream is written to [path].  Each frame is an
+ *   SOI marker, then an APP1 and a COM marker if asked for, then DQT,
+ *   SOF0, and DHT markers, a DRI marker if there are restart markers,
+ *   an SOS marker, the compressed data, and finally an EOI marker.  The
+ *   compressed data is random bytes with no 0xFF bytes in them, except
+ *   for the stuffed 0xFF 0x00 pairs, which are placed at random, and
+ *   the RST markers, which cycle from RST0 to RST7.  The frames have the
+ *   marker structure of real JPEG images, so they exercise the parsers
+ *   in the same way, but they can't be decoded.  The same options and
+ *   seed always give the same stream.
+ * 
+ *   Then each of these is run as a child process, with its output
+ *   thrown away:
+ * 
+ *     mjpg_index stdio    - mjpg_index [path]
+ *     mjpg_index ring     - mjpg_index -q 4 [path]
+ *     mjpg_index mmap     - mjpg_index --mmap [path]
+ *     mjpg_index parallel - mjpg_index -j [n] [path]
+ *     jpgtrace stdio      - jpgtrace --summary -f csv [path]
+ *     jpgtrace mmap       - jpgtrace --summary -f csv --mmap [path]
+ * 
+ *   Each is run -r times, and the fastest run is reported as the
+ *   throughput in MB/s (millions of bytes per second) and frames per
+ *   second, along with the peak resident set size in KiB, as reported
+ *   by wait4(), which is the largest of any of the runs.  The stream
+ *   has just been written, so it is normally in the page cache, and the
+ *   numbers are those of the parsers rather than the disk; make the
+ *   stream larger than memory to measure the disk instead.  Timing uses
+ *   the monotonic clock.
+ * 
+ *   The report is written to standard output, with a line describing
+ *   the stream and then one line per benchmark.  If a benchmark fails
+ *   to run, or exits with an error, the program stops with an error.
+ *   The index written by mjpg_index is left at [path] with ".index"
+ *   suffixed.
+ * 
+ * Compilation:
+ * 
+ *   This program doesn't use the parser, but it runs the programs that
+ *   do, so build those first.  POSIX is required.
+ * 
+ *   Compile with 64-bit file offset support if you're going to try this
+ *   on huge M-JPEG files.  Define _FILE_OFFSET_BITS=64
+ * 
+ *   For example:
+ * 
+ *     cc -O2 -D_FILE_OFFSET_BITS=64 -o mjpg_bench mjpg_bench.c
+ */
+
+/* wait4() needs _DEFAULT_SOURCE with glibc */
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The ranges and defaults of the options.
+ */
+#define FRAMES_DEFAULT (1000L)
+#define FRAMES_MAX     (1000000L)
+
+#define KIB_DEFAULT (256L)
+#define KIB_MAX     (65536L)
+
+#define RST_MAX (16777216L)
+
+#define STUFF_DEFAULT (4L)
+#define STUFF_MAX     (500L)
+
+#define PAYLOAD_MAX (65533L)
+
+#define RUNS_DEFAULT (3L)
+#define RUNS_MAX     (100L)
+
+#define WORKERS_DEFAULT (4L)
+#define WORKERS_MIN     (2L)
+#define WORKERS_MAX     (64L)
+
+/*
+ * The image geometry given in the SOF0 marker of each frame.
+ */
+#define FRAME_WIDTH  (1920)
+#define FRAME_HEIGHT (1080)
+
+/*
+ * The most arguments that a benchmark passes to its program, including
+ * the program name.
+ */
+#define BENCH_ARGS_MAX (8)
+
+/*
+ * The options of the synthetic stream.
+ */
+typedef struct {
+  
+  /*
+   * The number of frames, and the size of the compressed data of each
+   * frame in bytes.
+   */
+  long frames;
+  long size;
+  
+  /*
+   * The number of bytes of compressed data between RST markers, or zero
+   * for none.
+   */
+  long rst;
+  
+  /*
+   * The number of stuffed 0xFF 0x00 pairs per 1000 bytes of compressed
+   * data.
+   */
+  long stuff;
+  
+  /*
+   * The lengths of the APP1 and COM payloads, or zero for none.
+   */
+  long app;
+  long com;
+  
+  /*
+   * The seed of the random compressed data.
+   */
+  uint64_t seed;
+  
+} GEN_OPTIONS;
+
+/*
+ * The result of a benchmark.
+ */
+typedef struct {
+  
+  /*
+   * The wall time of the fastest run in seconds.
+   */
+  double best;
+  
+  /*
+   * The largest peak resident set size of any run, in KiB.
+   */
+  long rss;
+  
+} BENCH_RESULT;
+
+/* Function prototypes */
+static uint64_t randNext(uint64_t *pState);
+static size_t putMarker(unsigned char *p, int c, long len);
+static size_t putHeaders(unsigned char *p, const GEN_OPTIONS *pg);
+static size_t putData(
+    unsigned char     * p,
+    const GEN_OPTIONS * pg,
+    uint64_t          * pState);
+static int writeStream(
+    const char        * pPath,
+    const GEN_OPTIONS * pg,
+    int64_t           * pLen);
+static double clockNow(void);
+static int runOnce(char *const *ppArgs, double *pSec, long *pRss);
+static int runBench(
+    char *const  * ppArgs,
+    long           runs,
+    BENCH_RESULT * pr);
+static int parseInt(const char *pStr, long *pv);
+
+/*
+ * Get the next random number.
+ * 
+ * This is xorshift64*, which is plenty for making up compressed data,
+ * and fast enough that it doesn't slow down writing the stream.
+ * 
+ * Parameters:
+ * 
+ *   pState - the random state, which must not be zero
+ * 
+ * Return:
+ * 
+ *   the next random number
+ */
+static uint64_t randNext(uint64_t *pState) {
+  
+  uint64_t x = 0;
+  
+  /* Check parameter */
+  if ((pState == NULL) || (*pState == 0)) {
+    abort();
+  }
+  
+  x = *pState;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *pState = x;
+  
+  return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Write the 0xFF byte, marker byte, and length of a marker, followed by
+ * a payload of zero bytes.
+ * 
+ * Parameters:
+ * 
+ *   p - where to write the marker
+ * 
+ *   c - the marker byte
+ * 
+ *   len - the length of the payload, not counting the length bytes, in
+ *   range 0 to 65533
+ * 
+ * Return:
+ * 
+ *   the number of bytes written
+ */
+static size_t putMarker(unsigned char *p, int c, long len) {
+  
+  /* Check parameters */
+  if ((p == NULL) || (c < 0) || (c > 0xfe) ||
+      (len < 0) || (len > PAYLOAD_MAX)) {
+    abort();
+  }
+  
+  p[0] = (unsigned char) 0xff;
+  p[1] = (unsigned char) c;
+  p[2] = (unsigned char) ((len + 2) >> 8);
+  p[3] = (unsigned char) ((len + 2) & 0xff);
+  memset(p + 4, 0, (size_t) len);
+  
+  return (size_t) (len + 4);
+}
+
+/*
+ * Write the markers of a frame that come before its compressed data,
+ * from the SOI up to and including the SOS.
+ * 
+ * The buffer must have room for at least 65537 * 2 + 512 bytes.
+ * 
+ * Parameters:
+ * 
+ *   p - where to write the markers
+ * 
+ *   pg - the stream options
+ * 
+ * Return:
+ * 
+ *   the number of bytes written
+ */
+static size_t putHeaders(unsigned char *p, const GEN_OPTIONS *pg) {
+  
+  size_t n = 0;
+  size_t k = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (pg == NULL)) {
+    abort();
+  }
+  
+  /* SOI */
+  p[n++] = (unsigned char) 0xff;
+  p[n++] = (unsigned char) 0xd8;
+  
+  /* APP1 and COM, if asked for */
+  if (pg->app > 0) {
+    n += putMarker(p + n, 0xe1, pg->app);
+  }
+  if (pg->com > 0) {
+    n += putMarker(p + n, 0xfe, pg->com);
+  }
+  
+  /* DQT with one table of all ones */
+  k = n;
+  n += putMarker(p + n, 0xdb, 65);
+  memset(p + k + 5, 1, 64);
+  
+  /* SOF0 with three components, all using table zero */
+  k = n;
+  n += putMarker(p + n, 0xc0, 15);
+  p[k + 4] = (unsigned char) 8;
+  p[k + 5] = (unsigned char) (FRAME_HEIGHT >> 8);
+  p[k + 6] = (unsigned char) (FRAME_HEIGHT & 0xff);
+  p[k + 7] = (unsigned char) (FRAME_WIDTH >> 8);
+  p[k + 8] = (unsigned char) (FRAME_WIDTH & 0xff);
+  p[k + 9] = (unsigned char) 3;
+  for(i = 0; i < 3; i++) {
+    p[k + 10 + (i * 3)] = (unsigned char) (i + 1);
+    p[k + 11 + (i * 3)] = (unsigned char) 0x11;
+  }
+  
+  /* DHT with a single one-bit code */
+  k = n;
+  n += putMarker(p + n, 0xc4, 18);
+  p[k + 5] = (unsigned char) 1;
+  
+  /* DRI, if there are restart markers */
+  if (pg->rst > 0) {
+    k = n;
+    n += putMarker(p + n, 0xdd, 2);
+    p[k + 4] = (unsigned char) 0;
+    p[k + 5] = (unsigned char) 1;
+  }
+  
+  /* SOS for all three components */
+  k = n;
+  n += putMarker(p + n, 0xda, 10);
+  p[k + 4] = (unsigned char) 3;
+  for(i = 0; i < 3; i++) {
+    p[k + 5 + (i * 2)] = (unsigned char) (i + 1);
+  }
+  p[k + 12] = (unsigned char) 63;
+  
+  return n;
+}
+
+/*
+ * Write the compressed data of a frame.
+ * 
+ * Exactly pg->size bytes are written, counting stuffed zeros and RST
+ * markers.
+ * 
+ * Parameters:
+ * 
+ *   p - where to write the data
+ * 
+ *   pg - the stream options
+ * 
+ *   pState - the random state
+ * 
+ * Return:
+ * 
+ *   the number of bytes written
+ */
+static size_t putData(
+    unsigned char     * p,
+    const GEN_OPTIONS * pg,
+    uint64_t          * pState) {
+  
+  size_t n = 0;
+  size_t len = 0;
+  long since = 0;
+  int rst = 0;
+  uint64_t r = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (pg == NULL) || (pState == NULL)) {
+    abort();
+  }
+  len = (size_t) pg->size;
+  
+  while (n < len) {
+    
+    /* RST marker, with room for both bytes */
+    if ((pg->rst > 0) && (since >= pg->rst) && (n + 2 <= len)) {
+      p[n++] = (unsigned char) 0xff;
+      p[n++] = (unsigned char) (0xd0 + rst);
+      rst = (rst + 1) & 7;
+      since = 0;
+      continue;
+    }
+    
+    /* Stuffed zero, with room for both bytes, or else a byte that
+     * isn't 0xFF */
+    r = randNext(pState);
+    if ((n + 2 <= len) && ((long) ((r >> 32) % 1000) < pg->stuff)) {
+      p[n++] = (unsigned char) 0xff;
+      p[n++] = (unsigned char) 0;
+      since += 2;
+    } else {
+      p[n++] = (unsigned char) ((r & 0xffffffff) % 255);
+      since++;
+    }
+  }
+  
+  return n;
+}
+
+/*
+ * Write the synthetic stream.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to write to
+ * 
+ *   pg - the stream options
+ * 
+ *   pLen - receives the length of the stream in bytes
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an error, which has been
+ *   reported
+ */
+static int writeStream(
+    const char        * pPath,
+    const GEN_OPTIONS * pg,
+    int64_t           * pLen) {
+  
+  int status = 1;
+  long i = 0;
+  size_t n = 0;
+  size_t cap = 0;
+  uint64_t state = 0;
+  unsigned char *pBuf = NULL;
+  FILE *fp = NULL;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pg == NULL) || (pLen == NULL)) {
+    abort();
+  }
+  *pLen = 0;
+  
+  /* The seed must not give a zero state */
+  state = pg->seed ^ UINT64_C(0x9e3779b97f4a7c15);
+  if (state == 0) {
+    state = 1;
+  }
+  
+  /* Allocate room for the largest frame */
+  cap = (size_t) pg->size + (PAYLOAD_MAX * 2) + 512;
+  pBuf = (unsigned char *) malloc(cap);
+  if (pBuf == NULL) {
+    abort();
+  }
+  
+  /* Create the stream */
+  fp = fopen(pPath, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't create output file!\n");
+    status = 0;
+  }
+  
+  /* Write each frame */
+  for(i = 0; status && (i < pg->frames); i++) {
+    n = putHeaders(pBuf, pg);
+    n += putData(pBuf + n, pg, &state);
+    pBuf[n++] = (unsigned char) 0xff;
+    pBuf[n++] = (unsigned char) 0xd9;
+    
+    if (fwrite(pBuf, 1, n, fp) != n) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+    *pLen += (int64_t) n;
+  }
+  
+  /* Close the stream */
+  if (fp != NULL) {
+    if (fclose(fp) && status) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+  }
+  
+  free(pBuf);
+  return status;
+}
+
+/*
+ * Get the current time.
+ * 
+ * Return:
+ * 
+ *   the time in seconds from an arbitrary starting point
+ */
+static double clockNow(void) {
+  
+  struct timespec ts;
+  
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  return ((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1.0e9);
+}
+
+/*
+ * Run a program once as a child process, with its standard output and
+ * standard error thrown away, and wait for it.
+ * 
+ * Parameters:
+ * 
+ *   ppArgs - the arguments, ending with NULL, where the first is the
+ *   path of the program
+ * 
+ *   pSec - receives the wall time in seconds
+ * 
+ *   pRss - receives the peak resident set size in KiB
+ * 
+ * Return:
+ * 
+ *   non-zero if the program ran and exited successfully, zero if not
+ */
+static int runOnce(char *const *ppArgs, double *pSec, long *pRss) {
+  
+  int fd = -1;
+  int st = 0;
+  pid_t pid = 0;
+  double t = 0.0;
+  struct rusage ru;
+  
+  /* Check parameters */
+  if ((ppArgs == NULL) || (ppArgs[0] == NULL) ||
+      (pSec == NULL) || (pRss == NULL)) {
+    abort();
+  }
+  memset(&ru, 0, sizeof(struct rusage));
+  
+  /* Start the child, flushing our output so the report stays in
+   * order */
+  fflush(stdout);
+  t = clockNow();
+  pid = fork();
+  if (pid < 0) {
+    return 0;
+  }
+  if (pid == 0) {
+    fd = open("/dev/null", O_WRONLY);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(ppArgs[0], ppArgs);
+    _exit(127);
+  }
+  
+  /* Wait for it, and get its peak memory */
+  if (wait4(pid, &st, 0, &ru) != pid) {
+    return 0;
+  }
+  *pSec = clockNow() - t;
+  *pRss = (long) ru.ru_maxrss;
+  
+  return (WIFEXITED(st) && (WEXITSTATUS(st) == 0));
+}
+
+/*
+ * Run a benchmark a number of times.
+ * 
+ * Parameters:
+ * 
+ *   ppArgs - the arguments, as for runOnce()
+ * 
+ *   runs - the number of runs
+ * 
+ *   pr - receives the result
+ * 
+ * Return:
+ * 
+ *   non-zero if every run succeeded, zero if not
+ */
+static int runBench(
+    char *const  * ppArgs,
+    long           runs,
+    BENCH_RESULT * pr) {
+  
+  long i = 0;
+  long rss = 0;
+  double sec = 0.0;
+  
+  /* Check parameters */
+  if ((ppArgs == NULL) || (runs < 1) || (pr == NULL)) {
+    abort();
+  }
+  memset(pr, 0, sizeof(BENCH_RESULT));
+  
+  for(i = 0; i < runs; i++) {
+    if (!runOnce(ppArgs, &sec, &rss)) {
+      return 0;
+    }
+    if ((i == 0) || (sec < pr->best)) {
+      pr->best = sec;
+    }
+    if (rss > pr->rss) {
+      pr->rss = rss;
+    }
+  }
+  
+  return 1;
+}
+
+/*
+ * Parse a string as an unsigned decimal integer.
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pv - receives the parsed value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid unsigned
+ *   decimal integer within the range of a long
+ */
+static int parseInt(const char *pStr, long *pv) {
+  
+  long v = 0;
+  int d = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* Must not be empty */
+  if (*pStr == 0) {
+    return 0;
+  }
+  
+  /* Parse digits, watching for overflow */
+  for( ; *pStr != 0; pStr++) {
+    if ((*pStr < '0') || (*pStr > '9')) {
+      return 0;
+    }
+    d = *pStr - '0';
+    if (v > (LONG_MAX - d) / 10) {
+      return 0;
+    }
+    v = (v * 10) + d;
+  }
+  
+  *pv = v;
+  return 1;
+}
+
+/*
+ * Program entrypoint.
+ * 
+ * See the documentation at the top of this source file for the details
+ * of how this program works.
+ * 
+ * argc is the number of parameters in argv.  argv is an array of
+ * pointers to null-terminated string parameters.  The first parameter
+ * in argv  is the module name, the second is the first actual command
+ * line parameter.
+ * 
+ * Parameters:
+ * 
+ *   argc - the number of elements in argv
+ * 
+ *   argv - array of pointers to null-terminated string parameters
+ * 
+ * Return:
+ * 
+ *   zero if successful, one if error
+ */
+int main(int argc, char *argv[]) {
+  
+  int x = 0;
+  int i = 0;
+  int status = 1;
+  int gen_only = 0;
+  long runs = RUNS_DEFAULT;
+  long workers = WORKERS_DEFAULT;
+  long v = 0;
+  int64_t len = 0;
+  double mb = 0.0;
+  const char *pPath = NULL;
+  const char *pBin = ".";
+  char *pIndex = NULL;
+  char *pTrace = NULL;
+  char jobs[32];
+  char *apArgs[BENCH_ARGS_MAX];
+  GEN_OPTIONS g;
+  BENCH_RESULT br;
+  
+  /* The benchmarks, each with its program (0 for mjpg_index, 1 for
+   * jpgtrace), mode name, and options before the path */
+  static const struct {
+    int prog;
+    const char *pMode;
+    const char *apOpt[4];
+  } bench[] = {
+    {0, "stdio",    {NULL}},
+    {0, "ring",     {"-q", "4", NULL}},
+    {0, "mmap",     {"--mmap", NULL}},
+    {0, "parallel", {"-j", NULL}},
+    {1, "stdio",    {"--summary", "-f", "csv", NULL}},
+    {1, "mmap",     {"--summary", "-f", "csv", "--mmap"}}
+  };
+  
+  /* Initialize structures */
+  memset(&g, 0, sizeof(GEN_OPTIONS));
+  memset(&br, 0, sizeof(BENCH_RESULT));
+  g.frames = FRAMES_DEFAULT;
+  g.size = KIB_DEFAULT * 1024L;
+  g.rst = 0;
+  g.stuff = STUFF_DEFAULT;
+  g.app = 0;
+  g.com = 0;
+  g.seed = 1;
+  
+  /* Check parameters */
+  if (argc < 0) {
+    abort();
+  }
+  if ((argc > 0) && (argv == NULL)) {
+    abort();
+  }
+  for(x = 0; x < argc; x++) {
+    if (argv[x] == NULL) {
+      abort();
+    }
+  }
+  
+  /* Parse any options */
+  for(x = 1; status && (x < argc); x++) {
+    if (strcmp(argv[x], "-n") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing frame count!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) ||
+                  (v < 1) || (v > FRAMES_MAX)) {
+        fprintf(stderr, "Invalid frame count!\n");
+        status = 0;
+      } else {
+        g.frames = v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-s") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing frame size!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) ||
+                  (v < 1) || (v > KIB_MAX)) {
+        fprintf(stderr, "Invalid frame size!\n");
+        status = 0;
+      } else {
+        g.size = v * 1024L;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--rst") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing restart spacing!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) || (v > RST_MAX)) {
+        fprintf(stderr, "Invalid restart spacing!\n");
+        status = 0;
+      } else {
+        g.rst = v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--stuff") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing stuffing rate!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) || (v > STUFF_MAX)) {
+        fprintf(stderr, "Invalid stuffing rate!\n");
+        status = 0;
+      } else {
+        g.stuff = v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--app") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing APP1 length!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) || (v > PAYLOAD_MAX)) {
+        fprintf(stderr, "Invalid APP1 length!\n");
+        status = 0;
+      } else {
+        g.app = v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--com") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing COM length!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &v)) || (v > PAYLOAD_MAX)) {
+        fprintf(stderr, "Invalid COM length!\n");
+        status = 0;
+      } else {
+        g.com = v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--seed") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing seed!\n");
+        status = 0;
+      } else if (!parseInt(argv[x + 1], &v)) {
+        fprintf(stderr, "Invalid seed!\n");
+        status = 0;
+      } else {
+        g.seed = (uint64_t) v;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-r") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing run count!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &runs)) ||
+                  (runs < 1) || (runs > RUNS_MAX)) {
+        fprintf(stderr, "Invalid run count!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-j") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing worker count!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &workers)) ||
+                  (workers < WORKERS_MIN) || (workers > WORKERS_MAX)) {
+        fprintf(stderr, "Invalid worker count!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--bin") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing program directory!\n");
+        status = 0;
+      } else {
+        pBin = argv[x + 1];
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--gen") == 0) {
+      gen_only = 1;
+      
+    } else {
+      break;
+    }
+  }
+  
+  /* We need exactly one parameter beyond the options */
+  if (status && (x != argc - 1)) {
+    fprintf(stderr, "Expecting exactly one parameter!\n");
+    status = 0;
+  }
+  if (status) {
+    pPath = argv[x];
+  }
+  
+  /* Write the stream */
+  if (status) {
+    status = writeStream(pPath, &g, &len);
+  }
+  if (status) {
+    mb = ((double) len) / 1.0e6;
+    printf("Stream: %ld frames, %.1f MB, %ld KiB per frame, "
+            "RST every %ld bytes, %ld stuffed per 1000, "
+            "APP1 %ld, COM %ld\n",
+            g.frames, mb, g.size / 1024L, g.rst, g.stuff, g.app, g.com);
+  }
+  
+  /* Get the program paths */
+  if (status && (!gen_only)) {
+    pIndex = (char *) malloc(strlen(pBin) + 16);
+    pTrace = (char *) malloc(strlen(pBin) + 16);
+    if ((pIndex == NULL) || (pTrace == NULL)) {
+      abort();
+    }
+    sprintf(pIndex, "%s/mjpg_index", pBin);
+    sprintf(pTrace, "%s/jpgtrace", pBin);
+    sprintf(jobs, "%ld", workers);
+    
+    printf("%-11s %-9s %10s %12s %14s\n",
+            "program", "mode", "MB/s", "frames/s", "peak RSS KiB");
+  }
+  
+  /* Run the benchmarks */
+  for(x = 0; status && (!gen_only) &&
+        (x < (int) (sizeof(bench) / sizeof(bench[0]))); x++) {
+    
+    /* Build the arguments */
+    i = 0;
+    apArgs[i++] = (bench[x].prog == 0) ? pIndex : pTrace;
+    for(v = 0; (v < 4) && (bench[x].apOpt[v] != NULL); v++) {
+      apArgs[i++] = (char *) bench[x].apOpt[v];
+      if (strcmp(bench[x].apOpt[v], "-j") == 0) {
+        apArgs[i++] = jobs;
+      }
+    }
+    apArgs[i++] = (char *) pPath;
+    apArgs[i] = NULL;
+    
+    /* Run and report */
+    if (!runBench(apArgs, runs, &br)) {
+      fprintf(stderr, "Benchmark failed: %s %s!\n",
+        (bench[x].prog == 0) ? "mjpg_index" : "jpgtrace",
+        bench[x].pMode);
+      status = 0;
+      break;
+    }
+    
+    printf("%-11s %-9s %10.1f %12.1f %14ld\n",
+            (bench[x].prog == 0) ? "mjpg_index" : "jpgtrace",
+            bench[x].pMode,
+            mb / br.best,
+            ((double) g.frames) / br.best,
+            br.rss);
+  }
+  
+  /* Release the program paths */
+  if (pIndex != NULL) {
+    free(pIndex);
+    pIndex = NULL;
+  }
+  if (pTrace != NULL) {
+    free(pTrace);
+    pTrace = NULL;
+  }
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,1497 @@
+/*
+ * mjpg_extract.c
+ * 
+ * Extract frames from a raw Motion-JPEG stream using its index.
+ * 
+ * Syntax:
+ * 
+ *   mjpg_extract [options] [path] [out]
+ *   mjpg_extract --merge [out] [path] [path] ...
+ * 
+ * Parameters:
+ * 
+ *   [path] - the path of the raw Motion-JPEG file, or with --merge, of
+ *   each of the files to join together, in order
+ * 
+ *   [out] - the path of the Motion-JPEG file to write, or with --jpg,
+ *   the prefix of the JPEG files to write
+ * 
+ * Options:
+ * 
+ *   -i [index] - the index of the file made by mjpg_index, in any of
+ *   its formats; the default is [path] with ".index" suffixed
+ * 
+ *   --frames [A..B] - only extract frames A through B, counting from
+ *   zero; a single frame number extracts just that frame; the default
+ *   is every frame in the index
+ * 
+ *   --every [n] - only extract every nth frame of the range, starting
+ *   with the first; the default is 1, which extracts every frame
+ * 
+ *   --jpg - write each frame to a JPEG file of its own instead of
+ *   writing a new Motion-JPEG file
+ * 
+ *   --merge - join whole Motion-JPEG files together into [out], along
+ *   with their indexes; can't be combined with the other options
+ * 
+ * Operation:
+ * 
+ *   The frames to extract are looked up in the index, so only the bytes
+ *   of those frames are ever read from the input file.  Each frame
+ *   starts at its offset in the index.  With a v2 index, the frame runs
+ *   up to the end of its EOI marker.  With a v1 or native index, which
+ *   only record offsets, the frame runs up to the start of the next
+ *   frame, or the end of the file for the last frame.  Each frame must
+ *   start with an SOI marker and lie within the input file, or else the
+ *   index doesn't match the file and extraction stops with an error.
+ * 
+ *   Normally, the extracted frames are written one after the other to
+ *   [out] as a new raw Motion-JPEG stream, and an index of the new
+ *   stream is written to [out] with ".index" suffixed.  The new index
+ *   is in the same format as the input index, and for v2, each record
+ *   keeps the frame information from the input index, including the
+ *   frame hashes if the input index has them.  A frame keeps the
+ *   duplicate flag only if it has the same hash and length as the frame
+ *   extracted just before it, since with --every, or at the start of
+ *   the range, the frame it duplicated may not have been extracted.
+ *   Apart from the duplicate flags, the new index is therefore exactly
+ *   what mjpg_index would write for [out], with --hash if the input
+ *   index has hashes.  The exception is a sparse or packed input
+ *   index, which gives a v1 index, since those formats have to be
+ *   written in a single pass by mjpg_index; run mjpg_index -f sparse or
+ *   -f packed on [out] to get one.
+ * 
+ *   With --jpg, each frame is instead written to a file of its own,
+ *   named with [out] followed by the number of the frame in the input
+ *   stream, padded to at least six digits with zeros, and ".jpg".  For
+ *   example, with an [out] of "clip/f", frame 42 is written to
+ *   "clip/f000042.jpg".  No index is written.
+ * 
+ *   Output files are truncated when they are created, so the program
+ *   stops with an error before writing anything if [out], its index, or
+ *   any of the JPEG files is the same file as [path] or its index, or
+ *   with --merge, as any [path] or its index.
+ * 
+ *   With --merge, each [path] is copied whole to [out] one after the
+ *   other, and the index of each, which must be [path] with ".index"
+ *   suffixed, is appended to the index of [out] with its frame offsets
+ *   moved along by the total length of the files before it.  The
+ *   indexes must all be in the same format, which is also the format of
+ *   the new index, except that sparse and packed indexes give v1.  This
+ *   gives the same index as running mjpg_index on [out], but only the
+ *   indexes are read, so the cost is proportional to the number of
+ *   frames rather than the number of bytes.  Only the first and last
+ *   frame of each file are checked against the index.  For v2, the new
+ *   index only has hashes if every index has them, and is marked as
+ *   having duplicates left out if any index is.  Duplicate flags are
+ *   kept, except on the first frame of each file, since the frame
+ *   before it in [out] is the last frame of the file before.
+ * 
+ *   On Linux, frame bytes are copied from the input file to the output
+ *   file within the kernel with copy_file_range(), so they are never
+ *   copied into this program at all, and on filesystems that support
+ *   it they may not even be copied on disk.  If the files don't support
+ *   that, sendfile() is tried, and failing that (and on other systems)
+ *   the bytes are copied through a buffer with pread() and write().
+ * 
+ * Compilation:
+ * 
+ *   This program uses the index reader in mjpg_idx.c, which must be
+ *   compiled along with it.
+ * 
+ *   Compile with 64-bit file offset support if you're going to try this
+ *   on huge M-JPEG files.  Define _FILE_OFFSET_BITS=64
+ * 
+ *   For example:
+ * 
+ *     cc -O2 -D_FILE_OFFSET_BITS=64 -o mjpg_extract \
+ *       mjpg_extract.c mjpg_idx.c
+ */
+
+/* copy_file_range() needs _GNU_SOURCE with glibc */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define EXTRACT_ZEROCOPY
+#endif
+
+#include "mjpg_idx.h"
+
+/*
+ * The size in bytes of the buffer used to copy frames when they can't
+ * be copied within the kernel.
+ */
+#define COPY_BUF_SIZE (1024L * 1024L)
+
+/*
+ * The largest number of bytes to ask the kernel to copy in one call.
+ */
+#define COPY_CHUNK_MAX (1024L * 1024L * 1024L)
+
+/*
+ * Ways of copying bytes between files, from most to least preferred.
+ */
+#define COPY_RANGE    (1)
+#define COPY_SENDFILE (2)
+#define COPY_BUFFER   (3)
+
+/*
+ * State for copying frames between files.
+ */
+typedef struct {
+  
+  /*
+   * The COPY method currently in use.  This only ever moves down the
+   * list, the first time a method turns out not to work.
+   */
+  int method;
+  
+  /*
+   * The buffer for COPY_BUFFER, or NULL if not allocated yet.
+   */
+  unsigned char *pBuf;
+  
+} COPIER;
+
+/*
+ * The device and inode numbers of a file, which tell whether two paths
+ * name the same file.
+ */
+typedef struct {
+  
+  dev_t dev;
+  ino_t ino;
+  
+} FILE_ID;
+
+/* Function prototypes */
+static void copierInit(COPIER *pc);
+static void copierFree(COPIER *pc);
+static int copyBuffered(
+    COPIER  * pc,
+    int       fdIn,
+    int64_t   off,
+    int       fdOut,
+    int64_t   len);
+static int copyFrame(
+    COPIER  * pc,
+    int       fdIn,
+    int64_t   off,
+    int       fdOut,
+    int64_t   len);
+static void packBE(unsigned char *p, uint64_t val, int n);
+static void packLE(unsigned char *p, uint64_t val, int n);
+static int outputFormat(int format);
+static int writeIndexHeader(
+    FILE     * fp,
+    int        format,
+    long       count,
+    uint64_t   flags);
+static int writeRecord(
+    FILE                 * fp,
+    int                    format,
+    const MJPG_IDX_FRAME * pf,
+    int64_t                offset);
+static const char *checkFrame(
+    int              fdIn,
+    int64_t          in_len,
+    MJPG_IDX_FRAME * pf);
+static char *indexPath(const char *pPath);
+static void fileId(const struct stat *pst, FILE_ID *pId);
+static int sameFile(const char *pPath, const FILE_ID *pIds, int count);
+static int mergeStreams(
+    COPIER       * pc,
+    const char   * pOutPath,
+    char * const * ppInPath,
+    int            count);
+static int parseInt(const char *pStr, long *pv);
+static int parseFrames(const char *pStr, long *pa, long *pb);
+
+/*
+ * Initialize a copier, starting with the most preferred method that is
+ * available.
+ * 
+ * Parameters:
+ * 
+ *   pc - the copier to initialize
+ */
+static void copierInit(COPIER *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pc, 0, sizeof(COPIER));
+#ifdef EXTRACT_ZEROCOPY
+  pc->method = COPY_RANGE;
+#else
+  pc->method = COPY_BUFFER;
+#endif
+  pc->pBuf = NULL;
+}
+
+/*
+ * Release a copier.
+ * 
+ * Parameters:
+ * 
+ *   pc - the copier to release
+ */
+static void copierFree(COPIER *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Free buffer if allocated */
+  if (pc->pBuf != NULL) {
+    free(pc->pBuf);
+    pc->pBuf = NULL;
+  }
+}
+
+/*
+ * Copy bytes from one file to another through the copier's buffer.
+ * 
+ * The bytes are read from the given offset of the input file, and
+ * written at the current position of the output file.  Interrupted
+ * reads and writes are retried.
+ * 
+ * Parameters:
+ * 
+ *   pc - the copier
+ * 
+ *   fdIn - the input file
+ * 
+ *   off - the offset in the input file to copy from
+ * 
+ *   fdOut - the output file
+ * 
+ *   len - the number of bytes to copy
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an I/O error
+ */
+static int copyBuffered(
+    COPIER  * pc,
+    int       fdIn,
+    int64_t   off,
+    int       fdOut,
+    int64_t   len) {
+  
+  ssize_t got = 0;
+  ssize_t put = 0;
+  size_t chunk = 0;
+  size_t done = 0;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (fdIn < 0) || (off < 0) || (fdOut < 0) ||
+      (len < 0)) {
+    abort();
+  }
+  
+  /* Allocate the buffer the first time it is needed */
+  if (pc->pBuf == NULL) {
+    pc->pBuf = (unsigned char *) malloc((size_t) COPY_BUF_SIZE);
+    if (pc->pBuf == NULL) {
+      abort();
+    }
+  }
+  
+  /* Copy a buffer at a time */
+  while (len > 0) {
+    chunk = (size_t) COPY_BUF_SIZE;
+    if (len < (int64_t) chunk) {
+      chunk = (size_t) len;
+    }
+    
+    got = pread(fdIn, pc->pBuf, chunk, (off_t) off);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    } else if (got == 0) {
+      return 0;
+    }
+    
+    for(done = 0; done < (size_t) got; done += (size_t) put) {
+      put = write(fdOut, pc->pBuf + done, ((size_t) got) - done);
+      if (put < 0) {
+        if (errno == EINTR) {
+          put = 0;
+          continue;
+        }
+        return 0;
+      }
+    }
+    
+    off += (int64_t) got;
+    len -= (int64_t) got;
+  }
+  
+  return 1;
+}
+
+/*
+ * Copy a run of bytes, such as a frame, from one file to another.
+ * 
+ * The bytes are read from the given offset of the input file, and
+ * written at the current position of the output file.  The copy is
+ * done within the kernel if possible.  If the kernel refuses a method
+ * before anything has been copied with it, the copier moves on to the
+ * next method, and keeps using that for later frames.
+ * 
+ * Parameters:
+ * 
+ *   pc - the copier
+ * 
+ *   fdIn - the input file
+ * 
+ *   off - the offset in the input file to copy from
+ * 
+ *   fdOut - the output file
+ * 
+ *   len - the number of bytes to copy
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an I/O error
+ */
+static int copyFrame(
+    COPIER  * pc,
+    int       fdIn,
+    int64_t   off,
+    int       fdOut,
+    int64_t   len) {
+
+#ifdef EXTRACT_ZEROCOPY
+  off_t in_off = 0;
+  ssize_t got = 0;
+  size_t chunk = 0;
+  int copied = 0;
+#endif
+  
+  /* Check parameters */
+  if ((pc == NULL) || (fdIn < 0) || (off < 0) || (fdOut < 0) ||
+      (len < 0)) {
+    abort();
+  }
+
+#ifdef EXTRACT_ZEROCOPY
+  /* Copy within the kernel for as long as that works */
+  in_off = (off_t) off;
+  while ((len > 0) && (pc->method != COPY_BUFFER)) {
+    chunk = (size_t) COPY_CHUNK_MAX;
+    if (len < (int64_t) chunk) {
+      chunk = (size_t) len;
+    }
+    
+    if (pc->method == COPY_RANGE) {
+      got = copy_file_range(fdIn, &in_off, fdOut, NULL, chunk, 0);
+    } else {
+      got = sendfile(fdOut, fdIn, &in_off, chunk);
+    }
+    
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      
+      /* If this method isn't supported for these files, move on to
+       * the next one, unless part of the frame has been copied with
+       * it, in which case the error is real */
+      if (copied || ((errno != EXDEV) && (errno != EINVAL) &&
+            (errno != ENOSYS) && (errno != EOPNOTSUPP) &&
+            (errno != EBADF))) {
+        return 0;
+      }
+      (pc->method)++;
+      continue;
+      
+    } else if (got == 0) {
+      /* Input ended early */
+      return 0;
+    }
+    
+    copied = 1;
+    len -= (int64_t) got;
+  }
+  off = (int64_t) in_off;
+#endif
+  
+  /* Copy whatever is left through the buffer */
+  if (len > 0) {
+    return copyBuffered(pc, fdIn, off, fdOut, len);
+  }
+  return 1;
+}
+
+/*
+ * Store an unsigned integer in big endian into a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to write to
+ * 
+ *   val - the value to store
+ * 
+ *   n - the number of bytes to store, in range 1 to 8
+ */
+static void packBE(unsigned char *p, uint64_t val, int n) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Store bytes from the least significant end */
+  for(i = n - 1; i >= 0; i--) {
+    p[i] = (unsigned char) (val & 0xff);
+    val >>= 8;
+  }
+}
+
+/*
+ * Store an unsigned integer in little endian into a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to write to
+ * 
+ *   val - the value to store
+ * 
+ *   n - the number of bytes to store, in range 1 to 8
+ */
+static void packLE(unsigned char *p, uint64_t val, int n) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Store bytes from the least significant end */
+  for(i = 0; i < n; i++) {
+    p[i] = (unsigned char) (val & 0xff);
+    val >>= 8;
+  }
+}
+
+/*
+ * Get the format of the index to write for a given input index format.
+ * 
+ * This is the same format, except that a sparse or packed index gives
+ * v1, which records the same information.
+ * 
+ * Parameters:
+ * 
+ *   format - the INDEX format of the input index
+ * 
+ * Return:
+ * 
+ *   the INDEX format of the output index
+ */
+static int outputFormat(int format) {
+  if ((format == INDEX_SPARSE) || (format == INDEX_PACKED)) {
+    return INDEX_V1;
+  }
+  return format;
+}
+
+/*
+ * Write the header of an index file, with a given frame count.
+ * 
+ * Parameters:
+ * 
+ *   fp - the index file
+ * 
+ *   format - the INDEX format
+ * 
+ *   count - the number of frames
+ * 
+ *   flags - for v2, the INDEX_V2_FLAG constants
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was a write error
+ */
+static int writeIndexHeader(
+    FILE     * fp,
+    int        format,
+    long       count,
+    uint64_t   flags) {
+  
+  unsigned char buf[INDEX_V2_HEADER];
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((fp == NULL) || (count < 1)) {
+    abort();
+  }
+  
+  /* Build the header */
+  memset(buf, 0, sizeof(buf));
+  if (format == INDEX_V1) {
+    packBE(buf, (uint64_t) count, 8);
+    len = 8;
+    
+  } else if (format == INDEX_V2) {
+    memcpy(buf, INDEX_V2_MAGIC, 8);
+    packBE(buf + 8, INDEX_V2_HEADER, 4);
+    packBE(buf + 12, INDEX_V2_RECORD, 4);
+    packBE(buf + 16, (uint64_t) count, 8);
+    packBE(buf + 24, flags, 8);
+    len = INDEX_V2_HEADER;
+    
+  } else if (format == INDEX_NATIVE) {
+    memcpy(buf, INDEX_NATIVE_MAGIC, 8);
+    packLE(buf + 8, (uint64_t) count, 8);
+    len = INDEX_NATIVE_HEADER;
+    
+  } else {
+    abort();
+  }
+  
+  /* Write the header */
+  return (fwrite(buf, 1, len, fp) == len);
+}
+
+/*
+ * Write the index record of an extracted frame.
+ * 
+ * Parameters:
+ * 
+ *   fp - the index file
+ * 
+ *   format - the INDEX format
+ * 
+ *   pf - the frame record from the input index
+ * 
+ *   offset - the offset of the frame in the output stream
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was a write error
+ */
+static int writeRecord(
+    FILE                 * fp,
+    int                    format,
+    const MJPG_IDX_FRAME * pf,
+    int64_t                offset) {
+  
+  unsigned char buf[INDEX_V2_RECORD];
+  
+  /* Check parameters */
+  if ((fp == NULL) || (pf == NULL) || (offset < 0)) {
+    abort();
+  }
+  
+  /* v1 and native records are just the offset */
+  if (format == INDEX_V1) {
+    packBE(buf, (uint64_t) offset, 8);
+    return (fwrite(buf, 1, 8, fp) == 8);
+  } else if (format == INDEX_NATIVE) {
+    packLE(buf, (uint64_t) offset, 8);
+    return (fwrite(buf, 1, 8, fp) == 8);
+  } else if (format != INDEX_V2) {
+    abort();
+  }
+  
+  /* v2 record keeps the frame information, which is known to fit since
+   * it came from a v2 record */
+  memset(buf, 0, sizeof(buf));
+  packBE(buf, (uint64_t) offset, 8);
+  packBE(buf + 8, (uint64_t) pf->length, 4);
+  packBE(buf + 12, (uint64_t) pf->width, 2);
+  packBE(buf + 14, (uint64_t) pf->height, 2);
+  packBE(buf + 16, (uint64_t) pf->restart, 2);
+  packBE(buf + 18, (uint64_t) pf->scans, 2);
+  packBE(buf + 20, (uint64_t) pf->components, 1);
+  packBE(buf + 21, (uint64_t) pf->sof, 1);
+  packBE(buf + 22, (uint64_t) pf->flags, 2);
+  packBE(buf + 24, pf->hash, 8);
+  
+  return (fwrite(buf, 1, sizeof(buf), fp) == sizeof(buf));
+}
+
+/*
+ * Check a frame record from an index against the input file.
+ * 
+ * A frame that runs to the end of the stream is given a length that
+ * runs to the end of the input file.  The frame must then lie within
+ * the input file and start with an SOI marker.
+ * 
+ * Parameters:
+ * 
+ *   fdIn - the input file
+ * 
+ *   in_len - the length of the input file
+ * 
+ *   pf - the frame record, whose length may be updated
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+static const char *checkFrame(
+    int              fdIn,
+    int64_t          in_len,
+    MJPG_IDX_FRAME * pf) {
+  
+  unsigned char soi[2];
+  ssize_t got = 0;
+  
+  /* Check parameters */
+  if ((fdIn < 0) || (in_len < 0) || (pf == NULL)) {
+    abort();
+  }
+  
+  /* A frame that runs to the end of the stream runs to the end of the
+   * file */
+  if ((pf->length < 0) && (pf->offset < in_len)) {
+    pf->length = in_len - pf->offset;
+  }
+  
+  /* The frame must be within the file and start with an SOI */
+  if ((pf->length < 2) || (pf->offset > in_len - pf->length)) {
+    return "Index doesn't match input file!";
+  }
+  do {
+    got = pread(fdIn, soi, 2, (off_t) pf->offset);
+  } while ((got < 0) && (errno == EINTR));
+  if (got != 2) {
+    return "I/O error!";
+  }
+  if ((soi[0] != 0xff) || (soi[1] != 0xd8)) {
+    return "Index doesn't match input file!";
+  }
+  
+  return NULL;
+}
+
+/*
+ * Allocate the default index path for a Motion-JPEG file, which is the
+ * path with ".index" suffixed.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the Motion-JPEG file
+ * 
+ * Return:
+ * 
+ *   a newly allocated string with the index path
+ */
+static char *indexPath(const char *pPath) {
+  
+  char *pIdxPath = NULL;
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Build the path */
+  pIdxPath = (char *) malloc(strlen(pPath) + 7);
+  if (pIdxPath == NULL) {
+    abort();
+  }
+  strcpy(pIdxPath, pPath);
+  strcat(pIdxPath, ".index");
+  
+  return pIdxPath;
+}
+
+/*
+ * Get the identity of a file from its status.
+ * 
+ * Parameters:
+ * 
+ *   pst - the status of the file, from stat() or fstat()
+ * 
+ *   pId - receives the identity of the file
+ */
+static void fileId(const struct stat *pst, FILE_ID *pId) {
+  
+  /* Check parameters */
+  if ((pst == NULL) || (pId == NULL)) {
+    abort();
+  }
+  
+  pId->dev = pst->st_dev;
+  pId->ino = pst->st_ino;
+}
+
+/*
+ * Check whether a path names any of a list of files.
+ * 
+ * This is used before creating an output file, so that the output can
+ * never truncate one of the input files.  A path that doesn't exist
+ * yet doesn't name any of them.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to check
+ * 
+ *   pIds - the identities of the files
+ * 
+ *   count - the number of files in pIds
+ * 
+ * Return:
+ * 
+ *   non-zero if the path names one of the files, zero if not
+ */
+static int sameFile(const char *pPath, const FILE_ID *pIds, int count) {
+  
+  struct stat st;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || ((pIds == NULL) && (count > 0)) ||
+      (count < 0)) {
+    abort();
+  }
+  
+  /* A path that can't be looked up isn't an existing file */
+  if (stat(pPath, &st)) {
+    return 0;
+  }
+  
+  for(i = 0; i < count; i++) {
+    if ((st.st_dev == pIds[i].dev) && (st.st_ino == pIds[i].ino)) {
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+/*
+ * Join whole Motion-JPEG files together along with their indexes.
+ * 
+ * See the documentation at the top of this source file for how this
+ * works.  The indexes are read twice, first to check their formats and
+ * total the frame counts so that the new index header can be written
+ * up front, and then to copy the records.  Errors are reported to
+ * stderr.
+ * 
+ * Parameters:
+ * 
+ *   pc - the copier
+ * 
+ *   pOutPath - the path of the Motion-JPEG file to write
+ * 
+ *   ppInPath - the paths of the files to join
+ * 
+ *   count - the number of files to join, one or greater
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int mergeStreams(
+    COPIER       * pc,
+    const char   * pOutPath,
+    char * const * ppInPath,
+    int            count) {
+  
+  int status = 1;
+  int format = 0;
+  int fdIn = -1;
+  int fdOut = -1;
+  int i = 0;
+  int id_count = 0;
+  long k = 0;
+  long total = 0;
+  uint64_t flags = INDEX_V2_FLAG_HASH;
+  int64_t in_len = 0;
+  int64_t base = 0;
+  struct stat st;
+  FILE_ID *pIds = NULL;
+  FILE *fi = NULL;
+  char *pIdxPath = NULL;
+  const char *pErr = NULL;
+  MJPG_IDX idx;
+  MJPG_IDX_FRAME fr;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pOutPath == NULL) || (ppInPath == NULL) ||
+      (count < 1)) {
+    abort();
+  }
+  
+  /* Initialize structures */
+  mjpg_idxInit(&idx);
+  memset(&fr, 0, sizeof(MJPG_IDX_FRAME));
+  memset(&st, 0, sizeof(struct stat));
+  
+  /* Allocate room for the identities of each file and its index */
+  pIds = (FILE_ID *) calloc((size_t) count, 2 * sizeof(FILE_ID));
+  if (pIds == NULL) {
+    abort();
+  }
+  
+  /* Check that all the indexes are in the same format, total the frame
+   * counts, and work out the v2 header flags, noting the identity of
+   * each file and its index; a file that can't be looked up fails
+   * later, when it is opened */
+  for(i = 0; status && (i < count); i++) {
+    if (stat(ppInPath[i], &st) == 0) {
+      fileId(&st, &(pIds[id_count]));
+      id_count++;
+    }
+    pIdxPath = indexPath(ppInPath[i]);
+    pErr = mjpg_idxOpen(&idx, pIdxPath);
+    if ((pErr == NULL) && (fstat(fileno(idx.fp), &st) == 0)) {
+      fileId(&st, &(pIds[id_count]));
+      id_count++;
+    }
+    if (pErr != NULL) {
+      fprintf(stderr, "%s: %s\n", pIdxPath, pErr);
+      status = 0;
+    } else if ((i > 0) && (idx.format != format)) {
+      fprintf(stderr, "%s: Index is in a different format!\n",
+              pIdxPath);
+      status = 0;
+    } else if (idx.count > LONG_MAX - total) {
+      fprintf(stderr, "Too many frames!\n");
+      status = 0;
+    } else {
+      format = idx.format;
+      total += idx.count;
+      if (!(idx.flags & INDEX_V2_FLAG_HASH)) {
+        flags &= ~((uint64_t) INDEX_V2_FLAG_HASH);
+      }
+      flags |= idx.flags & INDEX_V2_FLAG_DROP;
+    }
+    mjpg_idxClose(&idx);
+    free(pIdxPath);
+    pIdxPath = NULL;
+  }
+  
+  /* The output stream and its index are about to be truncated, so
+   * neither may be any of the files or their indexes */
+  if (status) {
+    pIdxPath = indexPath(pOutPath);
+    if (sameFile(pOutPath, pIds, id_count) ||
+        sameFile(pIdxPath, pIds, id_count)) {
+      fprintf(stderr, "Output is the same file as an input!\n");
+      status = 0;
+    }
+  }
+  free(pIds);
+  pIds = NULL;
+  
+  /* Create the output stream and its index */
+  if (status) {
+    fdOut = open(pOutPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fdOut < 0) {
+      fprintf(stderr, "Can't create output file!\n");
+      status = 0;
+    }
+  }
+  if (status) {
+    fi = fopen(pIdxPath, "wb");
+    if (fi == NULL) {
+      fprintf(stderr, "Can't create index file!\n");
+      status = 0;
+    } else if (!writeIndexHeader(fi, outputFormat(format), total,
+                                  flags)) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+  }
+  if (pIdxPath != NULL) {
+    free(pIdxPath);
+    pIdxPath = NULL;
+  }
+  
+  /* Append each file and its index */
+  for(i = 0; status && (i < count); i++) {
+    
+    /* Open the file and its index */
+    fdIn = open(ppInPath[i], O_RDONLY);
+    if (fdIn < 0) {
+      fprintf(stderr, "%s: Can't open input file!\n", ppInPath[i]);
+      status = 0;
+      break;
+    }
+    if (fstat(fdIn, &st) || (!S_ISREG(st.st_mode))) {
+      fprintf(stderr, "%s: Input must be a regular file!\n",
+              ppInPath[i]);
+      status = 0;
+    } else {
+      in_len = (int64_t) st.st_size;
+    }
+    if (status && (in_len > INT64_MAX - base)) {
+      fprintf(stderr, "Output file too large!\n");
+      status = 0;
+    }
+    
+    if (status) {
+      pIdxPath = indexPath(ppInPath[i]);
+      pErr = mjpg_idxOpen(&idx, pIdxPath);
+      free(pIdxPath);
+      pIdxPath = NULL;
+      if ((pErr == NULL) && (idx.format != format)) {
+        pErr = "Index is in a different format!";
+      }
+      if (pErr != NULL) {
+        fprintf(stderr, "%s: %s\n", ppInPath[i], pErr);
+        status = 0;
+      }
+    }
+    
+    /* Check the first and last frames against the file */
+    if (status) {
+      pErr = mjpg_idxFrame(&idx, 0, &fr);
+      if (pErr == NULL) {
+        pErr = checkFrame(fdIn, in_len, &fr);
+      }
+      if (pErr == NULL) {
+        pErr = mjpg_idxFrame(&idx, idx.count - 1, &fr);
+      }
+      if (pErr == NULL) {
+        pErr = checkFrame(fdIn, in_len, &fr);
+      }
+      if (pErr != NULL) {
+        fprintf(stderr, "%s: %s\n", ppInPath[i], pErr);
+        status = 0;
+      }
+    }
+    
+    /* Copy the whole file */
+    if (status) {
+      if (!copyFrame(pc, fdIn, 0, fdOut, in_len)) {
+        fprintf(stderr, "I/O error on copy!\n");
+        status = 0;
+      }
+    }
+    
+    /* Append the index records with the offsets moved along, dropping
+     * the hashes unless every index has them, and the duplicate flag of
+     * the first frame, which follows the frames of another file */
+    for(k = 0; status && (k < idx.count); k++) {
+      pErr = mjpg_idxFrame(&idx, k, &fr);
+      if (!(flags & INDEX_V2_FLAG_HASH)) {
+        fr.hash = 0;
+      }
+      if (k == 0) {
+        fr.flags &= ~FRAME_FLAG_DUP;
+      }
+      if (pErr != NULL) {
+        fprintf(stderr, "%s: %s\n", ppInPath[i], pErr);
+        status = 0;
+      } else if (fr.offset >= in_len) {
+        fprintf(stderr, "%s: Index doesn't match input file!\n",
+                ppInPath[i]);
+        status = 0;
+      } else if (!writeRecord(fi, outputFormat(format), &fr,
+                              base + fr.offset)) {
+        fprintf(stderr, "I/O error on write!\n");
+        status = 0;
+      }
+    }
+    base += in_len;
+    
+    /* Close the file and its index */
+    mjpg_idxClose(&idx);
+    close(fdIn);
+    fdIn = -1;
+  }
+  
+  /* Close the output stream and its index, checking for errors */
+  if (fdOut >= 0) {
+    if (close(fdOut) && status) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+    fdOut = -1;
+  }
+  if (fi != NULL) {
+    if (fclose(fi) && status) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+    fi = NULL;
+  }
+  
+  return status;
+}
+
+/*
+ * Parse a string as an unsigned decimal integer.
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pv - receives the parsed value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid unsigned
+ *   decimal integer within the range of a long
+ */
+static int parseInt(const char *pStr, long *pv) {
+  
+  long v = 0;
+  int d = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* Must not be empty */
+  if (*pStr == 0) {
+    return 0;
+  }
+  
+  /* Parse digits, watching for overflow */
+  for( ; *pStr != 0; pStr++) {
+    if ((*pStr < '0') || (*pStr > '9')) {
+      return 0;
+    }
+    d = *pStr - '0';
+    if (v > (LONG_MAX - d) / 10) {
+      return 0;
+    }
+    v = (v * 10) + d;
+  }
+  
+  *pv = v;
+  return 1;
+}
+
+/*
+ * Parse a frame range, which is either a single frame number, or two
+ * frame numbers separated by "..", such as "10..20".
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pa - receives the first frame of the range
+ * 
+ *   pb - receives the last frame of the range
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid range
+ */
+static int parseFrames(const char *pStr, long *pa, long *pb) {
+  
+  char buf[32];
+  const char *pSep = NULL;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pa == NULL) || (pb == NULL)) {
+    abort();
+  }
+  
+  /* A single frame number is a range of one frame */
+  pSep = strstr(pStr, "..");
+  if (pSep == NULL) {
+    if (!parseInt(pStr, pa)) {
+      return 0;
+    }
+    *pb = *pa;
+    return 1;
+  }
+  
+  /* Parse the first number from a copy, then the second in place */
+  len = (size_t) (pSep - pStr);
+  if (len >= sizeof(buf)) {
+    return 0;
+  }
+  memcpy(buf, pStr, len);
+  buf[len] = (char) 0;
+  
+  if ((!parseInt(buf, pa)) || (!parseInt(pSep + 2, pb))) {
+    return 0;
+  }
+  if (*pb < *pa) {
+    return 0;
+  }
+  
+  return 1;
+}
+
+/*
+ * Program entrypoint.
+ * 
+ * See the documentation at the top of this source file for the details
+ * of how this program works.
+ * 
+ * argc is the number of parameters in argv.  argv is an array of
+ * pointers to null-terminated string parameters.  The first parameter
+ * in argv  is the module name, the second is the first actual command
+ * line parameter.
+ * 
+ * Parameters:
+ * 
+ *   argc - the number of elements in argv
+ * 
+ *   argv - array of pointers to null-terminated string parameters
+ * 
+ * Return:
+ * 
+ *   zero if successful, one if error
+ */
+int main(int argc, char *argv[]) {
+  
+  int x = 0;
+  int status = 1;
+  int ranged = 0;
+  int jpg = 0;
+  int merge = 0;
+  int fdIn = -1;
+  int fdOut = -1;
+  long frame_a = 0;
+  long frame_b = 0;
+  long every = 1;
+  long count = 0;
+  long i = 0;
+  int64_t in_len = 0;
+  int64_t out_off = 0;
+  int64_t last_length = -1;
+  uint64_t last_hash = 0;
+  struct stat st;
+  FILE_ID ids[2];
+  FILE *fi = NULL;
+  const char *pErr = NULL;
+  const char *pInPath = NULL;
+  const char *pOutPath = NULL;
+  const char *pIdxArg = NULL;
+  char *pIdxPath = NULL;
+  char *pName = NULL;
+  size_t name_len = 0;
+  MJPG_IDX idx;
+  MJPG_IDX_FRAME fr;
+  COPIER cp;
+  
+  /* Initialize structures */
+  mjpg_idxInit(&idx);
+  memset(&fr, 0, sizeof(MJPG_IDX_FRAME));
+  memset(&st, 0, sizeof(struct stat));
+  memset(ids, 0, sizeof(ids));
+  copierInit(&cp);
+  
+  /* Check parameters */
+  if (argc < 0) {
+    abort();
+  }
+  if ((argc > 0) && (argv == NULL)) {
+    abort();
+  }
+  for(x = 0; x < argc; x++) {
+    if (argv[x] == NULL) {
+      abort();
+    }
+  }
+  
+  /* Parse any options */
+  for(x = 1; status && (x < argc); x++) {
+    if (strcmp(argv[x], "-i") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing index path!\n");
+        status = 0;
+      } else {
+        pIdxArg = argv[x + 1];
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--frames") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing frame range!\n");
+        status = 0;
+      } else if (!parseFrames(argv[x + 1], &frame_a, &frame_b)) {
+        fprintf(stderr, "Invalid frame range!\n");
+        status = 0;
+      }
+      ranged = 1;
+      x++;
+      
+    } else if (strcmp(argv[x], "--every") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing frame step!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &every)) || (every < 1)) {
+        fprintf(stderr, "Invalid frame step!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--jpg") == 0) {
+      jpg = 1;
+      
+    } else if (strcmp(argv[x], "--merge") == 0) {
+      merge = 1;
+      
+    } else {
+      break;
+    }
+  }
+  
+  /* Merging takes an output file and then any number of files to join,
+   * and no other options */
+  if (status && merge) {
+    if ((pIdxArg != NULL) || ranged || (every != 1) || jpg) {
+      fprintf(stderr,
+        "--merge can't be combined with -i, --frames, --every, or "
+        "--jpg!\n");
+      status = 0;
+    } else if (x > argc - 2) {
+      fprintf(stderr, "Expecting output file and files to merge!\n");
+      status = 0;
+    } else {
+      status = mergeStreams(&cp, argv[x], argv + x + 1, argc - x - 1);
+    }
+    
+    copierFree(&cp);
+    if (status) {
+      return 0;
+    }
+    return 1;
+  }
+  
+  /* We need exactly two parameters beyond the options */
+  if (status && (x != argc - 2)) {
+    fprintf(stderr, "Expecting exactly two parameters!\n");
+    status = 0;
+  }
+  if (status) {
+    pInPath = argv[x];
+    pOutPath = argv[x + 1];
+  }
+  
+  /* Open the index */
+  if (status) {
+    if (pIdxArg != NULL) {
+      pErr = mjpg_idxOpen(&idx, pIdxArg);
+    } else {
+      pIdxPath = indexPath(pInPath);
+      pErr = mjpg_idxOpen(&idx, pIdxPath);
+    }
+    if (pErr != NULL) {
+      fprintf(stderr, "%s\n", pErr);
+      status = 0;
+    }
+  }
+  
+  /* Work out the frames to extract */
+  if (status) {
+    if (!ranged) {
+      frame_a = 0;
+      frame_b = idx.count - 1;
+    } else if (frame_b >= idx.count) {
+      fprintf(stderr, "Frame range goes past end of index!\n");
+      status = 0;
+    }
+  }
+  if (status) {
+    count = ((frame_b - frame_a) / every) + 1;
+  }
+  
+  /* Open the input file and get its length */
+  if (status) {
+    fdIn = open(pInPath, O_RDONLY);
+    if (fdIn < 0) {
+      fprintf(stderr, "Can't open input file!\n");
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fstat(fdIn, &st) || (!S_ISREG(st.st_mode))) {
+      fprintf(stderr, "Input must be a regular file!\n");
+      status = 0;
+    } else {
+      in_len = (int64_t) st.st_size;
+      fileId(&st, &(ids[0]));
+    }
+  }
+  if (status) {
+    if (fstat(fileno(idx.fp), &st)) {
+      fprintf(stderr, "Can't read index file!\n");
+      status = 0;
+    } else {
+      fileId(&st, &(ids[1]));
+    }
+  }
+  
+  /* Unless writing JPEG files, the output stream and its index are
+   * about to be truncated, so neither may be the input or its index */
+  if (status && (!jpg)) {
+    if (pIdxPath != NULL) {
+      free(pIdxPath);
+    }
+    pIdxPath = indexPath(pOutPath);
+    if (sameFile(pOutPath, ids, 2) || sameFile(pIdxPath, ids, 2)) {
+      fprintf(stderr, "Output is the same file as the input!\n");
+      status = 0;
+    }
+  }
+  
+  /* Unless writing JPEG files, create the output stream and its index,
+   * which has the frame count up front since it is already known */
+  if (status && (!jpg)) {
+    fdOut = open(pOutPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fdOut < 0) {
+      fprintf(stderr, "Can't create output file!\n");
+      status = 0;
+    }
+  }
+  if (status && (!jpg)) {
+    fi = fopen(pIdxPath, "wb");
+    if (fi == NULL) {
+      fprintf(stderr, "Can't create index file!\n");
+      status = 0;
+    } else if (!writeIndexHeader(fi, outputFormat(idx.format), count,
+                                  idx.flags & INDEX_V2_FLAG_HASH)) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+  }
+  
+  /* When writing JPEG files, allocate room for the file names */
+  if (status && jpg) {
+    name_len = strlen(pOutPath) + 32;
+    pName = (char *) malloc(name_len);
+    if (pName == NULL) {
+      abort();
+    }
+  }
+  
+  /* Extract each frame */
+  for(i = frame_a; status && (i <= frame_b); i += every) {
+    
+    /* Look up the frame and check it against the input file */
+    pErr = mjpg_idxFrame(&idx, i, &fr);
+    if (pErr == NULL) {
+      pErr = checkFrame(fdIn, in_len, &fr);
+    }
+    if (pErr != NULL) {
+      fprintf(stderr, "%s\n", pErr);
+      status = 0;
+      break;
+    }
+    
+    /* Create the JPEG file for this frame if writing JPEG files */
+    if (jpg) {
+      snprintf(pName, name_len, "%s%06ld.jpg", pOutPath, i);
+      if (sameFile(pName, ids, 2)) {
+        fprintf(stderr, "Output is the same file as the input!\n");
+        status = 0;
+        break;
+      }
+      fdOut = open(pName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fdOut < 0) {
+        fprintf(stderr, "Can't create output file!\n");
+        status = 0;
+        break;
+      }
+    }
+    
+    /* Copy the frame, and index it in the output stream */
+    if (!copyFrame(&cp, fdIn, fr.offset, fdOut, fr.length)) {
+      fprintf(stderr, "I/O error on copy!\n");
+      status = 0;
+      break;
+    }
+    if (!jpg) {
+      /* A duplicate must still follow a frame just like it */
+      if ((fr.hash != last_hash) || (fr.length != last_length)) {
+        fr.flags &= ~FRAME_FLAG_DUP;
+      }
+      last_hash = fr.hash;
+      last_length = fr.length;
+      if (!writeRecord(fi, outputFormat(idx.format), &fr, out_off)) {
+        fprintf(stderr, "I/O error on write!\n");
+        status = 0;
+        break;
+      }
+      out_off += fr.length;
+    }
+    
+    /* Close the JPEG file for this frame if writing JPEG files */
+    if (jpg) {
+      if (close(fdOut)) {
+        fprintf(stderr, "I/O error on write!\n");
+        status = 0;
+      }
+      fdOut = -1;
+    }
+    
+    /* Stop before the frame number could overflow */
+    if (i > LONG_MAX - every) {
+      break;
+    }
+  }
+  
+  /* Close the output stream and its index, checking for errors */
+  if (fdOut >= 0) {
+    if (close(fdOut) && status) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+    fdOut = -1;
+  }
+  if (fi != NULL) {
+    if (fclose(fi) && status) {
+      fprintf(stderr, "I/O error on write!\n");
+      status = 0;
+    }
+    fi = NULL;
+  }
+  
+  /* Close input file if open */
+  if (fdIn >= 0) {
+    close(fdIn);
+    fdIn = -1;
+  }
+  
+  /* Release the index, the copier, and any strings */
+  mjpg_idxClose(&idx);
+  copierFree(&cp);
+  if (pIdxPath != NULL) {
+    free(pIdxPath);
+    pIdxPath = NULL;
+  }
+  if (pName != NULL) {
+    free(pName);
+    pName = NULL;
+  }
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
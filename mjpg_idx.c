@@ -0,0 +1,660 @@
+/*
+ * mjpg_idx.c
+ * 
+ * Implementation of mjpg_idx.h
+ * 
+ * See the header for further information.
+ */
+
+#include "mjpg_idx.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+/* Function prototypes */
+static uint64_t idxUnpack(const unsigned char *p, int n, int le);
+static int idxReadAt(MJPG_IDX *pi, int64_t pos, unsigned char *p,
+                     size_t len);
+static const char *idxOpenSparse(MJPG_IDX *pi, const unsigned char *ph,
+                                 int64_t flen);
+static const char *idxLoadGroup(MJPG_IDX *pi, long g);
+
+/*
+ * Unpack an unsigned integer of n bytes, in big endian order if le is
+ * zero or little endian order otherwise.
+ * 
+ * Parameters:
+ * 
+ *   p - the bytes to unpack
+ * 
+ *   n - the number of bytes, in range 1 to 8
+ * 
+ *   le - non-zero for little endian, zero for big endian
+ * 
+ * Return:
+ * 
+ *   the unpacked value
+ */
+static uint64_t idxUnpack(const unsigned char *p, int n, int le) {
+  
+  int i = 0;
+  uint64_t val = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Load bytes from the most significant end */
+  for(i = 0; i < n; i++) {
+    if (le) {
+      val = (val << 8) | ((uint64_t) p[n - 1 - i]);
+    } else {
+      val = (val << 8) | ((uint64_t) p[i]);
+    }
+  }
+  
+  return val;
+}
+
+/*
+ * Read bytes at a given position in the index file.
+ * 
+ * Parameters:
+ * 
+ *   pi - the open index
+ * 
+ *   pos - the file position to read from
+ * 
+ *   p - the buffer to read into
+ * 
+ *   len - the number of bytes to read
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the bytes couldn't be read
+ */
+static int idxReadAt(MJPG_IDX *pi, int64_t pos, unsigned char *p,
+                     size_t len) {
+  
+  /* Check parameters */
+  if ((pi == NULL) || (pi->fp == NULL) || (pos < 0) || (p == NULL)) {
+    abort();
+  }
+  
+  /* Seek and read */
+  if (fseeko(pi->fp, (off_t) pos, SEEK_SET)) {
+    return 0;
+  }
+  if (fread(p, 1, len, pi->fp) != len) {
+    return 0;
+  }
+  
+  return 1;
+}
+
+/*
+ * Read the rest of the header and the checkpoint table of a sparse or
+ * packed index.
+ * 
+ * The checkpoints must have strictly ascending frame offsets, and data
+ * positions in ascending order between the header and the checkpoint
+ * table, which must run to the end of the file.
+ * 
+ * Parameters:
+ * 
+ *   pi - the index being opened, with its format set
+ * 
+ *   ph - the 32-byte header
+ * 
+ *   flen - the length of the index file
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+static const char *idxOpenSparse(MJPG_IDX *pi, const unsigned char *ph,
+                                 int64_t flen) {
+  
+  unsigned char buf[INDEX_PACKED_CHECK];
+  size_t csize = 0;
+  uint64_t hsize = 0;
+  uint64_t k = 0;
+  uint64_t count = 0;
+  uint64_t table = 0;
+  uint64_t groups = 0;
+  long g = 0;
+  MJPG_IDX_CHECK *pc = NULL;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (pi->fp == NULL) || (ph == NULL) || (flen < 0)) {
+    abort();
+  }
+  
+  /* Get the checkpoint size for the format */
+  if (pi->format == INDEX_SPARSE) {
+    csize = INDEX_SPARSE_CHECK;
+  } else if (pi->format == INDEX_PACKED) {
+    csize = INDEX_PACKED_CHECK;
+  } else {
+    abort();
+  }
+  
+  /* Get the header fields */
+  hsize = idxUnpack(ph + 8, 4, 0);
+  k = idxUnpack(ph + 12, 4, 0);
+  count = idxUnpack(ph + 16, 8, 0);
+  table = idxUnpack(ph + 24, 8, 0);
+  if ((hsize < INDEX_SPARSE_HEADER) || (k < 1) ||
+      (k > INDEX_SPARSE_K_MAX) || (count < 1) || (count > LONG_MAX)) {
+    return "Invalid index file!";
+  }
+  
+  /* The checkpoint table runs from its position to the end of the
+   * file, after the header */
+  groups = (count / k) + ((count % k) ? 1 : 0);
+  if ((table < hsize) || (table > (uint64_t) flen) ||
+      (groups != ((uint64_t) flen - table) / csize) ||
+      ((((uint64_t) flen) - table) % csize)) {
+    return "Invalid index file!";
+  }
+  
+  pi->count = (long) count;
+  pi->header = (int64_t) hsize;
+  pi->interval = (long) k;
+  pi->groups = (long) groups;
+  pi->table = (int64_t) table;
+  
+  /* Allocate the checkpoints and the buffers for decoding a group */
+  pi->pCheck = (MJPG_IDX_CHECK *) malloc(
+                  ((size_t) groups) * sizeof(MJPG_IDX_CHECK));
+  pi->pOffs = (int64_t *) malloc(((size_t) k) * sizeof(int64_t));
+  pi->pDelta = (unsigned char *) malloc(
+                  ((size_t) k) * INDEX_VARINT_MAX);
+  if ((pi->pCheck == NULL) || (pi->pOffs == NULL) ||
+      (pi->pDelta == NULL)) {
+    abort();
+  }
+  pi->group = -1;
+  
+  /* Load and check the checkpoints */
+  if (fseeko(pi->fp, (off_t) table, SEEK_SET)) {
+    return "I/O error on index file!";
+  }
+  for(g = 0; g < pi->groups; g++) {
+    if (fread(buf, 1, csize, pi->fp) != csize) {
+      return "I/O error on index file!";
+    }
+    if ((idxUnpack(buf, 8, 0) > (uint64_t) INT64_MAX) ||
+        (idxUnpack(buf + 8, 8, 0) > table)) {
+      return "Invalid index file!";
+    }
+    pc = &((pi->pCheck)[g]);
+    pc->offset = (int64_t) idxUnpack(buf, 8, 0);
+    pc->pos = (int64_t) idxUnpack(buf + 8, 8, 0);
+    pc->base = 0;
+    pc->bits = 0;
+    
+    /* Packed checkpoints also have the base delta and residual bits */
+    if (pi->format == INDEX_PACKED) {
+      pc->base = idxUnpack(buf + 16, 8, 0);
+      pc->bits = (int) buf[24];
+      if ((pc->base > (uint64_t) INT64_MAX) || (pc->bits > 63)) {
+        return "Invalid index file!";
+      }
+    }
+    
+    if (pc->pos < (int64_t) hsize) {
+      return "Invalid index file!";
+    }
+    if (g > 0) {
+      if ((pc->offset <= pc[-1].offset) || (pc->pos < pc[-1].pos)) {
+        return "Invalid index file!";
+      }
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Decode the frame offsets of a group of a sparse or packed index,
+ * unless it is the group that was decoded last.
+ * 
+ * The group must decode to exactly one delta for each frame in the
+ * group after the first, using exactly all of the bytes up to the next
+ * group, and every offset must come before the next checkpoint.  In a
+ * sparse index, the deltas are varints.  In a packed index, each delta
+ * is the base of the group plus a residual of a fixed number of bits,
+ * and the residuals are packed with the least significant bit first.
+ * 
+ * Parameters:
+ * 
+ *   pi - the open sparse or packed index
+ * 
+ *   g - the group to load
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+static const char *idxLoadGroup(MJPG_IDX *pi, long g) {
+  
+  const MJPG_IDX_CHECK *pc = NULL;
+  int64_t end = 0;
+  int64_t next = INT64_MAX;
+  long n = 0;
+  long j = 0;
+  size_t len = 0;
+  size_t i = 0;
+  uint64_t val = 0;
+  uint64_t delta = 0;
+  int shift = 0;
+  int b = 0;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (g < 0) || (g >= pi->groups) ||
+      ((pi->format != INDEX_SPARSE) && (pi->format != INDEX_PACKED))) {
+    abort();
+  }
+  
+  /* Nothing to do if already decoded */
+  if (pi->group == g) {
+    return NULL;
+  }
+  pi->group = -1;
+  
+  /* Find the data and the number of frames in this group, and the
+   * offset of the next checkpoint, if any */
+  pc = &((pi->pCheck)[g]);
+  if (g < pi->groups - 1) {
+    end = pc[1].pos;
+    next = pc[1].offset;
+    n = pi->interval;
+  } else {
+    end = pi->table;
+    n = pi->count - (g * pi->interval);
+  }
+  
+  /* Packed data has an exact length, and varints a maximum length */
+  if (pi->format == INDEX_PACKED) {
+    if (end - pc->pos !=
+          (int64_t) ((((uint64_t) (n - 1)) * pc->bits + 7) / 8)) {
+      return "Invalid index file!";
+    }
+  } else if (end - pc->pos > (int64_t) (n * INDEX_VARINT_MAX)) {
+    return "Invalid index file!";
+  }
+  len = (size_t) (end - pc->pos);
+  
+  /* Read the data in one go */
+  if (len > 0) {
+    if (!idxReadAt(pi, pc->pos, pi->pDelta, len)) {
+      return "I/O error on index file!";
+    }
+  }
+  
+  /* Decode the offsets; for packed, shift counts bits rather than
+   * bytes */
+  (pi->pOffs)[0] = pc->offset;
+  for(j = 1; j < n; j++) {
+    delta = 0;
+    
+    if (pi->format == INDEX_PACKED) {
+      for(b = 0; b < pc->bits; b++) {
+        if (((pi->pDelta)[(size_t) (shift >> 3)] >> (shift & 7)) & 1) {
+          delta |= ((uint64_t) 1) << b;
+        }
+        shift++;
+      }
+      delta += pc->base;
+      
+    } else {
+      shift = 0;
+      do {
+        if ((i >= len) || (shift > 63)) {
+          return "Invalid index file!";
+        }
+        val = (uint64_t) ((pi->pDelta)[i] & 0x7f);
+        if ((shift > 0) && (val > (UINT64_MAX >> shift))) {
+          return "Invalid index file!";
+        }
+        delta |= val << shift;
+        shift += 7;
+        i++;
+      } while ((pi->pDelta)[i - 1] & 0x80);
+    }
+    
+    if ((delta < 1) ||
+        (delta >= (uint64_t) (next - (pi->pOffs)[j - 1]))) {
+      return "Invalid index file!";
+    }
+    (pi->pOffs)[j] = (pi->pOffs)[j - 1] + (int64_t) delta;
+  }
+  if ((pi->format == INDEX_SPARSE) && (i != len)) {
+    return "Invalid index file!";
+  }
+  
+  pi->group = g;
+  return NULL;
+}
+
+/*
+ * Initialize an index structure to the closed state.
+ * 
+ * mjpg_idxClose() may safely be called on the structure afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pi - the structure to initialize
+ */
+void mjpg_idxInit(MJPG_IDX *pi) {
+  
+  /* Check parameter */
+  if (pi == NULL) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pi, 0, sizeof(MJPG_IDX));
+  pi->fp = NULL;
+  pi->format = 0;
+  pi->count = 0;
+  pi->header = 0;
+  pi->record = 0;
+  pi->flags = 0;
+  pi->interval = 0;
+  pi->groups = 0;
+  pi->table = 0;
+  pi->pCheck = NULL;
+  pi->group = -1;
+  pi->pOffs = NULL;
+  pi->pDelta = NULL;
+}
+
+/*
+ * Open an index file and read its header.
+ * 
+ * The format is detected from the magic, and is v1 if there is none.
+ * The frame count must be at least one, and the file length must match
+ * the frame count.  A v2 index may have larger header and record sizes
+ * than this reader knows about, in which case the extra bytes are
+ * ignored.  The checkpoint table of a sparse or packed index is loaded
+ * into memory.
+ * 
+ * The structure must have been initialized with mjpg_idxInit().  Use
+ * mjpg_idxClose() to close the index, even if this function fails.
+ * 
+ * Parameters:
+ * 
+ *   pi - the structure to hold the open index
+ * 
+ *   pPath - the path of the index file
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+const char *mjpg_idxOpen(MJPG_IDX *pi, const char *pPath) {
+  
+  unsigned char buf[INDEX_V2_HEADER];
+  uint64_t count = 0;
+  uint64_t hsize = 0;
+  uint64_t rsize = 0;
+  int64_t flen = 0;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  pi->fp = fopen(pPath, "rb");
+  if (pi->fp == NULL) {
+    return "Can't open index file!";
+  }
+  
+  /* Read the start of the file, which must be at least a v1 header */
+  memset(buf, 0, sizeof(buf));
+  if (!idxReadAt(pi, 0, buf, 8)) {
+    return "Invalid index file!";
+  }
+  
+  /* Detect the format and get the frame count and sizes */
+  if (memcmp(buf, INDEX_V2_MAGIC, 8) == 0) {
+    pi->format = INDEX_V2;
+    if (!idxReadAt(pi, 8, buf + 8, INDEX_V2_HEADER - 8)) {
+      return "Invalid index file!";
+    }
+    hsize = idxUnpack(buf + 8, 4, 0);
+    rsize = idxUnpack(buf + 12, 4, 0);
+    count = idxUnpack(buf + 16, 8, 0);
+    pi->flags = idxUnpack(buf + 24, 8, 0);
+    if ((hsize < INDEX_V2_HEADER) || (rsize < INDEX_V2_RECORD)) {
+      return "Invalid index file!";
+    }
+    
+  } else if (memcmp(buf, INDEX_NATIVE_MAGIC, 8) == 0) {
+    pi->format = INDEX_NATIVE;
+    if (!idxReadAt(pi, 8, buf + 8, 8)) {
+      return "Invalid index file!";
+    }
+    hsize = INDEX_NATIVE_HEADER;
+    rsize = 8;
+    count = idxUnpack(buf + 8, 8, 1);
+    
+  } else if ((memcmp(buf, INDEX_SPARSE_MAGIC, 8) == 0) ||
+              (memcmp(buf, INDEX_PACKED_MAGIC, 8) == 0)) {
+    /* Sparse and packed indexes have variable-length groups and are
+     * checked separately */
+    if (memcmp(buf, INDEX_SPARSE_MAGIC, 8) == 0) {
+      pi->format = INDEX_SPARSE;
+    } else {
+      pi->format = INDEX_PACKED;
+    }
+    if (!idxReadAt(pi, 8, buf + 8, INDEX_SPARSE_HEADER - 8)) {
+      return "Invalid index file!";
+    }
+    if (fseeko(pi->fp, 0, SEEK_END)) {
+      return "Invalid index file!";
+    }
+    return idxOpenSparse(pi, buf, (int64_t) ftello(pi->fp));
+    
+  } else {
+    pi->format = INDEX_V1;
+    hsize = 8;
+    rsize = 8;
+    count = idxUnpack(buf, 8, 0);
+  }
+  
+  /* Check the frame count, making sure the records fit in a file */
+  if ((count < 1) || (count > LONG_MAX) ||
+      (count > ((uint64_t) INT64_MAX - hsize) / rsize)) {
+    return "Invalid index file!";
+  }
+  
+  /* Check the file length */
+  if (fseeko(pi->fp, 0, SEEK_END)) {
+    return "Invalid index file!";
+  }
+  flen = (int64_t) ftello(pi->fp);
+  if (flen != (int64_t) (hsize + (count * rsize))) {
+    return "Invalid index file!";
+  }
+  
+  pi->count = (long) count;
+  pi->header = (int64_t) hsize;
+  pi->record = (int64_t) rsize;
+  return NULL;
+}
+
+/*
+ * Read the record of a frame from an open index.
+ * 
+ * In the v1, native, sparse, and packed formats, which only store
+ * offsets, the length is worked out from the offset of the following
+ * frame, except for the last frame, whose length is -1 since it runs
+ * to the end of the stream.  In the sparse and packed formats, the
+ * group of the frame is decoded with a single read, and kept so that
+ * looking up the frames after it is cheap.
+ * 
+ * Parameters:
+ * 
+ *   pi - the open index
+ * 
+ *   i - the frame number, in range 0 to count - 1
+ * 
+ *   pf - receives the frame record
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+const char *mjpg_idxFrame(MJPG_IDX *pi, long i, MJPG_IDX_FRAME *pf) {
+  
+  unsigned char buf[INDEX_V2_RECORD];
+  uint64_t off = 0;
+  uint64_t next = 0;
+  int le = 0;
+  long g = 0;
+  long j = 0;
+  const char *pErr = NULL;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (pi->fp == NULL) || (pf == NULL) ||
+      (i < 0) || (i >= pi->count)) {
+    abort();
+  }
+  
+  /* Clear the record */
+  memset(pf, 0, sizeof(MJPG_IDX_FRAME));
+  memset(buf, 0, sizeof(buf));
+  
+  /* v2 records have everything */
+  if (pi->format == INDEX_V2) {
+    if (!idxReadAt(pi, pi->header + ((int64_t) i) * pi->record,
+                    buf, INDEX_V2_RECORD)) {
+      return "I/O error on index file!";
+    }
+    off = idxUnpack(buf, 8, 0);
+    if (off > (uint64_t) INT64_MAX) {
+      return "Invalid index file!";
+    }
+    pf->offset = (int64_t) off;
+    pf->length = (int64_t) idxUnpack(buf + 8, 4, 0);
+    pf->width = (int) idxUnpack(buf + 12, 2, 0);
+    pf->height = (int) idxUnpack(buf + 14, 2, 0);
+    pf->restart = (int) idxUnpack(buf + 16, 2, 0);
+    pf->scans = (int) idxUnpack(buf + 18, 2, 0);
+    pf->components = (int) idxUnpack(buf + 20, 1, 0);
+    pf->sof = (int) idxUnpack(buf + 21, 1, 0);
+    pf->flags = (int) idxUnpack(buf + 22, 2, 0);
+    if (pi->flags & INDEX_V2_FLAG_HASH) {
+      pf->hash = idxUnpack(buf + 24, 8, 0);
+    }
+    return NULL;
+  }
+  
+  /* Sparse and packed offsets come from the group holding the frame,
+   * and the next frame is either in the same group or the next
+   * checkpoint */
+  if ((pi->format == INDEX_SPARSE) || (pi->format == INDEX_PACKED)) {
+    g = i / pi->interval;
+    j = i % pi->interval;
+    pErr = idxLoadGroup(pi, g);
+    if (pErr != NULL) {
+      return pErr;
+    }
+    pf->offset = (pi->pOffs)[j];
+    if (i >= pi->count - 1) {
+      pf->length = -1;
+    } else if (j < pi->interval - 1) {
+      pf->length = (pi->pOffs)[j + 1] - pf->offset;
+    } else {
+      pf->length = (pi->pCheck)[g + 1].offset - pf->offset;
+    }
+    return NULL;
+  }
+  
+  /* Otherwise, read this offset and the next one if there is one */
+  if (pi->format == INDEX_NATIVE) {
+    le = 1;
+  } else if (pi->format == INDEX_V1) {
+    le = 0;
+  } else {
+    abort();
+  }
+  
+  if (i < pi->count - 1) {
+    if (!idxReadAt(pi, pi->header + ((int64_t) i) * pi->record,
+                    buf, 16)) {
+      return "I/O error on index file!";
+    }
+    next = idxUnpack(buf + 8, 8, le);
+  } else {
+    if (!idxReadAt(pi, pi->header + ((int64_t) i) * pi->record,
+                    buf, 8)) {
+      return "I/O error on index file!";
+    }
+  }
+  off = idxUnpack(buf, 8, le);
+  
+  if (off > (uint64_t) INT64_MAX) {
+    return "Invalid index file!";
+  }
+  pf->offset = (int64_t) off;
+  
+  if (i < pi->count - 1) {
+    if ((next <= off) || (next > (uint64_t) INT64_MAX)) {
+      return "Invalid index file!";
+    }
+    pf->length = (int64_t) (next - off);
+  } else {
+    pf->length = -1;
+  }
+  
+  return NULL;
+}
+
+/*
+ * Close an index opened with mjpg_idxOpen().
+ * 
+ * This may be called on a structure that mjpg_idxOpen() failed on, or
+ * that has already been closed.
+ * 
+ * Parameters:
+ * 
+ *   pi - the index to close
+ */
+void mjpg_idxClose(MJPG_IDX *pi) {
+  
+  /* Check parameter */
+  if (pi == NULL) {
+    abort();
+  }
+  
+  /* Close the file if open */
+  if (pi->fp != NULL) {
+    fclose(pi->fp);
+    pi->fp = NULL;
+  }
+  pi->count = 0;
+  
+  /* Free the sparse and packed index tables if allocated */
+  if (pi->pCheck != NULL) {
+    free(pi->pCheck);
+    pi->pCheck = NULL;
+  }
+  if (pi->pOffs != NULL) {
+    free(pi->pOffs);
+    pi->pOffs = NULL;
+  }
+  if (pi->pDelta != NULL) {
+    free(pi->pDelta);
+    pi->pDelta = NULL;
+  }
+  pi->group = -1;
+}
@@ -0,0 +1,221 @@
+#ifndef MJPG_IDX_H_INCLUDED
+#define MJPG_IDX_H_INCLUDED
+
+/*
+ * mjpg_idx.h
+ * 
+ * Random-access reader for the index files written by mjpg_index.
+ * 
+ * All of the index formats are supported, and the format is detected
+ * from the magic at the start of the file.  See mjpg_index.c for the
+ * details of each format.  Only the header is read when the index is
+ * opened, along with the checkpoint table of a sparse or packed index;
+ * each frame record is read on demand, so looking up a frame costs the
+ * same however long the index is.
+ * 
+ * Compilation:
+ * 
+ *   Compile mjpg_idx.c along with the program that uses it.
+ * 
+ *   Define _FILE_OFFSET_BITS=64 so that large index files can be
+ *   seeked.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Index file formats.
+ */
+#define INDEX_V1     (1)
+#define INDEX_V2     (2)
+#define INDEX_NATIVE (3)
+#define INDEX_SPARSE (5)
+#define INDEX_PACKED (6)
+
+/*
+ * The magic at the start of a v2 index file, and the sizes of the v2
+ * header and of each v2 frame record.
+ */
+#define INDEX_V2_MAGIC  "MJPGIDX2"
+#define INDEX_V2_HEADER (32)
+#define INDEX_V2_RECORD (32)
+
+/*
+ * Flags in the v2 header: set when each record holds a hash of its
+ * frame, and set when runs of duplicate frames were left out of the
+ * index.
+ */
+#define INDEX_V2_FLAG_HASH (0x0001)
+#define INDEX_V2_FLAG_DROP (0x0002)
+
+/*
+ * The magic at the start of a native index file, and the size of the
+ * native header.  Each native frame record is a single 64-bit offset.
+ */
+#define INDEX_NATIVE_MAGIC  "MJPGIDXL"
+#define INDEX_NATIVE_HEADER (16)
+
+/*
+ * The magic at the start of a sparse index file, the size of the
+ * sparse header, the size of each checkpoint, and the largest
+ * checkpoint interval.  A varint delta is at most 10 bytes long.
+ */
+#define INDEX_SPARSE_MAGIC  "MJPGIDXS"
+#define INDEX_SPARSE_HEADER (32)
+#define INDEX_SPARSE_CHECK  (16)
+#define INDEX_SPARSE_K_MAX  (65536L)
+#define INDEX_VARINT_MAX    (10)
+
+/*
+ * The magic at the start of a packed index file, and the size of each
+ * packed checkpoint.  The header and checkpoint interval are the same
+ * as for the sparse format.
+ */
+#define INDEX_PACKED_MAGIC "MJPGIDXP"
+#define INDEX_PACKED_CHECK (32)
+
+/*
+ * Pseudo-format for the header of a restart index, and the magic at
+ * the start of a restart index file, the size of its header, and the
+ * size of the fixed part of each frame record.  See mjpg_index.c for
+ * the details of the format.
+ */
+#define INDEX_RST   (4)
+#define RST_MAGIC   "MJPGRST1"
+#define RST_HEADER  (16)
+#define RST_RECORD  (16)
+
+/*
+ * Frame record flag set when the frame had no EOI marker before the
+ * next frame started.
+ */
+#define FRAME_FLAG_NO_EOI (0x0001)
+
+/*
+ * Frame record flag set when the frame has the same hash and length as
+ * the frame before it in the stream.
+ */
+#define FRAME_FLAG_DUP (0x0002)
+
+/*
+ * A checkpoint of a sparse or packed index, for one group of frames.
+ */
+typedef struct {
+  
+  /*
+   * The offset of the first frame in the group, and the position of
+   * the group's deltas in the index file.
+   */
+  int64_t offset;
+  int64_t pos;
+  
+  /*
+   * For a packed index only, the smallest delta in the group, which is
+   * added to every residual, and the number of bits in each residual.
+   */
+  uint64_t base;
+  int bits;
+  
+} MJPG_IDX_CHECK;
+
+/*
+ * An index file open for reading.
+ */
+typedef struct {
+  
+  /*
+   * The index file, or NULL if not open.
+   */
+  FILE *fp;
+  
+  /*
+   * The INDEX format of the file.
+   */
+  int format;
+  
+  /*
+   * The number of frames, which is always one or greater.
+   */
+  long count;
+  
+  /*
+   * The size of the header, which is where the first record starts,
+   * and the size of each record.
+   */
+  int64_t header;
+  int64_t record;
+  
+  /*
+   * For a v2 index only, the INDEX_V2_FLAG constants from the header.
+   */
+  uint64_t flags;
+  
+  /*
+   * For a sparse or packed index only, the checkpoint interval, the
+   * number of checkpoints, the position of the checkpoint table, and
+   * the checkpoints, which are loaded when the index is opened.
+   */
+  long interval;
+  long groups;
+  int64_t table;
+  MJPG_IDX_CHECK *pCheck;
+  
+  /*
+   * For a sparse or packed index only, the group whose frame offsets
+   * were decoded most recently, or -1 if none, its frame offsets, and a
+   * buffer for reading its deltas.
+   */
+  long group;
+  int64_t *pOffs;
+  unsigned char *pDelta;
+  
+} MJPG_IDX;
+
+/*
+ * Information about one frame read from an index.
+ * 
+ * Fields that the index format doesn't record are zero, except for
+ * length, which is -1 when it isn't known.
+ */
+typedef struct {
+  
+  /*
+   * The byte offset of the start of the frame.
+   */
+  int64_t offset;
+  
+  /*
+   * The length of the frame in bytes, or -1 if it runs to the end of
+   * the stream.
+   */
+  int64_t length;
+  
+  /*
+   * The image geometry and SOF marker type, the restart interval in
+   * effect for the first scan, the number of scans, and the
+   * FRAME_FLAG constants, as stored in v2 records.
+   */
+  int width;
+  int height;
+  int components;
+  int sof;
+  int restart;
+  int scans;
+  int flags;
+  
+  /*
+   * The XXH64 hash of the frame bytes, for a v2 index with
+   * INDEX_V2_FLAG_HASH.
+   */
+  uint64_t hash;
+  
+} MJPG_IDX_FRAME;
+
+void mjpg_idxInit(MJPG_IDX *pi);
+const char *mjpg_idxOpen(MJPG_IDX *pi, const char *pPath);
+const char *mjpg_idxFrame(MJPG_IDX *pi, long i, MJPG_IDX_FRAME *pf);
+void mjpg_idxClose(MJPG_IDX *pi);
+
+#endif
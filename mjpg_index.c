@@ -5,11 +5,83 @@
  * 
  * Syntax:
  * 
- *   mjpg_index [path]
+ *   mjpg_index [options] [path]
+ *   mjpg_index [options] [path1] [path2] ...
+ *   mjpg_index [options] --batch [path1] ... < list.txt
  * 
  * Parameters:
  * 
- *   [path] - the path of the raw Motion-JPEG file
+ *   [path] - the path of the raw Motion-JPEG file, or "-" to read the
+ *   stream from standard input; with more than one path, or --batch,
+ *   each file is indexed in turn as a batch
+ * 
+ * Options:
+ * 
+ *   -b [mib] - size of the read blocks in MiB, in range 1 to 256; the
+ *   default is 4
+ * 
+ *   -q [n] - read the blocks with a separate reader thread, keeping up
+ *   to n of them filled ahead of the parser, in range 2 to 64; can't be
+ *   combined with --mmap, -j, or --follow
+ * 
+ *   --mmap - map the whole input file into memory and parse it in place
+ *   instead of reading it in blocks
+ * 
+ *   -j [n] - index with n worker threads, in range 1 to 64; anything
+ *   above one implies --mmap
+ * 
+ *   --update - update an existing index file for a stream that has had
+ *   more frames appended to it since the index was made
+ * 
+ *   --follow - keep indexing a stream that is still being written,
+ *   until interrupted; can't be combined with --mmap or -j
+ * 
+ *   -f [format] - the index format to write, either "v2" (the default),
+ *   "v1", "native", "sparse", or "packed"; with --update, the format of
+ *   the existing index is kept, and a sparse or packed index can't be
+ *   updated, since its checkpoint table is only written at the end
+ * 
+ *   -k [n] - for the sparse and packed formats, the number of frames
+ *   between checkpoints, in range 1 to 65536; the default is 64
+ * 
+ *   -o [path] - write the index to the given path instead of [path]
+ *   with ".index" suffixed; required when reading standard input, and
+ *   it can't be the input file itself
+ * 
+ *   --no-tee - when reading standard input, don't copy the stream to
+ *   standard output
+ * 
+ *   --summary - when done, report the number of frames, bytes read and
+ *   written, and throughput on standard error
+ * 
+ *   --progress [sec] - while indexing, report progress on standard
+ *   error every [sec] seconds, in range 1 to 3600; can't be combined
+ *   with a batch
+ * 
+ *   --stats [path] - when done, write the figures of --summary, the
+ *   time split between reading and parsing, and the options that
+ *   affect throughput, as a JSON object to [path], or to standard error
+ *   if [path] is "-"
+ * 
+ *   --rst - also write a restart index, with the offset of every
+ *   restart marker in each frame, to the index path with ".rst"
+ *   suffixed; can't be combined with --update or -j
+ * 
+ *   --recover - on an error in the stream, skip ahead to the next frame
+ *   and keep indexing instead of failing; can't be combined with -j
+ * 
+ *   --hash - store a hash of each frame in the index; needs the v2
+ *   format
+ * 
+ *   --dedup [mode] - find runs of identical frames, and either "flag"
+ *   each frame of a run after the first, or "drop" them from the index;
+ *   implies --hash
+ * 
+ *   --batch - also read paths to index from standard input, one per
+ *   line, after any given on the command line
+ * 
+ *   -P [n] - in a batch, index up to n files at once, in range 1 to
+ *   64; the default is 4
  * 
  * Operation:
  * 
@@ -20,21 +92,333 @@
  * 
  *   The output is written to a file that is the passed [path] with
  *   ".index" suffixed to it.  If this file already exists, it is
- *   overwritten.  The output is an array of 64-bit integers in big
- *   endian ordering.  The first integer stores how many frames there
- *   are, which is always one or greater.  This is followed by one
- *   integer per frame.  Each integer is a byte offset within the
- *   Motion-JPEG sequence of the start of the JPEG frame.  These offsets
- *   are in strictly ascending order.
+ *   overwritten.  All integers in the output are unsigned, and in big
+ *   endian ordering except in the native format.
+ * 
+ *   The v2 format starts with a 32-byte header:
+ * 
+ *     8 bytes - the magic "MJPGIDX2" in ASCII
+ *     4 bytes - the header size, currently 32
+ *     4 bytes - the record size, currently 32
+ *     8 bytes - the number of frames, which is always one or greater
+ *     8 bytes - flags
+ * 
+ *   The header is followed by one fixed-size record per frame, so frame
+ *   N is at byte (header size + N * record size).  Readers must use the
+ *   sizes in the header rather than assuming 32, and ignore any bytes
+ *   beyond the fields they know.  Each record is:
+ * 
+ *     8 bytes - byte offset of the start of the frame
+ *     4 bytes - length of the frame in bytes
+ *     2 bytes - image width from the SOF marker
+ *     2 bytes - image height from the SOF marker
+ *     2 bytes - restart interval in effect for the first scan
+ *     2 bytes - number of scans (SOS markers)
+ *     1 byte  - number of components from the SOF marker
+ *     1 byte  - the SOF marker type byte (0xC0 to 0xCF)
+ *     2 bytes - flags
+ *     8 bytes - hash of the frame, or zero
+ * 
+ *   The frame runs from its offset to the end of its EOI marker.  Flag
+ *   0x0001 is set when the frame had no EOI before the next frame
+ *   started, in which case the frame runs up to the start of the next
+ *   frame.  Flag 0x0002 is set by --dedup flag when the frame is the
+ *   same as the frame before it.  If the frame had no SOF marker, the
+ *   SOF type and geometry are zero.  In the header, flag 0x0001 is set
+ *   when the records hold hashes, and flag 0x0002 is set when duplicate
+ *   frames were left out by --dedup drop, so that the frames no longer
+ *   cover the whole stream.
+ * 
+ *   The v1 format is an array of 64-bit integers.  The first integer
+ *   stores how many frames there are, which is always one or greater.
+ *   This is followed by one integer per frame.  Each integer is a byte
+ *   offset within the Motion-JPEG sequence of the start of the JPEG
+ *   frame.
+ * 
+ *   The native format is made to be mapped into memory and used as an
+ *   array of 64-bit integers without any conversion.  It is an array of
+ *   64-bit integers in little endian ordering, which is the native
+ *   ordering on x86 and ARM.  The first integer is the magic "MJPGIDXL"
+ *   in ASCII, the second is the number of frames, which is always one
+ *   or greater, and this is followed by one integer per frame, which is
+ *   the frame offset, as in v1.  Each frame runs up to the start of the
+ *   next frame, or the end of the stream for the last frame.  Since
+ *   the header is 16 bytes, the offsets are 8-byte aligned whenever the
+ *   file is, so with the file mapped at p, the offsets are simply the
+ *   array ((const uint64_t *) p) + 2.
+ * 
+ *   The sparse format is for very long recordings, where even the v1
+ *   index gets large.  It stores the full offset of every Kth frame in
+ *   a checkpoint, and only the difference from the previous offset for
+ *   the frames in between, as a varint.  Each varint is stored with the
+ *   least significant 7 bits first, one group of 7 bits per byte, with
+ *   the high bit of each byte set if another byte follows.  Frames of
+ *   up to 16 KiB take two bytes, and up to 2 MiB three, so the sparse
+ *   index is usually around a third of the size of v1.  It starts
+ *   with a 32-byte header:
+ * 
+ *     8 bytes - the magic "MJPGIDXS" in ASCII
+ *     4 bytes - the header size, currently 32
+ *     4 bytes - the checkpoint interval K, in range 1 to 65536
+ *     8 bytes - the number of frames, which is always one or greater
+ *     8 bytes - byte offset of the checkpoint table in the index file
+ * 
+ *   The header is followed by the varint deltas, and then the
+ *   checkpoint table, which runs to the end of the file.  Frames are
+ *   divided into groups of K, and each group has a 16-byte checkpoint:
+ * 
+ *     8 bytes - byte offset of the first frame in the group
+ *     8 bytes - byte offset in the index file of the group's deltas
+ * 
+ *   The deltas of a group are the K - 1 varints (fewer for the last
+ *   group) giving the offset of each frame after the first, relative
+ *   to the frame before it.  They run up to the deltas of the next
+ *   group, or the checkpoint table for the last group.  A reader keeps
+ *   the checkpoint table in memory, which is only 16 bytes per K
+ *   frames, and finds frame N by reading the deltas of group N / K in
+ *   one go and summing them.  As in v1, each frame runs up to the
+ *   start of the next frame, or the end of the stream for the last
+ *   frame.
+ * 
+ *   The packed format is the same as the sparse format, except for the
+ *   magic "MJPGIDXP" and the way the deltas of each group are stored.
+ *   Since the frames of a recording tend to be close in size, each
+ *   delta is stored as a residual above the smallest delta in its
+ *   group, using just enough bits for the largest residual.  The
+ *   residuals of a group are packed one after the other, least
+ *   significant bit first from the lowest bit of each byte, and padded
+ *   with zero bits to a whole byte.  The deltas of a group of N frames
+ *   with B-bit residuals are therefore exactly (B * (N - 1) + 7) / 8
+ *   bytes long, and a group of identical deltas takes no bytes at all.
+ *   Each group has a 32-byte checkpoint:
+ * 
+ *     8 bytes - byte offset of the first frame in the group
+ *     8 bytes - byte offset in the index file of the group's deltas
+ *     8 bytes - the base, which is added to every residual
+ *     1 byte  - the number of bits B in each residual, from 0 to 63
+ *     7 bytes - reserved, set to zero
+ * 
+ *   In all formats, frame offsets are in strictly ascending order.
+ * 
+ *   With --rst, a restart index is also written.  When a frame has a
+ *   restart interval set by a DRI marker, its compressed data is broken
+ *   up by RST markers, and each segment between them can be decoded
+ *   independently of the others, so a decoder can use the restart index
+ *   to split a single large frame across several cores.  All integers
+ *   in the restart index are unsigned and big endian.  It starts with a
+ *   16-byte header:
+ * 
+ *     8 bytes - the magic "MJPGRST1" in ASCII
+ *     8 bytes - the number of frames, the same as in the index
+ * 
+ *   This is followed by one variable-length record per frame, in the
+ *   same order as the index:
+ * 
+ *     8 bytes - byte offset of the start of the frame
+ *     4 bytes - the number of RST markers in the frame, N
+ *     2 bytes - restart interval in effect for the first scan
+ *     2 bytes - reserved, zero
+ *     N * 4   - offset of each RST marker's 0xff byte from the start of
+ *               the frame
+ * 
+ *   The RST markers of every scan in the frame are included, in stream
+ *   order.  Since the records vary in length, readers walk them in
+ *   order, using the frame offsets to stay in step with the index.
+ * 
+ *   The input file is read sequentially in large blocks and the parser
+ *   runs directly over each block in memory.  The parser keeps its
+ *   state between blocks, so markers that straddle a block boundary are
+ *   handled without any seeking.  Compressed data is skipped with a
+ *   vectorized search that passes over stuffed zero bytes and restart
+ *   markers in bulk, stopping only at the next real marker.
+ * 
+ *   With -q, the blocks are read by a separate reader thread into a
+ *   ring of n buffers, and the parser takes each block in turn as soon
+ *   as it is full, so reading the next blocks overlaps with parsing
+ *   this one instead of alternating with it.  With two buffers, this is
+ *   double buffering; more buffers smooth out storage that delivers
+ *   data in bursts, such as network mounts and spinning disks.  The
+ *   file is also given sequential access advice, so the kernel keeps
+ *   its own reads going further ahead.  This takes n times the block
+ *   size in memory (per file, in a batch).  The index is exactly the
+ *   same as without -q.  With --stats, the I/O time is then the time
+ *   that the parser spent waiting for a full block, and falls towards
+ *   zero when reading keeps ahead of parsing.
+ * 
+ *   With --mmap, the input file is instead mapped into memory with
+ *   sequential access advice, and the parser runs over the mapped bytes
+ *   directly.  This avoids copying the data through stdio and lets the
+ *   kernel read ahead as far as it likes.  The input must be a regular
+ *   file that fits within the address space.
+ * 
+ *   With -j, the mapped file is split into byte ranges that are indexed
+ *   in parallel by worker threads.  Each worker after the first
+ *   resynchronizes on the first FF D8 FF sequence (a candidate SOI)
+ *   within its range, and validates the candidate by parsing forward
+ *   through the marker structure until it reaches the first frame that
+ *   starts in the next range.  A candidate that fails to parse is
+ *   discarded and the search resumes after it, but a later candidate
+ *   that reaches a frame the failed one already parsed is given up on
+ *   there, so an error in the stream is only parsed up to once in each
+ *   range rather than once for every frame before it.  The per-range
+ *   frame lists are then chained together: each range must contain the
+ *   frame where the previous range left off, and frames before that
+ *   point are false candidates that are dropped.  If a range doesn't
+ *   line up this way, indexing falls back to a sequential scan from
+ *   where the last good range left off, so the index (and any error) is
+ *   always exactly the same as for a sequential scan.
+ * 
+ *   With --update, the existing index file is read to get the offset of
+ *   the last frame it records, and parsing resumes from that frame
+ *   instead of from the start of the file.  Only the frames after it
+ *   are appended to the index, and then the frame count at the start of
+ *   the index is rewritten, so the cost is proportional to the amount
+ *   of new data.  The last recorded frame must still be at the same
+ *   place in the stream, or the update fails.  If the update fails, the
+ *   index file is restored to what it was before.
+ * 
+ *   With --follow, reaching the end of the input file doesn't end the
+ *   stream.  Instead, the program waits for the file to grow (using
+ *   inotify on Linux, or polling elsewhere) and continues parsing the
+ *   new data as it arrives, like "tail -f".  In this mode, frames are
+ *   only added to the index once their EOI marker has been read, and
+ *   the index file (including the frame count at the start) is brought
+ *   up to date whenever the program catches up with the writer, and at
+ *   least once a second while data keeps arriving.  The index file is
+ *   therefore always a valid index of the complete frames so far.
+ *   Send SIGINT or SIGTERM to stop following; the index is then
+ *   finalized with the complete frames, and a partially written frame
+ *   at the end of the stream is left out.  --follow can be combined
+ *   with --update to resume following a stream that was indexed
+ *   before.
+ * 
+ *   With --recover, an error in the stream doesn't end indexing.
+ *   Instead, the frame that the error was found in is dropped, along
+ *   with everything up to the next candidate SOI (FF D8 FF) after the
+ *   start of that frame, which is found with the same fast search as
+ *   for -j, and parsing starts over at the candidate.  If the error
+ *   wasn't within a frame, the search starts where the error was found.
+ *   Each skipped range is reported on standard error, as a line like:
+ * 
+ *     cam.mjpg: skipped bytes 1048576 to 1310720: Missing pre-marker
+ *     byte!
+ * 
+ *   (all on one line), giving the offset of the first byte skipped, the
+ *   offset where indexing picked up again, and the error.  A frame that
+ *   is cut off by the end of the stream, as happens when the recorder
+ *   crashes, is skipped the same way, up to the end of the stream.
+ *   The index then holds every frame that parsed, and indexing only
+ *   fails if there are no frames at all, or on an error that isn't in
+ *   the stream, such as an I/O error.  When reading in blocks, the
+ *   search can't go back to a block before the one the error was found
+ *   in, so if a frame is cut off inside a marker payload and the next
+ *   frame starts in an earlier block, that frame is lost too; --mmap
+ *   doesn't have this limit.  A candidate in the middle of a marker
+ *   payload, such as a thumbnail, may be indexed as a frame, but since
+ *   the rest of the payload then fails to parse, the search just moves
+ *   on from it.
+ * 
+ *   With --hash, each frame is hashed with XXH64 (with a seed of zero)
+ *   over the bytes given by its offset and length, and the hash is
+ *   stored in its record.  The hash is worked out as the parser goes,
+ *   straight from each block while it is still in the cache, so it
+ *   costs no extra I/O, and frames can be checked for corruption or
+ *   compared with each other later on from the index alone.  With
+ *   --dedup, a frame with the same hash and length as the frame before
+ *   it counts as a duplicate, as when a camera repeats its last frame
+ *   because nothing new has arrived.  With "flag", duplicates are still
+ *   indexed, with flag 0x0002 set; with "drop", they are left out of
+ *   the index, so only the first frame of each run is listed.  Hashes
+ *   need the v2 format, since the other formats have no frame lengths.
+ *   With -j, the frames are hashed straight from the mapping as the
+ *   index is written, once the workers are done.  With --update, frames
+ *   are hashed if the existing index has hashes, and --hash or --dedup
+ *   fails if it doesn't.
+ * 
+ *   If [path] is "-", the stream is read from standard input, which may
+ *   be a pipe, and the index must be given with -o.  Input from a pipe
+ *   is never seeked, and is parsed as soon as each chunk arrives rather
+ *   than waiting for a full block.  Unless --no-tee is given, every
+ *   byte read is also copied to standard output before it is parsed, so
+ *   the program can sit in a pipeline and index a stream on its way
+ *   elsewhere without a second pass over the data:
+ * 
+ *     curl ... | mjpg_index -o cam.index - > cam.mjpg
+ * 
+ *   Standard input can't be combined with --mmap, -j, --update, or
+ *   --follow.
+ * 
+ *   A batch indexes many files with a single process, which saves
+ *   starting a process per file when there are thousands of short
+ *   recordings.  The files are shared out among a pool of -P threads,
+ *   each taking the next file as soon as it finishes the last, and the
+ *   threads take their read blocks from a shared pool, so memory use
+ *   stays bounded however many files there are.  Each file is indexed
+ *   exactly as it would be on its own, with the same options, and its
+ *   index goes to its own path with ".index" suffixed.  As each file
+ *   finishes, a line is printed with its path and either the number of
+ *   frames on standard output, or the error on standard error.  A file
+ *   that fails doesn't stop the rest of the batch, but the program
+ *   exits with an error at the end if any file failed.  With --summary,
+ *   the totals for the whole batch are reported at the end.  A batch
+ *   can't be combined with -o, --follow, or standard input as a path,
+ *   and each path should only be listed once, since files are indexed
+ *   at the same time.  With -j, each file of the batch is also indexed
+ *   with that many threads.
+ * 
+ *   Long runs can be watched with --progress, which prints a line like
+ *   this at the given interval:
+ * 
+ *     1073741824 bytes (25.0%), 16384 frames, 412.3 MiB/s, ETA 8 s,
+ *     I/O 1.902 s, parse 0.581 s
+ * 
+ *   (all on one line), giving the bytes scanned so far, the frames
+ *   found, the throughput since the last line, the estimated time left
+ *   at the average throughput so far, and the time spent reading the
+ *   input and parsing it.  The percentage and ETA are left out when
+ *   the length of the input isn't known, which is the case for
+ *   standard input and with --follow.  With -j, nothing is printed
+ *   while the workers run, since they don't count frames as they go.
+ * 
+ *   --stats writes a single line of JSON when done, for example:
+ * 
+ *     {"path": "cam.mjpg", "frames": 65536, "new_frames": 65536,
+ *     "bytes_read": 4294967296, "index_bytes": 2097184,
+ *     "seconds": 10.402, "io_seconds": 7.611, "parse_seconds": 2.322,
+ *     "frames_per_s": 6300.3, "mib_per_s": 393.8, "block_mib": 4,
+ *     "mmap": false, "workers": 1, "read_ring": 0, "skipped_ranges": 0,
+ *     "skipped_bytes": 0, "duplicate_frames": 0}
+ * 
+ *   For a batch, "path" is replaced by "files" and "failed", the
+ *   counts and times are totals over the files that were indexed, and
+ *   "batch_files" gives -P.  The I/O time is spent in reading blocks,
+ *   or in mapping the file with --mmap, and writing standard output
+ *   when teeing; the parse time covers the parser and writing the index
+ *   records.  With --mmap or -j, the file is read through page faults
+ *   during parsing, so most of the reading counts as parsing.  In a
+ *   batch, the times are summed over threads that run at once, so they
+ *   can add up to more than the elapsed time.  The JSON is only written
+ *   if indexing succeeded, except for a batch, where it is always
+ *   written.
  * 
  * Compilation:
  * 
- *   This program uses its own parser.  libjpeg is *not* required.
+ *   This program uses the parser in jpeg_parse.c, which must be
+ *   compiled along with it.  libjpeg is *not* required.  See
+ *   jpeg_parse.h for further compilation notes.
  * 
  *   Compile with 64-bit file offset support if you're going to try this
  *   on huge M-JPEG files.  Define _FILE_OFFSET_BITS=64
+ * 
+ *   POSIX threads are required, so link with -pthread
+ * 
+ *   For example:
+ * 
+ *     cc -O2 -D_FILE_OFFSET_BITS=64 -pthread -o mjpg_index \
+ *       mjpg_index.c jpeg_parse.c
  */
 
+#include <errno.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -42,243 +426,5385 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define FOLLOW_INOTIFY
+#endif
+
+#include "jpeg_parse.h"
+#include "mjpg_idx.h"
+
+/*
+ * The size in bytes of the buffer that index output is collected in
+ * before it is written to the index file.
+ */
+#define WRITER_BUF_SIZE (1024L * 1024L)
+
+/*
+ * The default, minimum, and maximum read block sizes in MiB.
+ */
+#define BLOCK_MIB_DEFAULT (4)
+#define BLOCK_MIB_MIN     (1)
+#define BLOCK_MIB_MAX     (256)
+
 /*
- * The unsigned byte value used to signal markers.
+ * The minimum and maximum number of blocks in the -q read ring.
  */
-#define JPEG_PREMARK (0xff)
+#define AHEAD_MIN (2)
+#define AHEAD_MAX (64)
 
 /*
- * JPEG marker definitions.
+ * In --follow mode, the longest time in milliseconds to wait for the
+ * input file to grow before checking again, and the longest time in
+ * milliseconds that complete frames may go unflushed to the index file
+ * while data keeps arriving.
  */
-#define JPEG_TEM      (0x01)    /* Temporary for arithmetic coding */
+#define FOLLOW_WAIT_MS  (250)
+#define FOLLOW_FLUSH_MS (1000)
 
-#define JPEG_SOF_0    (0xC0)    /* Start Of Frame, Type 0 */
-#define JPEG_SOF_1    (0xC1)    /* Start Of Frame, Type 1 */
-#define JPEG_SOF_2    (0xC2)    /* Start Of Frame, Type 2 */
-#define JPEG_SOF_3    (0xC3)    /* Start Of Frame, Type 3 */
+/*
+ * The minimum and maximum --progress intervals in seconds.
+ */
+#define PROGRESS_SEC_MIN (1)
+#define PROGRESS_SEC_MAX (3600)
 
-#define JPEG_SOF_5    (0xC5)    /* Start Of Frame, Type 5 */
-#define JPEG_SOF_6    (0xC6)    /* Start Of Frame, Type 6 */
-#define JPEG_SOF_7    (0xC7)    /* Start Of Frame, Type 7 */
+/*
+ * The default checkpoint interval for the sparse and packed formats.
+ */
+#define SPARSE_K_DEFAULT (64)
 
-#define JPEG_SOF_9    (0xC9)    /* Start Of Frame, Type 9 */
-#define JPEG_SOF_10   (0xCA)    /* Start Of Frame, Type 10 */
-#define JPEG_SOF_11   (0xCB)    /* Start Of Frame, Type 11 */
+/*
+ * The maximum number of worker threads.
+ */
+#define WORKER_MAX (64)
 
-#define JPEG_SOF_13   (0xCD)    /* Start Of Frame, Type 13 */
-#define JPEG_SOF_14   (0xCE)    /* Start Of Frame, Type 14 */
-#define JPEG_SOF_15   (0xCF)    /* Start Of Frame, Type 15 */
+/*
+ * The default number of files of a batch to index at once.
+ */
+#define BATCH_DEFAULT (4)
 
-#define JPEG_DHT      (0xC4)    /* Define Huffman Table */
-#define JPEG_DAC      (0xCC)    /* Define Arithmetic Coding cond. */
-#define JPEG_DQT      (0xDB)    /* Define Quantization Tables */
-#define JPEG_DRI      (0xDD)    /* Define Restart Interval */
-#define JPEG_DHP      (0xDE)    /* Define Hierarchical Progression */
-#define JPEG_EXP      (0xDF)    /* Expand Reference Components */
-#define JPEG_COM      (0xFE)    /* Comment */
+/*
+ * The minimum number of bytes in the range for each worker thread.
+ * Files too small to give each requested worker this much get fewer
+ * workers.
+ */
+#define WORKER_MIN_RANGE (1024L * 1024L)
 
-#define JPEG_APP_MIN  (0xE0)    /* Application-specific data zero */
-#define JPEG_APP_MAX  (0xEF)    /* Application-specific data fifteen */
+/*
+ * The primes of the XXH64 hash.
+ */
+#define HASH_P1 UINT64_C(0x9e3779b185ebca87)
+#define HASH_P2 UINT64_C(0xc2b2ae3d27d4eb4f)
+#define HASH_P3 UINT64_C(0x165667b19e3779f9)
+#define HASH_P4 UINT64_C(0x85ebca77c2b2ae63)
+#define HASH_P5 UINT64_C(0x27d4eb2f165667c5)
 
-#define JPEG_RST_MIN  (0xD0)    /* Restart Marker zero */
-#define JPEG_RST_MAX  (0xD7)    /* Restart Marker seven */
-#define JPEG_SOI      (0xD8)    /* Start Of Image */
-#define JPEG_EOI      (0xD9)    /* End Of Image */
-#define JPEG_SOS      (0xDA)    /* Start Of Scan */
-#define JPEG_DNL      (0xDC)    /* Define Number Of Lines */
+/*
+ * The --dedup modes: duplicate frames are written as usual, written
+ * with FRAME_FLAG_DUP, or left out of the index.
+ */
+#define DEDUP_NONE (0)
+#define DEDUP_FLAG (1)
+#define DEDUP_DROP (2)
 
-/* Function prototypes */
-static int jpeg_isStandAlone(int c);
-static int jpeg_isImmediate(int c);
-static void writeInt64BE(FILE *pOut, int64_t val);
-static char *suffix(const char *pa, const char *pb);
+/*
+ * Information about one frame, as stored in a v2 index record.
+ */
+typedef struct {
+  
+  /*
+   * The byte offset of the start of the frame.
+   */
+  int64_t offset;
+  
+  /*
+   * The length of the frame in bytes, once it is known.
+   */
+  int64_t length;
+  
+  /*
+   * The image geometry and SOF marker type from the first SOF marker,
+   * or all zero if no SOF marker.
+   */
+  int width;
+  int height;
+  int components;
+  int sof;
+  
+  /*
+   * The restart interval in effect for the first scan.
+   */
+  int restart;
+  
+  /*
+   * The number of scans.
+   */
+  int scans;
+  
+  /*
+   * FRAME_FLAG constants.
+   */
+  int flags;
+  
+  /*
+   * With --hash, the XXH64 hash of the frame bytes, once it is known;
+   * otherwise, zero.
+   */
+  uint64_t hash;
+  
+} FRAME_INFO;
+
+/*
+ * The state of an XXH64 hash with a seed of zero, which is fed the
+ * bytes in pieces of any length.
+ */
+typedef struct {
+  
+  /*
+   * The four accumulators, and the total number of bytes so far.
+   */
+  uint64_t v[4];
+  uint64_t total;
+  
+  /*
+   * The bytes that don't yet make up a whole 32-byte stripe, and how
+   * many there are.
+   */
+  unsigned char mem[32];
+  size_t mem_len;
+  
+} HASH_STATE;
+
+/*
+ * Buffered writer for the index file.
+ * 
+ * Index output is collected in memory and written to the file in large
+ * blocks.  The first error is remembered and everything after it is
+ * ignored, so that errors only need to be checked once at the end.
+ */
+typedef struct {
+  
+  /*
+   * The index file, which is unbuffered at the stdio level.
+   */
+  FILE *fp;
+  
+  /*
+   * The output buffer, and the number of bytes waiting in it.
+   */
+  unsigned char *pBuf;
+  size_t fill;
+  
+  /*
+   * Set if there was a write error.
+   */
+  int err;
+  
+  /*
+   * For the sparse and packed formats only: the checkpoint interval,
+   * the number of records written so far, the offset of the last frame
+   * written, and the position in the file where the next delta goes.
+   */
+  long interval;
+  long records;
+  int64_t prev;
+  int64_t pos;
+  
+  /*
+   * For the sparse and packed formats only: the checkpoints so far,
+   * with the number of checkpoints and the number there is room for,
+   * and the position of the checkpoint table once it has been written,
+   * or zero before then.
+   */
+  MJPG_IDX_CHECK *pCheck;
+  long checks;
+  long check_cap;
+  int64_t table;
+  
+  /*
+   * For the packed format only: the deltas of the current group, which
+   * are written once the group is complete, and how many there are.
+   */
+  uint64_t *pPend;
+  long pend;
+  
+  /*
+   * For the v2 format only, the INDEX_V2_FLAG constants for the header.
+   */
+  uint64_t flags;
+  
+} INDEX_WRITER;
+
+/*
+ * State used by the marker callback while building the index.
+ */
+typedef struct {
+  
+  /*
+   * The writer for the index file, and its INDEX format.
+   */
+  INDEX_WRITER *pw;
+  int format;
+  
+  /*
+   * The parser, so the callback can get at marker payloads.
+   */
+  const JPEG_PARSER *pParser;
+  
+  /*
+   * The number of frames that have been found so far.
+   */
+  long frame_count;
+  
+  /*
+   * When updating an existing index, the offset of the last frame that
+   * is already in the index, where parsing resumes; otherwise, -1.
+   */
+  int64_t resume;
+  
+  /*
+   * Set once the frame at the resume offset has been seen.
+   */
+  int resumed;
+  
+  /*
+   * Set when the frame whose SOI has been read hasn't been written to
+   * the index yet, and the information gathered about it so far.
+   */
+  int pending;
+  FRAME_INFO frame;
+  
+  /*
+   * Set when the pending frame is the frame being resumed from, which
+   * is already in the index.
+   */
+  int skip;
+  
+  /*
+   * The number of frames that were in the index file the last time that
+   * its frame count was brought up to date.
+   */
+  long flushed_count;
+  
+  /*
+   * The writer for the restart index, or NULL if there isn't one, and
+   * the offsets of the RST markers read so far in the pending frame,
+   * relative to the start of the frame.
+   */
+  INDEX_WRITER *pRw;
+  uint32_t *pRst;
+  long rst_count;
+  long rst_cap;
+  
+  /*
+   * Set by recoverMarker() when the callback fails, so that --recover
+   * doesn't mistake an error in writing the index for an error in the
+   * stream.
+   */
+  int failed;
+  
+  /*
+   * Set with --hash, and then the hash of the pending frame so far,
+   * which covers the stream up to the hashed offset.
+   */
+  int hash;
+  HASH_STATE hs;
+  int64_t hashed;
+  
+  /*
+   * With --hash, the block being parsed, its length, and the stream
+   * offset of its first byte.
+   */
+  const unsigned char *pBlock;
+  size_t block_len;
+  int64_t block_off;
+  
+  /*
+   * The DEDUP mode, the number of duplicate frames found, and the hash
+   * and length of the last frame, if there has been one.
+   */
+  int dedup;
+  long dup_count;
+  int have_last;
+  uint64_t last_hash;
+  int64_t last_length;
+  
+} INDEX_STATE;
+
+/*
+ * State of --recover while indexing a file.
+ */
+typedef struct {
+  
+  /*
+   * The path of the file, for reporting skipped ranges.
+   */
+  const char *pPath;
+  
+  /*
+   * The stream offset of the next byte that will be passed in.
+   */
+  int64_t offset;
+  
+  /*
+   * Set while searching for a candidate SOI after an error, the offset
+   * that the candidate may start at, the start of the range being
+   * skipped, and the error.
+   */
+  int hunting;
+  int64_t from;
+  int64_t bad;
+  const char *pWhy;
+  
+  /*
+   * While searching, the last bytes of the previous block, which end at
+   * offset, in case a candidate straddles the block boundary.
+   */
+  unsigned char tail[2];
+  int tail_len;
+  
+  /*
+   * The number of ranges skipped, and the total bytes in them.
+   */
+  long ranges;
+  int64_t skipped;
+  
+} RECOVER;
+
+/*
+ * A growable list of frames.
+ */
+typedef struct {
+  
+  /*
+   * The array of frames, or NULL if nothing allocated yet.
+   */
+  FRAME_INFO *pFrame;
+  
+  /*
+   * The number of frames stored in the list.
+   */
+  long count;
+  
+  /*
+   * The number of frames the array has room for.
+   */
+  long cap;
+  
+} FRAME_LIST;
+
+/*
+ * State of one worker thread in parallel indexing.
+ */
+typedef struct {
+  
+  /*
+   * The whole mapped file.
+   */
+  const unsigned char *pData;
+  size_t len;
+  
+  /*
+   * The byte range this worker is responsible for.  The worker records
+   * all frames that start within this range.
+   */
+  size_t start;
+  size_t end;
+  
+  /*
+   * Non-zero if this is the first worker, which starts parsing at the
+   * beginning of its range rather than resynchronizing.
+   */
+  int first;
+  
+  /*
+   * The frames that were found.
+   */
+  FRAME_LIST frames;
+  
+  /*
+   * While parsing, the parser, and the frame currently being parsed if
+   * pending is set.
+   */
+  const JPEG_PARSER *pParser;
+  int pending;
+  FRAME_INFO frame;
+  
+  /*
+   * While resynchronizing, the frames reached by the failed candidate
+   * that got furthest, in ascending order, or NULL if none.  Parsing on
+   * from any of them would fail in the same way.
+   */
+  const FRAME_LIST *pDead;
+  
+  /*
+   * Set to non-zero by the worker if it parsed successfully from a
+   * candidate to its handoff point, or else the parser error, and the
+   * offset where the parser stopped on it.
+   */
+  int ok;
+  const char *pErr;
+  int64_t fail;
+  
+  /*
+   * Set to non-zero by the worker if there were no candidates within
+   * its range.
+   */
+  int empty;
+  
+  /*
+   * The offset of the first frame starting at or after the end of the
+   * range, where parsing stopped, or -1 if parsing continued all the
+   * way to the end of the file.
+   */
+  int64_t handoff;
+  
+  /*
+   * The thread handle, and whether a thread was actually started.
+   */
+  pthread_t thread;
+  int started;
+  
+} INDEX_WORKER;
+
+/*
+ * Options for indexing a file, which are the same for every file in a
+ * batch.
+ */
+typedef struct {
+  
+  /*
+   * Non-zero to map the file, to update an existing index, to follow
+   * the file as it grows, to read standard input, to copy standard
+   * input to standard output, to write a restart index, to skip
+   * errors in the stream, and to hash each frame.
+   */
+  int use_mmap;
+  int update;
+  int follow;
+  int use_stdin;
+  int tee;
+  int rst;
+  int recover;
+  int hash;
+  
+  /*
+   * The DEDUP mode.
+   */
+  int dedup;
+  
+  /*
+   * The INDEX format to write, and whether it was given explicitly.
+   */
+  int format;
+  int format_set;
+  
+  /*
+   * The number of worker threads for each file, the checkpoint interval
+   * for the sparse and packed formats, and the read block size in
+   * bytes.
+   */
+  long workers;
+  long sparse_k;
+  size_t block_size;
+  
+  /*
+   * The number of blocks in the -q read ring, or zero to read blocks on
+   * the parsing thread.
+   */
+  long ahead;
+  
+  /*
+   * The interval between progress reports in milliseconds, or zero for
+   * none.
+   */
+  int64_t progress_ms;
+  
+  /*
+   * The path to write the index to, or NULL to suffix the input path.
+   */
+  const char *pOutPath;
+  
+} INDEX_OPTIONS;
+
+/*
+ * The result of indexing a file.
+ */
+typedef struct {
+  
+  /*
+   * The number of frames in the index, and the number that were already
+   * in it before an update.
+   */
+  long frame_count;
+  long old_count;
+  
+  /*
+   * The number of bytes of the input that were read, and the length of
+   * the index file.
+   */
+  int64_t read_count;
+  int64_t index_bytes;
+  
+  /*
+   * The time spent reading the input and parsing it, in microseconds.
+   */
+  int64_t io_us;
+  int64_t parse_us;
+  
+  /*
+   * With --recover, the number of ranges of the input that were
+   * skipped, and the total bytes in them.
+   */
+  long skipped_ranges;
+  int64_t skipped_bytes;
+  
+  /*
+   * With --dedup, the number of duplicate frames found.
+   */
+  long dup_frames;
+  
+} INDEX_RESULT;
+
+/*
+ * State of the --progress reports for a file.
+ */
+typedef struct {
+  
+  /*
+   * The interval between reports, the time indexing started, and the
+   * time of the last report, in microseconds on the monotonic clock.
+   */
+  int64_t interval;
+  int64_t start;
+  int64_t last;
+  
+  /*
+   * The bytes scanned at the last report, and the total bytes to scan,
+   * or -1 if not known.
+   */
+  int64_t last_bytes;
+  int64_t total;
+  
+} PROGRESS;
 
 /*
- * Return whether the given marker is a stand-alone JPEG marker.
+ * A pool of read buffers shared by the files of a batch.
  * 
- * A stand-alone JPEG marker carries no data and has no data length
- * following it.
+ * Buffers are only allocated when there is no free buffer to reuse,
+ * and at most cap are ever allocated, so the memory used is bounded no
+ * matter how many files there are.
+ */
+typedef struct {
+  
+  /*
+   * Lock for the pool, and the condition signalled when a buffer is
+   * returned.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t avail;
+  
+  /*
+   * The size of each buffer in bytes.
+   */
+  size_t size;
+  
+  /*
+   * The free buffers, the number of them, the number of buffers
+   * allocated so far, and the most that may be allocated.
+   */
+  unsigned char **ppFree;
+  int free_count;
+  int total;
+  int cap;
+  
+} BUF_POOL;
+
+/*
+ * A reader thread that keeps a ring of read blocks filled ahead of the
+ * parser, for -q.
  * 
- * c is the marker byte, which must be in range 0x00-0xFE.
+ * The blocks from head onwards that are filled belong to the parser,
+ * which takes them in order and hands each back once it is done with
+ * it; the rest belong to the reader thread, which fills them in order.
+ * The reader stops after the block that hits the end of input.
+ */
+typedef struct {
+  
+  /*
+   * Lock for everything below that changes, and the condition signalled
+   * when a block is filled or handed back.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * The input, whether it is standard input, and the block size.
+   */
+  FILE *fp;
+  int use_stdin;
+  size_t size;
+  
+  /*
+   * The blocks, the number of bytes read into each, and the number of
+   * blocks.
+   */
+  unsigned char **ppBuf;
+  size_t *pGot;
+  int count;
+  
+  /*
+   * The first block that belongs to the parser, and the number of
+   * filled blocks from there on.
+   */
+  int head;
+  int filled;
+  
+  /*
+   * Set by the reader when it has filled the last block, along with
+   * whether the last read failed; set by the parser to stop the reader
+   * early.
+   */
+  int done;
+  int err;
+  int stop;
+  
+  /*
+   * The thread handle, and whether the thread was actually started; if
+   * not, the parser reads each block itself.
+   */
+  pthread_t thread;
+  int started;
+  
+} READ_AHEAD;
+
+/*
+ * State shared by the threads indexing the files of a batch.
+ */
+typedef struct {
+  
+  /*
+   * Lock for everything below that changes.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * The options for every file, and the read buffer pool.
+   */
+  const INDEX_OPTIONS *pOpt;
+  BUF_POOL *pPool;
+  
+  /*
+   * The paths of the files, how many there are, how many there is room
+   * for, and the next one that hasn't been started.
+   */
+  char **ppPath;
+  long count;
+  long cap;
+  long next;
+  
+  /*
+   * The number of files that failed, and the totals over the files that
+   * were indexed.
+   */
+  long failed;
+  long frames;
+  int64_t read_count;
+  int64_t index_bytes;
+  int64_t io_us;
+  int64_t parse_us;
+  long skipped_ranges;
+  int64_t skipped_bytes;
+  long dup_frames;
+  
+} BATCH_STATE;
+
+/* Function prototypes */
+static void frameBegin(FRAME_INFO *pf, int64_t pos);
+static int frameMarker(
+    FRAME_INFO        * pf,
+    const JPEG_PARSER * pp,
+    int                 c,
+    int64_t             pos);
+static const char *indexMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+static const char *listMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+static void listInit(FRAME_LIST *pl);
+static void listFree(FRAME_LIST *pl);
+static int listAppend(FRAME_LIST *pl, const FRAME_INFO *pf);
+static long listFind(const FRAME_LIST *pl, int64_t off);
+static size_t findCandidate(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from);
+static int parseRange(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from,
+    INDEX_WORKER        * pw);
+static void *indexWorker(void *pv);
+static const char *indexParallel(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from,
+    int                   workers,
+    FRAME_LIST          * pl);
+static const char *commitFrame(INDEX_STATE *ps);
+static int dedupFrame(INDEX_STATE *ps, FRAME_INFO *pf);
+static const char *recoverMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos);
+static void recoverStart(RECOVER *pr, INDEX_STATE *ps, JPEG_PARSER *pp);
+static void recoverSkip(RECOVER *pr, int64_t end);
+static void hashTo(INDEX_STATE *ps, int64_t end);
+static void hashFrame(INDEX_STATE *ps);
+static int parseBlock(
+    INDEX_STATE         * ps,
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len);
+static const char *indexFeed(
+    INDEX_STATE         * ps,
+    JPEG_PARSER         * pp,
+    RECOVER             * pr,
+    const unsigned char * pBuf,
+    size_t                len,
+    size_t                back);
+static const char *indexFinish(
+    INDEX_STATE * ps,
+    JPEG_PARSER * pp,
+    RECOVER     * pr);
+static const char *rstAppend(INDEX_STATE *ps, int64_t pos);
+static void writeRstRecord(INDEX_STATE *ps);
+static int readPipe(int fd, unsigned char *pBuf, size_t len,
+                    size_t *pGot);
+static int flushIndex(INDEX_STATE *ps);
+static void handleStop(int signum);
+static int64_t monoMillis(void);
+static int64_t monoMicros(void);
+static void progressInit(PROGRESS *pp, int64_t interval_ms, int64_t total);
+static void progressReport(
+    PROGRESS * pp,
+    int64_t    bytes,
+    long       frames,
+    int64_t    io_us,
+    int64_t    parse_us);
+static void statsString(FILE *fp, const char *pStr);
+static int writeStats(
+    const char          * pPath,
+    const INDEX_OPTIONS * po,
+    const char          * pInPath,
+    long                  files,
+    long                  failed,
+    long                  threads,
+    const INDEX_RESULT  * pr,
+    int64_t               elapsed_ms);
+static int followWait(int wfd);
+static void writerInit(INDEX_WRITER *pw, FILE *fp);
+static void writerFree(INDEX_WRITER *pw);
+static void writerPut(
+    INDEX_WRITER        * pw,
+    const unsigned char * p,
+    size_t                len);
+static int writerFlush(INDEX_WRITER *pw);
+static int writerRewriteHeader(INDEX_WRITER *pw, int format, long count);
+static void writePackedGroup(INDEX_WRITER *pw);
+static void writeSparseDelta(
+    INDEX_WRITER * pw,
+    int            format,
+    int64_t        offset);
+static void writeSparseTable(INDEX_WRITER *pw, int format);
+static void packBE(unsigned char *p, uint64_t val, int n);
+static uint64_t unpackBE(const unsigned char *p, int n);
+static void packLE(unsigned char *p, uint64_t val, int n);
+static uint64_t unpackLE(const unsigned char *p, int n);
+static uint64_t hashLoad(const unsigned char *p, int n);
+static uint64_t hashRotl(uint64_t x, int r);
+static uint64_t hashRound(uint64_t acc, uint64_t val);
+static void hashInit(HASH_STATE *ph);
+static void hashUpdate(HASH_STATE *ph, const unsigned char *p, size_t len);
+static uint64_t hashFinish(const HASH_STATE *ph);
+static uint64_t hashBytes(const unsigned char *p, size_t len);
+static int64_t indexLength(int format, long count);
+static void writeIndexHeader(INDEX_WRITER *pw, int format, long count);
+static const char *writeRecord(
+    INDEX_WRITER     * pw,
+    int                format,
+    const FRAME_INFO * pf);
+static const char *readIndexTail(
+    FILE     * pIn,
+    int      * pFormat,
+    long     * pCount,
+    int64_t  * pLast,
+    uint64_t * pFlags);
+static char *suffix(const char *pa, const char *pb);
+static int sameFile(const char *pPath, const struct stat *pst);
+static int parseInt(const char *pStr, long *pv);
+static void poolInit(BUF_POOL *pp, size_t size, int cap);
+static void poolFree(BUF_POOL *pp);
+static unsigned char *poolGet(BUF_POOL *pp);
+static void poolPut(BUF_POOL *pp, unsigned char *pBuf);
+static int aheadRead(
+    READ_AHEAD    * pa,
+    unsigned char * pBuf,
+    size_t        * pGot,
+    int           * pErr);
+static void *aheadThread(void *pv);
+static void aheadInit(
+    READ_AHEAD * pa,
+    FILE       * fp,
+    int          use_stdin,
+    int          count,
+    BUF_POOL   * pPool);
+static unsigned char *aheadNext(
+    READ_AHEAD * pa,
+    size_t     * pGot,
+    int        * pEnd,
+    int        * pErr);
+static void aheadDone(READ_AHEAD *pa);
+static void aheadFree(READ_AHEAD *pa, BUF_POOL *pPool);
+static const char *indexFile(
+    const INDEX_OPTIONS * po,
+    const char          * pInPath,
+    BUF_POOL            * pPool,
+    INDEX_RESULT        * pr);
+static void *batchWorker(void *pv);
+static char *readLine(FILE *pIn, int *pErr);
+static void batchAdd(BATCH_STATE *ps, char *pPath);
+
+/*
+ * Set by the signal handler in --follow mode to request that following
+ * stops.
+ */
+static volatile sig_atomic_t m_stop = 0;
+
+/*
+ * Start gathering information about a new frame.
  * 
  * Parameters:
  * 
- *   c - the marker byte to check
+ *   pf - the frame information to reset
  * 
- * Return:
- * 
- *   non-zero if this is a stand-alone marker, zero if not
+ *   pos - the offset of the frame, which is the offset of the 0xff byte
+ *   before its SOI marker
  */
-static int jpeg_isStandAlone(int c) {
+static void frameBegin(FRAME_INFO *pf, int64_t pos) {
   
-  int result = 0;
-  
-  /* Check parameter */
-  if ((c < 0) || (c > 0xfe)) {
+  /* Check parameters */
+  if ((pf == NULL) || (pos < 0)) {
     abort();
   }
   
-  /* Check for stand-alone types */
-  if ((c == JPEG_TEM) || ((c >= JPEG_RST_MIN) && (c <= JPEG_RST_MAX)) ||
-      (c == JPEG_SOI) || (c == JPEG_EOI)) {
-    result = 1;
-  
-  } else {
-    result = 0;
-  }
-  
-  /* Return result */
-  return result;
+  /* Reset the information */
+  memset(pf, 0, sizeof(FRAME_INFO));
+  pf->offset = pos;
 }
 
 /*
- * Return whether a given marker is an "immediate" JPEG marker.
- * 
- * Immediate markers can occur within compressed data.  These are the
- * RST markers and the DNL marker.  The special zero-escape marker is
- * not considered an immediate because it is not a real marker.
+ * Update the information about a frame with a marker read within it.
  * 
- * c is the marker byte, which must be in range 0x00-0xFE.
+ * This is used for every marker after the SOI that starts the frame,
+ * excluding immediate markers.  The first SOF marker gives the frame
+ * geometry, a DRI marker before the first scan gives the restart
+ * interval, and each SOS marker counts a scan.  EOI completes the frame
+ * and sets its length.
  * 
  * Parameters:
  * 
- *   c - the marker byte to check
+ *   pf - the frame information to update
+ * 
+ *   pp - the parser, which has the start of the marker payload
+ * 
+ *   c - the marker byte
+ * 
+ *   pos - the offset of the 0xff byte before the marker byte
  * 
  * Return:
  * 
- *   non-zero if this is an immediate marker, zero if not
+ *   non-zero if the marker was EOI and the frame is complete, zero
+ *   otherwise
  */
-static int jpeg_isImmediate(int c) {
+static int frameMarker(
+    FRAME_INFO        * pf,
+    const JPEG_PARSER * pp,
+    int                 c,
+    int64_t             pos) {
   
-  int result = 0;
+  const unsigned char *ph = NULL;
   
-  /* Check parameter */
-  if ((c < 0) || (c > 0xfe)) {
+  /* Check parameters */
+  if ((pf == NULL) || (pp == NULL) || (pos < pf->offset)) {
     abort();
   }
+  ph = pp->head;
   
-  /* Check for immediate types */
-  if ((c == JPEG_DNL) || ((c >= JPEG_RST_MIN) && (c <= JPEG_RST_MAX))) {
-    result = 1;
-  
-  } else {
-    result = 0;
+  if (c == JPEG_EOI) {
+    /* End of frame includes the EOI marker */
+    pf->length = (pos + 2) - pf->offset;
+    return 1;
+    
+  } else if (jpeg_marker_flags[c] & JPEG_MF_SOF) {
+    /* First SOF payload has precision, height, width, components */
+    if ((pf->sof == 0) && (pp->head_len >= 6)) {
+      pf->sof = c;
+      pf->height = (((int) ph[1]) << 8) | ((int) ph[2]);
+      pf->width = (((int) ph[3]) << 8) | ((int) ph[4]);
+      pf->components = (int) ph[5];
+    }
+    
+  } else if (c == JPEG_DRI) {
+    /* Restart interval in effect for the first scan */
+    if ((pf->scans == 0) && (pp->head_len >= 2)) {
+      pf->restart = (((int) ph[0]) << 8) | ((int) ph[1]);
+    }
+    
+  } else if (c == JPEG_SOS) {
+    /* Count scans */
+    if (pf->scans < 0xffff) {
+      (pf->scans)++;
+    }
   }
   
-  /* Return result */
-  return result;
+  return 0;
 }
 
 /*
- * Write a 64-bit integer in big endian to the given output file.
- * 
- * pOut is the handle to write to.  It must be open for writing in
- * binary mode or undefined behavior occurs.  Writing is fully
- * sequential.  The integer is written starting at the current file
- * position.
+ * Marker callback used while building the index.
  * 
- * val is the integer value to write.  It must be zero or greater.
+ * If the marker is SOI, then the frame begins, with a frame offset that
+ * includes the 0xff byte before the SOI.  Markers within the frame are
+ * gathered into the frame information.  The frame is written to the
+ * index once its EOI has been read (or, failing that, when the next SOI
+ * is read), so that the index never includes a frame that is still
+ * being written.  With --hash, the frame is hashed along the way.
  * 
- * A fault occurs if there is any write error.
+ * When updating an existing index, the first frame must be the last
+ * frame already in the index, and it is not written again.
  * 
- * Parameters:
+ * See JPEG_MARKER_FN for the interface.  pCustom is the INDEX_STATE.
+ */
+static const char *indexMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos) {
+  
+  INDEX_STATE *ps = NULL;
+  const char *pErr = NULL;
+  
+  /* Check parameters */
+  if (pCustom == NULL) {
+    abort();
+  }
+  ps = (INDEX_STATE *) pCustom;
+  
+  /* The only immediates of interest are RST markers, for the restart
+   * index */
+  if (immed) {
+    if ((ps->pRw != NULL) && ps->pending &&
+        (jpeg_marker_flags[c] & JPEG_MF_RST)) {
+      return rstAppend(ps, pos);
+    }
+    return NULL;
+  }
+  
+  /* Markers other than SOI belong to the pending frame, if any, and EOI
+   * completes it */
+  if (c != JPEG_SOI) {
+    if (ps->pending) {
+      if (frameMarker(&(ps->frame), ps->pParser, c, pos)) {
+        hashFrame(ps);
+        return commitFrame(ps);
+      }
+    }
+    return NULL;
+  }
+  
+  /* If the previous frame never had an EOI, it runs up to this frame;
+   * write it now */
+  if (ps->pending) {
+    ps->frame.length = pos - ps->frame.offset;
+    ps->frame.flags |= FRAME_FLAG_NO_EOI;
+    hashFrame(ps);
+    pErr = commitFrame(ps);
+    if (pErr != NULL) {
+      return pErr;
+    }
+  }
+  
+  /* When updating, the first frame is the frame we are resuming from,
+   * which is already in the index */
+  if ((ps->resume >= 0) && (!(ps->resumed))) {
+    if (pos != ps->resume) {
+      return "Index does not match input file!";
+    }
+    ps->resumed = 1;
+    ps->skip = 1;
+  }
+  
+  /* This frame becomes the pending frame, and its hash starts here */
+  frameBegin(&(ps->frame), pos);
+  ps->pending = 1;
+  ps->rst_count = 0;
+  if (ps->hash) {
+    hashInit(&(ps->hs));
+    ps->hashed = pos;
+  }
+  
+  return NULL;
+}
+
+/*
+ * Write the pending frame to the index, if there is one.
+ * 
+ * The length of the frame must already be set, along with its hash
+ * if hashing.  This increments the frame count, watching for overflow.
+ * If the pending frame is the frame being resumed from, it is already
+ * in the index and nothing is written.  With --dedup drop, nothing is
+ * written for a duplicate frame either.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or an error message
+ */
+static const char *commitFrame(INDEX_STATE *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Nothing to do if no pending frame */
+  if (!(ps->pending)) {
+    return NULL;
+  }
+  ps->pending = 0;
+  
+  /* Nothing to write if resuming from this frame, but the frames after
+   * it are still compared with it */
+  if (ps->skip) {
+    ps->skip = 0;
+    dedupFrame(ps, &(ps->frame));
+    return NULL;
+  }
+  
+  /* Leave out a duplicate if dropping them */
+  if (dedupFrame(ps, &(ps->frame))) {
+    return NULL;
+  }
+  
+  /* Record the frame, and its restart markers if there is a restart
+   * index */
+  if (ps->frame_count < LONG_MAX) {
+    ps->frame_count++;
+    if (ps->pRw != NULL) {
+      writeRstRecord(ps);
+    }
+    return writeRecord(ps->pw, ps->format, &(ps->frame));
+  } else {
+    return "Too many frames!";
+  }
+}
+
+/*
+ * Compare a frame with the frame before it, for --dedup.
+ * 
+ * A frame with the same hash and length as the frame before it is a
+ * duplicate.  With DEDUP_FLAG, a duplicate gets FRAME_FLAG_DUP; with
+ * DEDUP_DROP, it should be left out of the index.  In both cases, the
+ * frame becomes the one that the next frame is compared with.  Nothing
+ * is done with DEDUP_NONE.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ *   pf - the frame, with its hash and length
+ * 
+ * Return:
+ * 
+ *   non-zero if the frame should be left out of the index, zero if it
+ *   should be written
+ */
+static int dedupFrame(INDEX_STATE *ps, FRAME_INFO *pf) {
+  
+  int dup = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pf == NULL)) {
+    abort();
+  }
+  
+  /* Nothing to do unless finding duplicates */
+  if (ps->dedup == DEDUP_NONE) {
+    return 0;
+  }
+  
+  /* Compare with the last frame, and then remember this one */
+  if (ps->have_last && (pf->hash == ps->last_hash) &&
+      (pf->length == ps->last_length)) {
+    dup = 1;
+    (ps->dup_count)++;
+  }
+  ps->have_last = 1;
+  ps->last_hash = pf->hash;
+  ps->last_length = pf->length;
+  
+  if (dup && (ps->dedup == DEDUP_DROP)) {
+    return 1;
+  }
+  if (dup) {
+    pf->flags |= FRAME_FLAG_DUP;
+  }
+  return 0;
+}
+
+/*
+ * Marker callback used with --recover.
+ * 
+ * This is indexMarker(), except that a failure is recorded in the index
+ * state, since errors from the callback can't be recovered from.
+ * 
+ * See JPEG_MARKER_FN for the interface.  pCustom is the INDEX_STATE.
+ */
+static const char *recoverMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos) {
+  
+  const char *pErr = NULL;
+  
+  /* Check parameters */
+  if (pCustom == NULL) {
+    abort();
+  }
+  
+  pErr = indexMarker(pCustom, c, immed, pos);
+  if (pErr != NULL) {
+    ((INDEX_STATE *) pCustom)->failed = 1;
+  }
+  return pErr;
+}
+
+/*
+ * Start searching for a candidate SOI after the parser stopped on an
+ * error in the stream.
+ * 
+ * The pending frame, if any, is dropped, and the search starts just
+ * after its SOI; otherwise, it starts where the parser stopped.
+ * 
+ * Parameters:
+ * 
+ *   pr - the recovery state
+ * 
+ *   ps - the index state
+ * 
+ *   pp - the parser, which has stopped on an error
+ */
+static void recoverStart(RECOVER *pr, INDEX_STATE *ps, JPEG_PARSER *pp) {
+  
+  /* Check parameters */
+  if ((pr == NULL) || (ps == NULL) || (pp == NULL) ||
+      (pp->pErr == NULL)) {
+    abort();
+  }
+  
+  pr->pWhy = pp->pErr;
+  if (ps->pending) {
+    pr->bad = ps->frame.offset;
+    pr->from = ps->frame.offset + 1;
+  } else {
+    pr->bad = pp->offset;
+    pr->from = pp->offset;
+  }
+  pr->hunting = 1;
+  pr->tail_len = 0;
+  
+  ps->pending = 0;
+  ps->skip = 0;
+  ps->rst_count = 0;
+}
+
+/*
+ * Report a skipped range and add it to the totals.
+ * 
+ * Parameters:
+ * 
+ *   pr - the recovery state, with the start of the range and the error
+ * 
+ *   end - the offset just after the range
+ */
+static void recoverSkip(RECOVER *pr, int64_t end) {
+  
+  /* Check parameters */
+  if ((pr == NULL) || (end < pr->bad)) {
+    abort();
+  }
+  
+  /* Nothing to report for an empty range */
+  if (end <= pr->bad) {
+    return;
+  }
+  
+  fprintf(stderr, "%s: skipped bytes %lld to %lld: %s\n",
+    pr->pPath, (long long) pr->bad, (long long) end, pr->pWhy);
+  (pr->ranges)++;
+  pr->skipped += end - pr->bad;
+}
+
+/*
+ * Hash the pending frame up to a given offset in the stream.
+ * 
+ * The bytes up to the offset must be in the block being parsed, except
+ * that the last byte of the block before may have been held back by
+ * parseBlock(), in which case it was 0xff.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state, which must be hashing
+ * 
+ *   end - the stream offset to hash up to
+ */
+static void hashTo(INDEX_STATE *ps, int64_t end) {
+  
+  unsigned char c = 0xff;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (!(ps->hash)) ||
+      (end > ps->block_off + (int64_t) ps->block_len)) {
+    abort();
+  }
+  
+  /* Nothing to do if already hashed that far */
+  if (end <= ps->hashed) {
+    return;
+  }
+  
+  /* Hash the byte that was held back, if any, and then the rest from
+   * the block */
+  if (ps->hashed == ps->block_off - 1) {
+    hashUpdate(&(ps->hs), &c, 1);
+    (ps->hashed)++;
+  }
+  if (ps->hashed < ps->block_off) {
+    abort();
+  }
+  hashUpdate(&(ps->hs), ps->pBlock + (size_t) (ps->hashed - ps->block_off),
+              (size_t) (end - ps->hashed));
+  ps->hashed = end;
+}
+
+/*
+ * Finish the hash of the pending frame once its length is known, if
+ * hashing.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state, with a pending frame
+ */
+static void hashFrame(INDEX_STATE *ps) {
+  
+  /* Check parameters */
+  if ((ps == NULL) || (!(ps->pending))) {
+    abort();
+  }
+  
+  if (ps->hash) {
+    hashTo(ps, ps->frame.offset + ps->frame.length);
+    ps->frame.hash = hashFinish(&(ps->hs));
+  }
+}
+
+/*
+ * Pass a block of the stream to the parser, keeping the hash of the
+ * pending frame up to date if hashing.
+ * 
+ * Frames are hashed as the parser reaches their end, and once the
+ * block has been parsed, the pending frame is hashed up to the end of
+ * the block, so the bytes are hashed while they are still in the cache
+ * and the block doesn't need to be kept.  A 0xff byte at the end of the
+ * block is held back, since it may turn out to be the start of the next
+ * SOI marker.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ *   pp - the parser
+ * 
+ *   pBuf - the block of data
+ * 
+ *   len - the number of bytes in the block
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the parser stopped on an error
+ */
+static int parseBlock(
+    INDEX_STATE         * ps,
+    JPEG_PARSER         * pp,
+    const unsigned char * pBuf,
+    size_t                len) {
+  
+  int64_t end = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pp == NULL) || ((pBuf == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Without hashing, just parse */
+  if (!(ps->hash)) {
+    return jpeg_parserFeed(pp, pBuf, len);
+  }
+  
+  ps->pBlock = pBuf;
+  ps->block_len = len;
+  ps->block_off = pp->offset;
+  if (!jpeg_parserFeed(pp, pBuf, len)) {
+    return 0;
+  }
+  
+  if (ps->pending && (len > 0)) {
+    end = ps->block_off + (int64_t) len;
+    if (pBuf[len - 1] == 0xff) {
+      end--;
+    }
+    hashTo(ps, end);
+  }
+  
+  return 1;
+}
+
+/*
+ * Pass the next block of the stream to the parser, recovering from
+ * errors if requested.
+ * 
+ * Without recovery, this is just parseBlock().  With recovery, an
+ * error in the stream starts a search for the next candidate SOI, and
+ * once one is found, the parser starts over there with a fresh state.
+ * The search may go back into the back bytes that come just before the
+ * block in memory, which is how a mapped file is searched all the way
+ * back to the start of the frame with the error.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ *   pp - the parser
+ * 
+ *   pr - the recovery state, or NULL for no recovery
+ * 
+ *   pBuf - the block of data
+ * 
+ *   len - the number of bytes in the block
+ * 
+ *   back - the number of bytes of the stream just before pBuf that may
+ *   also be read
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else an error message
+ */
+static const char *indexFeed(
+    INDEX_STATE         * ps,
+    JPEG_PARSER         * pp,
+    RECOVER             * pr,
+    const unsigned char * pBuf,
+    size_t                len,
+    size_t                back) {
+  
+  int64_t base = 0;
+  int64_t lo = 0;
+  int64_t cand = 0;
+  size_t k = 0;
+  size_t wlen = 0;
+  unsigned char w[4];
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pp == NULL) || ((pBuf == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Without recovery, just parse */
+  if (pr == NULL) {
+    if (!parseBlock(ps, pp, pBuf, len)) {
+      return pp->pErr;
+    }
+    return NULL;
+  }
+  
+  base = pr->offset;
+  pr->offset += (int64_t) len;
+  
+  while (1) {
+    
+    /* Parse the block, unless searching; only errors in the stream can
+     * be recovered from */
+    if (!(pr->hunting)) {
+      if (parseBlock(ps, pp, pBuf, len)) {
+        return NULL;
+      }
+      if (ps->failed) {
+        return pp->pErr;
+      }
+      recoverStart(pr, ps, pp);
+    }
+    
+    /* A candidate may straddle the start of a block that has no back
+     * bytes, so check the tail of the previous block first */
+    cand = -1;
+    if ((back < 1) && (pr->tail_len > 0)) {
+      memcpy(w, pr->tail, (size_t) pr->tail_len);
+      wlen = (size_t) pr->tail_len;
+      for(k = 0; (k < 2) && (k < len); k++) {
+        w[wlen++] = pBuf[k];
+      }
+      
+      lo = base - (int64_t) pr->tail_len;
+      k = 0;
+      if (pr->from > lo) {
+        k = (size_t) (pr->from - lo);
+      }
+      if (k <= wlen) {
+        k = findCandidate(w, wlen, k);
+        if (k < (size_t) pr->tail_len) {
+          cand = lo + (int64_t) k;
+        }
+      }
+    }
+    
+    /* Otherwise, search the block and its back bytes */
+    if (cand < 0) {
+      lo = base - (int64_t) back;
+      k = 0;
+      if (pr->from > lo) {
+        k = (size_t) (pr->from - lo);
+      }
+      if (k <= back + len) {
+        k = findCandidate(pBuf - back, back + len, k);
+        if (k < back + len) {
+          cand = lo + (int64_t) k;
+        }
+      }
+    }
+    
+    /* If there is no candidate, keep the tail of the block, and keep
+     * searching in the next block */
+    if (cand < 0) {
+      if (len >= 2) {
+        pr->tail[0] = pBuf[len - 2];
+        pr->tail[1] = pBuf[len - 1];
+        pr->tail_len = 2;
+      } else if (len > 0) {
+        if (pr->tail_len > 0) {
+          pr->tail[0] = pr->tail[pr->tail_len - 1];
+          pr->tail_len = 1;
+        }
+        pr->tail[(pr->tail_len)++] = pBuf[0];
+      }
+      return NULL;
+    }
+    
+    /* Start over at the candidate */
+    recoverSkip(pr, cand);
+    pr->hunting = 0;
+    pr->tail_len = 0;
+    jpeg_parserInit(pp, &recoverMarker, ps, pp->immed);
+    pp->offset = cand;
+    
+    /* A candidate in the tail of the previous block gets those bytes
+     * first, and then the whole block; otherwise, the block is parsed
+     * from the candidate, which may be in the back bytes */
+    if (cand < base - (int64_t) back) {
+      if (!parseBlock(ps, pp, w + (size_t) (cand - lo),
+                      (size_t) (base - cand))) {
+        if (ps->failed) {
+          return pp->pErr;
+        }
+        recoverStart(pr, ps, pp);
+      }
+    } else if (cand < base) {
+      k = (size_t) (base - cand);
+      pBuf -= k;
+      len += k;
+      back -= k;
+      base = cand;
+    } else {
+      k = (size_t) (cand - base);
+      pBuf += k;
+      len -= k;
+      back = 0;
+      base = cand;
+    }
+  }
+}
+
+/*
+ * Tell the parser that the end of the stream has been reached,
+ * recovering from a cut-off frame if requested.
+ * 
+ * Without recovery, this is just jpeg_parserFinish().  With recovery,
+ * a search still going on, or a frame cut off by the end of the
+ * stream, is reported as skipped up to the end of the stream.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ *   pp - the parser
+ * 
+ *   pr - the recovery state, or NULL for no recovery
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else an error message
+ */
+static const char *indexFinish(
+    INDEX_STATE * ps,
+    JPEG_PARSER * pp,
+    RECOVER     * pr) {
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pp == NULL)) {
+    abort();
+  }
+  
+  /* A search still going on skips the rest of the stream */
+  if ((pr != NULL) && pr->hunting) {
+    recoverSkip(pr, pr->offset);
+    pr->hunting = 0;
+    return NULL;
+  }
+  
+  if (jpeg_parserFinish(pp)) {
+    return NULL;
+  }
+  if (pr == NULL) {
+    return pp->pErr;
+  }
+  
+  /* Skip the frame that was cut off */
+  recoverStart(pr, ps, pp);
+  recoverSkip(pr, pr->offset);
+  pr->hunting = 0;
+  return NULL;
+}
+
+/*
+ * Add a restart marker to the pending frame.
+ * 
+ * The list of restart markers grows as necessary.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state, which must have a pending frame
+ * 
+ *   pos - the offset of the 0xff byte before the RST marker
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or an error message
+ */
+static const char *rstAppend(INDEX_STATE *ps, int64_t pos) {
+  
+  long new_cap = 0;
+  uint32_t *pNew = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (!(ps->pending)) || (pos < ps->frame.offset)) {
+    abort();
+  }
+  
+  /* Offset within the frame and count must fit in 32 bits */
+  if (pos - ps->frame.offset > (int64_t) UINT32_MAX) {
+    return "Frame too large for restart index!";
+  }
+  if (ps->rst_count >= (long) INT32_MAX) {
+    return "Too many restart markers!";
+  }
+  
+  /* Grow the array if necessary, doubling the capacity each time */
+  if (ps->rst_count >= ps->rst_cap) {
+    if (ps->rst_cap < 1) {
+      new_cap = 1024;
+    } else {
+      new_cap = ps->rst_cap * 2;
+    }
+    
+    if ((size_t) new_cap > SIZE_MAX / sizeof(uint32_t)) {
+      abort();
+    }
+    pNew = (uint32_t *) realloc(
+              ps->pRst, ((size_t) new_cap) * sizeof(uint32_t));
+    if (pNew == NULL) {
+      abort();
+    }
+    
+    ps->pRst = pNew;
+    ps->rst_cap = new_cap;
+  }
+  
+  /* Append the offset */
+  (ps->pRst)[ps->rst_count] = (uint32_t) (pos - ps->frame.offset);
+  (ps->rst_count)++;
+  
+  return NULL;
+}
+
+/*
+ * Add the restart index record of the pending frame to the restart
+ * index writer output, and clear its restart markers.
+ * 
+ * See the documentation at the top of this source file for the record
+ * format.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state, which must have a restart index writer
+ */
+static void writeRstRecord(INDEX_STATE *ps) {
+  
+  unsigned char buf[RST_RECORD];
+  long i = 0;
+  
+  /* Check parameter */
+  if ((ps == NULL) || (ps->pRw == NULL)) {
+    abort();
+  }
+  
+  /* Write the fixed part of the record */
+  memset(buf, 0, sizeof(buf));
+  packBE(buf, (uint64_t) ps->frame.offset, 8);
+  packBE(buf + 8, (uint64_t) ps->rst_count, 4);
+  packBE(buf + 12, (uint64_t) ps->frame.restart, 2);
+  packBE(buf + 14, 0, 2);
+  writerPut(ps->pRw, buf, sizeof(buf));
+  
+  /* Write the offset of each restart marker */
+  for(i = 0; i < ps->rst_count; i++) {
+    packBE(buf, (uint64_t) (ps->pRst)[i], 4);
+    writerPut(ps->pRw, buf, 4);
+  }
+  
+  ps->rst_count = 0;
+}
+
+/*
+ * Bring the index file fully up to date, so that it is a valid index
+ * of all the frames that have been written to it so far.
+ * 
+ * The frame count at the start of the index file is rewritten, and
+ * everything is flushed to the file.  The file position is left at the
+ * end of the file.  This does nothing if no frames have been written
+ * since the last time.
+ * 
+ * Parameters:
+ * 
+ *   ps - the index state
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an I/O error
+ */
+static int flushIndex(INDEX_STATE *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Nothing to do if frame count hasn't changed */
+  if (ps->frame_count == ps->flushed_count) {
+    return 1;
+  }
+  
+  /* Write everything out with the new frame count */
+  if (!writerRewriteHeader(ps->pw, ps->format, ps->frame_count)) {
+    return 0;
+  }
+  if (ps->pRw != NULL) {
+    if (!writerRewriteHeader(ps->pRw, INDEX_RST, ps->frame_count)) {
+      return 0;
+    }
+  }
+  
+  ps->flushed_count = ps->frame_count;
+  return 1;
+}
+
+/*
+ * Read whatever is available from a pipe, up to a given length.
+ * 
+ * Unlike fread(), this doesn't wait for the whole length to arrive, so
+ * that a live stream is parsed (and copied along) as it comes in.
+ * This waits until at least one byte is available, or the end of
+ * input.  A read interrupted by a signal is retried.
+ * 
+ * Parameters:
+ * 
+ *   fd - the descriptor to read from
+ * 
+ *   pBuf - the buffer to read into
+ * 
+ *   len - the maximum number of bytes to read, greater than zero
+ * 
+ *   pGot - receives the number of bytes read, which is zero only at
+ *   the end of input
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an I/O error
+ */
+static int readPipe(int fd, unsigned char *pBuf, size_t len,
+                    size_t *pGot) {
+  
+  ssize_t retval = 0;
+  
+  /* Check parameters */
+  if ((fd < 0) || (pBuf == NULL) || (len < 1) || (pGot == NULL)) {
+    abort();
+  }
+  
+  /* Read, retrying if interrupted */
+  do {
+    retval = read(fd, pBuf, len);
+  } while ((retval < 0) && (errno == EINTR));
+  
+  if (retval < 0) {
+    *pGot = 0;
+    return 0;
+  }
+  
+  *pGot = (size_t) retval;
+  return 1;
+}
+
+/*
+ * Signal handler for SIGINT and SIGTERM in --follow mode.
+ * 
+ * Parameters:
+ * 
+ *   signum - the signal number
+ */
+static void handleStop(int signum) {
+  (void) signum;
+  m_stop = 1;
+}
+
+/*
+ * Return the current reading of the monotonic clock in milliseconds.
+ * 
+ * Return:
+ * 
+ *   the clock reading
+ */
+static int64_t monoMillis(void) {
+  return monoMicros() / 1000;
+}
+
+/*
+ * Return the current reading of the monotonic clock in microseconds.
+ * 
+ * Return:
+ * 
+ *   the clock reading
+ */
+static int64_t monoMicros(void) {
+  
+  struct timespec ts;
+  
+  /* Read the clock */
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  
+  return (((int64_t) ts.tv_sec) * 1000000) +
+          (((int64_t) ts.tv_nsec) / 1000);
+}
+
+/*
+ * Start the --progress reports for a file.
+ * 
+ * Parameters:
+ * 
+ *   pp - the progress state to initialize
+ * 
+ *   interval_ms - the interval between reports in milliseconds
+ * 
+ *   total - the number of bytes to scan, or -1 if not known
+ */
+static void progressInit(PROGRESS *pp, int64_t interval_ms, int64_t total) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || (interval_ms < 1)) {
+    abort();
+  }
+  
+  pp->interval = interval_ms * 1000;
+  pp->start = monoMicros();
+  pp->last = pp->start;
+  pp->last_bytes = 0;
+  pp->total = total;
+}
+
+/*
+ * Report progress on standard error if the interval has passed since
+ * the last report.
+ * 
+ * The throughput is over the time since the last report.  The ETA is
+ * worked out from the average throughput since the start, which is
+ * steadier.
+ * 
+ * Parameters:
+ * 
+ *   pp - the progress state
+ * 
+ *   bytes - the number of bytes scanned so far
+ * 
+ *   frames - the number of frames found so far
+ * 
+ *   io_us - the time spent reading so far in microseconds
+ * 
+ *   parse_us - the time spent parsing so far in microseconds
+ */
+static void progressReport(
+    PROGRESS * pp,
+    int64_t    bytes,
+    long       frames,
+    int64_t    io_us,
+    int64_t    parse_us) {
+  
+  int64_t now = 0;
+  double rate = 0.0;
+  double eta = 0.0;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (bytes < 0) || (frames < 0)) {
+    abort();
+  }
+  
+  /* Only report once per interval */
+  now = monoMicros();
+  if (now - pp->last < pp->interval) {
+    return;
+  }
+  
+  /* Throughput since the last report */
+  rate = (((double) (bytes - pp->last_bytes)) / (1024.0 * 1024.0)) *
+            1000000.0 / ((double) (now - pp->last));
+  
+  if ((pp->total > 0) && (bytes > 0)) {
+    eta = ((double) (pp->total - bytes)) *
+            ((double) (now - pp->start)) / ((double) bytes) / 1000000.0;
+    if (eta < 0.0) {
+      eta = 0.0;
+    }
+    fprintf(stderr,
+      "%lld bytes (%.1f%%), %ld frames, %.1f MiB/s, ETA %.0f s, "
+      "I/O %.3f s, parse %.3f s\n",
+      (long long) bytes,
+      ((double) bytes) * 100.0 / ((double) pp->total),
+      frames,
+      rate,
+      eta,
+      ((double) io_us) / 1000000.0,
+      ((double) parse_us) / 1000000.0);
+    
+  } else {
+    fprintf(stderr,
+      "%lld bytes, %ld frames, %.1f MiB/s, I/O %.3f s, parse %.3f s\n",
+      (long long) bytes,
+      frames,
+      rate,
+      ((double) io_us) / 1000000.0,
+      ((double) parse_us) / 1000000.0);
+  }
+  
+  pp->last = now;
+  pp->last_bytes = bytes;
+}
+
+/*
+ * Write a string to a file as a JSON string literal, with the quotes.
+ * 
+ * Quotes, backslashes, and control characters are escaped.  Anything
+ * else, including bytes that aren't ASCII, is passed through as it is,
+ * so paths should be UTF-8.
+ * 
+ * Parameters:
+ * 
+ *   fp - the file to write to
+ * 
+ *   pStr - the string
+ */
+static void statsString(FILE *fp, const char *pStr) {
+  
+  /* Check parameters */
+  if ((fp == NULL) || (pStr == NULL)) {
+    abort();
+  }
+  
+  putc('"', fp);
+  for( ; *pStr != 0; pStr++) {
+    if ((*pStr == '"') || (*pStr == '\\')) {
+      putc('\\', fp);
+      putc(*pStr, fp);
+    } else if (((unsigned char) *pStr) < 0x20) {
+      fprintf(fp, "\\u%04x", (unsigned int) ((unsigned char) *pStr));
+    } else {
+      putc(*pStr, fp);
+    }
+  }
+  putc('"', fp);
+}
+
+/*
+ * Write the --stats JSON object.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to write to, or "-" for standard error
+ * 
+ *   po - the indexing options
+ * 
+ *   pInPath - the path of the file that was indexed, or NULL for a
+ *   batch
+ * 
+ *   files - for a batch, the number of files
+ * 
+ *   failed - for a batch, the number of files that failed
+ * 
+ *   threads - for a batch, the number of files indexed at once
+ * 
+ *   pr - the result, or for a batch, the totals
+ * 
+ *   elapsed_ms - the elapsed time in milliseconds, at least one
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the file couldn't be written
+ */
+static int writeStats(
+    const char          * pPath,
+    const INDEX_OPTIONS * po,
+    const char          * pInPath,
+    long                  files,
+    long                  failed,
+    long                  threads,
+    const INDEX_RESULT  * pr,
+    int64_t               elapsed_ms) {
+  
+  int status = 1;
+  FILE *fp = NULL;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (po == NULL) || (pr == NULL) ||
+      (elapsed_ms < 1)) {
+    abort();
+  }
+  
+  /* Open the output */
+  if (strcmp(pPath, "-") == 0) {
+    fp = stderr;
+  } else {
+    fp = fopen(pPath, "w");
+    if (fp == NULL) {
+      return 0;
+    }
+  }
+  
+  /* Write the object on a single line */
+  putc('{', fp);
+  if (pInPath != NULL) {
+    fprintf(fp, "\"path\": ");
+    statsString(fp, pInPath);
+  } else {
+    fprintf(fp, "\"files\": %ld, \"failed\": %ld", files, failed);
+  }
+  fprintf(fp,
+    ", \"frames\": %ld, \"new_frames\": %ld, \"bytes_read\": %lld, "
+    "\"index_bytes\": %lld, \"seconds\": %.3f, \"io_seconds\": %.3f, "
+    "\"parse_seconds\": %.3f, \"frames_per_s\": %.1f, "
+    "\"mib_per_s\": %.1f, \"block_mib\": %ld, \"mmap\": %s, "
+    "\"workers\": %ld, \"read_ring\": %ld, \"skipped_ranges\": %ld, "
+    "\"skipped_bytes\": %lld, \"duplicate_frames\": %ld",
+    pr->frame_count,
+    pr->frame_count - pr->old_count,
+    (long long) pr->read_count,
+    (long long) pr->index_bytes,
+    ((double) elapsed_ms) / 1000.0,
+    ((double) pr->io_us) / 1000000.0,
+    ((double) pr->parse_us) / 1000000.0,
+    ((double) (pr->frame_count - pr->old_count)) * 1000.0 /
+      ((double) elapsed_ms),
+    (((double) pr->read_count) / (1024.0 * 1024.0)) * 1000.0 /
+      ((double) elapsed_ms),
+    (long) (po->block_size / (1024 * 1024)),
+    po->use_mmap ? "true" : "false",
+    po->workers,
+    po->ahead,
+    pr->skipped_ranges,
+    (long long) pr->skipped_bytes,
+    pr->dup_frames);
+  if (pInPath == NULL) {
+    fprintf(fp, ", \"batch_files\": %ld", threads);
+  }
+  fprintf(fp, "}\n");
+  
+  /* Close the output, or flush it if it's standard error */
+  if (fp == stderr) {
+    if (fflush(fp)) {
+      status = 0;
+    }
+  } else {
+    if (fclose(fp)) {
+      status = 0;
+    }
+  }
+  fp = NULL;
+  
+  return status;
+}
+
+/*
+ * Wait for the input file to grow in --follow mode.
+ * 
+ * wfd is an inotify descriptor watching the input file, or -1.  With
+ * inotify, this returns as soon as the file is modified.  In any case,
+ * this returns after at most FOLLOW_WAIT_MS milliseconds, or sooner if
+ * interrupted by a signal; the caller just tries reading again.
+ * 
+ * Parameters:
+ * 
+ *   wfd - the inotify descriptor, or -1
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there was an error waiting
+ */
+static int followWait(int wfd) {
+  
+  struct pollfd pfd;
+  int retval = 0;
+  
+  /* Initialize structures */
+  memset(&pfd, 0, sizeof(struct pollfd));
+  
+  /* If no inotify descriptor, just sleep */
+  if (wfd < 0) {
+    if (poll(NULL, 0, FOLLOW_WAIT_MS) < 0) {
+      if (errno != EINTR) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  
+  /* Wait for an event on the inotify descriptor */
+  pfd.fd = wfd;
+  pfd.events = POLLIN;
+  retval = poll(&pfd, 1, FOLLOW_WAIT_MS);
+  if (retval < 0) {
+    if (errno != EINTR) {
+      return 0;
+    }
+    return 1;
+  }
+
+#ifdef FOLLOW_INOTIFY
+  /* If there are events, drain them -- we only care that something
+   * happened, not what */
+  if (retval > 0) {
+    char evbuf[4096];
+    while (read(wfd, evbuf, sizeof(evbuf)) > 0);
+  }
+#endif
+  
+  return 1;
+}
+
+/*
+ * Marker callback used while building a frame list.
+ * 
+ * Frames that start in the worker's range are added to the worker's
+ * frame list once they are complete, gathering the same information as
+ * indexMarker().  The first SOI marker at or after the end of the
+ * worker's range is recorded as the handoff point and stops the parser.
+ * An SOI marker that a failed candidate has already reached stops the
+ * parser with an error, since the rest of the parse would be the same.
+ * 
+ * See JPEG_MARKER_FN for the interface.  pCustom is the INDEX_WORKER.
+ */
+static const char *listMarker(
+    void    * pCustom,
+    int       c,
+    int       immed,
+    int64_t   pos) {
+  
+  INDEX_WORKER *pw = NULL;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pos < 0)) {
+    abort();
+  }
+  pw = (INDEX_WORKER *) pCustom;
+  
+  /* Not interested in immediates */
+  if (immed) {
+    return NULL;
+  }
+  
+  /* Markers other than SOI belong to the current frame, if any, and EOI
+   * completes it */
+  if (c != JPEG_SOI) {
+    if (pw->pending) {
+      if (frameMarker(&(pw->frame), pw->pParser, c, pos)) {
+        pw->pending = 0;
+        if (!listAppend(&(pw->frames), &(pw->frame))) {
+          return "Too many frames!";
+        }
+      }
+    }
+    return NULL;
+  }
+  
+  /* If the previous frame never had an EOI, it runs up to this frame */
+  if (pw->pending) {
+    pw->frame.length = pos - pw->frame.offset;
+    pw->frame.flags |= FRAME_FLAG_NO_EOI;
+    pw->pending = 0;
+    if (!listAppend(&(pw->frames), &(pw->frame))) {
+      return "Too many frames!";
+    }
+  }
+  
+  /* Stop at the handoff point */
+  if (pos >= (int64_t) pw->end) {
+    pw->handoff = pos;
+    return JPEG_STOP;
+  }
+  
+  /* Stop at a frame that a failed candidate has already reached */
+  if ((pw->pDead != NULL) && (listFind(pw->pDead, pos) >= 0)) {
+    return "Frame already failed to parse!";
+  }
+  
+  /* Start the next frame */
+  frameBegin(&(pw->frame), pos);
+  pw->pending = 1;
+  
+  return NULL;
+}
+
+/*
+ * Initialize an empty frame list.
+ * 
+ * Parameters:
+ * 
+ *   pl - the frame list to initialize
+ */
+static void listInit(FRAME_LIST *pl) {
+  
+  /* Check parameter */
+  if (pl == NULL) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pl, 0, sizeof(FRAME_LIST));
+  pl->pFrame = NULL;
+  pl->count = 0;
+  pl->cap = 0;
+}
+
+/*
+ * Free any memory held by a frame list and reset it to empty.
+ * 
+ * Parameters:
+ * 
+ *   pl - the frame list to free
+ */
+static void listFree(FRAME_LIST *pl) {
+  
+  /* Check parameter */
+  if (pl == NULL) {
+    abort();
+  }
+  
+  /* Free array if allocated */
+  if (pl->pFrame != NULL) {
+    free(pl->pFrame);
+    pl->pFrame = NULL;
+  }
+  pl->count = 0;
+  pl->cap = 0;
+}
+
+/*
+ * Append a frame to a frame list, growing it as necessary.
+ * 
+ * Parameters:
+ * 
+ *   pl - the frame list
+ * 
+ *   pf - the frame to append
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the list already has the maximum
+ *   number of frames
+ */
+static int listAppend(FRAME_LIST *pl, const FRAME_INFO *pf) {
+  
+  long new_cap = 0;
+  FRAME_INFO *pNew = NULL;
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pf == NULL)) {
+    abort();
+  }
+  
+  /* Fail if frame count is at maximum */
+  if (pl->count >= LONG_MAX) {
+    return 0;
+  }
+  
+  /* Grow the array if necessary, doubling the capacity each time */
+  if (pl->count >= pl->cap) {
+    if (pl->cap < 1) {
+      new_cap = 1024;
+    } else if (pl->cap <= LONG_MAX / 2) {
+      new_cap = pl->cap * 2;
+    } else {
+      new_cap = LONG_MAX;
+    }
+    
+    if ((size_t) new_cap > SIZE_MAX / sizeof(FRAME_INFO)) {
+      abort();
+    }
+    pNew = (FRAME_INFO *) realloc(
+              pl->pFrame, ((size_t) new_cap) * sizeof(FRAME_INFO));
+    if (pNew == NULL) {
+      abort();
+    }
+    
+    pl->pFrame = pNew;
+    pl->cap = new_cap;
+  }
+  
+  /* Append the frame */
+  memcpy(&((pl->pFrame)[pl->count]), pf, sizeof(FRAME_INFO));
+  (pl->count)++;
+  
+  return 1;
+}
+
+/*
+ * Find the frame with a given offset within a frame list.
+ * 
+ * The list must be in strictly ascending order of offset, which is
+ * always the case for the lists built while parsing.
+ * 
+ * Parameters:
+ * 
+ *   pl - the frame list
+ * 
+ *   off - the frame offset to look for
+ * 
+ * Return:
+ * 
+ *   the index of the offset within the list, or -1 if not found
+ */
+static long listFind(const FRAME_LIST *pl, int64_t off) {
+  
+  long lo = 0;
+  long hi = 0;
+  long mid = 0;
+  
+  /* Check parameter */
+  if (pl == NULL) {
+    abort();
+  }
+  
+  /* Binary search */
+  lo = 0;
+  hi = pl->count - 1;
+  while (lo <= hi) {
+    mid = lo + ((hi - lo) / 2);
+    if ((pl->pFrame)[mid].offset < off) {
+      lo = mid + 1;
+    } else if ((pl->pFrame)[mid].offset > off) {
+      hi = mid - 1;
+    } else {
+      return mid;
+    }
+  }
+  
+  return -1;
+}
+
+/*
+ * Find the next candidate SOI within mapped data.
+ * 
+ * A candidate is the sequence FF D8 FF, which is an SOI marker followed
+ * by the pre-marker byte of the next marker.  This is only a candidate,
+ * because the same sequence can also turn up in a marker payload, such
+ * as a thumbnail embedded in an APP marker.
+ * 
+ * Parameters:
+ * 
+ *   pData - the mapped data
+ * 
+ *   len - the length of the mapped data
+ * 
+ *   from - the offset to start searching from
+ * 
+ * Return:
+ * 
+ *   the offset of the first candidate at or after from, or len if there
+ *   are no further candidates
+ */
+static size_t findCandidate(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from) {
+  
+  const unsigned char *p = NULL;
+  const unsigned char *pHit = NULL;
+  const unsigned char *pEnd = NULL;
+  
+  /* Check parameters */
+  if (((pData == NULL) && (len > 0)) || (from > len)) {
+    abort();
+  }
+  
+  /* Search for each 0xFF byte and check the two bytes after it */
+  p = pData + from;
+  pEnd = pData + len;
+  while (pEnd - p >= 3) {
+    pHit = (const unsigned char *) memchr(
+              p, JPEG_PREMARK, (size_t) (pEnd - p) - 2);
+    if (pHit == NULL) {
+      break;
+    }
+    
+    if ((pHit[1] == JPEG_SOI) && (pHit[2] == JPEG_PREMARK)) {
+      return (size_t) (pHit - pData);
+    }
+    p = pHit + 1;
+  }
+  
+  return len;
+}
+
+/*
+ * Parse mapped data starting at a given offset, building the frame list
+ * of a worker.
+ * 
+ * Parsing starts at from, which must be the first byte of a marker.
+ * Frames are added to the worker's frame list until a frame starts at
+ * or after the end of the worker's range, which is stored as the
+ * handoff point.  If the parser reaches the end of the data instead,
+ * the handoff point is set to -1 and the stream must end properly.
+ * 
+ * The ok flag of the worker is set according to whether parsing was
+ * successful, and if it wasn't, the error and the offset where the
+ * parser stopped are stored in the worker.
+ * 
+ * Parameters:
+ * 
+ *   pData - the mapped data
+ * 
+ *   len - the length of the mapped data
+ * 
+ *   from - the offset to start parsing at
+ * 
+ *   pw - the worker that receives the frames
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if parsing failed
+ */
+static int parseRange(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from,
+    INDEX_WORKER        * pw) {
+  
+  JPEG_PARSER parser;
+  
+  /* Check parameters */
+  if (((pData == NULL) && (len > 0)) || (from > len) || (pw == NULL)) {
+    abort();
+  }
+  
+  /* Initialize worker results */
+  pw->ok = 0;
+  pw->pErr = NULL;
+  pw->fail = -1;
+  pw->handoff = -1;
+  pw->pending = 0;
+  
+  /* Parse from the starting point */
+  jpeg_parserInit(&parser, &listMarker, pw, 0);
+  parser.offset = (int64_t) from;
+  pw->pParser = &parser;
+  
+  if (jpeg_parserFeed(&parser, pData + from, len - from)) {
+    if (jpeg_parserFinish(&parser)) {
+      pw->ok = 1;
+    }
+  } else if (parser.pErr == JPEG_STOP) {
+    pw->ok = 1;
+  }
+  
+  /* Keep the error for the caller */
+  if (!(pw->ok)) {
+    pw->pErr = parser.pErr;
+    pw->fail = parser.offset;
+  }
+  pw->pParser = NULL;
+  
+  return pw->ok;
+}
+
+/*
+ * Worker thread for parallel indexing.
+ * 
+ * The first worker parses from the start of its range.  Every other
+ * worker looks for candidate SOIs within its range, and parses forward
+ * from each until one parses successfully to the handoff point.
+ * 
+ * The frames reached by the failed candidate that got furthest are
+ * kept, and a later candidate is given up on as soon as it reaches one
+ * of them, or skipped if it is one of them.  Otherwise, every real SOI
+ * before an error in the stream would be parsed all the way to the
+ * error again, which takes time proportional to the number of frames
+ * times the distance to the error.
+ * 
+ * Parameters:
+ * 
+ *   pv - the INDEX_WORKER
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *indexWorker(void *pv) {
+  
+  INDEX_WORKER *pw = NULL;
+  size_t pos = 0;
+  int64_t dead_end = -1;
+  FRAME_LIST dead;
+  FRAME_LIST swap;
+  
+  /* Check parameter */
+  if (pv == NULL) {
+    abort();
+  }
+  pw = (INDEX_WORKER *) pv;
+  listInit(&dead);
+  
+  /* The first worker doesn't need to resynchronize */
+  if (pw->first) {
+    parseRange(pw->pData, pw->len, pw->start, pw);
+    return NULL;
+  }
+  
+  /* Try each candidate within the range until one parses */
+  pos = pw->start;
+  while (1) {
+    pos = findCandidate(pw->pData, pw->len, pos);
+    if (pos >= pw->end) {
+      pw->frames.count = 0;
+      pw->empty = 1;
+      pw->ok = 1;
+      break;
+    }
+    
+    /* Skip a candidate that a failed candidate already reached */
+    if (listFind(&dead, (int64_t) pos) >= 0) {
+      pos++;
+      continue;
+    }
+    
+    pw->frames.count = 0;
+    pw->pDead = &dead;
+    if (parseRange(pw->pData, pw->len, pos, pw)) {
+      break;
+    }
+    
+    /* If this candidate got further than any before it, its frames,
+     * including the one it failed in, become the dead ends; a frame
+     * that can't be added just isn't skipped */
+    if (pw->fail > dead_end) {
+      if (pw->pending) {
+        listAppend(&(pw->frames), &(pw->frame));
+      }
+      swap = dead;
+      dead = pw->frames;
+      pw->frames = swap;
+      dead_end = pw->fail;
+    }
+    pos++;
+  }
+  
+  pw->pDead = NULL;
+  listFree(&dead);
+  
+  return NULL;
+}
+
+/*
+ * Index mapped data in parallel with a given number of worker threads.
+ * 
+ * Indexing starts at offset from, which must be the first byte of a
+ * marker.  The frame list receives the frames in strictly ascending
+ * order, exactly as a sequential scan from that offset would find them,
+ * and any error is the same as the sequential scan would give.
+ * 
+ * Parameters:
+ * 
+ *   pData - the mapped data
+ * 
+ *   len - the length of the mapped data
+ * 
+ *   from - the offset to start indexing at
+ * 
+ *   workers - the number of worker threads to use
+ * 
+ *   pl - the empty frame list to receive the frames
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else an error message
+ */
+static const char *indexParallel(
+    const unsigned char * pData,
+    size_t                len,
+    size_t                from,
+    int                   workers,
+    FRAME_LIST          * pl) {
+  
+  const char *pErr = NULL;
+  int done = 0;
+  int i = 0;
+  long k = 0;
+  size_t range = 0;
+  int64_t h = 0;
+  INDEX_WORKER *pWorkers = NULL;
+  INDEX_WORKER *pw = NULL;
+  INDEX_WORKER tail;
+  
+  /* Check parameters */
+  if (((pData == NULL) && (len > 0)) || (from > len) ||
+      (workers < 1) || (pl == NULL)) {
+    abort();
+  }
+  
+  /* Reduce number of workers if necessary so that each gets at least
+   * the minimum range */
+  if ((size_t) workers > (len - from) / WORKER_MIN_RANGE) {
+    workers = (int) ((len - from) / WORKER_MIN_RANGE);
+    if (workers < 1) {
+      workers = 1;
+    }
+  }
+  range = (len - from) / ((size_t) workers);
+  
+  /* Allocate and initialize the workers */
+  pWorkers = (INDEX_WORKER *) calloc(
+                (size_t) workers, sizeof(INDEX_WORKER));
+  if (pWorkers == NULL) {
+    abort();
+  }
+  
+  for(i = 0; i < workers; i++) {
+    pw = &(pWorkers[i]);
+    pw->pData = pData;
+    pw->len = len;
+    pw->start = from + (range * ((size_t) i));
+    if (i < workers - 1) {
+      pw->end = pw->start + range;
+    } else {
+      pw->end = len;
+    }
+    if (i == 0) {
+      pw->first = 1;
+    } else {
+      pw->first = 0;
+    }
+    listInit(&(pw->frames));
+    pw->ok = 0;
+    pw->empty = 0;
+    pw->handoff = -1;
+    pw->started = 0;
+  }
+  
+  /* Start a thread for every worker but the first, which runs on this
+   * thread; if a thread can't be started, run that worker here too */
+  for(i = 1; i < workers; i++) {
+    pw = &(pWorkers[i]);
+    if (pthread_create(&(pw->thread), NULL, &indexWorker, pw) == 0) {
+      pw->started = 1;
+    } else {
+      indexWorker(pw);
+    }
+  }
+  indexWorker(&(pWorkers[0]));
+  
+  /* Wait for all threads */
+  for(i = 1; i < workers; i++) {
+    pw = &(pWorkers[i]);
+    if (pw->started) {
+      if (pthread_join(pw->thread, NULL)) {
+        abort();
+      }
+      pw->started = 0;
+    }
+  }
+  
+  /* Chain the ranges together, starting with the first, which is good
+   * if it parsed at all; h is the offset of the frame where the next
+   * range must pick up */
+  h = (int64_t) from;
+  for(i = 0; i < workers; i++) {
+    pw = &(pWorkers[i]);
+    
+    /* Skip ranges that have nothing to contribute */
+    if (pw->empty) {
+      continue;
+    }
+    if ((i > 0) && pw->ok && (pw->handoff >= 0) && (pw->handoff <= h)) {
+      continue;
+    }
+    
+    /* Find where this range picks up; the first range picks up at its
+     * start; stop chaining if this range doesn't line up */
+    if (!(pw->ok)) {
+      break;
+    }
+    if (i > 0) {
+      k = listFind(&(pw->frames), h);
+      if (k < 0) {
+        break;
+      }
+    } else {
+      k = 0;
+    }
+    
+    /* Add this range's frames */
+    for( ; k < pw->frames.count; k++) {
+      if (!listAppend(pl, &((pw->frames.pFrame)[k]))) {
+        pErr = "Too many frames!";
+        break;
+      }
+    }
+    if (pErr != NULL) {
+      break;
+    }
+    
+    /* Update the handoff point, or finish if this range parsed to the
+     * end of the file */
+    if (pw->handoff < 0) {
+      done = 1;
+      break;
+    }
+    h = pw->handoff;
+  }
+  
+  /* If the ranges didn't chain all the way to the end, finish with a
+   * sequential scan from the last good handoff point */
+  if ((pErr == NULL) && (!done)) {
+    memset(&tail, 0, sizeof(INDEX_WORKER));
+    tail.pData = pData;
+    tail.len = len;
+    tail.start = (size_t) h;
+    tail.end = len;
+    listInit(&(tail.frames));
+    
+    if (parseRange(pData, len, (size_t) h, &tail)) {
+      for(k = 0; k < tail.frames.count; k++) {
+        if (!listAppend(pl, &((tail.frames.pFrame)[k]))) {
+          pErr = "Too many frames!";
+          break;
+        }
+      }
+    } else {
+      pErr = tail.pErr;
+    }
+    
+    listFree(&(tail.frames));
+  }
+  
+  /* Free the workers */
+  for(i = 0; i < workers; i++) {
+    listFree(&(pWorkers[i].frames));
+  }
+  free(pWorkers);
+  pWorkers = NULL;
+  
+  return pErr;
+}
+
+/*
+ * Initialize an index writer.
+ * 
+ * The file is switched to unbuffered mode at the stdio level, since the
+ * writer does its own buffering.  This must be done before any other
+ * I/O on the file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer to initialize
+ * 
+ *   fp - the index file, open for writing in binary mode
+ */
+static void writerInit(INDEX_WRITER *pw, FILE *fp) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (fp == NULL)) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pw, 0, sizeof(INDEX_WRITER));
+  pw->fp = fp;
+  pw->fill = 0;
+  pw->err = 0;
+  pw->interval = SPARSE_K_DEFAULT;
+  pw->records = 0;
+  pw->prev = 0;
+  pw->pos = INDEX_SPARSE_HEADER;
+  pw->pCheck = NULL;
+  pw->checks = 0;
+  pw->check_cap = 0;
+  pw->table = 0;
+  pw->pPend = NULL;
+  pw->pend = 0;
+  
+  pw->pBuf = (unsigned char *) malloc((size_t) WRITER_BUF_SIZE);
+  if (pw->pBuf == NULL) {
+    abort();
+  }
+  
+  /* Turn off stdio buffering */
+  if (setvbuf(fp, NULL, _IONBF, 0)) {
+    pw->err = 1;
+  }
+}
+
+/*
+ * Release an index writer.
+ * 
+ * Anything still in the buffer is discarded, so call writerFlush()
+ * first to keep it.  The file is not closed.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer to release
+ */
+static void writerFree(INDEX_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Release buffer, checkpoints, and pending deltas */
+  if (pw->pBuf != NULL) {
+    free(pw->pBuf);
+    pw->pBuf = NULL;
+  }
+  pw->fill = 0;
+  if (pw->pCheck != NULL) {
+    free(pw->pCheck);
+    pw->pCheck = NULL;
+  }
+  pw->checks = 0;
+  pw->check_cap = 0;
+  if (pw->pPend != NULL) {
+    free(pw->pPend);
+    pw->pPend = NULL;
+  }
+  pw->pend = 0;
+}
+
+/*
+ * Add bytes to the index output.
+ * 
+ * The bytes go into the buffer, which is written to the file whenever
+ * it fills up.  After a write error, this does nothing.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer
+ * 
+ *   p - the bytes to add
+ * 
+ *   len - the number of bytes, at most WRITER_BUF_SIZE
+ */
+static void writerPut(
+    INDEX_WRITER        * pw,
+    const unsigned char * p,
+    size_t                len) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || ((p == NULL) && (len > 0)) ||
+      (len > (size_t) WRITER_BUF_SIZE)) {
+    abort();
+  }
+  
+  /* Ignore if there was an error */
+  if (pw->err) {
+    return;
+  }
+  
+  /* Make room if necessary */
+  if (len > (size_t) WRITER_BUF_SIZE - pw->fill) {
+    if (fwrite(pw->pBuf, 1, pw->fill, pw->fp) != pw->fill) {
+      pw->err = 1;
+      return;
+    }
+    pw->fill = 0;
+  }
+  
+  /* Add to buffer */
+  memcpy(pw->pBuf + pw->fill, p, len);
+  pw->fill += len;
+}
+
+/*
+ * Write everything in the buffer to the index file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there has been a write error at
+ *   any point
+ */
+static int writerFlush(INDEX_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Write the buffer */
+  if ((!(pw->err)) && (pw->fill > 0)) {
+    if (fwrite(pw->pBuf, 1, pw->fill, pw->fp) != pw->fill) {
+      pw->err = 1;
+    }
+    pw->fill = 0;
+  }
+  if ((!(pw->err)) && fflush(pw->fp)) {
+    pw->err = 1;
+  }
+  
+  return !(pw->err);
+}
+
+/*
+ * Bring the whole index file up to date with a new frame count.
+ * 
+ * Everything in the buffer is written first, so that the frame count
+ * never covers frames that aren't in the file yet.  Then the header is
+ * rewritten, and the file position is left at the end of the file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the writer
+ * 
+ *   format - the INDEX format, or INDEX_RST for a restart index
+ * 
+ *   count - the number of frames
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there has been a write error at
+ *   any point
+ */
+static int writerRewriteHeader(INDEX_WRITER *pw, int format, long count) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  /* Write the frames, then the header at the start of the file, then
+   * go back to the end */
+  if (!writerFlush(pw)) {
+    return 0;
+  }
+  if (fseeko(pw->fp, 0, SEEK_SET)) {
+    pw->err = 1;
+    return 0;
+  }
+  writeIndexHeader(pw, format, count);
+  if (!writerFlush(pw)) {
+    return 0;
+  }
+  if (fseeko(pw->fp, 0, SEEK_END)) {
+    pw->err = 1;
+    return 0;
+  }
+  
+  return 1;
+}
+
+/*
+ * Write the pending deltas of the current group of a packed index, and
+ * record their base and residual size in the group's checkpoint.
+ * 
+ * Nothing is written if there are no pending deltas.
+ * 
+ * Parameters:
+ * 
+ *   pw - the index writer
+ */
+static void writePackedGroup(INDEX_WRITER *pw) {
+  
+  MJPG_IDX_CHECK *pc = NULL;
+  uint64_t base = 0;
+  uint64_t top = 0;
+  uint64_t r = 0;
+  unsigned char c = 0;
+  int bits = 0;
+  int fill = 0;
+  int b = 0;
+  long j = 0;
+  
+  /* Check parameter */
+  if ((pw == NULL) || ((pw->pend > 0) && (pw->checks < 1))) {
+    abort();
+  }
+  
+  /* Nothing to do if there are no pending deltas */
+  if (pw->pend < 1) {
+    return;
+  }
+  
+  /* The base is the smallest delta, and the residuals need enough bits
+   * for the largest delta above it */
+  base = (pw->pPend)[0];
+  top = base;
+  for(j = 1; j < pw->pend; j++) {
+    if ((pw->pPend)[j] < base) {
+      base = (pw->pPend)[j];
+    }
+    if ((pw->pPend)[j] > top) {
+      top = (pw->pPend)[j];
+    }
+  }
+  for(r = top - base; r > 0; r >>= 1) {
+    bits++;
+  }
+  
+  pc = &((pw->pCheck)[pw->checks - 1]);
+  pc->base = base;
+  pc->bits = bits;
+  
+  /* Pack the residuals, least significant bit first */
+  for(j = 0; j < pw->pend; j++) {
+    r = (pw->pPend)[j] - base;
+    for(b = 0; b < bits; b++) {
+      if ((r >> b) & 1) {
+        c |= (unsigned char) (1 << fill);
+      }
+      fill++;
+      if (fill >= 8) {
+        writerPut(pw, &c, 1);
+        (pw->pos)++;
+        c = 0;
+        fill = 0;
+      }
+    }
+  }
+  if (fill > 0) {
+    writerPut(pw, &c, 1);
+    (pw->pos)++;
+  }
+  
+  pw->pend = 0;
+}
+
+/*
+ * Add the next frame of a sparse or packed index to the writer
+ * output.
+ * 
+ * The first frame of each group starts a new checkpoint, which is
+ * kept in memory until writeSparseTable().  In a sparse index, every
+ * other frame is written as a varint delta from the frame before it.
+ * In a packed index, the deltas are held back until the next group
+ * starts, and then written with writePackedGroup().
+ * 
+ * Parameters:
+ * 
+ *   pw - the index writer
+ * 
+ *   format - INDEX_SPARSE or INDEX_PACKED
+ * 
+ *   offset - the offset of the frame, which must be greater than the
+ *   offset of the frame before it
+ */
+static void writeSparseDelta(
+    INDEX_WRITER * pw,
+    int            format,
+    int64_t        offset) {
+  
+  unsigned char buf[INDEX_VARINT_MAX];
+  uint64_t delta = 0;
+  long new_cap = 0;
+  MJPG_IDX_CHECK *pNew = NULL;
+  MJPG_IDX_CHECK *pc = NULL;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (offset < 0) || (pw->interval < 1) ||
+      ((pw->records > 0) && (offset <= pw->prev)) ||
+      ((format != INDEX_SPARSE) && (format != INDEX_PACKED))) {
+    abort();
+  }
+  
+  /* Packed deltas need room for a whole group */
+  if ((format == INDEX_PACKED) && (pw->pPend == NULL)) {
+    pw->pPend = (uint64_t *) malloc(
+                  ((size_t) pw->interval) * sizeof(uint64_t));
+    if (pw->pPend == NULL) {
+      abort();
+    }
+    pw->pend = 0;
+  }
+  
+  if ((pw->records % pw->interval) == 0) {
+    /* Start of a group, so finish the previous packed group */
+    if (format == INDEX_PACKED) {
+      writePackedGroup(pw);
+    }
+    
+    /* Add a checkpoint, growing the array if necessary by doubling the
+     * capacity each time */
+    if (pw->checks >= pw->check_cap) {
+      if (pw->check_cap < 1) {
+        new_cap = 1024;
+      } else {
+        new_cap = pw->check_cap * 2;
+      }
+      
+      if ((size_t) new_cap > SIZE_MAX / sizeof(MJPG_IDX_CHECK)) {
+        abort();
+      }
+      pNew = (MJPG_IDX_CHECK *) realloc(
+                pw->pCheck, ((size_t) new_cap) * sizeof(MJPG_IDX_CHECK));
+      if (pNew == NULL) {
+        abort();
+      }
+      
+      pw->pCheck = pNew;
+      pw->check_cap = new_cap;
+    }
+    
+    pc = &((pw->pCheck)[pw->checks]);
+    pc->offset = offset;
+    pc->pos = pw->pos;
+    pc->base = 0;
+    pc->bits = 0;
+    (pw->checks)++;
+    
+  } else if (format == INDEX_PACKED) {
+    /* Within a packed group, so hold the delta until the group is
+     * complete */
+    (pw->pPend)[pw->pend] = (uint64_t) (offset - pw->prev);
+    (pw->pend)++;
+    
+  } else {
+    /* Within a sparse group, so write the delta as a varint */
+    delta = (uint64_t) (offset - pw->prev);
+    do {
+      buf[len] = (unsigned char) (delta & 0x7f);
+      delta >>= 7;
+      if (delta > 0) {
+        buf[len] |= 0x80;
+      }
+      len++;
+    } while (delta > 0);
+    
+    writerPut(pw, buf, len);
+    pw->pos += (int64_t) len;
+  }
+  
+  pw->prev = offset;
+  (pw->records)++;
+}
+
+/*
+ * Add the checkpoint table of a sparse or packed index to the writer
+ * output, after the last delta.
+ * 
+ * For a packed index, the deltas of the last group are written first.
+ * This records the position of the table for the header, so the header
+ * must be rewritten afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pw - the index writer
+ * 
+ *   format - INDEX_SPARSE or INDEX_PACKED
+ */
+static void writeSparseTable(INDEX_WRITER *pw, int format) {
+  
+  unsigned char buf[INDEX_PACKED_CHECK];
+  size_t csize = 0;
+  long g = 0;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if (format == INDEX_SPARSE) {
+    csize = INDEX_SPARSE_CHECK;
+  } else if (format == INDEX_PACKED) {
+    csize = INDEX_PACKED_CHECK;
+    writePackedGroup(pw);
+  } else {
+    abort();
+  }
+  
+  /* The table goes where the next delta would */
+  memset(buf, 0, sizeof(buf));
+  pw->table = pw->pos;
+  for(g = 0; g < pw->checks; g++) {
+    packBE(buf, (uint64_t) (pw->pCheck)[g].offset, 8);
+    packBE(buf + 8, (uint64_t) (pw->pCheck)[g].pos, 8);
+    if (format == INDEX_PACKED) {
+      packBE(buf + 16, (pw->pCheck)[g].base, 8);
+      buf[24] = (unsigned char) (pw->pCheck)[g].bits;
+    }
+    writerPut(pw, buf, csize);
+  }
+  pw->pos += ((int64_t) pw->checks) * ((int64_t) csize);
+}
+
+/*
+ * Store an unsigned integer in big endian into a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to write to
+ * 
+ *   val - the value to store
+ * 
+ *   n - the number of bytes to store, in range 1 to 8
+ */
+static void packBE(unsigned char *p, uint64_t val, int n) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Store bytes from the least significant end */
+  for(i = n - 1; i >= 0; i--) {
+    p[i] = (unsigned char) (val & 0xff);
+    val >>= 8;
+  }
+}
+
+/*
+ * Load an unsigned integer in big endian from a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to read from
+ * 
+ *   n - the number of bytes to load, in range 1 to 8
+ * 
+ * Return:
+ * 
+ *   the value
+ */
+static uint64_t unpackBE(const unsigned char *p, int n) {
+  
+  int i = 0;
+  uint64_t val = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Load bytes from the most significant end */
+  for(i = 0; i < n; i++) {
+    val = (val << 8) | ((uint64_t) p[i]);
+  }
+  
+  return val;
+}
+
+/*
+ * Store an unsigned integer in little endian into a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to write to
+ * 
+ *   val - the value to store
+ * 
+ *   n - the number of bytes to store, in range 1 to 8
+ */
+static void packLE(unsigned char *p, uint64_t val, int n) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Store bytes from the least significant end */
+  for(i = 0; i < n; i++) {
+    p[i] = (unsigned char) (val & 0xff);
+    val >>= 8;
+  }
+}
+
+/*
+ * Load an unsigned integer in little endian from a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to read from
+ * 
+ *   n - the number of bytes to load, in range 1 to 8
+ * 
+ * Return:
+ * 
+ *   the value
+ */
+static uint64_t unpackLE(const unsigned char *p, int n) {
+  
+  int i = 0;
+  uint64_t val = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (n < 1) || (n > 8)) {
+    abort();
+  }
+  
+  /* Load bytes from the most significant end */
+  for(i = n - 1; i >= 0; i--) {
+    val = (val << 8) | ((uint64_t) p[i]);
+  }
+  
+  return val;
+}
+
+/*
+ * Load a 4-byte or 8-byte little endian word for the hash.
+ * 
+ * This is unpackLE() without the checks, written out so that the
+ * compiler can turn it into a single load.
+ * 
+ * Parameters:
+ * 
+ *   p - the bytes to load
+ * 
+ *   n - the number of bytes, either 4 or 8
+ * 
+ * Return:
+ * 
+ *   the value
+ */
+static uint64_t hashLoad(const unsigned char *p, int n) {
+  
+  uint64_t val = 0;
+  
+  val = ((uint64_t) p[0]) | (((uint64_t) p[1]) << 8) |
+        (((uint64_t) p[2]) << 16) | (((uint64_t) p[3]) << 24);
+  if (n > 4) {
+    val |= (((uint64_t) p[4]) << 32) | (((uint64_t) p[5]) << 40) |
+            (((uint64_t) p[6]) << 48) | (((uint64_t) p[7]) << 56);
+  }
+  return val;
+}
+
+/*
+ * Rotate a 64-bit value left.
+ * 
+ * Parameters:
+ * 
+ *   x - the value
+ * 
+ *   r - the number of bits to rotate by, in range 1 to 63
+ * 
+ * Return:
+ * 
+ *   the rotated value
+ */
+static uint64_t hashRotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Mix an 8-byte word into an accumulator of the hash.
+ * 
+ * Parameters:
+ * 
+ *   acc - the accumulator
+ * 
+ *   val - the word
+ * 
+ * Return:
+ * 
+ *   the new accumulator
+ */
+static uint64_t hashRound(uint64_t acc, uint64_t val) {
+  acc += val * HASH_P2;
+  acc = hashRotl(acc, 31);
+  return acc * HASH_P1;
+}
+
+/*
+ * Start an XXH64 hash with a seed of zero.
+ * 
+ * Parameters:
+ * 
+ *   ph - the hash state to initialize
+ */
+static void hashInit(HASH_STATE *ph) {
+  
+  /* Check parameter */
+  if (ph == NULL) {
+    abort();
+  }
+  
+  memset(ph, 0, sizeof(HASH_STATE));
+  ph->v[0] = HASH_P1 + HASH_P2;
+  ph->v[1] = HASH_P2;
+  ph->v[2] = 0;
+  ph->v[3] = 0 - HASH_P1;
+  ph->total = 0;
+  ph->mem_len = 0;
+}
+
+/*
+ * Add bytes to a hash.
+ * 
+ * The bytes are mixed in 32-byte stripes, and any left over are kept
+ * for the next call, so the hash is the same however the bytes are
+ * split up between calls.
+ * 
+ * Parameters:
+ * 
+ *   ph - the hash state
+ * 
+ *   p - the bytes
+ * 
+ *   len - the number of bytes
+ */
+static void hashUpdate(HASH_STATE *ph, const unsigned char *p, size_t len) {
+  
+  size_t n = 0;
+  uint64_t v0 = 0;
+  uint64_t v1 = 0;
+  uint64_t v2 = 0;
+  uint64_t v3 = 0;
+  
+  /* Check parameters */
+  if ((ph == NULL) || ((p == NULL) && (len > 0))) {
+    abort();
+  }
+  ph->total += (uint64_t) len;
+  
+  /* If there isn't a whole stripe yet, just keep the bytes */
+  if (ph->mem_len + len < 32) {
+    if (len > 0) {
+      memcpy(ph->mem + ph->mem_len, p, len);
+      ph->mem_len += len;
+    }
+    return;
+  }
+  
+  v0 = ph->v[0];
+  v1 = ph->v[1];
+  v2 = ph->v[2];
+  v3 = ph->v[3];
+  
+  /* Complete the stripe left over from before, if any */
+  if (ph->mem_len > 0) {
+    n = 32 - ph->mem_len;
+    memcpy(ph->mem + ph->mem_len, p, n);
+    v0 = hashRound(v0, hashLoad(ph->mem, 8));
+    v1 = hashRound(v1, hashLoad(ph->mem + 8, 8));
+    v2 = hashRound(v2, hashLoad(ph->mem + 16, 8));
+    v3 = hashRound(v3, hashLoad(ph->mem + 24, 8));
+    p += n;
+    len -= n;
+    ph->mem_len = 0;
+  }
+  
+  /* Mix the whole stripes */
+  for( ; len >= 32; len -= 32) {
+    v0 = hashRound(v0, hashLoad(p, 8));
+    v1 = hashRound(v1, hashLoad(p + 8, 8));
+    v2 = hashRound(v2, hashLoad(p + 16, 8));
+    v3 = hashRound(v3, hashLoad(p + 24, 8));
+    p += 32;
+  }
+  
+  ph->v[0] = v0;
+  ph->v[1] = v1;
+  ph->v[2] = v2;
+  ph->v[3] = v3;
+  
+  /* Keep what is left over */
+  if (len > 0) {
+    memcpy(ph->mem, p, len);
+    ph->mem_len = len;
+  }
+}
+
+/*
+ * Get the value of a hash.
+ * 
+ * The state is left as it is, so more bytes could still be added.
+ * 
+ * Parameters:
+ * 
+ *   ph - the hash state
+ * 
+ * Return:
+ * 
+ *   the XXH64 hash of all the bytes added
+ */
+static uint64_t hashFinish(const HASH_STATE *ph) {
+  
+  int i = 0;
+  uint64_t h = 0;
+  const unsigned char *p = NULL;
+  size_t n = 0;
+  
+  /* Check parameter */
+  if (ph == NULL) {
+    abort();
+  }
+  
+  /* Combine the accumulators, if there was at least one stripe */
+  if (ph->total >= 32) {
+    h = hashRotl(ph->v[0], 1) + hashRotl(ph->v[1], 7) +
+        hashRotl(ph->v[2], 12) + hashRotl(ph->v[3], 18);
+    for(i = 0; i < 4; i++) {
+      h ^= hashRound(0, ph->v[i]);
+      h = h * HASH_P1 + HASH_P4;
+    }
+  } else {
+    h = HASH_P5;
+  }
+  h += ph->total;
+  
+  /* Mix in the bytes left over */
+  p = ph->mem;
+  for(n = ph->mem_len; n >= 8; n -= 8) {
+    h ^= hashRound(0, hashLoad(p, 8));
+    h = hashRotl(h, 27) * HASH_P1 + HASH_P4;
+    p += 8;
+  }
+  if (n >= 4) {
+    h ^= hashLoad(p, 4) * HASH_P1;
+    h = hashRotl(h, 23) * HASH_P2 + HASH_P3;
+    p += 4;
+    n -= 4;
+  }
+  for( ; n > 0; n--) {
+    h ^= ((uint64_t) *p) * HASH_P5;
+    h = hashRotl(h, 11) * HASH_P1;
+    p++;
+  }
+  
+  /* Final avalanche */
+  h ^= h >> 33;
+  h *= HASH_P2;
+  h ^= h >> 29;
+  h *= HASH_P3;
+  h ^= h >> 32;
+  
+  return h;
+}
+
+/*
+ * Get the XXH64 hash of a run of bytes in one go.
+ * 
+ * Parameters:
+ * 
+ *   p - the bytes
+ * 
+ *   len - the number of bytes
+ * 
+ * Return:
+ * 
+ *   the hash
+ */
+static uint64_t hashBytes(const unsigned char *p, size_t len) {
+  
+  HASH_STATE hs;
+  
+  hashInit(&hs);
+  hashUpdate(&hs, p, len);
+  return hashFinish(&hs);
+}
+
+/*
+ * Return the length in bytes of an index file with a given number of
+ * frames.
+ * 
+ * Parameters:
+ * 
+ *   format - the INDEX format
+ * 
+ *   count - the number of frames, in range 0 to LONG_MAX
+ * 
+ * Return:
+ * 
+ *   the file length, or -1 if it is too large
+ */
+static int64_t indexLength(int format, long count) {
+  
+  int64_t head = 0;
+  int64_t rec = 0;
+  
+  /* Check parameters */
+  if (count < 0) {
+    abort();
+  }
+  
+  /* Get the sizes for the format */
+  if (format == INDEX_V1) {
+    head = 8;
+    rec = 8;
+  } else if (format == INDEX_V2) {
+    head = INDEX_V2_HEADER;
+    rec = INDEX_V2_RECORD;
+  } else if (format == INDEX_NATIVE) {
+    head = INDEX_NATIVE_HEADER;
+    rec = 8;
+  } else {
+    abort();
+  }
+  
+  /* Compute length, watching for overflow */
+  if ((int64_t) count > (INT64_MAX - head) / rec) {
+    return -1;
+  }
+  return head + (((int64_t) count) * rec);
+}
+
+/*
+ * Write the header of an index file, with a given frame count.
+ * 
+ * The header is added to the writer output, which should be at the
+ * start of the file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the index writer
+ * 
+ *   format - the INDEX format, or INDEX_RST for a restart index
+ * 
+ *   count - the number of frames
+ */
+static void writeIndexHeader(INDEX_WRITER *pw, int format, long count) {
+  
+  unsigned char buf[INDEX_V2_HEADER];
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  /* Build the header */
+  memset(buf, 0, sizeof(buf));
+  if (format == INDEX_V1) {
+    packBE(buf, (uint64_t) count, 8);
+    len = 8;
+    
+  } else if (format == INDEX_V2) {
+    memcpy(buf, INDEX_V2_MAGIC, 8);
+    packBE(buf + 8, INDEX_V2_HEADER, 4);
+    packBE(buf + 12, INDEX_V2_RECORD, 4);
+    packBE(buf + 16, (uint64_t) count, 8);
+    packBE(buf + 24, pw->flags, 8);
+    len = INDEX_V2_HEADER;
+    
+  } else if (format == INDEX_NATIVE) {
+    memcpy(buf, INDEX_NATIVE_MAGIC, 8);
+    packLE(buf + 8, (uint64_t) count, 8);
+    len = INDEX_NATIVE_HEADER;
+    
+  } else if ((format == INDEX_SPARSE) || (format == INDEX_PACKED)) {
+    if (format == INDEX_SPARSE) {
+      memcpy(buf, INDEX_SPARSE_MAGIC, 8);
+    } else {
+      memcpy(buf, INDEX_PACKED_MAGIC, 8);
+    }
+    packBE(buf + 8, INDEX_SPARSE_HEADER, 4);
+    packBE(buf + 12, (uint64_t) pw->interval, 4);
+    packBE(buf + 16, (uint64_t) count, 8);
+    packBE(buf + 24, (uint64_t) pw->table, 8);
+    len = INDEX_SPARSE_HEADER;
+    
+  } else if (format == INDEX_RST) {
+    memcpy(buf, RST_MAGIC, 8);
+    packBE(buf + 8, (uint64_t) count, 8);
+    len = RST_HEADER;
+    
+  } else {
+    abort();
+  }
+  
+  /* Write the header */
+  writerPut(pw, buf, len);
+}
+
+/*
+ * Add the index record of a frame to the writer output.
+ * 
+ * For v1 and native, only the frame offset is written.  For sparse and
+ * packed, only the frame offset is written too, as a checkpoint or a
+ * delta.
+ * 
+ * Parameters:
+ * 
+ *   pw - the index writer
+ * 
+ *   format - the INDEX format
+ * 
+ *   pf - the frame
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or an error message if the frame can't be
+ *   stored in the format
+ */
+static const char *writeRecord(
+    INDEX_WRITER     * pw,
+    int                format,
+    const FRAME_INFO * pf) {
+  
+  unsigned char buf[INDEX_V2_RECORD];
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pf == NULL) || (pf->offset < 0)) {
+    abort();
+  }
+  
+  /* v1 record is just the offset */
+  if (format == INDEX_V1) {
+    packBE(buf, (uint64_t) pf->offset, 8);
+    writerPut(pw, buf, 8);
+    return NULL;
+  }
+  
+  /* Native record is just the offset in little endian */
+  if (format == INDEX_NATIVE) {
+    packLE(buf, (uint64_t) pf->offset, 8);
+    writerPut(pw, buf, 8);
+    return NULL;
+  }
+  
+  /* Sparse and packed records are a checkpoint or a delta */
+  if ((format == INDEX_SPARSE) || (format == INDEX_PACKED)) {
+    writeSparseDelta(pw, format, pf->offset);
+    return NULL;
+  }
+  
+  if (format != INDEX_V2) {
+    abort();
+  }
+  
+  /* Frame length must fit in 32 bits */
+  if ((pf->length < 0) || (pf->length > (int64_t) UINT32_MAX)) {
+    return "Frame too large for index!";
+  }
+  
+  /* Build the v2 record */
+  memset(buf, 0, sizeof(buf));
+  packBE(buf, (uint64_t) pf->offset, 8);
+  packBE(buf + 8, (uint64_t) pf->length, 4);
+  packBE(buf + 12, (uint64_t) pf->width, 2);
+  packBE(buf + 14, (uint64_t) pf->height, 2);
+  packBE(buf + 16, (uint64_t) pf->restart, 2);
+  packBE(buf + 18, (uint64_t) pf->scans, 2);
+  packBE(buf + 20, (uint64_t) pf->components, 1);
+  packBE(buf + 21, (uint64_t) pf->sof, 1);
+  packBE(buf + 22, (uint64_t) pf->flags, 2);
+  packBE(buf + 24, pf->hash, 8);
+  
+  /* Write the record */
+  writerPut(pw, buf, sizeof(buf));
+  
+  return NULL;
+}
+
+/*
+ * Read the format, frame count, last frame offset, and header flags
+ * from an existing index file.
+ * 
+ * The format is detected from the magic at the start of the file, and
+ * is v1 if there is no magic.  A v2 index must have the header and
+ * record sizes that this program writes, so that records can be
+ * appended to it.  A sparse or packed index can't be appended to, since
+ * its checkpoint table is at the end.  The index file must have a frame
+ * count of at least one and a file length that matches the frame
+ * count.  The file position is left at the end of the file, ready to
+ * append more frames.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the index file, open for reading in binary mode
+ * 
+ *   pFormat - receives the INDEX format
+ * 
+ *   pCount - receives the frame count
+ * 
+ *   pLast - receives the offset of the last frame
+ * 
+ *   pFlags - receives the INDEX_V2_FLAG constants for a v2 index, or
+ *   zero for the other formats
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else a static error message
+ */
+static const char *readIndexTail(
+    FILE     * pIn,
+    int      * pFormat,
+    long     * pCount,
+    int64_t  * pLast,
+    uint64_t * pFlags) {
+  
+  unsigned char buf[INDEX_V2_HEADER];
+  int format = 0;
+  uint64_t count = 0;
+  uint64_t last = 0;
+  uint64_t flags = 0;
+  int64_t flen = 0;
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pFormat == NULL) || (pCount == NULL) ||
+      (pLast == NULL) || (pFlags == NULL)) {
+    abort();
+  }
+  
+  /* Read the start of the file, which must be at least a v1 header */
+  memset(buf, 0, sizeof(buf));
+  if (fseeko(pIn, 0, SEEK_SET)) {
+    return "Invalid index file!";
+  }
+  if (fread(buf, 1, 8, pIn) != 8) {
+    return "Invalid index file!";
+  }
+  
+  /* Detect the format and get the frame count */
+  if ((memcmp(buf, INDEX_SPARSE_MAGIC, 8) == 0) ||
+      (memcmp(buf, INDEX_PACKED_MAGIC, 8) == 0)) {
+    return "Can't update a sparse or packed index!";
+    
+  } else if (memcmp(buf, INDEX_V2_MAGIC, 8) == 0) {
+    format = INDEX_V2;
+    if (fread(buf + 8, 1, INDEX_V2_HEADER - 8, pIn) !=
+          INDEX_V2_HEADER - 8) {
+      return "Invalid index file!";
+    }
+    if ((unpackBE(buf + 8, 4) != INDEX_V2_HEADER) ||
+        (unpackBE(buf + 12, 4) != INDEX_V2_RECORD)) {
+      return "Invalid index file!";
+    }
+    count = unpackBE(buf + 16, 8);
+    flags = unpackBE(buf + 24, 8);
+    
+  } else if (memcmp(buf, INDEX_NATIVE_MAGIC, 8) == 0) {
+    format = INDEX_NATIVE;
+    if (fread(buf + 8, 1, 8, pIn) != 8) {
+      return "Invalid index file!";
+    }
+    count = unpackLE(buf + 8, 8);
+    
+  } else {
+    format = INDEX_V1;
+    count = unpackBE(buf, 8);
+  }
+  if ((count < 1) || (count > LONG_MAX) ||
+      (indexLength(format, (long) count) < 0)) {
+    return "Invalid index file!";
+  }
+  
+  /* Check the file length */
+  if (fseeko(pIn, 0, SEEK_END)) {
+    return "Invalid index file!";
+  }
+  flen = (int64_t) ftello(pIn);
+  if (flen != indexLength(format, (long) count)) {
+    return "Invalid index file!";
+  }
+  
+  /* Read the last frame offset, which starts the last record */
+  if (fseeko(pIn, (off_t) indexLength(format, ((long) count) - 1),
+              SEEK_SET)) {
+    return "Invalid index file!";
+  }
+  if (fread(buf, 1, 8, pIn) != 8) {
+    return "Invalid index file!";
+  }
+  if (format == INDEX_NATIVE) {
+    last = unpackLE(buf, 8);
+  } else {
+    last = unpackBE(buf, 8);
+  }
+  if (last > (uint64_t) INT64_MAX) {
+    return "Invalid index file!";
+  }
+  
+  /* Leave file position at the end */
+  if (fseeko(pIn, 0, SEEK_END)) {
+    return "Invalid index file!";
+  }
+  
+  *pFormat = format;
+  *pCount = (long) count;
+  *pLast = (int64_t) last;
+  *pFlags = flags;
+  return NULL;
+}
+
+/*
+ * Check whether a path names a file that is already open.
+ * 
+ * A path that doesn't exist yet can't be the open file.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to check
+ * 
+ *   pst - the status of the open file, from fstat()
+ * 
+ * Return:
+ * 
+ *   non-zero if the path names the same file, zero if not
+ */
+static int sameFile(const char *pPath, const struct stat *pst) {
+  
+  struct stat st;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pst == NULL)) {
+    abort();
+  }
+  
+  if (stat(pPath, &st)) {
+    return 0;
+  }
+  return ((st.st_dev == pst->st_dev) && (st.st_ino == pst->st_ino));
+}
+
+/*
+ * Given two nul-terminated strings, allocate a new nul-terminated
+ * string that is the concatenation of the two strings.
+ * 
+ * Parameters:
+ * 
+ *   pa - the first string
+ * 
+ *   pb - the second string
+ * 
+ * Return:
+ * 
+ *   a newly allocated string that is the concatenation
+ */
+static char *suffix(const char *pa, const char *pb) {
+  
+  long full_size = 0;
+  long sz = 0;
+  size_t szt = 0;
+  char *pr = NULL;
+  
+  /* Check parameters */
+  if ((pa == NULL) || (pb == NULL)) {
+    abort();
+  }
+  
+  /* Determine combined length (without terminating nuls) and watch for
+   * overflow */
+  szt = strlen(pa);
+  if (szt >= LONG_MAX) {
+    abort();
+  }
+  sz = (long) szt;
+  
+  if (full_size <= LONG_MAX - sz) {
+    full_size += sz;
+  } else {
+    abort();
+  }
+  
+  szt = strlen(pb);
+  if (szt >= LONG_MAX) {
+    abort();
+  }
+  sz = (long) szt;
+  
+  if (full_size <= LONG_MAX - sz) {
+    full_size += sz;
+  } else {
+    abort();
+  }
+  
+  /* Add one more byte for the terminating nul */
+  if (full_size < LONG_MAX) {
+    full_size++;
+  } else {
+    abort();
+  }
+  
+  /* Allocate the buffer and clear to zero */
+  pr = (char *) calloc((size_t) full_size, 1);
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Copy the strings in */
+  strcat(pr, pa);
+  strcat(pr, pb);
+  
+  /* Return the new string */
+  return pr;
+}
+
+/*
+ * Parse a string as a non-negative decimal integer.
+ * 
+ * The string must be non-empty and contain only decimal digits.
+ * 
+ * Parameters:
+ * 
+ *   pStr - the string to parse
+ * 
+ *   pv - receives the parsed value if successful
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the string is not a valid integer
+ *   or the value overflows
+ */
+static int parseInt(const char *pStr, long *pv) {
+  
+  long v = 0;
+  int d = 0;
+  
+  /* Check parameters */
+  if ((pStr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* Must not be empty */
+  if (*pStr == 0) {
+    return 0;
+  }
+  
+  /* Parse digits, watching for overflow */
+  for( ; *pStr != 0; pStr++) {
+    if ((*pStr < '0') || (*pStr > '9')) {
+      return 0;
+    }
+    d = *pStr - '0';
+    if (v > (LONG_MAX - d) / 10) {
+      return 0;
+    }
+    v = (v * 10) + d;
+  }
+  
+  *pv = v;
+  return 1;
+}
+
+/*
+ * Initialize a read buffer pool.
+ * 
+ * No buffers are allocated until they are needed.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pool to initialize
+ * 
+ *   size - the size of each buffer in bytes, greater than zero
+ * 
+ *   cap - the most buffers that may be allocated, one or greater
+ */
+static void poolInit(BUF_POOL *pp, size_t size, int cap) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || (size < 1) || (cap < 1)) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pp, 0, sizeof(BUF_POOL));
+  if (pthread_mutex_init(&(pp->lock), NULL) ||
+      pthread_cond_init(&(pp->avail), NULL)) {
+    abort();
+  }
+  pp->size = size;
+  pp->free_count = 0;
+  pp->total = 0;
+  pp->cap = cap;
+  
+  pp->ppFree = (unsigned char **) calloc(
+                  (size_t) cap, sizeof(unsigned char *));
+  if (pp->ppFree == NULL) {
+    abort();
+  }
+}
+
+/*
+ * Release a read buffer pool.
+ * 
+ * Every buffer must have been returned to the pool with poolPut().
+ * 
+ * Parameters:
+ * 
+ *   pp - the pool to release
+ */
+static void poolFree(BUF_POOL *pp) {
+  
+  int i = 0;
+  
+  /* Check parameter */
+  if ((pp == NULL) || (pp->free_count != pp->total)) {
+    abort();
+  }
+  
+  /* Free the buffers and the pool */
+  for(i = 0; i < pp->free_count; i++) {
+    free((pp->ppFree)[i]);
+    (pp->ppFree)[i] = NULL;
+  }
+  free(pp->ppFree);
+  pp->ppFree = NULL;
+  pp->free_count = 0;
+  pp->total = 0;
+  
+  pthread_cond_destroy(&(pp->avail));
+  pthread_mutex_destroy(&(pp->lock));
+}
+
+/*
+ * Take a read buffer from a pool.
+ * 
+ * A free buffer is reused if there is one.  Otherwise, a new buffer is
+ * allocated, unless the pool is at its limit, in which case this waits
+ * for a buffer to be returned.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pool
+ * 
+ * Return:
+ * 
+ *   the buffer, which must be returned with poolPut()
+ */
+static unsigned char *poolGet(BUF_POOL *pp) {
+  
+  unsigned char *pBuf = NULL;
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  if (pthread_mutex_lock(&(pp->lock))) {
+    abort();
+  }
+  
+  /* Wait until there is a free buffer or room for a new one */
+  while ((pp->free_count < 1) && (pp->total >= pp->cap)) {
+    if (pthread_cond_wait(&(pp->avail), &(pp->lock))) {
+      abort();
+    }
+  }
+  
+  /* Reuse a free buffer, or else allocate a new one */
+  if (pp->free_count > 0) {
+    (pp->free_count)--;
+    pBuf = (pp->ppFree)[pp->free_count];
+    (pp->ppFree)[pp->free_count] = NULL;
+    
+  } else {
+    pBuf = (unsigned char *) malloc(pp->size);
+    if (pBuf == NULL) {
+      abort();
+    }
+    (pp->total)++;
+  }
+  
+  if (pthread_mutex_unlock(&(pp->lock))) {
+    abort();
+  }
+  
+  return pBuf;
+}
+
+/*
+ * Return a read buffer to the pool it was taken from.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pool
+ * 
+ *   pBuf - the buffer from poolGet()
+ */
+static void poolPut(BUF_POOL *pp, unsigned char *pBuf) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pBuf == NULL)) {
+    abort();
+  }
+  
+  if (pthread_mutex_lock(&(pp->lock))) {
+    abort();
+  }
+  
+  if (pp->free_count >= pp->total) {
+    abort();
+  }
+  (pp->ppFree)[pp->free_count] = pBuf;
+  (pp->free_count)++;
+  
+  if (pthread_cond_signal(&(pp->avail)) ||
+      pthread_mutex_unlock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Read one block for the -q read ring.
+ * 
+ * From standard input, whatever is available is taken, and only
+ * nothing at all means the end of input; otherwise, a short block
+ * means the end of input or an error.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read ring
+ * 
+ *   pBuf - the block to read into
+ * 
+ *   pGot - receives the number of bytes read
+ * 
+ *   pErr - receives non-zero if there was an I/O error, else zero
+ * 
+ * Return:
+ * 
+ *   non-zero if this was the last block, zero if there is more to read
+ */
+static int aheadRead(
+    READ_AHEAD    * pa,
+    unsigned char * pBuf,
+    size_t        * pGot,
+    int           * pErr) {
+  
+  /* Check parameters */
+  if ((pa == NULL) || (pBuf == NULL) || (pGot == NULL) ||
+      (pErr == NULL)) {
+    abort();
+  }
+  *pErr = 0;
+  
+  if (pa->use_stdin) {
+    if (!readPipe(fileno(pa->fp), pBuf, pa->size, pGot)) {
+      *pErr = 1;
+    }
+    return (*pErr || (*pGot < 1));
+  }
+  
+  *pGot = fread(pBuf, 1, pa->size, pa->fp);
+  if (*pGot < pa->size) {
+    if (ferror(pa->fp)) {
+      *pErr = 1;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Reader thread for the -q read ring.
+ * 
+ * Blocks are filled in order whenever one is free, until the end of
+ * input or until asked to stop.
+ * 
+ * Parameters:
+ * 
+ *   pv - the READ_AHEAD
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *aheadThread(void *pv) {
+  
+  READ_AHEAD *pa = NULL;
+  int slot = 0;
+  int end = 0;
+  int err = 0;
+  size_t got = 0;
+  
+  /* Check parameter */
+  if (pv == NULL) {
+    abort();
+  }
+  pa = (READ_AHEAD *) pv;
+  
+  while (!end) {
+    
+    /* Wait for a free block, unless asked to stop */
+    if (pthread_mutex_lock(&(pa->lock))) {
+      abort();
+    }
+    while ((pa->filled >= pa->count) && (!(pa->stop))) {
+      if (pthread_cond_wait(&(pa->cond), &(pa->lock))) {
+        abort();
+      }
+    }
+    if (pa->stop) {
+      if (pthread_mutex_unlock(&(pa->lock))) {
+        abort();
+      }
+      break;
+    }
+    slot = (pa->head + pa->filled) % pa->count;
+    if (pthread_mutex_unlock(&(pa->lock))) {
+      abort();
+    }
+    
+    /* Fill it without holding the lock */
+    end = aheadRead(pa, (pa->ppBuf)[slot], &got, &err);
+    
+    /* Hand it to the parser */
+    if (pthread_mutex_lock(&(pa->lock))) {
+      abort();
+    }
+    (pa->pGot)[slot] = got;
+    (pa->filled)++;
+    if (end) {
+      pa->done = 1;
+      pa->err = err;
+    }
+    if (pthread_cond_signal(&(pa->cond)) ||
+        pthread_mutex_unlock(&(pa->lock))) {
+      abort();
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Set up the -q read ring and start its reader thread.
+ * 
+ * The blocks are taken from the pool, which must have room for count
+ * more.  If the thread can't be started, the ring still works, but the
+ * parser reads each block itself.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read ring to set up
+ * 
+ *   fp - the input, positioned where reading starts
+ * 
+ *   use_stdin - non-zero if the input is standard input
+ * 
+ *   count - the number of blocks, in range AHEAD_MIN to AHEAD_MAX
+ * 
+ *   pPool - the pool to take the blocks from
+ */
+static void aheadInit(
+    READ_AHEAD * pa,
+    FILE       * fp,
+    int          use_stdin,
+    int          count,
+    BUF_POOL   * pPool) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pa == NULL) || (fp == NULL) || (pPool == NULL) ||
+      (count < AHEAD_MIN) || (count > AHEAD_MAX)) {
+    abort();
+  }
+  
+  /* Initialize structure */
+  memset(pa, 0, sizeof(READ_AHEAD));
+  if (pthread_mutex_init(&(pa->lock), NULL) ||
+      pthread_cond_init(&(pa->cond), NULL)) {
+    abort();
+  }
+  pa->fp = fp;
+  pa->use_stdin = use_stdin;
+  pa->size = pPool->size;
+  pa->count = count;
+  pa->head = 0;
+  pa->filled = 0;
+  pa->done = 0;
+  pa->err = 0;
+  pa->stop = 0;
+  
+  pa->ppBuf = (unsigned char **) calloc(
+                (size_t) count, sizeof(unsigned char *));
+  pa->pGot = (size_t *) calloc((size_t) count, sizeof(size_t));
+  if ((pa->ppBuf == NULL) || (pa->pGot == NULL)) {
+    abort();
+  }
+  for(i = 0; i < count; i++) {
+    (pa->ppBuf)[i] = poolGet(pPool);
+  }
+  
+  /* Let the kernel read ahead as far as it likes; this is only advice,
+   * so it doesn't matter if it fails */
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (!use_stdin) {
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+#endif
+  
+  /* Start the reader */
+  if (pthread_create(&(pa->thread), NULL, &aheadThread, pa) == 0) {
+    pa->started = 1;
+  }
+}
+
+/*
+ * Take the next block from the -q read ring, waiting for it to fill if
+ * necessary.
+ * 
+ * The block must be handed back with aheadDone() before taking the
+ * next one.  Once the last block has been taken, this returns an empty
+ * block.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read ring
+ * 
+ *   pGot - receives the number of bytes in the block
+ * 
+ *   pEnd - receives non-zero if this is the last block, else zero
+ * 
+ *   pErr - receives non-zero if the last read failed, else zero
+ * 
+ * Return:
+ * 
+ *   the block
+ */
+static unsigned char *aheadNext(
+    READ_AHEAD * pa,
+    size_t     * pGot,
+    int        * pEnd,
+    int        * pErr) {
+  
+  unsigned char *pBuf = NULL;
+  
+  /* Check parameters */
+  if ((pa == NULL) || (pGot == NULL) || (pEnd == NULL) ||
+      (pErr == NULL)) {
+    abort();
+  }
+  
+  /* Without a reader thread, read the block here */
+  if (!(pa->started)) {
+    pBuf = (pa->ppBuf)[0];
+    *pGot = 0;
+    *pErr = 0;
+    *pEnd = 1;
+    if (!(pa->done)) {
+      *pEnd = aheadRead(pa, pBuf, pGot, pErr);
+      pa->done = *pEnd;
+    }
+    return pBuf;
+  }
+  
+  if (pthread_mutex_lock(&(pa->lock))) {
+    abort();
+  }
+  
+  /* Wait for the block, unless the reader is already done and every
+   * block has been taken */
+  while ((pa->filled < 1) && (!(pa->done))) {
+    if (pthread_cond_wait(&(pa->cond), &(pa->lock))) {
+      abort();
+    }
+  }
+  
+  pBuf = (pa->ppBuf)[pa->head];
+  if (pa->filled > 0) {
+    *pGot = (pa->pGot)[pa->head];
+    *pEnd = (pa->done && (pa->filled == 1));
+  } else {
+    *pGot = 0;
+    *pEnd = 1;
+  }
+  *pErr = (*pEnd && pa->err);
+  
+  if (pthread_mutex_unlock(&(pa->lock))) {
+    abort();
+  }
+  
+  return pBuf;
+}
+
+/*
+ * Hand the block taken with aheadNext() back to the -q read ring, so
+ * that the reader can fill it again.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read ring
+ */
+static void aheadDone(READ_AHEAD *pa) {
+  
+  /* Check parameter */
+  if (pa == NULL) {
+    abort();
+  }
+  
+  /* Nothing to do without a reader thread */
+  if (!(pa->started)) {
+    return;
+  }
+  
+  if (pthread_mutex_lock(&(pa->lock))) {
+    abort();
+  }
+  
+  if (pa->filled > 0) {
+    pa->head = (pa->head + 1) % pa->count;
+    (pa->filled)--;
+  }
+  
+  if (pthread_cond_signal(&(pa->cond)) ||
+      pthread_mutex_unlock(&(pa->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Stop the reader thread of the -q read ring, if it is still going,
+ * and return the blocks to the pool.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read ring
+ * 
+ *   pPool - the pool the blocks were taken from
+ */
+static void aheadFree(READ_AHEAD *pa, BUF_POOL *pPool) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pa == NULL) || (pPool == NULL)) {
+    abort();
+  }
+  
+  /* Stop the reader and wait for it */
+  if (pa->started) {
+    if (pthread_mutex_lock(&(pa->lock))) {
+      abort();
+    }
+    pa->stop = 1;
+    if (pthread_cond_signal(&(pa->cond)) ||
+        pthread_mutex_unlock(&(pa->lock))) {
+      abort();
+    }
+    if (pthread_join(pa->thread, NULL)) {
+      abort();
+    }
+    pa->started = 0;
+  }
+  
+  /* Return the blocks */
+  for(i = 0; i < pa->count; i++) {
+    if ((pa->ppBuf)[i] != NULL) {
+      poolPut(pPool, (pa->ppBuf)[i]);
+      (pa->ppBuf)[i] = NULL;
+    }
+  }
+  free(pa->ppBuf);
+  pa->ppBuf = NULL;
+  free(pa->pGot);
+  pa->pGot = NULL;
+  
+  pthread_mutex_destroy(&(pa->lock));
+  pthread_cond_destroy(&(pa->cond));
+}
+
+/*
+ * Index one file.
+ * 
+ * This does all of the work of the program for a single input file,
+ * from opening the file to writing the finished index.  Nothing is
+ * written to standard error apart from --progress reports and the
+ * ranges skipped by --recover, so several files can be indexed at once
+ * on different threads; any error is returned instead.  If an update
+ * fails, the index file is put back the way it was, header and all.
+ * 
+ * Parameters:
+ * 
+ *   po - the options
+ * 
+ *   pInPath - the path of the input file, which is ignored when reading
+ *   standard input
+ * 
+ *   pPool - the pool to take the read buffer from, or the blocks of the
+ *   read ring with -q, which may only be NULL if the file is mapped
+ * 
+ *   pr - receives the result, if successful
+ * 
+ * Return:
+ * 
+ *   NULL if successful, or else an error message
+ */
+static const char *indexFile(
+    const INDEX_OPTIONS * po,
+    const char          * pInPath,
+    BUF_POOL            * pPool,
+    INDEX_RESULT        * pr) {
+  
+  int status = 1;
+  int at_end = 0;
+  int ahead = 0;
+  int err = 0;
+  int format = 0;
+  int old_format = 0;
+  int wfd = -1;
+  int in_fd = -1;
+  const char *pErr = NULL;
+  int64_t last_flush = 0;
+  long i = 0;
+  long old_count = 0;
+  uint64_t old_flags = 0;
+  int64_t last = -1;
+  int64_t read_count = 0;
+  int64_t t = 0;
+  int64_t io_us = 0;
+  int64_t parse_us = 0;
+  int64_t total = -1;
+  size_t got = 0;
+  size_t pos = 0;
+  size_t n = 0;
+  FILE *fp = NULL;
+  FILE *fi = NULL;
+  FILE *fr = NULL;
+  char *pIPath = NULL;
+  char *pRPath = NULL;
+  unsigned char *pBuf = NULL;
+  JPEG_PARSER parser;
+  JPEG_MAP mf;
+  INDEX_STATE ist;
+  INDEX_WRITER iw;
+  INDEX_WRITER rw;
+  FRAME_LIST frames;
+  PROGRESS prog;
+  RECOVER rec;
+  RECOVER *pRec = NULL;
+  READ_AHEAD ra;
+  FRAME_INFO *pf = NULL;
+  struct stat st;
+  
+  /* Check parameters */
+  if ((po == NULL) || (pInPath == NULL) || (pr == NULL) ||
+      ((pPool == NULL) && (!(po->use_mmap)))) {
+    abort();
+  }
+  
+  /* Initialize structures */
+  memset(&parser, 0, sizeof(JPEG_PARSER));
+  jpeg_mapInit(&mf);
+  memset(&ist, 0, sizeof(INDEX_STATE));
+  memset(&iw, 0, sizeof(INDEX_WRITER));
+  memset(&rw, 0, sizeof(INDEX_WRITER));
+  listInit(&frames);
+  memset(&prog, 0, sizeof(PROGRESS));
+  memset(&rec, 0, sizeof(RECOVER));
+  memset(&ra, 0, sizeof(READ_AHEAD));
+  memset(&st, 0, sizeof(struct stat));
+  memset(pr, 0, sizeof(INDEX_RESULT));
+  format = po->format;
+  
+  /* Generate the index file name, unless it was given */
+  if (po->pOutPath != NULL) {
+    pIPath = suffix(po->pOutPath, "");
+  } else {
+    pIPath = suffix(pInPath, ".index");
+  }
+  if (po->rst) {
+    pRPath = suffix(pIPath, ".rst");
+  }
+  
+  /* Take a read buffer from the pool, unless we are mapping the file
+   * or using a read ring */
+  if ((!(po->use_mmap)) && (po->ahead < AHEAD_MIN)) {
+    pBuf = poolGet(pPool);
+  }
+  
+  /* Open the provided file for reading, or map it into memory */
+  if (status) {
+    if (po->use_mmap) {
+      t = monoMicros();
+      pErr = jpeg_mapFile(&mf, pInPath);
+      io_us += monoMicros() - t;
+      if (pErr != NULL) {
+        status = 0;
+      }
+      
+    } else if (po->use_stdin) {
+      fp = stdin;
+      
+    } else {
+      fp = fopen(pInPath, "rb");
+      if (fp == NULL) {
+        pErr = "Can't open input file!";
+        status = 0;
+      }
+    }
+  }
+  
+  /* The index file, and the restart index if any, are about to be
+   * written, so neither may be the input itself; the input has nothing
+   * to lose if it can't be looked up */
+  if (status) {
+    if (po->use_mmap) {
+      in_fd = mf.fd;
+    } else {
+      in_fd = fileno(fp);
+    }
+    if ((in_fd >= 0) && (fstat(in_fd, &st) == 0)) {
+      if (sameFile(pIPath, &st)) {
+        pErr = "Index is the same file as the input!";
+        status = 0;
+      } else if ((pRPath != NULL) && sameFile(pRPath, &st)) {
+        pErr = "Restart index is the same file as the input!";
+        status = 0;
+      }
+    }
+  }
+  
+  /* If updating, open the existing index file and get the last frame
+   * that it records */
+  if (status && po->update) {
+    fi = fopen(pIPath, "r+b");
+    if (fi == NULL) {
+      pErr = "Can't open index file!";
+      status = 0;
+    } else {
+      writerInit(&iw, fi);
+    }
+    
+    if (status) {
+      old_format = format;
+      pErr = readIndexTail(fi, &format, &old_count, &last, &(iw.flags));
+      if (pErr != NULL) {
+        status = 0;
+      } else if (po->format_set && (format != old_format)) {
+        pErr = "Index file is not in the requested format!";
+        status = 0;
+      } else if (po->hash && (!(iw.flags & INDEX_V2_FLAG_HASH))) {
+        pErr = "Index file has no hashes!";
+        status = 0;
+      }
+      old_flags = iw.flags;
+    }
+  }
+  
+  /* Otherwise, open the index file for writing */
+  if (status && (!(po->update))) {
+    fi = fopen(pIPath, "wb");
+    if (fi == NULL) {
+      pErr = "Can't create index file!";
+      status = 0;
+    } else {
+      writerInit(&iw, fi);
+      iw.interval = po->sparse_k;
+      if (po->hash) {
+        iw.flags |= INDEX_V2_FLAG_HASH;
+      }
+    }
+  }
+  
+  /* Mark the index if duplicates are left out of it */
+  if (status && (po->dedup == DEDUP_DROP)) {
+    iw.flags |= INDEX_V2_FLAG_DROP;
+  }
+  
+  /* If not updating, write a header with a frame count of zero for
+   * now -- we will fill it in with the frame count at the end */
+  if (status && (!(po->update))) {
+    writeIndexHeader(&iw, format, 0);
+  }
+  
+  /* Open the restart index file if requested, likewise with a frame
+   * count of zero for now */
+  if (status && po->rst) {
+    fr = fopen(pRPath, "wb");
+    if (fr == NULL) {
+      pErr = "Can't create restart index file!";
+      status = 0;
+    } else {
+      writerInit(&rw, fr);
+      writeIndexHeader(&rw, INDEX_RST, 0);
+    }
+  }
+  
+  /* If updating, the last frame must start within the input file */
+  if (status && po->update && po->use_mmap) {
+    if (last >= (int64_t) mf.len) {
+      pErr = "Index does not match input file!";
+      status = 0;
+    }
+  }
+  
+  /* If updating and reading in blocks, seek to the last frame */
+  if (status && po->update && (!(po->use_mmap))) {
+    if (fseeko(fp, (off_t) last, SEEK_SET)) {
+      pErr = "Seek failed!";
+      status = 0;
+    }
+  }
+  
+  /* Initialize the parser, starting at the last frame if updating */
+  if (status) {
+    ist.pw = &iw;
+    ist.format = format;
+    ist.pParser = &parser;
+    ist.frame_count = old_count;
+    ist.resume = last;
+    ist.resumed = 0;
+    ist.pending = 0;
+    ist.skip = 0;
+    ist.flushed_count = old_count;
+    if (po->rst) {
+      ist.pRw = &rw;
+    }
+    if (iw.flags & INDEX_V2_FLAG_HASH) {
+      ist.hash = 1;
+      ist.dedup = po->dedup;
+    }
+    if (po->recover) {
+      jpeg_parserInit(&parser, &recoverMarker, &ist, po->rst);
+    } else {
+      jpeg_parserInit(&parser, &indexMarker, &ist, po->rst);
+    }
+    if (po->update) {
+      parser.offset = last;
+    }
+  }
+  
+  /* Set up recovery if requested */
+  if (status && po->recover) {
+    rec.pPath = pInPath;
+    rec.offset = parser.offset;
+    pRec = &rec;
+  }
+  
+  /* If reporting progress, work out how much there is to scan, which
+   * isn't known for standard input or a file that is growing */
+  if (status && (po->progress_ms > 0)) {
+    if (po->use_mmap) {
+      total = (int64_t) mf.len - parser.offset;
+    } else if ((!(po->use_stdin)) && (!(po->follow))) {
+      if (fstat(fileno(fp), &st) == 0) {
+        total = (int64_t) st.st_size - parser.offset;
+      }
+    }
+    progressInit(&prog, po->progress_ms, total);
+  }
+  
+  /* If indexing in parallel, build the frame list with the workers and
+   * then write it out */
+  if (status && (po->workers > 1)) {
+    read_count = (int64_t) mf.len - parser.offset;
+    t = monoMicros();
+    pErr = indexParallel(mf.pData, mf.len, (size_t) parser.offset,
+                          (int) po->workers, &frames);
+    parse_us += monoMicros() - t;
+    if (pErr == NULL) {
+      
+      /* When updating, the first frame is the one we resumed from,
+       * which the frames after it are still compared with */
+      i = 0;
+      if (po->update) {
+        if ((frames.count < 1) || ((frames.pFrame)[0].offset != last)) {
+          pErr = "Index does not match input file!";
+          status = 0;
+        }
+        i = 1;
+        ist.resumed = 1;
+      }
+      if (status && po->update && ist.hash) {
+        pf = &((frames.pFrame)[0]);
+        pf->hash = hashBytes(mf.pData + (size_t) pf->offset,
+                              (size_t) pf->length);
+        dedupFrame(&ist, pf);
+      }
+      
+      /* Hash each frame straight from the mapping if requested, while
+       * writing it out */
+      for( ; status && (i < frames.count); i++) {
+        pf = &((frames.pFrame)[i]);
+        if (ist.frame_count >= LONG_MAX) {
+          pErr = "Too many frames!";
+          status = 0;
+          break;
+        }
+        if (ist.hash) {
+          pf->hash = hashBytes(mf.pData + (size_t) pf->offset,
+                                (size_t) pf->length);
+        }
+        if (dedupFrame(&ist, pf)) {
+          continue;
+        }
+        pErr = writeRecord(&iw, format, pf);
+        if (pErr != NULL) {
+          status = 0;
+          break;
+        }
+        ist.frame_count++;
+      }
+      
+    } else {
+      status = 0;
+    }
+  }
+  
+  /* Otherwise, if the file is mapped, run the whole mapping through the
+   * parser, in pieces of the block size if reporting progress */
+  if (status && po->use_mmap && (po->workers <= 1)) {
+    read_count = (int64_t) mf.len - parser.offset;
+    for(pos = (size_t) parser.offset; pos < mf.len; pos += n) {
+      n = mf.len - pos;
+      if ((po->progress_ms > 0) && (n > po->block_size)) {
+        n = po->block_size;
+      }
+      
+      t = monoMicros();
+      pErr = indexFeed(&ist, &parser, pRec, mf.pData + pos, n, pos);
+      if (pErr != NULL) {
+        status = 0;
+      }
+      parse_us += monoMicros() - t;
+      if (!status) {
+        break;
+      }
+      
+      if (po->progress_ms > 0) {
+        progressReport(&prog, read_count - (int64_t) (mf.len - pos - n),
+                        ist.frame_count, io_us, parse_us);
+      }
+    }
+  }
+  
+  /* If following, install the signal handlers that stop following,
+   * and watch the input file for changes if possible */
+  if (status && po->follow) {
+    signal(SIGINT, &handleStop);
+    signal(SIGTERM, &handleStop);
+
+#ifdef FOLLOW_INOTIFY
+    wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wfd >= 0) {
+      if (inotify_add_watch(wfd, pInPath,
+            IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        close(wfd);
+        wfd = -1;
+      }
+    }
+#endif
+    
+    last_flush = monoMillis();
+  }
+  
+  /* If reading with a read ring, start the reader, now that the input
+   * is where reading starts */
+  if (status && (!(po->use_mmap)) && (po->ahead >= AHEAD_MIN)) {
+    aheadInit(&ra, fp, po->use_stdin, (int) po->ahead, pPool);
+    ahead = 1;
+  }
+  
+  /* Otherwise, read the input in blocks and run each through the
+   * parser */
+  while (status && (!(po->use_mmap))) {
+    
+    /* Read the next block, or take it from the read ring; from
+     * standard input, take whatever is available, and only nothing at
+     * all means EOF */
+    t = monoMicros();
+    if (ahead) {
+      pBuf = aheadNext(&ra, &got, &at_end, &err);
+      if (err) {
+        pErr = "I/O error!";
+        status = 0;
+      }
+    } else if (po->use_stdin) {
+      if (!readPipe(fileno(fp), pBuf, po->block_size, &got)) {
+        pErr = "I/O error!";
+        status = 0;
+      }
+      at_end = (got < 1);
+    } else {
+      got = fread(pBuf, 1, po->block_size, fp);
+      at_end = (got < po->block_size);
+    }
+    read_count += (int64_t) got;
+    
+    /* Pass the data along to standard output if teeing */
+    if (status && po->use_stdin && po->tee && (got > 0)) {
+      if (fwrite(pBuf, 1, got, stdout) != got) {
+        pErr = "I/O error on output!";
+        status = 0;
+      }
+    }
+    io_us += monoMicros() - t;
+    
+    /* Parse whatever we got */
+    if (status && (got > 0)) {
+      t = monoMicros();
+      pErr = indexFeed(&ist, &parser, pRec, pBuf, got, 0);
+      if (pErr != NULL) {
+        status = 0;
+      }
+      parse_us += monoMicros() - t;
+    }
+    
+    /* Report progress if it's time */
+    if (status && (po->progress_ms > 0)) {
+      progressReport(&prog, read_count, ist.frame_count, io_us, parse_us);
+    }
+    
+    /* Hand the block back to the read ring */
+    if (ahead) {
+      aheadDone(&ra);
+      pBuf = NULL;
+    }
+    
+    /* A partial block means either EOF or an I/O error */
+    if (status && at_end) {
+      if (ferror(fp)) {
+        pErr = "I/O error!";
+        status = 0;
+      } else if (!(po->follow)) {
+        break;
+      }
+    }
+    
+    /* If following, bring the index up to date if we caught up with
+     * the writer or it has been too long since the last time */
+    if (status && po->follow) {
+      if (at_end || (monoMillis() - last_flush >= FOLLOW_FLUSH_MS)) {
+        if (!flushIndex(&ist)) {
+          pErr = "I/O error on write!";
+          status = 0;
+        }
+        last_flush = monoMillis();
+      }
+    }
+    
+    /* If following and we caught up with the writer, stop if requested
+     * or else wait for more data */
+    if (status && po->follow && at_end) {
+      if (m_stop) {
+        break;
+      }
+      clearerr(fp);
+      if (!followWait(wfd)) {
+        pErr = "Can't wait for input!";
+        status = 0;
+      }
+    }
+  }
+  
+  /* When updating, make sure we found the frame we resumed from */
+  if (status && po->update && (!ist.resumed)) {
+    pErr = "Index does not match input file!";
+    status = 0;
+  }
+  
+  /* Make sure the stream ended properly, unless the workers already
+   * took care of it, or we were following a stream and were stopped,
+   * in which case it may be in the middle of a frame */
+  if (status && (po->workers <= 1) && (!(po->follow))) {
+    pErr = indexFinish(&ist, &parser, pRec);
+    if (pErr != NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Make sure everything passed along reached standard output */
+  if (status && po->use_stdin && po->tee) {
+    if (fflush(stdout)) {
+      pErr = "I/O error on output!";
+      status = 0;
+    }
+  }
+  
+  /* Must have at least one frame */
+  if (status && (ist.frame_count < 1)) {
+    pErr = "No frames found!";
+    status = 0;
+  }
+  
+  /* Write out the rest of the index and the number of frames, and
+   * check that there were no write errors along the way; a sparse or
+   * packed index ends with its checkpoint table */
+  if (status && ((format == INDEX_SPARSE) || (format == INDEX_PACKED))) {
+    writeSparseTable(&iw, format);
+  }
+  if (status) {
+    if (!writerRewriteHeader(&iw, format, ist.frame_count)) {
+      pErr = "I/O error on write!";
+      status = 0;
+    }
+  }
+  if (status && po->rst) {
+    if (!writerRewriteHeader(&rw, INDEX_RST, ist.frame_count)) {
+      pErr = "I/O error on write!";
+      status = 0;
+    }
+  }
+  
+  /* Store the result */
+  if (status) {
+    pr->frame_count = ist.frame_count;
+    pr->old_count = old_count;
+    pr->read_count = read_count;
+    pr->index_bytes = (int64_t) ftello(fi);
+    pr->io_us = io_us;
+    pr->parse_us = parse_us;
+    pr->skipped_ranges = rec.ranges;
+    pr->skipped_bytes = rec.skipped;
+    pr->dup_frames = ist.dup_count;
+  }
+  
+  /* If an update failed, put the header back the way it was before,
+   * since following may have rewritten it already, and truncate the
+   * index file back to its old length, so that it stays valid; any
+   * records still buffered are dropped, and a write error is cleared
+   * so that the header can still be written */
+  if ((!status) && po->update && (fi != NULL) && (old_count > 0)) {
+    iw.fill = 0;
+    iw.err = 0;
+    iw.flags = old_flags;
+    if ((!writerRewriteHeader(&iw, format, old_count)) ||
+        ftruncate(fileno(fi), (off_t) indexLength(format, old_count))) {
+      pErr = "Can't restore index file!";
+    }
+  }
+  
+  /* Close inotify descriptor if open */
+  if (wfd >= 0) {
+    close(wfd);
+    wfd = -1;
+  }
+  
+  /* Release the index writer, and close index file if open */
+  writerFree(&iw);
+  if (fi != NULL) {
+    fclose(fi);
+    fi = NULL;
+  }
+  
+  /* Likewise for the restart index, and its restart marker list */
+  writerFree(&rw);
+  if (fr != NULL) {
+    fclose(fr);
+    fr = NULL;
+  }
+  if (ist.pRst != NULL) {
+    free(ist.pRst);
+    ist.pRst = NULL;
+  }
+  
+  /* Stop the reader of the read ring, if any, before closing the file
+   * it reads */
+  if (ahead) {
+    aheadFree(&ra, pPool);
+    ahead = 0;
+    pBuf = NULL;
+  }
+  
+  /* Close JPEG file if open, leaving standard input alone */
+  if ((fp != NULL) && (fp != stdin)) {
+    fclose(fp);
+  }
+  fp = NULL;
+  
+  /* Release JPEG file mapping if mapped */
+  jpeg_unmapFile(&mf);
+  
+  /* Return read buffer to the pool if taken */
+  if (pBuf != NULL) {
+    poolPut(pPool, pBuf);
+    pBuf = NULL;
+  }
+  
+  /* Free frame list */
+  listFree(&frames);
+  
+  /* Free index path strings */
+  free(pIPath);
+  pIPath = NULL;
+  if (pRPath != NULL) {
+    free(pRPath);
+    pRPath = NULL;
+  }
+  
+  return pErr;
+}
+
+/*
+ * Thread that indexes files of a batch until there are none left.
+ * 
+ * Each file's status is reported as soon as it is done, one line per
+ * file: the frame count on standard output if it was indexed, or the
+ * error on standard error if not.  A file that fails doesn't stop the
+ * batch.
+ * 
+ * Parameters:
+ * 
+ *   pv - the BATCH_STATE
+ * 
+ * Return:
  * 
- *   pOut - the file handle to write to
+ *   NULL
  */
-static void writeInt64BE(FILE *pOut, int64_t val) {
+static void *batchWorker(void *pv) {
   
-  int i = 0;
-  int c = 0;
+  BATCH_STATE *ps = NULL;
+  INDEX_RESULT res;
+  const char *pErr = NULL;
+  const char *pPath = NULL;
   
-  /* Check parameters */
-  if ((pOut == NULL) || (val < 0)) {
+  /* Check parameter */
+  if (pv == NULL) {
     abort();
   }
+  ps = (BATCH_STATE *) pv;
+  memset(&res, 0, sizeof(INDEX_RESULT));
   
-  /* Write bytes in big-endian order */
-  for(i = 56; i >= 0; i -= 8) {
-    /* Get current byte */
-    c = (int) ((val >> i) & 0xff);
+  for( ; ; ) {
+    
+    /* Take the next file, if any */
+    if (pthread_mutex_lock(&(ps->lock))) {
+      abort();
+    }
+    pPath = NULL;
+    if (ps->next < ps->count) {
+      pPath = (ps->ppPath)[ps->next];
+      (ps->next)++;
+    }
+    if (pthread_mutex_unlock(&(ps->lock))) {
+      abort();
+    }
+    if (pPath == NULL) {
+      break;
+    }
     
-    /* Write byte */
-    if (putc(c, pOut) != c) {
-      fprintf(stderr, "I/O error on write!\n");
+    /* Index it */
+    pErr = indexFile(ps->pOpt, pPath, ps->pPool, &res);
+    
+    /* Report the status and add to the totals */
+    if (pthread_mutex_lock(&(ps->lock))) {
+      abort();
+    }
+    if (pErr == NULL) {
+      printf("%s: %ld frames\n", pPath, res.frame_count);
+      fflush(stdout);
+      ps->frames += res.frame_count;
+      ps->read_count += res.read_count;
+      ps->index_bytes += res.index_bytes;
+      ps->io_us += res.io_us;
+      ps->parse_us += res.parse_us;
+      ps->skipped_ranges += res.skipped_ranges;
+      ps->skipped_bytes += res.skipped_bytes;
+      ps->dup_frames += res.dup_frames;
+    } else {
+      fprintf(stderr, "%s: %s\n", pPath, pErr);
+      (ps->failed)++;
+    }
+    if (pthread_mutex_unlock(&(ps->lock))) {
       abort();
     }
   }
+  
+  return NULL;
 }
 
 /*
- * Given two nul-terminated strings, allocate a new nul-terminated
- * string that is the concatenation of the two strings.
+ * Read a line of text from a file.
+ * 
+ * The line break, either LF or CR+LF, is not included in the line.  A
+ * last line without a line break is still returned.
  * 
  * Parameters:
  * 
- *   pa - the first string
+ *   pIn - the file to read
  * 
- *   pb - the second string
+ *   pErr - set to non-zero if there was an I/O error, else zero
  * 
  * Return:
  * 
- *   a newly allocated string that is the concatenation
+ *   the line, which must be freed with free(), or NULL if there are no
+ *   more lines or there was an error
  */
-static char *suffix(const char *pa, const char *pb) {
+static char *readLine(FILE *pIn, int *pErr) {
   
-  long full_size = 0;
-  long sz = 0;
-  size_t szt = 0;
-  char *pr = NULL;
+  char *pLine = NULL;
+  char *pNew = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  int c = 0;
   
   /* Check parameters */
-  if ((pa == NULL) || (pb == NULL)) {
+  if ((pIn == NULL) || (pErr == NULL)) {
     abort();
   }
+  *pErr = 0;
   
-  /* Determine combined length (without terminating nuls) and watch for
-   * overflow */
-  szt = strlen(pa);
-  if (szt >= LONG_MAX) {
-    abort();
+  /* Read characters up to the line break or EOF */
+  for(c = getc(pIn); (c != EOF) && (c != '\n'); c = getc(pIn)) {
+    
+    /* Make room for the character and a terminating nul, growing the
+     * buffer by doubling */
+    if (len + 2 > cap) {
+      if (cap < 1) {
+        cap = 256;
+      } else if (cap > SIZE_MAX / 2) {
+        abort();
+      } else {
+        cap = cap * 2;
+      }
+      pNew = (char *) realloc(pLine, cap);
+      if (pNew == NULL) {
+        abort();
+      }
+      pLine = pNew;
+    }
+    
+    pLine[len] = (char) c;
+    len++;
   }
-  sz = (long) szt;
   
-  if (full_size <= LONG_MAX - sz) {
-    full_size += sz;
-  } else {
-    abort();
+  /* Check for errors and the end of the file */
+  if (ferror(pIn)) {
+    *pErr = 1;
+    if (pLine != NULL) {
+      free(pLine);
+    }
+    return NULL;
   }
-  
-  szt = strlen(pb);
-  if (szt >= LONG_MAX) {
-    abort();
+  if ((c == EOF) && (len < 1)) {
+    if (pLine != NULL) {
+      free(pLine);
+    }
+    return NULL;
   }
-  sz = (long) szt;
   
-  if (full_size <= LONG_MAX - sz) {
-    full_size += sz;
-  } else {
-    abort();
+  /* An empty line still needs a buffer */
+  if (pLine == NULL) {
+    pLine = (char *) malloc(1);
+    if (pLine == NULL) {
+      abort();
+    }
   }
   
-  /* Add one more byte for the terminating nul */
-  if (full_size < LONG_MAX) {
-    full_size++;
-  } else {
-    abort();
+  /* Drop a CR before the line break and terminate */
+  if ((len > 0) && (pLine[len - 1] == '\r')) {
+    len--;
   }
+  pLine[len] = 0;
   
-  /* Allocate the buffer and clear to zero */
-  pr = (char *) calloc((size_t) full_size, 1);
-  if (pr == NULL) {
+  return pLine;
+}
+
+/*
+ * Add a path to the file list of a batch.
+ * 
+ * Parameters:
+ * 
+ *   ps - the batch
+ * 
+ *   pPath - the path, allocated with malloc(), which the batch takes
+ *   ownership of
+ */
+static void batchAdd(BATCH_STATE *ps, char *pPath) {
+  
+  long new_cap = 0;
+  char **ppNew = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pPath == NULL)) {
     abort();
   }
   
-  /* Copy the strings in */
-  strcat(pr, pa);
-  strcat(pr, pb);
+  /* Grow the list if necessary by doubling the capacity each time */
+  if (ps->count >= ps->cap) {
+    if (ps->cap < 1) {
+      new_cap = 64;
+    } else {
+      new_cap = ps->cap * 2;
+    }
+    
+    if ((size_t) new_cap > SIZE_MAX / sizeof(char *)) {
+      abort();
+    }
+    ppNew = (char **) realloc(
+              ps->ppPath, ((size_t) new_cap) * sizeof(char *));
+    if (ppNew == NULL) {
+      abort();
+    }
+    
+    ps->ppPath = ppNew;
+    ps->cap = new_cap;
+  }
   
-  /* Return the new string */
-  return pr;
+  (ps->ppPath)[ps->count] = pPath;
+  (ps->count)++;
 }
 
 /*
@@ -305,17 +5831,39 @@ static char *suffix(const char *pa, const char *pb) {
 int main(int argc, char *argv[]) {
   
   int x = 0;
-  int c = 0;
-  int c2 = 0;
   int status = 1;
-  int eoi_read = 0;
-  long mark_len = 0;
-  long frame_count = 0;
-  FILE *fp = NULL;
-  FILE *fi = NULL;
-  char *pIPath = NULL;
+  int batch = 0;
+  int list = 0;
+  int summary = 0;
+  int err = 0;
+  int64_t start_ms = 0;
+  int64_t elapsed_ms = 0;
+  const char *pErr = NULL;
+  long block_mib = BLOCK_MIB_DEFAULT;
+  long files = BATCH_DEFAULT;
+  long progress_sec = 0;
+  const char *pStats = NULL;
+  long i = 0;
+  char *pLine = NULL;
+  pthread_t *pThreads = NULL;
+  int *pStarted = NULL;
+  INDEX_OPTIONS opt;
+  INDEX_RESULT res;
+  BUF_POOL pool;
+  BATCH_STATE bs;
   
-  int64_t read_count = 0;
+  /* Initialize structures */
+  memset(&opt, 0, sizeof(INDEX_OPTIONS));
+  memset(&res, 0, sizeof(INDEX_RESULT));
+  memset(&pool, 0, sizeof(BUF_POOL));
+  memset(&bs, 0, sizeof(BATCH_STATE));
+  opt.tee = 1;
+  opt.format = INDEX_V2;
+  opt.workers = 1;
+  opt.sparse_k = SPARSE_K_DEFAULT;
+  
+  /* Start the clock for the summary */
+  start_ms = monoMillis();
   
   /* Check parameters */
   if (argc < 0) {
@@ -330,311 +5878,437 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* We need exactly one parameter beyond the module name */
-  if (argc != 2) {
-    fprintf(stderr, "Expecting exactly one parameter!\n");
+  /* Parse any options */
+  for(x = 1; status && (x < argc); x++) {
+    if (strcmp(argv[x], "-b") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing block size!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &block_mib)) ||
+                  (block_mib < BLOCK_MIB_MIN) ||
+                  (block_mib > BLOCK_MIB_MAX)) {
+        fprintf(stderr, "Invalid block size!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-q") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing read ring size!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &(opt.ahead))) ||
+                  (opt.ahead < AHEAD_MIN) || (opt.ahead > AHEAD_MAX)) {
+        fprintf(stderr, "Invalid read ring size!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--mmap") == 0) {
+      opt.use_mmap = 1;
+      
+    } else if (strcmp(argv[x], "--update") == 0) {
+      opt.update = 1;
+      
+    } else if (strcmp(argv[x], "--follow") == 0) {
+      opt.follow = 1;
+      
+    } else if (strcmp(argv[x], "-o") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing index path!\n");
+        status = 0;
+      } else {
+        opt.pOutPath = argv[x + 1];
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--no-tee") == 0) {
+      opt.tee = 0;
+      
+    } else if (strcmp(argv[x], "--summary") == 0) {
+      summary = 1;
+      
+    } else if (strcmp(argv[x], "--progress") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing progress interval!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &progress_sec)) ||
+                  (progress_sec < PROGRESS_SEC_MIN) ||
+                  (progress_sec > PROGRESS_SEC_MAX)) {
+        fprintf(stderr, "Invalid progress interval!\n");
+        status = 0;
+      } else {
+        opt.progress_ms = ((int64_t) progress_sec) * 1000;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--stats") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing stats path!\n");
+        status = 0;
+      } else {
+        pStats = argv[x + 1];
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "--rst") == 0) {
+      opt.rst = 1;
+      
+    } else if (strcmp(argv[x], "--recover") == 0) {
+      opt.recover = 1;
+      
+    } else if (strcmp(argv[x], "--hash") == 0) {
+      opt.hash = 1;
+      
+    } else if (strcmp(argv[x], "--dedup") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing dedup mode!\n");
+        status = 0;
+      } else if (strcmp(argv[x + 1], "flag") == 0) {
+        opt.dedup = DEDUP_FLAG;
+      } else if (strcmp(argv[x + 1], "drop") == 0) {
+        opt.dedup = DEDUP_DROP;
+      } else {
+        fprintf(stderr, "Unknown dedup mode!\n");
+        status = 0;
+      }
+      opt.hash = 1;
+      x++;
+      
+    } else if (strcmp(argv[x], "--batch") == 0) {
+      list = 1;
+      
+    } else if (strcmp(argv[x], "-f") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing index format!\n");
+        status = 0;
+      } else if (strcmp(argv[x + 1], "v1") == 0) {
+        opt.format = INDEX_V1;
+      } else if (strcmp(argv[x + 1], "v2") == 0) {
+        opt.format = INDEX_V2;
+      } else if (strcmp(argv[x + 1], "native") == 0) {
+        opt.format = INDEX_NATIVE;
+      } else if (strcmp(argv[x + 1], "sparse") == 0) {
+        opt.format = INDEX_SPARSE;
+      } else if (strcmp(argv[x + 1], "packed") == 0) {
+        opt.format = INDEX_PACKED;
+      } else {
+        fprintf(stderr, "Unknown index format!\n");
+        status = 0;
+      }
+      opt.format_set = 1;
+      x++;
+      
+    } else if (strcmp(argv[x], "-k") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing checkpoint interval!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &(opt.sparse_k))) ||
+                  (opt.sparse_k < 1) ||
+                  (opt.sparse_k > INDEX_SPARSE_K_MAX)) {
+        fprintf(stderr, "Invalid checkpoint interval!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-j") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing worker count!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &(opt.workers))) ||
+                  (opt.workers < 1) || (opt.workers > WORKER_MAX)) {
+        fprintf(stderr, "Invalid worker count!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else if (strcmp(argv[x], "-P") == 0) {
+      if (x >= argc - 1) {
+        fprintf(stderr, "Missing file count!\n");
+        status = 0;
+      } else if ((!parseInt(argv[x + 1], &files)) ||
+                  (files < 1) || (files > WORKER_MAX)) {
+        fprintf(stderr, "Invalid file count!\n");
+        status = 0;
+      }
+      x++;
+      
+    } else {
+      break;
+    }
+  }
+  
+  /* The read ring only reads blocks up to the end of input, once */
+  if (status && (opt.ahead > 0) &&
+      (opt.use_mmap || (opt.workers > 1) || opt.follow)) {
+    fprintf(stderr, "-q can't be combined with --mmap, -j, or --follow!\n");
     status = 0;
   }
   
-  /* Generate the index file name */
-  if (status) {
-    pIPath = suffix(argv[1], ".index");
+  /* Following requires reading in blocks */
+  if (status && opt.follow && (opt.use_mmap || (opt.workers > 1))) {
+    fprintf(stderr, "--follow can't be combined with --mmap or -j!\n");
+    status = 0;
   }
   
-  /* Open the provided file for reading */
-  if (status) {
-    fp = fopen(argv[1], "rb");
-    if (fp == NULL) {
-      fprintf(stderr, "Can't open input file!\n");
-      status = 0;
-    }
+  /* The sparse and packed checkpoint tables are only written once, at
+   * the end */
+  if (status &&
+      ((opt.format == INDEX_SPARSE) || (opt.format == INDEX_PACKED)) &&
+      (opt.update || opt.follow)) {
+    fprintf(stderr,
+      "Sparse and packed formats can't be combined with --update or "
+      "--follow!\n");
+    status = 0;
   }
   
-  /* Open the index file for writing */
-  if (status) {
-    fi = fopen(pIPath, "wb");
-    if (fi == NULL) {
-      fprintf(stderr, "Can't create index file!\n");
-      status = 0;
-    }
+  /* The restart index is only written in a single sequential pass */
+  if (status && opt.rst && (opt.update || (opt.workers > 1))) {
+    fprintf(stderr, "--rst can't be combined with --update or -j!\n");
+    status = 0;
   }
   
-  /* Write a zero at the start of the index file for now -- we will fill
-   * it in with the frame count at the end */
-  if (status) {
-    writeInt64BE(fi, 0);
+  /* Hashes only make sense with frame lengths, which only the v2 format
+   * records */
+  if (status && opt.hash && (opt.format != INDEX_V2)) {
+    fprintf(stderr, "--hash and --dedup need the v2 format!\n");
+    status = 0;
+  }
+  
+  /* The workers must find exactly the frames of a sequential scan */
+  if (status && opt.recover && (opt.workers > 1)) {
+    fprintf(stderr, "--recover can't be combined with -j!\n");
+    status = 0;
+  }
+  
+  /* Parallel indexing requires the file to be mapped */
+  if (opt.workers > 1) {
+    opt.use_mmap = 1;
   }
+  opt.block_size = ((size_t) block_mib) * 1024 * 1024;
   
-  /* Read and report all markers */
-  while (status) {
+  /* More than one parameter, or a list of them, means a batch */
+  if (list || (argc - x > 1)) {
+    batch = 1;
+  }
+  
+  /* Index a single file */
+  if (status && (!batch)) {
     
-    /* Read a byte, leaving loop if EOF */
-    c = getc(fp);
-    read_count++;
-    if (c == EOF) {
-      if (feof(fp)) {
-        /* We are done reading all the markers -- make sure we read at
-         * least one marker and that the last marker we read was EOI */
-        if (eoi_read) {
-          break;
-        } else {
-          fprintf(stderr, "Missing EOI marker!\n");
-          status = 0;
-        }
-      
-      } else {
-        /* I/O error */
-        fprintf(stderr, "I/O error!\n");
+    /* We need exactly one parameter beyond the options */
+    if (x != argc - 1) {
+      fprintf(stderr, "Expecting exactly one parameter!\n");
+      status = 0;
+    }
+    if (status) {
+      if (strcmp(argv[x], "-") == 0) {
+        opt.use_stdin = 1;
+      }
+    }
+    
+    /* Standard input can only be read in blocks from the start */
+    if (status && opt.use_stdin) {
+      if (opt.use_mmap || opt.update || opt.follow) {
+        fprintf(stderr,
+          "Standard input can't be combined with --mmap, -j, --update, "
+          "or --follow!\n");
+        status = 0;
+      } else if (opt.pOutPath == NULL) {
+        fprintf(stderr, "Index path must be given with -o!\n");
         status = 0;
       }
     }
     
-    /* The byte we read must be 0xff, or the file is invalid */
+    /* Index the file with a pool of just one read buffer */
     if (status) {
-      if (c != JPEG_PREMARK) {
-        fprintf(stderr, "Missing pre-marker byte!\n");
+      poolInit(&pool, opt.block_size,
+                (opt.ahead >= AHEAD_MIN) ? (int) opt.ahead : 1);
+      pErr = indexFile(&opt, argv[x], &pool, &res);
+      poolFree(&pool);
+      if (pErr != NULL) {
+        fprintf(stderr, "%s\n", pErr);
         status = 0;
       }
     }
     
-    /* Read a sequence of zero or more 0xff bytes, until we get the
-     * actual marker byte; an EOF is an error here */
-    while (status) {
-      
-      /* Read another byte */
-      c = getc(fp);
-      read_count++;
-      if (c == EOF) {
-        if (feof(fp)) {
-          /* EOF not allowed here */
-          fprintf(stderr, "Missing marker byte!\n");
-          status = 0;
-          
-        } else {
-          /* I/O error */
-          fprintf(stderr, "I/O error!\n");
-          status = 0;
-        }
+    /* Report the summary if requested */
+    if (status && summary) {
+      elapsed_ms = monoMillis() - start_ms;
+      if (elapsed_ms < 1) {
+        elapsed_ms = 1;
       }
-      
-      /* We're done if we got anything besides the pre-marker */
-      if (status && (c != JPEG_PREMARK)) {
+      fprintf(stderr,
+        "%ld frames (%ld new), %lld bytes read, %lld index bytes, "
+        "%.3f s, %.1f frames/s, %.1f MiB/s\n",
+        res.frame_count,
+        res.frame_count - res.old_count,
+        (long long) res.read_count,
+        (long long) res.index_bytes,
+        ((double) elapsed_ms) / 1000.0,
+        ((double) (res.frame_count - res.old_count)) * 1000.0 /
+          ((double) elapsed_ms),
+        (((double) res.read_count) / (1024.0 * 1024.0)) * 1000.0 /
+          ((double) elapsed_ms));
+    }
+    
+    /* Write the stats if requested */
+    if (status && (pStats != NULL)) {
+      elapsed_ms = monoMillis() - start_ms;
+      if (elapsed_ms < 1) {
+        elapsed_ms = 1;
+      }
+      if (!writeStats(pStats, &opt, argv[x], 0, 0, 0, &res, elapsed_ms)) {
+        fprintf(stderr, "Can't write stats file!\n");
+        status = 0;
+      }
+    }
+  }
+  
+  /* Batches can't follow, can't write every index to the same path,
+   * can't interleave progress reports of files, and can't read streams
+   * from standard input */
+  if (status && batch) {
+    if (opt.follow || (opt.pOutPath != NULL) || (opt.progress_ms > 0)) {
+      fprintf(stderr,
+        "--batch can't be combined with --follow, -o, or --progress!\n");
+      status = 0;
+    }
+  }
+  
+  /* Gather the paths of a batch, first from the command line and then
+   * from standard input if --batch was given, skipping blank lines */
+  if (status && batch) {
+    for(i = x; i < argc; i++) {
+      batchAdd(&bs, suffix(argv[i], ""));
+    }
+    while (list) {
+      pLine = readLine(stdin, &err);
+      if (pLine == NULL) {
         break;
       }
+      if (pLine[0] == 0) {
+        free(pLine);
+      } else {
+        batchAdd(&bs, pLine);
+      }
+      pLine = NULL;
     }
     
-    /* If the marker is SOI, then increment frame count, watching for
-     * overflow, and report a frame as beginning at the byte offset
-     * before this one (to include the 0xff byte before the SOI) */
-    if (status && (c == JPEG_SOI)) {
-      if (frame_count < LONG_MAX) {
-        frame_count++;
-        writeInt64BE(fi, read_count - 2);
-        
-      } else {
-        fprintf(stderr, "Too many frames!\n");
+    if (err) {
+      fprintf(stderr, "I/O error reading file list!\n");
+      status = 0;
+    } else if (bs.count < 1) {
+      fprintf(stderr, "No files to index!\n");
+      status = 0;
+    }
+    for(i = 0; status && (i < bs.count); i++) {
+      if (strcmp((bs.ppPath)[i], "-") == 0) {
+        fprintf(stderr, "Standard input can't be indexed in a batch!\n");
         status = 0;
       }
     }
+  }
+  
+  /* Index the batch with a pool of threads taking files in turn, each
+   * with a read buffer from a shared pool; if a thread can't be
+   * started, its share of the work falls to the others */
+  if (status && batch) {
+    if (files > bs.count) {
+      files = bs.count;
+    }
+    poolInit(&pool, opt.block_size,
+              (int) files * ((opt.ahead >= AHEAD_MIN) ? (int) opt.ahead : 1));
+    if (pthread_mutex_init(&(bs.lock), NULL)) {
+      abort();
+    }
+    bs.pOpt = &opt;
+    bs.pPool = &pool;
+    bs.next = 0;
     
-    /* If this is not a stand-alone marker, read two bytes to get the
-     * length of the data payload; else, zero out marker length */
-    if (status) {
-      if (!jpeg_isStandAlone(c)) {
-        
-        /* Read the first length byte */
-        c2 = getc(fp);
-        read_count++;
-        if (c2 == EOF) {
-          if (feof(fp)) {
-            /* EOF not allowed here */
-            fprintf(stderr, "Missing marker length!\n");
-            status = 0;
-            
-          } else {
-            /* I/O error */
-            fprintf(stderr, "I/O error!\n");
-            status = 0;
-          }
-        }
-        
-        /* Set marker length with first length byte */
-        if (status) {
-          mark_len = (((long) c2) << 8);
-        }
-        
-        /* Read the second length byte */
-        if (status) {
-          c2 = getc(fp);
-          read_count++;
-          if (c2 == EOF) {
-            if (feof(fp)) {
-              /* EOF not allowed here */
-              fprintf(stderr, "Partial marker length!\n");
-              status = 0;
-              
-            } else {
-              /* I/O error */
-              fprintf(stderr, "I/O error!\n");
-              status = 0;
-            }
-          }
-        }
-        
-        /* Get complete marker length, which must be at least two to
-         * account for the two length bytes */
-        if (status) {
-          mark_len |= ((long) c2);
-          if (mark_len < 2) {
-            fprintf(stderr, "Marker length less than two!\n");
-            status = 0;
-          }
-        }
-        
-        /* Subtract two from marker length because we've already read
-         * the length bytes */
-        if (status) {
-          mark_len -= 2;
+    pThreads = (pthread_t *) calloc((size_t) files, sizeof(pthread_t));
+    pStarted = (int *) calloc((size_t) files, sizeof(int));
+    if ((pThreads == NULL) || (pStarted == NULL)) {
+      abort();
+    }
+    for(i = 1; i < files; i++) {
+      if (pthread_create(&(pThreads[i]), NULL, &batchWorker, &bs) == 0) {
+        pStarted[i] = 1;
+      }
+    }
+    batchWorker(&bs);
+    for(i = 1; i < files; i++) {
+      if (pStarted[i]) {
+        if (pthread_join(pThreads[i], NULL)) {
+          abort();
         }
-        
-      } else {
-        /* Stand-alone marker -- set marker length to zero */
-        mark_len = 0;
+        pStarted[i] = 0;
       }
     }
     
-    /* If there is a data payload, skip over it */
-    if (status && (mark_len > 0)) {
-      if (fseeko(fp, (off_t) mark_len, SEEK_CUR)) {
-        fprintf(stderr, "Seek failed!\n");
-        status = 0;
-      } else {
-        read_count += (int64_t) mark_len;
-      }
-    }
-    
-    /* If we just read an SOS marker, we need to skip over compressed
-     * data, reporting any embedded markers along the way */
-    if (status && (c == JPEG_SOS)) {
-      while (status) {
-        
-        /* Read a character */
-        c2 = getc(fp);
-        read_count++;
-        if (c2 == EOF) {
-          if (feof(fp)) {
-            /* EOF not allowed here */
-            fprintf(stderr, "EOF in compressed stream!\n");
-            status = 0;
-            
-          } else {
-            /* I/O error */
-            fprintf(stderr, "I/O error!\n");
-            status = 0;
-          }
-        }
-        
-        /* If we read anything but JPEG_PREMARK, go to next character */
-        if (status && (c2 != JPEG_PREMARK)) {
-          continue;
-        }
-        
-        /* We read the JPEG_PREMARK character -- keep reading until we
-         * get the potential marker character */
-        while (status) {
-          
-          /* Read a character */
-          c2 = getc(fp);
-          read_count++;
-          if (c2 == EOF) {
-            if (feof(fp)) {
-              /* EOF not allowed here */
-              fprintf(stderr, "EOF in compressed stream!\n");
-              status = 0;
-            
-            } else {
-              /* I/O error */
-              fprintf(stderr, "I/O error!\n");
-              status = 0;
-            }
-          }
-          
-          /* We are done if we read something besides the pre-marker */
-          if (status && (c2 != JPEG_PREMARK)) {
-            break;
-          }
-        }
-        
-        /* If the marker is zero, then ignore it and continue because
-         * this is simply an escape for 0xFF bytes within compressed
-         * data; if the marker is immediate, then proceed; if the marker
-         * is non-immediate, then backtrack to the last 0xFF byte and
-         * we're done
-         * 
-         * We also check for the immediate DNL and raise an error in
-         * that case because it's rarely used and it carries a data
-         * payload, which we don't support here for immediates */
-        if (status && (c2 != 0)) {
-          if (jpeg_isImmediate(c2)) {
-            /* Fail if DNL */
-            if (c2 == JPEG_DNL) {
-              fprintf(stderr, "DNL markers not supported!\n");
-              status = 0;
-            }
-          
-          } else {
-            /* Not immediate -- backtrack two bytes to the last 0xFF
-             * character and then we're done */
-            if (fseeko(fp, (off_t) -2, SEEK_CUR)) {
-              fprintf(stderr, "Seek failed!\n");
-              status = 0;
-            } else {
-              read_count -= 2;
-            }
-            break;
-          }
-        }
+    free(pThreads);
+    pThreads = NULL;
+    free(pStarted);
+    pStarted = NULL;
+    poolFree(&pool);
+    pthread_mutex_destroy(&(bs.lock));
+    
+    /* Report the summary if requested */
+    if (summary) {
+      elapsed_ms = monoMillis() - start_ms;
+      if (elapsed_ms < 1) {
+        elapsed_ms = 1;
       }
+      fprintf(stderr,
+        "%ld files (%ld failed), %ld frames, %lld bytes read, "
+        "%lld index bytes, %.3f s, %.1f frames/s, %.1f MiB/s\n",
+        bs.count,
+        bs.failed,
+        bs.frames,
+        (long long) bs.read_count,
+        (long long) bs.index_bytes,
+        ((double) elapsed_ms) / 1000.0,
+        ((double) bs.frames) * 1000.0 / ((double) elapsed_ms),
+        (((double) bs.read_count) / (1024.0 * 1024.0)) * 1000.0 /
+          ((double) elapsed_ms));
     }
     
-    /* Set EOI flag if we just read EOF, else clear it */
-    if (status) {
-      if (c == JPEG_EOI) {
-        eoi_read = 1;
-      } else {
-        eoi_read = 0;
+    /* Write the stats if requested, with the batch totals as the
+     * result */
+    if (pStats != NULL) {
+      elapsed_ms = monoMillis() - start_ms;
+      if (elapsed_ms < 1) {
+        elapsed_ms = 1;
+      }
+      res.frame_count = bs.frames;
+      res.old_count = 0;
+      res.read_count = bs.read_count;
+      res.index_bytes = bs.index_bytes;
+      res.io_us = bs.io_us;
+      res.parse_us = bs.parse_us;
+      res.skipped_ranges = bs.skipped_ranges;
+      res.skipped_bytes = bs.skipped_bytes;
+      res.dup_frames = bs.dup_frames;
+      if (!writeStats(pStats, &opt, NULL, bs.count, bs.failed, files,
+                      &res, elapsed_ms)) {
+        fprintf(stderr, "Can't write stats file!\n");
+        status = 0;
       }
     }
+    
+    /* The batch fails if any file failed */
+    if (bs.failed > 0) {
+      fprintf(stderr, "%ld of %ld files failed!\n", bs.failed, bs.count);
+      status = 0;
+    }
   }
   
-  /* Must have at least one frame */
-  if (status && (frame_count < 1)) {
-    status = 0;
-    fprintf(stderr, "No frames found!\n");
-  }
-  
-  /* Rewind index file and write the number of frames */
-  if (status) {
-    rewind(fi);
-    writeInt64BE(fi, frame_count);
-  }
-  
-  /* Close index file if open */
-  if (fi != NULL) {
-    fclose(fi);
-    fi = NULL;
-  }
-  
-  /* Close JPEG file if open */
-  if (fp != NULL) {
-    fclose(fp);
-    fp = NULL;
-  }
-  
-  /* Free index path string if allocated */
-  if (pIPath != NULL) {
-    free(pIPath);
-    pIPath = NULL;
+  /* Free the batch paths, if any */
+  if (bs.ppPath != NULL) {
+    for(i = 0; i < bs.count; i++) {
+      free((bs.ppPath)[i]);
+      (bs.ppPath)[i] = NULL;
+    }
+    free(bs.ppPath);
+    bs.ppPath = NULL;
   }
   
   /* Invert status and return */
@@ -25,6 +25,53 @@
    */
   var MAX_IVAL = 9007199254740991;
 
+  /*
+   * The script that loads index files, as a Web Worker or in the page.
+   */
+  var WORKER_URL = "mjpg_view_worker.js";
+  
+  /*
+   * The most memory in bytes that the decoded frames in m_cache may
+   * take, counting four bytes per pixel.  This holds about seven
+   * frames of 4K video, or about sixty of 1080p.
+   */
+  var CACHE_BYTES = 268435456;
+  
+  /*
+   * How many frames to decode ahead of the current frame, in the
+   * direction that the position last moved in.  This is also the most
+   * frames that are decoded ahead at the same time.
+   */
+  var CACHE_AHEAD = 4;
+  
+  /*
+   * When there is no index file, the smallest byte range of the M-JPEG
+   * file that is given to each worker scanning it, and the most workers
+   * to use.
+   */
+  var SCAN_MIN_RANGE = 16777216;
+  var SCAN_WORKERS_MAX = 8;
+  
+  /*
+   * The most frames that playback may widen the read-ahead to, in
+   * place of CACHE_AHEAD, when decoding falls behind.  See m_ahead.
+   */
+  var PLAY_AHEAD_MAX = 16;
+  
+  /*
+   * The frame rate used if the frame rate box doesn't have a valid
+   * value, and the range of valid values.
+   */
+  var PLAY_FPS = 30;
+  var PLAY_FPS_MIN = 1;
+  var PLAY_FPS_MAX = 240;
+  
+  /*
+   * How often in milliseconds the playback counter is updated, and the
+   * read-ahead is narrowed again if no frames were late.
+   */
+  var PLAY_STAT_MS = 1000;
+  
   /*
    * Local data
    * ==========
@@ -45,15 +92,60 @@
    * 
    * This is a non-empty array, where each element is a byte offset
    * within the file stored at m_mjpg, indicating the start of a JPEG
-   * frame within that stream.
+   * frame within that stream.  Use frameOffset() to read it, because
+   * for a sparse or packed index, it is the object made by
+   * parseIndexSparse(), which only has a length and decodes offsets on
+   * demand; otherwise, it is a Float64Array made by the index loader.
+   * 
+   * While the rest of the index is still loading, this only has the
+   * first frame, so that it can be shown straight away.
    * 
    * Indices are in strictly ascending order.  Frame N starts at the
    * byte with offset [N] in the array, and ends one byte before the
-   * start of the next frame, ([N + 1] - 1).  For the last frame, the
-   * frame ends at the end of the M-JPEG stream.
+   * offset returned by frameEnd().
    */
   var m_index;
   
+  /*
+   * The end of each frame in m_index, only if m_loaded.
+   * 
+   * Each element is the byte offset just after the last byte of the
+   * frame, which comes from the frame length in a v2 index.  For the
+   * other formats, this is false instead, and each frame ends where
+   * the next frame starts, with the last frame ending at the end of
+   * the M-JPEG stream.  While the rest of the index is still loading,
+   * this is an array with the end of the first frame.
+   */
+  var m_ends;
+  
+  /*
+   * True while m_index only has the first frame, and the rest of the
+   * index is still loading.
+   */
+  var m_partial = false;
+  
+  /*
+   * If the index was built by scanning the M-JPEG file, because there
+   * was no index file, the frame information found by the scan, so that
+   * a v2 index file can be saved; otherwise, false.
+   * 
+   * This is a Uint16Array with seven elements for each frame: the
+   * width, height, components, SOF type, restart interval, scans, and
+   * flags, as in a v2 record.
+   */
+  var m_info = false;
+  
+  /*
+   * The Web Workers loading or building the index, if any.
+   */
+  var m_workers = [];
+  
+  /*
+   * A number that changes whenever an index load starts or is
+   * cancelled, so that a load can tell whether it is still wanted.
+   */
+  var m_load_id = 0;
+  
   /*
    * The current, zero-based frame index, only if m_loaded.
    * 
@@ -65,7 +157,8 @@
   var m_pos;
   
   /*
-   * The object URL to the current frame JPEG blob, only if m_loaded.
+   * The object URL to the current frame JPEG blob, only if m_loaded and
+   * frames are shown in an <img> because m_decode is false.
    * 
    * Don't forget to revoke this when appropriate.
    * 
@@ -74,10 +167,109 @@
   var m_url;
   
   /*
-   * Flag set to true when in the midst of processing a scrub event, to
-   * prevent recursive invocations of the event handler.
+   * True if the browser can decode frames with createImageBitmap(), in
+   * which case frames are decoded into m_cache and drawn on a <canvas>.
+   * Otherwise, each frame is shown in an <img> from m_url.
+   */
+  var m_decode = (typeof createImageBitmap === "function");
+  
+  /*
+   * The cache of decoded frames, ordered from least to most recently
+   * used.
+   * 
+   * Each element has the frame index "i", the ImageBitmap "bmp", or
+   * false while it is still decoding, and "bytes", the memory that the
+   * bitmap takes, which is zero while it is decoding.  See cacheLoad().
+   */
+  var m_cache = [];
+  
+  /*
+   * The total bytes of all the elements of m_cache.
+   */
+  var m_cache_bytes = 0;
+  
+  /*
+   * The number of elements of m_cache still decoding.
+   */
+  var m_decoding = 0;
+  
+  /*
+   * A number that changes whenever m_cache is cleared, so a decode that
+   * finishes afterwards can tell that its frame is no longer wanted.
+   */
+  var m_cache_id = 0;
+  
+  /*
+   * The direction that the position last moved in, 1 for forwards or
+   * -1 for backwards, which is the direction that cacheAhead() reads
+   * ahead in.
+   */
+  var m_dir = 1;
+  
+  /*
+   * The latest frame position asked for by the scrub slider, which is
+   * shown by showWanted() at the next animation frame, or -1 if none.
+   */
+  var m_want = -1;
+  
+  /*
+   * True if showWanted() is scheduled for the next animation frame.
+   */
+  var m_raf = false;
+  
+  /*
+   * The current frame if it is still decoding, or else -1.
+   * 
+   * While the current frame decodes, m_want waits for it rather than
+   * starting another decode, so that there is only ever one decode in
+   * flight for the scrub slider, and the delay before the latest
+   * position is shown is at most two decodes however fast the slider
+   * moves.
+   */
+  var m_wait = -1;
+  
+  /*
+   * How many frames cacheAhead() reads ahead, and how many decodes it
+   * lets run at once.
+   * 
+   * This is CACHE_AHEAD, except during playback, which widens it by one
+   * for each frame that isn't decoded in time, up to PLAY_AHEAD_MAX or
+   * as many frames as fit in the cache, and narrows it by one for each
+   * PLAY_STAT_MS with no late frames.
+   */
+  var m_ahead = CACHE_AHEAD;
+  
+  /*
+   * True while playing.
+   */
+  var m_playing = false;
+  
+  /*
+   * The frame rate that playback is aiming for.
+   */
+  var m_fps = PLAY_FPS;
+  
+  /*
+   * The time in milliseconds from playNow() when playback last started
+   * or changed frame rate, and the frame that was current then.  The
+   * frame that should be showing at any time is worked out from these,
+   * so that playback keeps time rather than drifting when frames are
+   * late.
+   */
+  var m_play_time;
+  var m_play_first;
+  
+  /*
+   * The playback counters: the time in milliseconds from playNow() when
+   * the counters were last shown, the frames shown since then, whether
+   * any frames were late since then, and the frames dropped since
+   * playback started.
    */
-  var m_scrubbing = false;
+  var m_stat_time;
+  var m_stat_shown;
+  var m_stat_late;
+  var m_stat_dropped;
+  
 
   /*
    * Local functions
@@ -250,9 +442,8 @@
   }
 
   /*
-   * Given a DataView on top of the index file, read the 64-bit entry
-   * number (i) from the view, where zero is the first 64-bit integer,
-   * one is the second 64-bit integer, and so forth.
+   * Given a DataView on top of the index file, read the big-endian
+   * 64-bit unsigned integer starting at byte offset (ofs).
    * 
    * This function doesn't check its input parameters, so be careful.
    * 
@@ -267,200 +458,1490 @@
    * 
    *   dv - the DataView
    * 
-   *   i - the integer index to read
+   *   ofs - the byte offset to read from
    * 
    * Return:
    * 
    *   the integer value, or -1 if the value stored can't be represented
    *   as a JavaScript numeric value
    */
-  function readIndexValue(dv, i) {
+  function readUint64(dv, ofs) {
     
     var a, b;
     
-    // Get the most-significant unsigned 32-bit value in "a" and the 
+    // Get the most-significant unsigned 32-bit value in "a" and the
     // least-significant unsigned 32-bit value in "b"; use big endian
     // ordering for both
-    a = dv.getUint32(i * 8, false);
-    b = dv.getUint32((i * 8) + 4, false);
-
+    a = dv.getUint32(ofs, false);
+    b = dv.getUint32(ofs + 4, false);
+    
     // We only have room in the range for 21 bits in the most
     // significant dword; otherwise, return -1
     if (a > 2097151) {
       return -1;
     }
     
-    // Range is fine, so combine into one value
-    return ((a << 32) | b);
+    // Range is fine, so combine into one value; this has to use
+    // floating-point arithmetic, since bitwise operators in JavaScript
+    // only work on 32 bits
+    return ((a * 4294967296) + b);
   }
-
+  
   /*
-   * Update the current frame position.
+   * Get the byte offset of the start of a frame in m_index.
    * 
-   * i is the new frame position index.  It must be a number, but may
-   * have any numeric value, including non-finite values.
+   * Parameters:
    * 
-   * This call will be ignored if no video is currently loaded.  The
-   * call will also be ignored if there is no actual change in position.
+   *   i - the frame index, which must be in range
    * 
-   * The given frame position is first floored to an integer.  Then, it
-   * is changed to zero if it is not finite.  Finally, it is clamped so
-   * that it is in valid frame index range.
+   * Return:
    * 
-   * Internal state will be updated to display the requested frame.  The
-   * status box will be updated to show the current position, the frame
-   * viewer will be displayed if currently hidden, and an <img> element
-   * will be added to the viewer showing the current frame.  This also
-   * handles showing and updating the navigation box.
+   *   the byte offset of the frame, as a Number
+   */
+  function frameOffset(i) {
+    if (m_index.sparse) {
+      return sparseOffset(m_index, i);
+    }
+    return m_index[i];
+  }
+  
+  /*
+   * Get the byte offset just after the end of a frame in m_index.
    * 
    * Parameters:
    * 
-   *   i : Number - the requested frame index
+   *   i - the frame index, which must be in range
+   * 
+   * Return:
+   * 
+   *   the byte offset after the end of the frame, as a Number
    */
-  function updatePos(i) {
-    
-    var func_name = "updatePos";
-    var eDIV, eIMG, eTrack, e, f_begin, f_end;
-    
-    // Check parameter
-    if (typeof(i) !== "number") {
-      fault(func_name, 100);
-    }
-    
-    // If nothing loaded, ignore this call
-    if (!m_loaded) {
-      return;
-    }
-
-    // Begin by correcting the value
-    i = Math.floor(i);
-    if (!isFinite(i)) {
-      i = 0;
+  function frameEnd(i) {
+    if (m_ends) {
+      return m_ends[i];
     }
-    i = Math.min(Math.max(i, 0), m_index.length - 1);
-
-    // Ignore the call if there has been no change in position
-    if (m_pos === i) {
-      return;
+    if (i < m_index.length - 1) {
+      return frameOffset(i + 1);
     }
+    return m_mjpg.size;
+  }
+  
+  /*
+   * Parse a sparse or packed index file.
+   * 
+   * The sparse index has a header with the checkpoint interval, frame
+   * count, and the position of the checkpoint table at the end of the
+   * file.  Each checkpoint has the offset of the first frame in a group
+   * and the position of the varint deltas for the rest of the group.
+   * Only the checkpoints are read here, into plain arrays; the deltas
+   * stay in the index file data and are decoded a group at a time by
+   * sparseOffset(), so the memory used is only a little more than the
+   * index file itself.
+   * 
+   * The packed index is the same, except that each checkpoint also has
+   * the base and the bit size of the residuals that the deltas of its
+   * group are packed as.  Bit sizes over 53 are rejected, since the
+   * residuals wouldn't fit in a Number.
+   * 
+   * Parameters:
+   * 
+   *   dv - the DataView on top of the whole index file
+   * 
+   *   fsize - the size in bytes of the M-JPEG file
+   * 
+   *   packed - true if this is a packed index
+   * 
+   * Return:
+   * 
+   *   an object with "index" and "ends" in the format of m_index and
+   *   m_ends, or an integer error code if the index is not valid
+   */
+  function parseIndexSparse(dv, fsize, packed) {
     
-    // Get the point tracker DIV
-    eTrack = document.getElementById("divPointTrack");
-    if (eTrack == null) {
-      fault(func_name, 190);
-    }
+    var hsize, k, arl, tpos, groups, csize, co, cp, cb, cw, i, ofs;
     
-    // Get the image viewer DIV
-    eDIV = document.getElementById("divImage");
-    if (eDIV == null) {
-      fault(func_name, 200);
+    // Header must be present
+    if (dv.byteLength < 32) {
+      return 12;
     }
     
-    // If nothing in image viewer DIV, add an <img> and add an event
-    // handler that updates the point tracker whenever the frame is
-    // clicked
-    if (!eDIV.hasChildNodes()) {
-      eIMG = document.createElement("img");
-      eIMG.onclick = function(ev) {
-        var img_x, img_y, clr;
-        
-        // Get position of image element in client space
-        clr = eIMG.getBoundingClientRect();
-        
-        // Compute click position relative to the bounding rect
-        img_x = ev.clientX - clr.left;
-        img_y = ev.clientY - clr.top;
-        
-        // Floor to integers
-        img_x = Math.floor(img_x);
-        img_y = Math.floor(img_y);
-        
-        // Update the tracking DIV
-        eTrack.innerHTML = "(" + img_x + ", " + img_y + ")";
-      };
-      eDIV.appendChild(eIMG);
+    // Get the header fields
+    hsize = dv.getUint32(8, false);
+    k = dv.getUint32(12, false);
+    arl = readUint64(dv, 16);
+    tpos = readUint64(dv, 24);
+    if ((hsize < 32) || (k < 1) || (k > 65536) || (arl < 1) ||
+        (tpos < hsize) || (tpos > dv.byteLength)) {
+      return 13;
     }
     
-    // Get the <img> element, which is the child of the image viewer DIV
-    eIMG = eDIV.firstChild;
-    
-    // Unles m_pos is the special initial value of -1, begin by revoking
-    // the current object URL
-    if (m_pos >= 0) {
-      URL.revokeObjectURL(m_url);
-      m_url = false;
+    // The checkpoint table must run to the end of the file
+    groups = Math.ceil(arl / k);
+    csize = packed ? 32 : 16;
+    if (tpos + (groups * csize) !== dv.byteLength) {
+      return 14;
     }
     
-    // Determine the beginning and end of the requested frame; the end
-    // is the byte offset AFTER the last byte
-    f_begin = m_index[i];
-    if (i < m_index.length - 1) {
-      f_end = m_index[i + 1];
-    } else {
-      f_end = m_mjpg.size;
+    // Read the checkpoints, checking that the offsets are strictly
+    // ascending and within the M-JPEG file, and the delta positions
+    // ascending and before the table
+    co = new Array(groups);
+    cp = new Array(groups);
+    cb = new Array(groups);
+    cw = new Array(groups);
+    for(i = 0; i < groups; i++) {
+      ofs = tpos + (i * csize);
+      co[i] = readUint64(dv, ofs);
+      cp[i] = readUint64(dv, ofs + 8);
+      cb[i] = 0;
+      cw[i] = 0;
+      if (packed) {
+        cb[i] = readUint64(dv, ofs + 16);
+        cw[i] = dv.getUint8(ofs + 24);
+      }
+      if ((co[i] < 0) || (co[i] >= fsize) ||
+          (cp[i] < hsize) || (cp[i] > tpos) ||
+          (cb[i] < 0) || (cw[i] > 53)) {
+        return 15;
+      }
+      if (i > 0) {
+        if (!((co[i - 1] < co[i]) && (cp[i - 1] <= cp[i]))) {
+          return 5;
+        }
+      }
     }
-
-    // Update the internal state
-    m_pos = i;
-    m_url = URL.createObjectURL(
-                  m_mjpg.slice(f_begin, f_end, "image/jpeg"));
     
-    // Update the <img> src for the current frame
-    eIMG.setAttribute("src", m_url);
+    return {
+      "index": {
+        "sparse": true,
+        "packed": packed,
+        "length": arl,
+        "dv": dv,
+        "k": k,
+        "tpos": tpos,
+        "co": co,
+        "cp": cp,
+        "cb": cb,
+        "cw": cw,
+        "group": -1,
+        "offs": []
+      },
+      "ends": false
+    };
+  }
+  
+  /*
+   * Get a frame offset from a sparse or packed index.
+   * 
+   * The group holding the frame is decoded unless it was the last group
+   * decoded, so stepping through frames only decodes each group once.
+   * Varints and packed residuals are decoded with multiplication rather
+   * than shifts, since bitwise operators only work on 32 bits.  If the
+   * group doesn't decode properly, -1 is returned, which updatePos()
+   * reports.
+   * 
+   * Parameters:
+   * 
+   *   sp - the index object from parseIndexSparse()
+   * 
+   *   i - the frame index, which must be in range
+   * 
+   * Return:
+   * 
+   *   the byte offset of the frame, or -1 if the index is not valid
+   */
+  function sparseOffset(sp, i) {
+    
+    var g, n, p, end, next, mul, b, d, j, w, bit, offs;
     
-    // Update the scrub slider
-    e = document.getElementById("rngScrub");
-    if (e == null) {
-      fault(func_name, 300);
-    }
-    if (m_index.length > 1) {
-      // More than one frame, so update slider appropriately
-      e.value = 0;
-      e.min = 0;
-      e.max = m_index.length - 1;
-      e.value = m_pos;
+    // Decode the group if it isn't the last one decoded
+    g = Math.floor(i / sp.k);
+    if (sp.group !== g) {
       
-    } else {
-      // Only a single frame, so we just define a dummy slider
-      e.value = 0;
-      e.min = 0;
-      e.max = 1;
+      // Find the deltas and frame count of the group, and the offset
+      // of the next group
+      p = sp.cp[g];
+      if (g < sp.co.length - 1) {
+        end = sp.cp[g + 1];
+        next = sp.co[g + 1];
+        n = sp.k;
+      } else {
+        end = sp.tpos;
+        next = MAX_IVAL;
+        n = sp.length - (g * sp.k);
+      }
+      
+      // Packed residuals take an exact number of bytes, counting bits
+      // from the start of the group
+      if (sp.packed) {
+        if (end - p !== Math.ceil(((n - 1) * sp.cw[g]) / 8)) {
+          return -1;
+        }
+        bit = p * 8;
+      }
+      
+      // Sum the deltas, making sure each varint is complete, each
+      // offset is before the next group, and the deltas use up exactly
+      // the bytes of the group
+      offs = [sp.co[g]];
+      for(j = 1; j < n; j++) {
+        d = 0;
+        mul = 1;
+        if (sp.packed) {
+          for(w = 0; w < sp.cw[g]; w++) {
+            b = sp.dv.getUint8(Math.floor(bit / 8));
+            d = d + (((b >> (bit % 8)) & 1) * mul);
+            mul = mul * 2;
+            bit++;
+          }
+          d = d + sp.cb[g];
+          
+        } else {
+          do {
+            if ((p >= end) || (mul > MAX_IVAL)) {
+              return -1;
+            }
+            b = sp.dv.getUint8(p);
+            p++;
+            d = d + ((b & 0x7f) * mul);
+            mul = mul * 128;
+          } while (b & 0x80);
+        }
+        
+        offs.push(offs[j - 1] + d);
+        if ((d < 1) || (offs[j] >= next)) {
+          return -1;
+        }
+      }
+      if ((!sp.packed) && (p !== end)) {
+        return -1;
+      }
+      
+      sp.group = g;
+      sp.offs = offs;
     }
     
-    // Show image viewer, point tracking, and navigation boxes if not
-    // already displayed
-    appear("divImage");
-    appear("divPointTrack");
-    appear("divNav");
-    
-    // Update status
-    setStatus("Frame " + i + " / " + (m_index.length - 1));
+    return sp.offs[i - (g * sp.k)];
   }
-
-  /*
-   * Public functions
-   * ================
-   */
-
+  
   /*
-   * Invoked when the user clicks the "Close" button, and also to close
-   * any currently loaded video before a new video is loaded.
+   * Get the JPEG blob of a frame in m_index.
    * 
-   * Also used when starting up to set initial state.
+   * Sparse and packed indexes are only checked here, so this makes sure
+   * that the frame is within the M-JPEG file.
+   * 
+   * Parameters:
+   * 
+   *   i - the frame index, which must be in range
+   * 
+   * Return:
+   * 
+   *   the Blob of the frame, or false if the index gives invalid bounds
    */
-  function close() {
+  function frameBlob(i) {
     
-    var func_name = "close";
-    var eDIV;
+    var f_begin, f_end;
     
-    // Get the image viewer DIV
-    eDIV = document.getElementById("divImage");
-    if (eDIV == null) {
-      fault(func_name, 100);
+    // Determine the beginning and end of the requested frame; the end
+    // is the byte offset AFTER the last byte
+    f_begin = frameOffset(i);
+    f_end = frameEnd(i);
+    if (!((f_begin >= 0) && (f_begin < f_end) &&
+          (f_end <= m_mjpg.size))) {
+      return false;
     }
     
-    // Clear contents of image viewer
-    while (eDIV.hasChildNodes()) {
+    return m_mjpg.slice(f_begin, f_end, "image/jpeg");
+  }
+  
+  /*
+   * Find a frame in m_cache.
+   * 
+   * Parameters:
+   * 
+   *   i - the frame index
+   * 
+   * Return:
+   * 
+   *   the index of the element in m_cache, or -1 if not cached
+   */
+  function cacheFind(i) {
+    var k;
+    for(k = 0; k < m_cache.length; k++) {
+      if (m_cache[k].i === i) {
+        return k;
+      }
+    }
+    return -1;
+  }
+  
+  /*
+   * Check whether a decoded frame is still wanted in m_cache.
+   * 
+   * A frame is wanted if it is the current frame, or one of the frames
+   * that cacheAhead() reads ahead from the current frame.  Decodes that
+   * finish for frames that are no longer wanted, which happens when the
+   * slider moves on while they decode, are thrown away rather than
+   * pushing wanted frames out of the cache.
+   * 
+   * Parameters:
+   * 
+   *   i - the frame index
+   * 
+   * Return:
+   * 
+   *   true if the frame is wanted
+   */
+  function cacheWanted(i) {
+    var n;
+    n = (i - m_pos) * m_dir;
+    return ((n >= 0) && (n <= m_ahead));
+  }
+  
+  /*
+   * Evict the least recently used frames from m_cache until it is
+   * within CACHE_BYTES, closing their bitmaps.
+   * 
+   * The current frame and frames still decoding are never evicted.
+   */
+  function cacheTrim() {
+    
+    var k;
+    
+    k = 0;
+    while ((m_cache_bytes > CACHE_BYTES) && (k < m_cache.length)) {
+      if ((m_cache[k].bmp === false) || (m_cache[k].i === m_pos)) {
+        k++;
+        continue;
+      }
+      m_cache[k].bmp.close();
+      m_cache_bytes -= m_cache[k].bytes;
+      m_cache.splice(k, 1);
+    }
+  }
+  
+  /*
+   * Close all the frames in m_cache and empty it.
+   */
+  function cacheClear() {
+    var k;
+    for(k = 0; k < m_cache.length; k++) {
+      if (m_cache[k].bmp !== false) {
+        m_cache[k].bmp.close();
+      }
+    }
+    m_cache = [];
+    m_cache_bytes = 0;
+    m_decoding = 0;
+    m_cache_id++;
+    m_dir = 1;
+    m_want = -1;
+    m_wait = -1;
+  }
+  
+  /*
+   * Draw a decoded frame on the <canvas> in the image viewer.
+   * 
+   * The canvas is resized to the frame if necessary.
+   * 
+   * Parameters:
+   * 
+   *   bmp - the ImageBitmap of the frame
+   */
+  function drawFrame(bmp) {
+    
+    var func_name = "drawFrame";
+    var eDIV, eCNV;
+    
+    eDIV = document.getElementById("divImage");
+    if (eDIV == null) {
+      fault(func_name, 100);
+    }
+    eCNV = eDIV.firstChild;
+    
+    if ((eCNV.width !== bmp.width) || (eCNV.height !== bmp.height)) {
+      eCNV.width = bmp.width;
+      eCNV.height = bmp.height;
+    }
+    eCNV.getContext("2d").drawImage(bmp, 0, 0);
+  }
+  
+  /*
+   * Make sure that a frame is in m_cache, or is being decoded into it,
+   * and mark it as the most recently used.
+   * 
+   * If the frame needs decoding, this starts decoding it in the
+   * background.  When it is done, it is drawn if it is the current
+   * frame by then, and m_cache is trimmed, or it is closed and dropped
+   * if cacheWanted() says it is no longer wanted.  If it can't be
+   * decoded, it is dropped from m_cache, and an error is shown if it is
+   * the current frame.  Either way, if this was m_wait, then m_want is
+   * scheduled.
+   * 
+   * Parameters:
+   * 
+   *   i - the frame index, which must be in range
+   * 
+   * Return:
+   * 
+   *   the element of m_cache, or false if the index gives invalid bounds
+   *   for the frame
+   */
+  function cacheLoad(i) {
+    
+    var k, blob, ent, id;
+    
+    // If already cached, move to the most recently used end
+    k = cacheFind(i);
+    if (k >= 0) {
+      ent = m_cache[k];
+      m_cache.splice(k, 1);
+      m_cache.push(ent);
+      return ent;
+    }
+    
+    // Get the frame data
+    blob = frameBlob(i);
+    if (!blob) {
+      return false;
+    }
+    
+    // Add a new element that is still decoding, and start decoding
+    ent = {"i": i, "bmp": false, "bytes": 0};
+    m_cache.push(ent);
+    m_decoding++;
+    
+    id = m_cache_id;
+    createImageBitmap(blob).then(function(bmp) {
+      if (id !== m_cache_id) {
+        bmp.close();
+        return;
+      }
+      m_decoding--;
+      decodeDone(i);
+      
+      if (!cacheWanted(i)) {
+        bmp.close();
+        m_cache.splice(m_cache.indexOf(ent), 1);
+        return;
+      }
+      
+      ent.bmp = bmp;
+      ent.bytes = bmp.width * bmp.height * 4;
+      m_cache_bytes += ent.bytes;
+      
+      if (m_pos === i) {
+        drawFrame(bmp);
+      }
+      cacheTrim();
+      
+    }, function() {
+      if (id !== m_cache_id) {
+        return;
+      }
+      m_decoding--;
+      decodeDone(i);
+      
+      m_cache.splice(m_cache.indexOf(ent), 1);
+      if (m_pos === i) {
+        setStatus("ERROR: Can't decode frame " + i + "!");
+      }
+    });
+    
+    return ent;
+  }
+  
+  /*
+   * Decode the frames ahead of the current frame into m_cache, in the
+   * direction m_dir.
+   * 
+   * Up to m_ahead frames are read ahead, stopping early if that many
+   * are already decoding.  Frames that are already cached are
+   * marked as recently used so that they stay.
+   */
+  function cacheAhead() {
+    
+    var n, j;
+    
+    for(n = 1; n <= m_ahead; n++) {
+      j = m_pos + (n * m_dir);
+      if ((j < 0) || (j >= m_index.length)) {
+        break;
+      }
+      if ((cacheFind(j) < 0) && (m_decoding >= m_ahead)) {
+        break;
+      }
+      if (!cacheLoad(j)) {
+        break;
+      }
+    }
+  }
+  
+  /*
+   * Called when a frame has finished decoding, whether or not it could
+   * be decoded.
+   * 
+   * If it was m_wait, the wait is over, and showWanted() is scheduled if
+   * m_want is waiting.
+   * 
+   * Parameters:
+   * 
+   *   i - the frame index
+   */
+  function decodeDone(i) {
+    if (m_wait === i) {
+      m_wait = -1;
+      if (m_want >= 0) {
+        wantPos(m_want);
+      }
+    }
+  }
+  
+  /*
+   * Ask for a frame position to be shown at the next animation frame.
+   * 
+   * Only the latest position asked for before the animation frame is
+   * shown, so any number of slider events only cost one update.
+   * 
+   * Parameters:
+   * 
+   *   i : Number - the requested frame index, as for updatePos()
+   */
+  function wantPos(i) {
+    m_want = i;
+    if (!m_raf) {
+      m_raf = true;
+      if (typeof requestAnimationFrame === "function") {
+        requestAnimationFrame(showWanted);
+      } else {
+        setTimeout(showWanted, 16);
+      }
+    }
+  }
+  
+  /*
+   * Show m_want at an animation frame.
+   * 
+   * If the current frame is still decoding, m_want is left waiting
+   * unless it is already decoded, and decodeDone() schedules this again
+   * when the decode finishes.
+   */
+  function showWanted() {
+    
+    var k;
+    
+    m_raf = false;
+    if (m_want < 0) {
+      return;
+    }
+    
+    if (m_wait >= 0) {
+      k = cacheFind(m_want);
+      if ((k < 0) || (m_cache[k].bmp === false)) {
+        return;
+      }
+    }
+    
+    k = m_want;
+    m_want = -1;
+    updatePos(k);
+  }
+  
+  /*
+   * Update the current frame position.
+   * 
+   * i is the new frame position index.  It must be a number, but may
+   * have any numeric value, including non-finite values.
+   * 
+   * This call will be ignored if no video is currently loaded.  The
+   * call will also be ignored if there is no actual change in position.
+   * 
+   * The given frame position is first floored to an integer.  Then, it
+   * is changed to zero if it is not finite.  Finally, it is clamped so
+   * that it is in valid frame index range.
+   * 
+   * Internal state will be updated to display the requested frame.  The
+   * status box will be updated to show the current position, the frame
+   * viewer will be displayed if currently hidden, and a <canvas> or
+   * <img> element will be added to the viewer showing the current
+   * frame.  This also handles showing and updating the navigation box.
+   * 
+   * When frames are decoded into m_cache, the frame is drawn straight
+   * away if it is cached, or else as soon as it is decoded, and the
+   * frames after it in the direction of movement are decoded ahead so
+   * that scrubbing and stepping find them ready.
+   * 
+   * Event handlers should use wantPos() rather than calling this
+   * directly, so that fast events are coalesced.
+   * 
+   * Parameters:
+   * 
+   *   i : Number - the requested frame index
+   */
+  function updatePos(i) {
+    
+    var func_name = "updatePos";
+    var eDIV, eIMG, eTrack, blob, ent;
+    
+    // Check parameter
+    if (typeof(i) !== "number") {
+      fault(func_name, 100);
+    }
+    
+    // If nothing loaded, ignore this call
+    if (!m_loaded) {
+      return;
+    }
+
+    // Begin by correcting the value
+    i = Math.floor(i);
+    if (!isFinite(i)) {
+      i = 0;
+    }
+    i = Math.min(Math.max(i, 0), m_index.length - 1);
+
+    // Ignore the call if there has been no change in position
+    if (m_pos === i) {
+      return;
+    }
+    
+    // Get the requested frame, from the cache if decoding, or else as
+    // a blob
+    if (m_decode) {
+      ent = cacheLoad(i);
+    } else {
+      blob = frameBlob(i);
+      ent = blob;
+    }
+    if (!ent) {
+      setStatus("ERROR: Invalid frame " + i + " in index file!");
+      return;
+    }
+    
+    // Get the point tracker DIV
+    eTrack = document.getElementById("divPointTrack");
+    if (eTrack == null) {
+      fault(func_name, 190);
+    }
+    
+    // Get the image viewer DIV
+    eDIV = document.getElementById("divImage");
+    if (eDIV == null) {
+      fault(func_name, 200);
+    }
+    
+    // If nothing in image viewer DIV, add a <canvas> or <img> and add an
+    // event handler that updates the point tracker whenever the frame is
+    // clicked
+    if (!eDIV.hasChildNodes()) {
+      eIMG = document.createElement(m_decode ? "canvas" : "img");
+      eIMG.onclick = function(ev) {
+        var img_x, img_y, clr;
+        
+        // Get position of image element in client space
+        clr = eIMG.getBoundingClientRect();
+        
+        // Compute click position relative to the bounding rect
+        img_x = ev.clientX - clr.left;
+        img_y = ev.clientY - clr.top;
+        
+        // Floor to integers
+        img_x = Math.floor(img_x);
+        img_y = Math.floor(img_y);
+        
+        // Update the tracking DIV
+        eTrack.innerHTML = "(" + img_x + ", " + img_y + ")";
+      };
+      eDIV.appendChild(eIMG);
+    }
+    
+    // Get the <canvas> or <img> element, which is the child of the image
+    // viewer DIV
+    eIMG = eDIV.firstChild;
+    
+    if (m_decode) {
+      // Read ahead backwards if moving backwards, else forwards
+      if ((m_pos >= 0) && (i < m_pos)) {
+        m_dir = -1;
+      } else {
+        m_dir = 1;
+      }
+      
+      // Update the internal state and draw the frame if it is decoded
+      // already; otherwise, cacheLoad() draws it when it is, and until
+      // then the slider waits for it
+      m_pos = i;
+      if (ent.bmp !== false) {
+        drawFrame(ent.bmp);
+        m_wait = -1;
+      } else {
+        m_wait = i;
+      }
+      cacheAhead();
+      
+    } else {
+      // Unles m_pos is the special initial value of -1, begin by
+      // revoking the current object URL
+      if (m_pos >= 0) {
+        URL.revokeObjectURL(m_url);
+        m_url = false;
+      }
+      
+      // Update the internal state
+      m_pos = i;
+      m_url = URL.createObjectURL(blob);
+      
+      // Update the <img> src for the current frame
+      eIMG.setAttribute("src", m_url);
+    }
+    
+    // Update the navigation and status
+    updateNav();
+  }
+  
+  /*
+   * Update the scrub slider and status to show the current position.
+   * 
+   * This also shows the image viewer, point tracking, and navigation
+   * boxes if they are hidden.  Use this, rather than updatePos(), when
+   * the index changes without the position changing.
+   */
+  function updateNav() {
+    
+    var func_name = "updateNav";
+    var e;
+    
+    // Update the scrub slider
+    e = document.getElementById("rngScrub");
+    if (e == null) {
+      fault(func_name, 100);
+    }
+    if (m_index.length > 1) {
+      // More than one frame, so update slider appropriately, leaving it
+      // alone if it is already right, since this is also called while
+      // the slider is being dragged
+      if (parseInt(e.max, 10) !== m_index.length - 1) {
+        e.value = 0;
+        e.min = 0;
+        e.max = m_index.length - 1;
+      }
+      if (parseInt(e.value, 10) !== m_pos) {
+        e.value = m_pos;
+      }
+      
+    } else {
+      // Only a single frame, so we just define a dummy slider
+      e.value = 0;
+      e.min = 0;
+      e.max = 1;
+    }
+    
+    // Show image viewer, point tracking, and navigation boxes if not
+    // already displayed
+    appear("divImage");
+    appear("divPointTrack");
+    appear("divNav");
+    
+    // Update status, unless the rest of the index is still loading and
+    // the loader will report progress
+    if (!m_partial) {
+      setStatus("Frame " + m_pos + " / " + (m_index.length - 1));
+    }
+  }
+
+  /*
+   * Get the time for playback.
+   * 
+   * Return:
+   * 
+   *   the time in milliseconds from an arbitrary starting point
+   */
+  function playNow() {
+    if ((typeof performance === "object") &&
+        (typeof performance.now === "function")) {
+      return performance.now();
+    }
+    return Date.now();
+  }
+  
+  /*
+   * Schedule playTick() for the next animation frame.
+   */
+  function playSchedule() {
+    if (typeof requestAnimationFrame === "function") {
+      requestAnimationFrame(playTick);
+    } else {
+      setTimeout(playTick, 16);
+    }
+  }
+  
+  /*
+   * Show or hide the playback state in the navigation box.
+   * 
+   * Parameters:
+   * 
+   *   str - the text for the playback counter, or false to leave it
+   */
+  function playShow(str) {
+    
+    var func_name = "playShow";
+    var e;
+    
+    e = document.getElementById("btnPlay");
+    if (e == null) {
+      fault(func_name, 100);
+    }
+    e.value = m_playing ? "Pause" : "Play";
+    
+    e = document.getElementById("spnPlayStat");
+    if (e == null) {
+      fault(func_name, 200);
+    }
+    if (str !== false) {
+      e.innerHTML = (str.length > 0) ? htmlEsc(str) : "&nbsp;";
+    }
+  }
+  
+  /*
+   * Restart the playback clock from the current frame, so that the
+   * frame rate can change without the position jumping.
+   */
+  function playRebase() {
+    m_play_time = playNow();
+    m_play_first = m_pos;
+  }
+  
+  /*
+   * Start playing from the current frame, or from the first frame if
+   * the current frame is the last one.
+   * 
+   * Ignored if nothing is loaded, or the index is still loading.
+   */
+  function playStart() {
+    
+    if ((!m_loaded) || m_partial || m_playing || (m_pos < 0)) {
+      return;
+    }
+    
+    if (m_pos >= m_index.length - 1) {
+      m_want = -1;
+      updatePos(0);
+    }
+    
+    m_playing = true;
+    m_dir = 1;
+    playRebase();
+    
+    m_stat_time = m_play_time;
+    m_stat_shown = 0;
+    m_stat_late = false;
+    m_stat_dropped = 0;
+    
+    playShow("");
+    playSchedule();
+  }
+  
+  /*
+   * Stop playing, if playing, leaving the last playback counter shown.
+   */
+  function playStop() {
+    if (m_playing) {
+      m_playing = false;
+      m_ahead = CACHE_AHEAD;
+      playShow(false);
+    }
+  }
+  
+  /*
+   * Show the next frame of playback, at an animation frame.
+   * 
+   * The frame that should be showing by now is worked out from the
+   * clock.  If it has been decoded, it is shown.  Otherwise, it is late,
+   * and the newest frame up to it that has been decoded is shown
+   * instead, if any.  Either way, frames that are passed over without
+   * being shown are counted as dropped, and playback doesn't slow down
+   * to wait for them.  When frames are decoded into m_cache, the
+   * read-ahead in m_ahead is widened when frames are late.
+   */
+  function playTick() {
+    
+    var now, t, j, k, n, str;
+    
+    if (!m_playing) {
+      return;
+    }
+    
+    // Work out which frame should be showing, stopping on the last
+    now = playNow();
+    t = m_play_first + Math.floor(((now - m_play_time) * m_fps) / 1000);
+    if (t >= m_index.length - 1) {
+      t = m_index.length - 1;
+    }
+    
+    // Find the frame to show, which can only be t without decoding
+    j = t;
+    if (m_decode && (t > m_pos)) {
+      for(j = t; j > m_pos; j--) {
+        k = cacheFind(j);
+        if ((k >= 0) && (m_cache[k].bmp !== false)) {
+          break;
+        }
+      }
+      
+      // If t is late, widen the read-ahead, as far as fits in the cache
+      if (j < t) {
+        m_stat_late = true;
+        n = PLAY_AHEAD_MAX;
+        k = cacheFind(m_pos);
+        if ((k >= 0) && (m_cache[k].bytes > 0)) {
+          n = Math.min(n, Math.floor(CACHE_BYTES / m_cache[k].bytes) - 2);
+        }
+        if (m_ahead < n) {
+          m_ahead++;
+        }
+      }
+    }
+    
+    // Show the frame, counting the frames passed over
+    if (j > m_pos) {
+      m_stat_dropped += j - m_pos - 1;
+      m_stat_shown++;
+      m_want = -1;
+      updatePos(j);
+    } else if (m_decode) {
+      cacheAhead();
+    }
+    
+    // Update the counter now and then, narrowing the read-ahead again if
+    // there were no late frames
+    if (now - m_stat_time >= PLAY_STAT_MS) {
+      if ((!m_stat_late) && (m_ahead > CACHE_AHEAD)) {
+        m_ahead--;
+      }
+      
+      str = ((m_stat_shown * 1000) / (now - m_stat_time)).toFixed(1) +
+              " fps, " + String(m_stat_dropped) + " dropped";
+      m_stat_time = now;
+      m_stat_shown = 0;
+      m_stat_late = false;
+      
+      playShow(str);
+    }
+    
+    // Stop on the last frame, or else carry on
+    if (m_pos >= m_index.length - 1) {
+      playStop();
+    } else {
+      playSchedule();
+    }
+  }
+  
+  /*
+   * Close whatever is loaded and start showing a new video.
+   * 
+   * Parameters:
+   * 
+   *   file - the M-JPEG File object
+   * 
+   *   index - the frame offsets, for m_index
+   * 
+   *   ends - the frame ends, for m_ends
+   * 
+   *   partial - true if the rest of the index is still loading
+   */
+  function openVideo(file, index, ends, partial) {
+    unload();
+    m_loaded = true;
+    m_mjpg = file;
+    m_index = index;
+    m_ends = ends;
+    m_partial = partial;
+    
+    // Use the special -1 code for m_pos to indicate no frame loaded yet,
+    // and then show the first frame
+    m_pos = -1;
+    updatePos(0);
+  }
+  
+  /*
+   * Build the index of an M-JPEG file that was dropped on its own, and
+   * show the video once it is done.
+   * 
+   * Parameters:
+   * 
+   *   fMJPG - the M-JPEG File object
+   */
+  function buildIndex(fMJPG) {
+    
+    var id;
+    
+    // Cancel any index that was already loading, and get the number of
+    // this load
+    cancelLoad();
+    id = m_load_id;
+    
+    setStatus("Indexing...");
+    dismiss("divLoad");
+    
+    startScan(fMJPG, {
+      
+      // Report progress
+      "progress": function(done, total) {
+        if (id !== m_load_id) {
+          return;
+        }
+        setStatus("Indexing " +
+          String(Math.min(Math.floor((done * 100) / total), 100)) +
+          "%...");
+      },
+      
+      // Show the video, which can then be saved
+      "done": function(index, ends, info) {
+        if (id !== m_load_id) {
+          return;
+        }
+        stopWorkers();
+        appear("divLoad");
+        openVideo(fMJPG, index, ends, false);
+        m_info = info;
+        appear("divSave");
+      },
+      
+      // Report an invalid M-JPEG file
+      "error": function(msg) {
+        if (id !== m_load_id) {
+          return;
+        }
+        stopWorkers();
+        appear("divLoad");
+        setStatus("ERROR: " + msg);
+      },
+      
+      // Likewise if it can't be read
+      "fail": function() {
+        if (id !== m_load_id) {
+          return;
+        }
+        stopWorkers();
+        appear("divLoad");
+        setStatus("ERROR: Failed to read M-JPEG file!");
+      }
+    });
+  }
+  
+  /*
+   * Write a 64-bit unsigned integer in big-endian order into a
+   * DataView.
+   * 
+   * Parameters:
+   * 
+   *   dv - the DataView
+   * 
+   *   ofs - the byte offset to write at
+   * 
+   *   v - the value, in range [0, pow(2, 53) - 1]
+   */
+  function writeUint64(dv, ofs, v) {
+    dv.setUint32(ofs, Math.floor(v / 4294967296), false);
+    dv.setUint32(ofs + 4, v % 4294967296, false);
+  }
+  
+  /*
+   * Run a request in a Web Worker running WORKER_URL, if possible.
+   * 
+   * The worker is added to m_workers.  If the worker can't be started,
+   * or fails before it replies, the request is run in the page instead,
+   * from the copy of WORKER_URL loaded with a <script> tag.  If the
+   * worker fails after it has replied, fMsg gets a "fail" message.
+   * 
+   * Parameters:
+   * 
+   *   msg - the request message, as described in mjpg_view_worker.js
+   * 
+   *   fMsg - the function called with the data of each reply message
+   * 
+   *   fLocal - the function called to run the request in the page
+   */
+  function startWorker(msg, fMsg, fLocal) {
+    
+    var w = false;
+    var got = false;
+    
+    // Try to start a worker
+    if (typeof Worker === "function") {
+      try {
+        w = new Worker(WORKER_URL);
+      } catch (ex) {
+        w = false;
+      }
+    }
+    
+    // Without a worker, run in the page
+    if (!w) {
+      fLocal();
+      return;
+    }
+    
+    // Pass each message from the worker on
+    w.onmessage = function(ev) {
+      got = true;
+      fMsg(ev.data);
+    };
+    
+    // If the worker fails before it replies, it probably couldn't load,
+    // so fall back to running in the page
+    w.onerror = function(ev) {
+      var k;
+      ev.preventDefault();
+      w.terminate();
+      k = m_workers.indexOf(w);
+      if (k >= 0) {
+        m_workers.splice(k, 1);
+      }
+      if (got) {
+        fMsg({"type": "fail"});
+      } else {
+        fLocal();
+      }
+    };
+    
+    m_workers.push(w);
+    w.postMessage(msg);
+  }
+  
+  /*
+   * Stop all the workers in m_workers.
+   */
+  function stopWorkers() {
+    var k;
+    for(k = 0; k < m_workers.length; k++) {
+      m_workers[k].terminate();
+    }
+    m_workers = [];
+  }
+  
+  /*
+   * Start loading an index file.
+   * 
+   * The index is loaded with startWorker().  See mjpg_view_worker.js
+   * for the handler functions, which are called the same way whether
+   * the index is loaded by a worker or in the page.
+   * 
+   * Parameters:
+   * 
+   *   fIndex - the index File object
+   * 
+   *   fsize - the size in bytes of the M-JPEG file
+   * 
+   *   h - the handler
+   */
+  function startLoad(fIndex, fsize, h) {
+    startWorker({"file": fIndex, "fsize": fsize}, function(d) {
+      if (d.type === "first") {
+        h.first(d.begin, d.end);
+      } else if (d.type === "progress") {
+        h.progress(d.done, d.total);
+      } else if (d.type === "done") {
+        h.done(d.index, d.ends);
+      } else if (d.type === "raw") {
+        h.raw(d.buf, d.packed);
+      } else if (d.type === "error") {
+        h.error(d.code);
+      } else {
+        h.fail();
+      }
+    }, function() {
+      mjvIndex.load(fIndex, fsize, h);
+    });
+  }
+  
+  /*
+   * Start scanning one byte range of an M-JPEG file for frames.
+   * 
+   * The range is scanned with startWorker().  See scanRange() in
+   * mjpg_view_worker.js for the parameters and the handler.
+   * 
+   * Parameters:
+   * 
+   *   file - the M-JPEG File object
+   * 
+   *   start - the start of the range
+   * 
+   *   end - the end of the range
+   * 
+   *   first - true to parse from the start of the range
+   * 
+   *   h - the handler
+   */
+  function startRange(file, start, end, first, h) {
+    startWorker({
+      "scan": true,
+      "file": file,
+      "start": start,
+      "end": end,
+      "first": first
+    }, function(d) {
+      if (d.type === "progress") {
+        h.progress(d.done);
+      } else if (d.type === "range") {
+        h.done(d.r);
+      } else {
+        h.fail();
+      }
+    }, function() {
+      mjvIndex.scan(file, start, end, first, h);
+    });
+  }
+  
+  /*
+   * Find a frame offset in a scanned range.
+   * 
+   * Parameters:
+   * 
+   *   r - the result of the range scan
+   * 
+   *   offset - the frame offset to look for
+   * 
+   * Return:
+   * 
+   *   the index of the frame in the range, or -1 if not found
+   */
+  function rangeFind(r, offset) {
+    
+    var lo, hi, mid;
+    
+    lo = 0;
+    hi = r.count - 1;
+    while (lo <= hi) {
+      mid = Math.floor((lo + hi) / 2);
+      if (r.offs[mid] < offset) {
+        lo = mid + 1;
+      } else if (r.offs[mid] > offset) {
+        hi = mid - 1;
+      } else {
+        return mid;
+      }
+    }
+    return -1;
+  }
+  
+  /*
+   * Build the index of an M-JPEG file by scanning it for frames.
+   * 
+   * This works the same way as mjpg_index -j, so the frames found are
+   * exactly those that mjpg_index would find.  The file is split into
+   * byte ranges of at least SCAN_MIN_RANGE, one per worker, up to the
+   * number of processors or SCAN_WORKERS_MAX, and the ranges are
+   * scanned in parallel with startRange().  The frames of the ranges
+   * are then chained together: each range must contain the frame where
+   * the previous range left off, and frames before that point are false
+   * candidates that are dropped.  If a range doesn't line up this way,
+   * the rest of the file is scanned in one go from where the last good
+   * range left off, so the result (and any error) is always the same as
+   * for a scan of the whole file in one go.  An error in the first range
+   * is reported straight away, since that range is parsed from the
+   * start of the file, just as a scan in one go would be.
+   * 
+   * The handler object has these functions:
+   * 
+   *   progress(done, total) - about done bytes of the total have been
+   *   scanned
+   * 
+   *   done(index, ends, info) - the index is built, with Float64Arrays
+   *   of frame offsets and frame ends, and the frame information as
+   *   described for scanRange(); see m_info
+   * 
+   *   error(msg) - the M-JPEG file isn't valid, with the error message
+   * 
+   *   fail() - the M-JPEG file couldn't be read
+   * 
+   * Parameters:
+   * 
+   *   file - the M-JPEG File object
+   * 
+   *   h - the handler
+   */
+  function startScan(file, h) {
+    
+    var n, range, left, i, results, seen, failed;
+    
+    // Work out the number of ranges
+    n = 1;
+    if ((typeof navigator === "object") &&
+        (typeof navigator.hardwareConcurrency === "number")) {
+      n = Math.floor(navigator.hardwareConcurrency);
+    }
+    n = Math.min(n, SCAN_WORKERS_MAX,
+                  Math.floor(file.size / SCAN_MIN_RANGE));
+    n = Math.max(n, 1);
+    range = Math.floor(file.size / n);
+    
+    // Chain the ranges together once they are all done, starting with
+    // the first, which is good if it parsed at all; hp is the offset of
+    // the frame where the next range must pick up
+    function chain() {
+      
+      var parts = [];
+      var hp = 0;
+      var done = false;
+      var j, r, k;
+      
+      for(j = 0; j < n; j++) {
+        r = results[j];
+        
+        // Skip ranges that have nothing to contribute
+        if (r.ok && r.empty) {
+          continue;
+        }
+        if ((j > 0) && r.ok && (r.handoff >= 0) && (r.handoff <= hp)) {
+          continue;
+        }
+        
+        // Find where this range picks up; stop chaining if this range
+        // doesn't line up.  The first range was parsed from the start of
+        // the file, just as a scan in one go would be, so its error is
+        // final
+        if (!r.ok) {
+          if (j === 0) {
+            h.error(r.err);
+            return;
+          }
+          break;
+        }
+        k = 0;
+        if (j > 0) {
+          k = rangeFind(r, hp);
+          if (k < 0) {
+            break;
+          }
+        }
+        parts.push({"r": r, "k": k});
+        
+        // Update the handoff point, or finish if this range parsed to
+        // the end of the file
+        if (r.handoff < 0) {
+          done = true;
+          break;
+        }
+        hp = r.handoff;
+      }
+      
+      // If the ranges didn't chain all the way to the end, finish with a
+      // scan from the last good handoff point
+      if (done) {
+        join(parts);
+        return;
+      }
+      startRange(file, hp, file.size, true, {
+        "progress": function() {},
+        "done": function(r) {
+          if (!r.ok) {
+            h.error(r.err);
+            return;
+          }
+          parts.push({"r": r, "k": 0});
+          join(parts);
+        },
+        "fail": h.fail
+      });
+    }
+    
+    // Join the frames of the chained ranges into the index
+    function join(parts) {
+      
+      var count, j, p, index, ends, info, m, c;
+      
+      count = 0;
+      for(j = 0; j < parts.length; j++) {
+        count += parts[j].r.count - parts[j].k;
+      }
+      if (count < 1) {
+        h.error("No frames found!");
+        return;
+      }
+      
+      index = new Float64Array(count);
+      ends = new Float64Array(count);
+      info = new Uint16Array(count * 7);
+      m = 0;
+      for(j = 0; j < parts.length; j++) {
+        p = parts[j];
+        c = p.r.count - p.k;
+        index.set(p.r.offs.subarray(p.k), m);
+        ends.set(p.r.ends.subarray(p.k), m);
+        info.set(p.r.info.subarray(p.k * 7), m * 7);
+        m += c;
+      }
+      h.done(index, ends, info);
+    }
+    
+    // Start a worker for each range
+    results = [];
+    seen = [];
+    left = n;
+    failed = false;
+    for(i = 0; i < n; i++) {
+      seen.push(0);
+      (function(j) {
+        var start = j * range;
+        var end = (j < n - 1) ? (start + range) : file.size;
+        startRange(file, start, end, (j === 0), {
+          "progress": function(done) {
+            var t = 0;
+            var k;
+            seen[j] = done;
+            for(k = 0; k < n; k++) {
+              t += seen[k];
+            }
+            h.progress(t, file.size);
+          },
+          "done": function(r) {
+            results[j] = r;
+            left--;
+            if ((left === 0) && (!failed)) {
+              chain();
+            }
+          },
+          "fail": function() {
+            if (!failed) {
+              failed = true;
+              h.fail();
+            }
+          }
+        });
+      }(i));
+    }
+  }
+
+  /*
+   * Cancel any index that is still loading or being built.
+   * 
+   * The workers doing the work are stopped.  Work running in the page
+   * can't be stopped, but it sees that it is no longer wanted, so its
+   * results are ignored.
+   */
+  function cancelLoad() {
+    stopWorkers();
+    m_load_id++;
+  }
+  
+  /*
+   * Close any currently loaded video, leaving any index that is still
+   * loading alone.
+   */
+  function unload() {
+    
+    var func_name = "unload";
+    var eDIV;
+    
+    // Get the image viewer DIV
+    eDIV = document.getElementById("divImage");
+    if (eDIV == null) {
+      fault(func_name, 100);
+    }
+    
+    // Clear contents of image viewer
+    while (eDIV.hasChildNodes()) {
       eDIV.removeChild(eDIV.firstChild);
     }
     
@@ -473,22 +1954,30 @@
     // Reset message in point tracker DIV
     eDIV.innerHTML = "(Click frame to get coordinates)";
     
-    // Hide image viewer, point tracker, and navigation
+    // Stop playing
+    playStop();
+    
+    // Hide image viewer, point tracker, navigation, and saving
+    dismiss("divSave");
     dismiss("divImage");
     dismiss("divPointTrack");
     dismiss("divNav");
     
     // If we are currently loaded, revoke the URL of the current frame
-    // blob
-    if (m_loaded) {
+    // blob, if any, and close all decoded frames
+    if (m_loaded && m_url) {
       URL.revokeObjectURL(m_url);
     }
+    cacheClear();
     
     // Clear everything to false, which also releases memory and file
     // objects
     m_loaded = false;
     m_mjpg = false;
     m_index = false;
+    m_ends = false;
+    m_partial = false;
+    m_info = false;
     m_pos = false;
     m_url = false;
     
@@ -496,6 +1985,22 @@
     setStatus("Nothing loaded");
   }
 
+  /*
+   * Public functions
+   * ================
+   */
+
+  /*
+   * Invoked when the user clicks the "Close" button, and also to close
+   * any currently loaded video before a new video is loaded.
+   * 
+   * Also used when starting up to set initial state.
+   */
+  function close() {
+    cancelLoad();
+    unload();
+  }
+
   /*
    * Invoked when the user scrubs the slider to a different position.
    */
@@ -509,31 +2014,22 @@
       return;
     }
     
-    // Ignore if currently scrubbing
-    if (m_scrubbing) {
-      return;
-    }
-    
     // Get the slider control
     e = document.getElementById("rngScrub");
     if (e == null) {
       fault(func_name, 100);
     }
     
-    // Update frame position with current value, using the scrubbing
-    // guard to block recursive invocations of this event handler
-    try {
-      m_scrubbing = true;
-      updatePos(parseInt(e.value, 10));
-    } catch (ex) {
-      m_scrubbing = false;
-      throw(ex);
-    }
-    m_scrubbing = false;
+    // Ask for the frame at the current value, pausing playback; the
+    // update happens at the next animation frame, so this can't recurse
+    playStop();
+    wantPos(parseInt(e.value, 10));
   }
 
   /*
    * Invoked when in the midst of dragging the scrub slider.
+   * 
+   * This shows the frames being dragged over, coalesced by wantPos().
    */
   function handleScrubbing() {
     
@@ -553,24 +2049,140 @@
     
     // Update current scrubbing value
     eSpan.innerHTML = eRng.value;
+    
+    // Show the frame being dragged over, pausing playback
+    if (m_loaded) {
+      playStop();
+      wantPos(parseInt(eRng.value, 10));
+    }
+  }
+
+  /*
+   * Invoked when the user clicks the "Play" or "Pause" button.
+   */
+  function handlePlay() {
+    if (m_playing) {
+      playStop();
+    } else {
+      playStart();
+    }
+  }
+
+  /*
+   * Invoked when the user changes the frame rate box.
+   * 
+   * Values that aren't a number in range are replaced by the current
+   * frame rate.
+   */
+  function handleFPS() {
+    
+    var func_name = "handleFPS";
+    var e, v;
+    
+    e = document.getElementById("txtFPS");
+    if (e == null) {
+      fault(func_name, 100);
+    }
+    
+    v = Number(e.value);
+    if ((!isFinite(v)) || (v < PLAY_FPS_MIN) || (v > PLAY_FPS_MAX)) {
+      e.value = String(m_fps);
+      return;
+    }
+    
+    m_fps = v;
+    if (m_playing) {
+      playRebase();
+    }
+  }
+
+  /*
+   * Invoked when the user clicks the "Save index" button, which is only
+   * shown when the index was built by scanning the M-JPEG file.
+   * 
+   * This saves a v2 index file, the same as mjpg_index would write, as
+   * a download named after the M-JPEG file with ".index" suffixed.
+   */
+  function handleSave() {
+    
+    var buf, dv, i, ofs, len, inf, url, e;
+    
+    // Ignore unless the index was built here
+    if ((!m_loaded) || (!m_info)) {
+      return;
+    }
+    
+    // Write the header
+    buf = new ArrayBuffer(32 + (32 * m_index.length));
+    dv = new DataView(buf);
+    for(i = 0; i < 8; i++) {
+      dv.setUint8(i, "MJPGIDX2".charCodeAt(i));
+    }
+    dv.setUint32(8, 32, false);
+    dv.setUint32(12, 32, false);
+    writeUint64(dv, 16, m_index.length);
+    
+    // Write the records
+    for(i = 0; i < m_index.length; i++) {
+      ofs = 32 + (32 * i);
+      len = m_ends[i] - m_index[i];
+      if (len > 4294967295) {
+        setStatus("ERROR: Frame too large for index!");
+        return;
+      }
+      inf = i * 7;
+      writeUint64(dv, ofs, m_index[i]);
+      dv.setUint32(ofs + 8, len, false);
+      dv.setUint16(ofs + 12, m_info[inf], false);
+      dv.setUint16(ofs + 14, m_info[inf + 1], false);
+      dv.setUint16(ofs + 16, m_info[inf + 4], false);
+      dv.setUint16(ofs + 18, m_info[inf + 5], false);
+      dv.setUint8(ofs + 20, m_info[inf + 2]);
+      dv.setUint8(ofs + 21, m_info[inf + 3]);
+      dv.setUint16(ofs + 22, m_info[inf + 6], false);
+    }
+    
+    // Download it through a temporary link
+    url = URL.createObjectURL(new Blob([buf]));
+    e = document.createElement("a");
+    e.href = url;
+    e.download = (m_mjpg.name ? m_mjpg.name : "mjpg") + ".index";
+    document.body.appendChild(e);
+    e.click();
+    document.body.removeChild(e);
+    setTimeout(function() {
+      URL.revokeObjectURL(url);
+    }, 0);
   }
 
   /*
    * Event handler for when files are dropped into the loading box.
    * 
-   * This gets the data files and routes the call to loadMJPG().
+   * This gets the data files and starts loading the index with
+   * startLoad().  As soon as the first frame is known, the previous
+   * video is closed and the first frame is shown, while the rest of the
+   * index carries on loading; scrubbing is possible once it is done.
+   * 
+   * If only an M-JPEG file is dropped, its index is built with
+   * buildIndex() instead.
    */
   function handleDrop(ev) {
     
     var fMJPG, fIndex;
-    var fr, f, dv, ar, arl, i;
+    var f, id;
     
     // Handle this event
     ev.preventDefault();
     
-    // Make sure we got two files
+    // With a single file, there is no index, so build one
+    if (ev.dataTransfer.files.length === 1) {
+      buildIndex(ev.dataTransfer.files.item(0));
+      return;
+    }
+    
+    // Otherwise, make sure we got two files
     if (ev.dataTransfer.files.length !== 2) {
-      setStatus("ERROR: Expecting two files!");
+      setStatus("ERROR: Expecting one or two files!");
       return;
     }
     
@@ -586,100 +2198,111 @@
       fIndex = f;
     }
     
-    // Index file size should be at least 16 and a multiple of eight
-    if ((fIndex.size < 16) || ((fIndex.size % 8) !== 0)) {
+    // Index file size should be at least 16, which is the smallest
+    // possible v1 index
+    if (fIndex.size < 16) {
       setStatus("ERROR: Invalid index file!");
       return;
     }
     
+    // Cancel any index that was already loading, and get the number of
+    // this load
+    cancelLoad();
+    id = m_load_id;
+    
     // We are starting the asynchronous loading procedure, so update
     // the status and hide the load box
     setStatus("Loading...");
     dismiss("divLoad");
     
-    // We want to read the whole index file
-    fr = new FileReader();
-    
-    // If the read operation fails, update status and show the load
-    // controls again
-    f = function(evb) {
-      setStatus("ERROR: Failed to read index file!");
-      appear("divLoad");
-    };
-    fr.onabort = f;
-    fr.onerror = f;
-    
-    // Function continues when the reading operation is complete
-    fr.onload = function(evb) {
-      
-      // Asynchronous portion has completed, so re-show the loading box
-      appear("divLoad");
-      
-      // Byte length must be at least 16 and a multiple of eight
-      if ((fr.result.byteLength < 16) ||
-            ((fr.result.byteLength % 8) !== 0)) {
-        setStatus("ERROR: Invalid index file (Code 1)!");
-        return;
-      }
-      
-      // Create a DataView for reading integers
-      dv = new DataView(fr.result);
-      
-      // Get the total number of elements from the first integer
-      arl = readIndexValue(dv, 0);
-      if (arl < 0) {
-        setStatus("ERROR: Invalid index file (Code 2)!");
-        return;
-      }
+    startLoad(fIndex, fMJPG.size, {
       
-      // Make sure that the length of the arraybuffer matches what is
-      // suggested by the element count
-      if ((fr.result.byteLength / 8) - 1 !== arl) {
-        setStatus("ERROR: Invalid index file (Code 3)!");
-        return;
-      }
+      // Show the first frame while the rest loads
+      "first": function(begin, end) {
+        if (id !== m_load_id) {
+          return;
+        }
+        appear("divLoad");
+        openVideo(fMJPG, new Float64Array([begin]), [end], true);
+      },
       
-      // Allocate an array to store the index values
-      ar = new Array(arl);
+      // Report progress
+      "progress": function(done, total) {
+        var pct;
+        if (id !== m_load_id) {
+          return;
+        }
+        pct = String(Math.floor((done * 100) / total)) + "%";
+        if (m_partial) {
+          setStatus("Frame 0, loading index " + pct + "...");
+        } else {
+          setStatus("Loading index " + pct + "...");
+        }
+      },
       
-      // Copy everything into the index array, checking that everything
-      // within JavaScript numeric range, the sequence is strictly
-      // ascending, and everything within range of the M-JPEG file blob
-      for(i = 0; i < arl; i++) {
-        ar[i] = readIndexValue(dv, i + 1);
-        if (ar[i] < 0) {
-          setStatus("ERROR: Invalid index file (Code 4)!");
+      // Swap in the whole index when it is done, or show the first
+      // frame now if there wasn't a partial index
+      "done": function(index, ends) {
+        if (id !== m_load_id) {
           return;
         }
-        if (i > 0) {
-          if (!(ar[i - 1] < ar[i])) {
-            setStatus("ERROR: Invalid index file (Code 5)!");
-            return;
+        stopWorkers();
+        appear("divLoad");
+        if (m_partial) {
+          m_index = index;
+          m_ends = ends;
+          m_partial = false;
+          updateNav();
+          if (m_decode) {
+            cacheAhead();
           }
+        } else {
+          openVideo(fMJPG, index, ends, false);
         }
-        if (ar[i] >= fMJPG.size) {
-          setStatus("ERROR: Invalid index file (Code 6)!");
+      },
+      
+      // Sparse and packed indexes are parsed here
+      "raw": function(buf, packed) {
+        var r;
+        if (id !== m_load_id) {
           return;
         }
-      }
-      
-      // We are ready to change the state, so begin by closing anything
-      // that is currently loaded
-      close();
+        stopWorkers();
+        appear("divLoad");
+        r = parseIndexSparse(new DataView(buf), fMJPG.size, packed);
+        if (typeof r === "number") {
+          setStatus("ERROR: Invalid index file (Code " + String(r) + ")!");
+          return;
+        }
+        openVideo(fMJPG, r.index, r.ends, false);
+      },
       
-      // Load initial state, using the special -1 code for m_pos to
-      // indicate no frame loaded yet
-      m_loaded = true;
-      m_mjpg = fMJPG;
-      m_index = ar;
-      m_pos = -1;
+      // If the index is bad, close a partially loaded video
+      "error": function(code) {
+        if (id !== m_load_id) {
+          return;
+        }
+        stopWorkers();
+        appear("divLoad");
+        if (m_partial) {
+          unload();
+        }
+        setStatus("ERROR: Invalid index file (Code " + String(code) + ")!");
+      },
       
-      // Show the first frame
-      updatePos(0);
-    };
-    
-    // Begin asynchronously reading the index blob
-    fr.readAsArrayBuffer(fIndex);
+      // Likewise if the index file can't be read
+      "fail": function() {
+        if (id !== m_load_id) {
+          return;
+        }
+        stopWorkers();
+        appear("divLoad");
+        if (m_partial) {
+          unload();
+        }
+        setStatus("ERROR: Failed to read index file!");
+      }
+    });
   }
 
   /*
@@ -718,6 +2341,9 @@
     "close": close,
     "handleScrub": handleScrub,
     "handleScrubbing": handleScrubbing,
+    "handlePlay": handlePlay,
+    "handleFPS": handleFPS,
+    "handleSave": handleSave,
     "handleDrop": handleDrop,
     "handleDrag": handleDrag,
     "handleLoad": handleLoad
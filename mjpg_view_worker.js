@@ -0,0 +1,1186 @@
+"use strict";
+
+/*
+ * mjpg_view_worker.js
+ * ===================
+ * 
+ * Index loader and scanner for the MJPEG-Viewer webapp.
+ * 
+ * This script runs as a Web Worker, so that reading and checking a
+ * large index doesn't hold up the page.  It can also be loaded into
+ * the page itself with a <script> tag, for browsers that won't start a
+ * worker, such as when the page is opened from a local file.  Either
+ * way, the index is read from the file a chunk at a time, so at most
+ * one chunk of the index file is ever held in memory alongside the
+ * frame offsets, and the offsets are stored in a Float64Array rather
+ * than a plain Array.
+ * 
+ * As a worker, it takes a message with the index File object in
+ * "file" and the M-JPEG file size in "fsize", and replies with a
+ * sequence of messages, each with a "type":
+ * 
+ *   "first" - the first chunk has been checked, and "begin" and "end"
+ *   are the byte range of the first frame
+ * 
+ *   "progress" - "done" of "total" bytes of the index have been read
+ * 
+ *   "done" - the whole index is loaded, with the offsets in "index" and
+ *   the frame ends in "ends", or false if the format has none; the
+ *   arrays' buffers are transferred rather than copied
+ * 
+ *   "raw" - the index is a sparse or packed index, whose whole file
+ *   data is in "buf", transferred, with "packed" set for packed; these
+ *   are decoded on demand by the page, so they aren't checked here
+ * 
+ *   "error" - the index is not valid, with the error code in "code"
+ * 
+ *   "fail" - the index file couldn't be read
+ * 
+ * It also scans M-JPEG files for frames when there is no index, using
+ * a port of the parser in jpeg_parse.c.  For this, it takes a message
+ * with "scan" set, the M-JPEG File object in "file", the byte range to
+ * scan in "start" and "end", and "first" set for the first range, and
+ * replies with messages of these types:
+ * 
+ *   "progress" - "done" bytes of the range have been scanned
+ * 
+ *   "range" - the scan is over, with the result in "r", whose arrays'
+ *   buffers are transferred; see scanRange()
+ * 
+ *   "fail" - the M-JPEG file couldn't be read
+ * 
+ * In the page, the same loader and scanner are available as
+ * mjvIndex.load() and mjvIndex.scan().
+ */
+
+// Wrap everything in an anonymous function that we immediately invoke
+// after it is declared -- this prevents anything from being implicitly
+// added to global scope
+(function() {
+  
+  /*
+   * Constants
+   * =========
+   */
+  
+  /*
+   * The magic string that begins a v2 index file.
+   */
+  var INDEX_V2_MAGIC = "MJPGIDX2";
+  
+  /*
+   * The magic string that begins a native index file.
+   */
+  var INDEX_NATIVE_MAGIC = "MJPGIDXL";
+  
+  /*
+   * The magic string that begins a sparse index file.
+   */
+  var INDEX_SPARSE_MAGIC = "MJPGIDXS";
+  
+  /*
+   * The magic string that begins a packed index file.
+   */
+  var INDEX_PACKED_MAGIC = "MJPGIDXP";
+  
+  /*
+   * The most bytes of the index file to read at a time.
+   */
+  var CHUNK_SIZE = 1048576;
+  
+  /*
+   * The most bytes of the M-JPEG file to read at a time when scanning.
+   */
+  var SCAN_SIZE = 4194304;
+  
+  /*
+   * Parser states, defined as in jpeg_parse.c.
+   */
+  var PS_PREMARK = 0;
+  var PS_MARKER = 1;
+  var PS_LEN1 = 2;
+  var PS_LEN2 = 3;
+  var PS_PAYLOAD = 4;
+  var PS_ENTROPY = 5;
+  var PS_ENTROPY_FF = 6;
+  
+  /*
+   * The JPEG markers that the scanner looks for.
+   */
+  var MARK_SOI = 0xd8;
+  var MARK_EOI = 0xd9;
+  var MARK_SOS = 0xda;
+  var MARK_DNL = 0xdc;
+  var MARK_DRI = 0xdd;
+  
+  /*
+   * The number of bytes at the start of each marker payload that the
+   * parser keeps for the marker function.
+   */
+  var HEAD_MAX = 8;
+  
+  /*
+   * The special error that a marker function returns to stop the parser
+   * without an actual error.
+   */
+  var PARSE_STOP = "Parser stopped!";
+  
+  /*
+   * Frame flag set when the frame had no EOI marker before the next
+   * frame started, as in a v2 record.
+   */
+  var FRAME_FLAG_NO_EOI = 0x0001;
+  
+  /*
+   * Local functions
+   * ===============
+   */
+  
+  /*
+   * Given a DataView, read the big-endian 64-bit unsigned integer
+   * starting at byte offset (ofs).
+   * 
+   * This function doesn't check its input parameters, so be careful.
+   * 
+   * Valid return values are in range [0, pow(2, 53) - 1].  If the
+   * value in the file is out of range, -1 is returned.
+   * 
+   * Parameters:
+   * 
+   *   dv - the DataView
+   * 
+   *   ofs - the byte offset to read from
+   * 
+   * Return:
+   * 
+   *   the integer value, or -1 if the value stored can't be represented
+   *   as a JavaScript numeric value
+   */
+  function readUint64(dv, ofs) {
+    
+    var a, b;
+    
+    // Get the most-significant unsigned 32-bit value in "a" and the
+    // least-significant unsigned 32-bit value in "b"; use big endian
+    // ordering for both
+    a = dv.getUint32(ofs, false);
+    b = dv.getUint32(ofs + 4, false);
+    
+    // We only have room in the range for 21 bits in the most
+    // significant dword; otherwise, return -1
+    if (a > 2097151) {
+      return -1;
+    }
+    
+    // Range is fine, so combine into one value; this has to use
+    // floating-point arithmetic, since bitwise operators in JavaScript
+    // only work on 32 bits
+    return ((a * 4294967296) + b);
+  }
+  
+  /*
+   * Given a DataView, read the little-endian 64-bit unsigned integer
+   * starting at byte offset (ofs).
+   * 
+   * This is the same as readUint64(), except for the byte order.
+   * 
+   * Parameters:
+   * 
+   *   dv - the DataView
+   * 
+   *   ofs - the byte offset to read from
+   * 
+   * Return:
+   * 
+   *   the integer value, or -1 if the value stored can't be represented
+   *   as a JavaScript numeric value
+   */
+  function readUint64LE(dv, ofs) {
+    
+    var a, b;
+    
+    // Get the most-significant unsigned 32-bit value in "a" and the
+    // least-significant unsigned 32-bit value in "b"
+    a = dv.getUint32(ofs + 4, true);
+    b = dv.getUint32(ofs, true);
+    
+    // We only have room in the range for 21 bits in the most
+    // significant dword; otherwise, return -1
+    if (a > 2097151) {
+      return -1;
+    }
+    
+    return ((a * 4294967296) + b);
+  }
+  
+  /*
+   * Check whether a DataView begins with a given magic string.
+   * 
+   * Parameters:
+   * 
+   *   dv - the DataView
+   * 
+   *   magic - the magic string, in ASCII
+   * 
+   * Return:
+   * 
+   *   true if the data begins with the magic, false otherwise
+   */
+  function hasMagic(dv, magic) {
+    
+    var i;
+    
+    // Must be long enough for the magic
+    if (dv.byteLength < magic.length) {
+      return false;
+    }
+    
+    // Compare each byte of the magic
+    for(i = 0; i < magic.length; i++) {
+      if (dv.getUint8(i) !== magic.charCodeAt(i)) {
+        return false;
+      }
+    }
+    
+    return true;
+  }
+  
+  /*
+   * Read a byte range of a file asynchronously.
+   * 
+   * Parameters:
+   * 
+   *   file - the File or Blob to read
+   * 
+   *   begin - the offset of the first byte to read
+   * 
+   *   end - the offset after the last byte to read
+   * 
+   *   f - the function to call with the ArrayBuffer that was read, or
+   *   false if the read failed
+   */
+  function readRange(file, begin, end, f) {
+    
+    var fr;
+    
+    fr = new FileReader();
+    fr.onabort = function(ev) {
+      f(false);
+    };
+    fr.onerror = fr.onabort;
+    fr.onload = function(ev) {
+      f(fr.result);
+    };
+    fr.readAsArrayBuffer(file.slice(begin, end));
+  }
+  
+  /*
+   * Get the layout of an index from its header.
+   * 
+   * Parameters:
+   * 
+   *   dv - a DataView on top of the start of the index file, with the
+   *   header of any format if the file is long enough
+   * 
+   *   size - the size in bytes of the whole index file
+   * 
+   * Return:
+   * 
+   *   an object with the "count" of frames, the size of the header in
+   *   "hsize" and of each record in "rsize", "le" set for little endian
+   *   offsets, and "lens" set if each record has the frame length after
+   *   the offset; or a string "sparse" or "packed" for those formats;
+   *   or an integer error code if the header is not valid
+   */
+  function readLayout(dv, size) {
+    
+    var hsize, rsize, arl;
+    
+    // Sparse and packed indexes are handled by the page
+    if (hasMagic(dv, INDEX_SPARSE_MAGIC)) {
+      return "sparse";
+    }
+    if (hasMagic(dv, INDEX_PACKED_MAGIC)) {
+      return "packed";
+    }
+    
+    // v2 has sizes in the header, and the frame length after the offset
+    // in each record, which must have room for both
+    if (hasMagic(dv, INDEX_V2_MAGIC)) {
+      if (size < 32) {
+        return 7;
+      }
+      hsize = dv.getUint32(8, false);
+      rsize = dv.getUint32(12, false);
+      arl = readUint64(dv, 16);
+      if ((hsize < 32) || (rsize < 12) || (arl < 1)) {
+        return 8;
+      }
+      if (hsize + (arl * rsize) !== size) {
+        return 9;
+      }
+      return {
+        "count": arl, "hsize": hsize, "rsize": rsize,
+        "le": false, "lens": true
+      };
+    }
+    
+    // Native has the frame count after the magic, in little endian
+    if (hasMagic(dv, INDEX_NATIVE_MAGIC)) {
+      if ((size < 24) || ((size % 8) !== 0)) {
+        return 10;
+      }
+      arl = readUint64LE(dv, 8);
+      if ((arl < 1) || ((size / 8) - 2 !== arl)) {
+        return 11;
+      }
+      return {
+        "count": arl, "hsize": 16, "rsize": 8,
+        "le": true, "lens": false
+      };
+    }
+    
+    // Otherwise v1, which must be at least 16 bytes and a multiple of
+    // eight, with the frame count matching the length
+    if ((size < 16) || ((size % 8) !== 0)) {
+      return 1;
+    }
+    arl = readUint64(dv, 0);
+    if (arl < 0) {
+      return 2;
+    }
+    if ((size / 8) - 1 !== arl) {
+      return 3;
+    }
+    return {
+      "count": arl, "hsize": 8, "rsize": 8,
+      "le": false, "lens": false
+    };
+  }
+  
+  /*
+   * Load an index file.
+   * 
+   * The header is read first to get the format and frame count, then
+   * the records are read and checked a chunk at a time: every offset
+   * must be within JavaScript numeric range, the offsets must be
+   * strictly ascending, and every frame must be within the M-JPEG file.
+   * Each chunk is started from the completion of the last, so the
+   * caller's event loop keeps running in between.  A sparse or packed
+   * index is just read whole, since the page decodes it on demand.
+   * 
+   * The handler is an object with these functions, which are called as
+   * loading goes on:
+   * 
+   *   first(begin, end) - the first chunk checked out, and the first
+   *   frame runs from begin up to end
+   * 
+   *   progress(done, total) - done of the total bytes have been read
+   * 
+   *   done(index, ends) - the index is loaded, with a Float64Array of
+   *   frame offsets, and a Float64Array of frame ends, or false if the
+   *   format only has offsets
+   * 
+   *   raw(buf, packed) - the index is sparse or packed, with its whole
+   *   data in the ArrayBuffer buf, and packed set for packed
+   * 
+   *   error(code) - the index is not valid, with an error code
+   * 
+   *   fail() - the index file couldn't be read
+   * 
+   * Exactly one of done(), raw(), error(), and fail() is called at the
+   * end.
+   * 
+   * Parameters:
+   * 
+   *   file - the index File object
+   * 
+   *   fsize - the size in bytes of the M-JPEG file
+   * 
+   *   h - the handler
+   */
+  function loadIndex(file, fsize, h) {
+    
+    var lay, ar, ae, per, i, pos, whole;
+    
+    // Read the rest of the records starting with frame i, which begin
+    // at byte pos of the file
+    function nextChunk() {
+      
+      var n = Math.min(per, lay.count - i);
+      
+      readRange(file, pos, pos + (n * lay.rsize), function(buf) {
+        
+        var dv, ofs, j;
+        
+        if (buf === false) {
+          h.fail();
+          return;
+        }
+        dv = new DataView(buf);
+        
+        // Copy the chunk into the arrays, checking each frame
+        for(j = 0; j < n; j++) {
+          ofs = j * lay.rsize;
+          if (lay.le) {
+            ar[i] = readUint64LE(dv, ofs);
+          } else {
+            ar[i] = readUint64(dv, ofs);
+          }
+          if (ar[i] < 0) {
+            h.error(4);
+            return;
+          }
+          if (i > 0) {
+            if (!(ar[i - 1] < ar[i])) {
+              h.error(5);
+              return;
+            }
+          }
+          if (lay.lens) {
+            ae[i] = ar[i] + dv.getUint32(ofs + 8, false);
+            if ((ae[i] <= ar[i]) || (ae[i] > fsize)) {
+              h.error(6);
+              return;
+            }
+          } else if (ar[i] >= fsize) {
+            h.error(6);
+            return;
+          }
+          i++;
+        }
+        pos = pos + (n * lay.rsize);
+        
+        // Once the first chunk is checked, the first frame can be shown;
+        // without lengths, it ends where the second frame starts, which
+        // is also in the first chunk unless that is all there is
+        if (i === n) {
+          if (lay.lens) {
+            h.first(ar[0], ae[0]);
+          } else if (lay.count > 1) {
+            h.first(ar[0], ar[1]);
+          } else {
+            h.first(ar[0], fsize);
+          }
+        }
+        h.progress(pos, file.size);
+        
+        // Carry on with the next chunk, or finish
+        if (i < lay.count) {
+          nextChunk();
+        } else if (lay.lens) {
+          h.done(ar, ae);
+        } else {
+          h.done(ar, false);
+        }
+      });
+    }
+    
+    // Read the whole of a sparse or packed index, a chunk at a time
+    function nextRaw() {
+      
+      var n = Math.min(CHUNK_SIZE, file.size - pos);
+      
+      readRange(file, pos, pos + n, function(buf) {
+        
+        if (buf === false) {
+          h.fail();
+          return;
+        }
+        whole.set(new Uint8Array(buf), pos);
+        pos = pos + n;
+        h.progress(pos, file.size);
+        
+        if (pos < file.size) {
+          nextRaw();
+        } else {
+          h.raw(whole.buffer, (lay === "packed"));
+        }
+      });
+    }
+    
+    // Start by reading the header, which is at most 32 bytes
+    readRange(file, 0, Math.min(32, file.size), function(buf) {
+      
+      if (buf === false) {
+        h.fail();
+        return;
+      }
+      
+      // Get the layout from the header
+      lay = readLayout(new DataView(buf), file.size);
+      if (typeof lay === "number") {
+        h.error(lay);
+        return;
+      }
+      
+      // Sparse and packed are read whole
+      pos = 0;
+      if (typeof lay === "string") {
+        whole = new Uint8Array(file.size);
+        nextRaw();
+        return;
+      }
+      
+      // Allocate the arrays, and read whole records at a time
+      ar = new Float64Array(lay.count);
+      ae = false;
+      if (lay.lens) {
+        ae = new Float64Array(lay.count);
+      }
+      per = Math.max(1, Math.floor(CHUNK_SIZE / lay.rsize));
+      i = 0;
+      pos = lay.hsize;
+      nextChunk();
+    });
+  }
+  
+  /*
+   * Start parsing at a given stream offset.
+   * 
+   * This is a port of the push parser in jpeg_parse.c, which keeps its
+   * state between chunks in the same way, except that immediate markers
+   * are never reported.  fMarker is called as fMarker(c, pos, pp) for
+   * each marker, where c is the marker byte, pos is the offset of the
+   * 0xFF byte before it, and pp is the parser, whose "head" has the
+   * first "head_len" bytes of the marker payload.  It returns null to
+   * carry on, PARSE_STOP to stop, or an error message.
+   * 
+   * Parameters:
+   * 
+   *   offset - the stream offset of the first byte that will be fed
+   * 
+   *   fMarker - the marker function
+   * 
+   * Return:
+   * 
+   *   the new parser
+   */
+  function parserInit(offset, fMarker) {
+    return {
+      "state": PS_PREMARK,
+      "marker": 0,
+      "eoi_read": false,
+      "remain": 0,
+      "head": new Uint8Array(HEAD_MAX),
+      "head_len": 0,
+      "offset": offset,
+      "mark_pos": 0,
+      "fMarker": fMarker,
+      "err": null
+    };
+  }
+  
+  /*
+   * Process the marker byte that was just read, as jpeg_parserMarker()
+   * does.
+   * 
+   * Parameters:
+   * 
+   *   pp - the parser
+   */
+  function parserMarker(pp) {
+    var c = pp.marker;
+    if ((c === 0x01) || ((c >= 0xd0) && (c <= 0xd9))) {
+      pp.err = pp.fMarker(c, pp.mark_pos, pp);
+      pp.eoi_read = (c === MARK_EOI);
+      pp.state = PS_PREMARK;
+    } else {
+      pp.head_len = 0;
+      pp.state = PS_LEN1;
+    }
+  }
+  
+  /*
+   * Pass the next chunk of the stream through the parser, until the
+   * chunk is used up or the parser stops.
+   * 
+   * Parameters:
+   * 
+   *   pp - the parser
+   * 
+   *   buf - the chunk, as a Uint8Array
+   */
+  function parserFeed(pp, buf) {
+    
+    var p, c, n, skip;
+    var len = buf.length;
+    
+    p = 0;
+    while ((p < len) && (pp.err === null)) {
+      switch (pp.state) {
+        
+        case PS_PREMARK:
+          // Expecting the pre-marker byte
+          if (buf[p] !== 0xff) {
+            pp.err = "Missing pre-marker byte!";
+            break;
+          }
+          pp.mark_pos = pp.offset + p;
+          pp.state = PS_MARKER;
+          p++;
+          break;
+        
+        case PS_MARKER:
+          // Skip any additional pre-marker bytes; anything else is the
+          // marker byte
+          c = buf[p];
+          if (c === 0xff) {
+            pp.mark_pos = pp.offset + p;
+            p++;
+            break;
+          }
+          p++;
+          pp.marker = c;
+          parserMarker(pp);
+          break;
+        
+        case PS_LEN1:
+          pp.remain = buf[p] * 256;
+          pp.state = PS_LEN2;
+          p++;
+          break;
+        
+        case PS_LEN2:
+          pp.remain += buf[p];
+          p++;
+          if (pp.remain < 2) {
+            pp.err = "Marker length less than two!";
+            break;
+          }
+          pp.remain -= 2;
+          pp.state = PS_PAYLOAD;
+          break;
+        
+        case PS_PAYLOAD:
+          // Skip as much of the payload as is in this chunk, keeping the
+          // start of it
+          skip = Math.min(len - p, pp.remain);
+          n = Math.min(HEAD_MAX - pp.head_len, skip);
+          if (n > 0) {
+            pp.head.set(buf.subarray(p, p + n), pp.head_len);
+            pp.head_len += n;
+          }
+          p += skip;
+          pp.remain -= skip;
+          
+          if (pp.remain < 1) {
+            pp.err = pp.fMarker(pp.marker, pp.mark_pos, pp);
+            pp.eoi_read = false;
+            pp.head_len = 0;
+            if (pp.marker === MARK_SOS) {
+              pp.state = PS_ENTROPY;
+            } else {
+              pp.state = PS_PREMARK;
+            }
+          }
+          break;
+        
+        case PS_ENTROPY:
+          // Skip compressed data up to the next 0xFF byte
+          n = buf.indexOf(0xff, p);
+          if (n < 0) {
+            p = len;
+            break;
+          }
+          pp.mark_pos = pp.offset + n;
+          pp.state = PS_ENTROPY_FF;
+          p = n + 1;
+          break;
+        
+        case PS_ENTROPY_FF:
+          // Stuffed zeros and RST markers stay in the compressed data,
+          // DNL isn't supported, and anything else ends it
+          c = buf[p];
+          if (c === 0xff) {
+            pp.mark_pos = pp.offset + p;
+            p++;
+            break;
+          }
+          p++;
+          if ((c === 0) || ((c >= 0xd0) && (c <= 0xd7))) {
+            pp.state = PS_ENTROPY;
+          } else if (c === MARK_DNL) {
+            pp.err = "DNL markers not supported!";
+          } else {
+            pp.marker = c;
+            parserMarker(pp);
+          }
+          break;
+      }
+    }
+    
+    pp.offset += p;
+  }
+  
+  /*
+   * Tell the parser that the end of the stream has been reached, and
+   * check that it ended at a proper place, as jpeg_parserFinish() does.
+   * 
+   * Parameters:
+   * 
+   *   pp - the parser
+   */
+  function parserFinish(pp) {
+    if (pp.err !== null) {
+      return;
+    }
+    if (pp.state === PS_PREMARK) {
+      if (!pp.eoi_read) {
+        pp.err = "Missing EOI marker!";
+      }
+    } else if (pp.state === PS_MARKER) {
+      pp.err = "Missing marker byte!";
+    } else if (pp.state === PS_LEN1) {
+      pp.err = "Missing marker length!";
+    } else if (pp.state === PS_LEN2) {
+      pp.err = "Partial marker length!";
+    } else if (pp.state === PS_PAYLOAD) {
+      if (pp.marker === MARK_SOS) {
+        pp.err = "EOF in compressed stream!";
+      } else {
+        pp.err = "Missing EOI marker!";
+      }
+    } else {
+      pp.err = "EOF in compressed stream!";
+    }
+  }
+  
+  /*
+   * Scan a byte range of an M-JPEG file for frames.
+   * 
+   * This works the same way as a worker thread of mjpg_index -j.  If
+   * "first" is set, parsing starts at "start", which must be the first
+   * byte of a marker.  Otherwise, parsing starts at the first candidate
+   * SOI in the range, which is the sequence FF D8 FF, and if that fails
+   * to parse, the next candidate is tried, and so on.  Either way,
+   * frames are gathered until a frame starts at or after "end", which
+   * becomes the handoff point, or the end of the file is reached.  See
+   * mjpg_index.c for how the ranges are chained together.
+   * 
+   * As in mjpg_index -j, the frames reached by the failed candidate that
+   * got furthest are kept as dead ends.  A later candidate that is one
+   * of them is skipped, and a parse that reaches one fails at once,
+   * since it could only go on to the same error.  The last chunk read
+   * is kept, so that the next candidate after a failure is looked for
+   * without reading the file again.
+   * 
+   * The handler object h has the following functions:
+   * 
+   *   progress(done) - "done" bytes of the range have been scanned
+   * 
+   *   done(r) - the scan is over, with the result "r", as described
+   *   below
+   * 
+   *   fail() - the file couldn't be read
+   * 
+   * The result has "ok" set if parsing succeeded, or else the error
+   * message in "err".  If ok, "empty" is set if there were no
+   * candidates in the range, and otherwise "handoff" is the handoff
+   * point, or -1 if parsing reached the end of the file, and "count" is
+   * the number of frames found.  Each frame has its offset in "offs"
+   * and the offset just after its end in "ends", both Float64Arrays,
+   * and its width, height, components, SOF type, restart interval,
+   * scans, and flags, as in a v2 record, in the seven elements of the
+   * Uint16Array "info" from 7 times the frame index.
+   * 
+   * Parameters:
+   * 
+   *   file - the M-JPEG Blob or File object
+   * 
+   *   start - the start of the range
+   * 
+   *   end - the end of the range
+   * 
+   *   first - true to parse from the start of the range
+   * 
+   *   h - the handler
+   */
+  function scanRange(file, start, end, first, h) {
+    
+    var pp, rs, pos, cand, seen;
+    var dead = [];
+    var deadEnd = -1;
+    var last = null;
+    var lastAt = 0;
+    
+    // Report progress, as far as the furthest point read in the range
+    seen = 0;
+    function report(at) {
+      at = Math.min(at, end) - start;
+      if (at > seen) {
+        seen = at;
+        h.progress(seen);
+      }
+    }
+    
+    // Read the bytes from "pos" up to "n" as a Uint8Array, or only the
+    // start of them if the last chunk read has more than two of those,
+    // so that a candidate that straddles the end of it is still read
+    // whole; a part of the last chunk is handed over asynchronously, as
+    // a read would be
+    function readChunk(n, f) {
+      if ((last !== null) && (pos >= lastAt) &&
+          (pos + 2 < lastAt + last.length)) {
+        Promise.resolve(last.subarray(pos - lastAt,
+                          Math.min(n, lastAt + last.length) - lastAt))
+          .then(f);
+        return;
+      }
+      readRange(file, pos, n, function(buf) {
+        if (buf === false) {
+          f(false);
+          return;
+        }
+        last = new Uint8Array(buf);
+        lastAt = pos;
+        f(last);
+      });
+    }
+    
+    // Parse from the current candidate, a chunk at a time
+    function nextParse() {
+      
+      readChunk(Math.min(pos + SCAN_SIZE, file.size), function(b) {
+        
+        if (b === false) {
+          h.fail();
+          return;
+        }
+        parserFeed(pp, b);
+        pos += b.length;
+        report(pos);
+        
+        // Carry on until stopped, or the end of the file
+        if ((pp.err === null) && (pos < file.size)) {
+          nextParse();
+          return;
+        }
+        parserFinish(pp);
+        
+        // A stop at the handoff point is a success; if any other
+        // candidate fails, try the next one
+        if ((pp.err === null) || (pp.err === PARSE_STOP)) {
+          finishRange();
+        } else if (first) {
+          h.done({"ok": false, "err": pp.err});
+        } else {
+          // If this candidate got further than any before it, its
+          // frames, including the one it failed in, become the dead ends
+          if (pp.offset > deadEnd) {
+            if (rs.pending) {
+              rs.offs.push(rs.frame.offset);
+            }
+            dead = rs.offs;
+            deadEnd = pp.offset;
+          }
+          pos = cand + 1;
+          nextCandidate();
+        }
+      });
+    }
+    
+    // Look for the next candidate, a chunk at a time; each chunk after
+    // the first overlaps the one before by two bytes, so that it catches
+    // a candidate that straddles them, and the search goes up to two
+    // bytes past the end of the range so that a candidate at the very
+    // end is seen whole
+    function nextCandidate() {
+      
+      if (pos >= end) {
+        h.done({"ok": true, "empty": true});
+        return;
+      }
+      
+      readChunk(Math.min(pos + SCAN_SIZE, end + 2, file.size), function(b) {
+        
+        var n, k;
+        
+        if (b === false) {
+          h.fail();
+          return;
+        }
+        n = pos + b.length;
+        
+        // Find the first FF D8 FF in the chunk, skipping dead ends
+        k = b.indexOf(0xff);
+        while ((k >= 0) && (k + 2 < b.length)) {
+          if ((b[k + 1] === MARK_SOI) && (b[k + 2] === 0xff) &&
+              (offsetFind(dead, pos + k) < 0)) {
+            break;
+          }
+          k = b.indexOf(0xff, k + 1);
+        }
+        
+        // Parse from the candidate, or move on to the next chunk
+        if ((k >= 0) && (k + 2 < b.length)) {
+          cand = pos + k;
+          if (cand >= end) {
+            h.done({"ok": true, "empty": true});
+          } else {
+            startParse(cand);
+          }
+        } else if (n >= Math.min(end + 2, file.size)) {
+          h.done({"ok": true, "empty": true});
+        } else {
+          pos = Math.max(n - 2, pos + 1);
+          report(pos);
+          nextCandidate();
+        }
+      });
+    }
+    
+    // Start parsing from a given offset, with a fresh frame list
+    function startParse(from) {
+      rs = {
+        "end": end,
+        "pending": false,
+        "frame": null,
+        "handoff": -1,
+        "dead": dead,
+        "offs": [],
+        "ends": [],
+        "info": []
+      };
+      pp = parserInit(from, function(c, at, p) {
+        return scanMarker(rs, c, at, p);
+      });
+      pos = from;
+      nextParse();
+    }
+    
+    // Hand back the frames that were found
+    function finishRange() {
+      h.done({
+        "ok": true,
+        "empty": false,
+        "handoff": rs.handoff,
+        "count": rs.offs.length,
+        "offs": new Float64Array(rs.offs),
+        "ends": new Float64Array(rs.ends),
+        "info": new Uint16Array(rs.info)
+      });
+    }
+    
+    if (first) {
+      startParse(start);
+    } else {
+      pos = start;
+      nextCandidate();
+    }
+  }
+  
+  /*
+   * Marker function used by scanRange(), which gathers frames the same
+   * way as listMarker() and frameMarker() in mjpg_index.c.
+   * 
+   * Parameters:
+   * 
+   *   rs - the range state of scanRange()
+   * 
+   *   c - the marker byte
+   * 
+   *   pos - the offset of the 0xFF byte before the marker
+   * 
+   *   pp - the parser
+   * 
+   * Return:
+   * 
+   *   null to carry on, PARSE_STOP at the handoff point, or an error
+   *   message at a dead end
+   */
+  function scanMarker(rs, c, pos, pp) {
+    
+    var f = rs.frame;
+    var hd = pp.head;
+    
+    // Markers other than SOI belong to the current frame, if any, and
+    // EOI completes it
+    if (c !== MARK_SOI) {
+      if (!rs.pending) {
+        return null;
+      }
+      if (c === MARK_EOI) {
+        f.end = pos + 2;
+        scanAppend(rs);
+        
+      } else if ((c >= 0xc0) && (c <= 0xcf) &&
+                  (c !== 0xc4) && (c !== 0xc8) && (c !== 0xcc)) {
+        if ((f.sof === 0) && (pp.head_len >= 6)) {
+          f.sof = c;
+          f.height = (hd[1] * 256) + hd[2];
+          f.width = (hd[3] * 256) + hd[4];
+          f.components = hd[5];
+        }
+        
+      } else if (c === MARK_DRI) {
+        if ((f.scans === 0) && (pp.head_len >= 2)) {
+          f.restart = (hd[0] * 256) + hd[1];
+        }
+        
+      } else if (c === MARK_SOS) {
+        if (f.scans < 0xffff) {
+          f.scans++;
+        }
+      }
+      return null;
+    }
+    
+    // If the previous frame never had an EOI, it runs up to this frame
+    if (rs.pending) {
+      f.end = pos;
+      f.flags |= FRAME_FLAG_NO_EOI;
+      scanAppend(rs);
+    }
+    
+    // Stop at the handoff point
+    if (pos >= rs.end) {
+      rs.handoff = pos;
+      return PARSE_STOP;
+    }
+    
+    // Stop at a frame that a failed candidate has already reached
+    if (offsetFind(rs.dead, pos) >= 0) {
+      return "Frame already failed to parse!";
+    }
+    
+    // Start the next frame
+    rs.frame = {
+      "offset": pos,
+      "end": 0,
+      "width": 0,
+      "height": 0,
+      "components": 0,
+      "sof": 0,
+      "restart": 0,
+      "scans": 0,
+      "flags": 0
+    };
+    rs.pending = true;
+    return null;
+  }
+  
+  /*
+   * Add the current frame to the frame list of scanRange().
+   * 
+   * Parameters:
+   * 
+   *   rs - the range state of scanRange()
+   */
+  function scanAppend(rs) {
+    var f = rs.frame;
+    rs.pending = false;
+    rs.offs.push(f.offset);
+    rs.ends.push(f.end);
+    rs.info.push(f.width, f.height, f.components, f.sof, f.restart,
+                  f.scans, f.flags);
+  }
+  
+  /*
+   * Find an offset in an ascending array of frame offsets.
+   * 
+   * Parameters:
+   * 
+   *   a - the array of offsets
+   * 
+   *   offset - the offset to look for
+   * 
+   * Return:
+   * 
+   *   the index of the offset in the array, or -1 if not found
+   */
+  function offsetFind(a, offset) {
+    
+    var lo, hi, mid;
+    
+    lo = 0;
+    hi = a.length - 1;
+    while (lo <= hi) {
+      mid = Math.floor((lo + hi) / 2);
+      if (a[mid] < offset) {
+        lo = mid + 1;
+      } else if (a[mid] > offset) {
+        hi = mid - 1;
+      } else {
+        return mid;
+      }
+    }
+    return -1;
+  }
+  
+  /*
+   * Handle the request to load an index or scan a range when running as
+   * a worker, replying with messages as described at the top of this
+   * file.
+   */
+  function handleMessage(ev) {
+    
+    var d = ev.data;
+    
+    if (d.scan) {
+      scanRange(d.file, d.start, d.end, d.first, {
+        "progress": function(done) {
+          self.postMessage({"type": "progress", "done": done});
+        },
+        "done": function(r) {
+          var xfer = [];
+          if (r.ok && (!r.empty)) {
+            xfer.push(r.offs.buffer, r.ends.buffer, r.info.buffer);
+          }
+          self.postMessage({"type": "range", "r": r}, xfer);
+        },
+        "fail": function() {
+          self.postMessage({"type": "fail"});
+        }
+      });
+      return;
+    }
+    
+    loadIndex(ev.data.file, ev.data.fsize, {
+      "first": function(begin, end) {
+        self.postMessage({"type": "first", "begin": begin, "end": end});
+      },
+      "progress": function(done, total) {
+        self.postMessage({"type": "progress", "done": done,
+                          "total": total});
+      },
+      "done": function(index, ends) {
+        var xfer = [index.buffer];
+        if (ends) {
+          xfer.push(ends.buffer);
+        }
+        self.postMessage({"type": "done", "index": index, "ends": ends},
+                          xfer);
+      },
+      "raw": function(buf, packed) {
+        self.postMessage({"type": "raw", "buf": buf, "packed": packed},
+                          [buf]);
+      },
+      "error": function(code) {
+        self.postMessage({"type": "error", "code": code});
+      },
+      "fail": function() {
+        self.postMessage({"type": "fail"});
+      }
+    });
+  }
+  
+  /*
+   * Export declarations
+   * ===================
+   * 
+   * The loader and scanner are declared within a global "mjvIndex"
+   * object, and when running as a worker, requests are taken from
+   * messages.
+   */
+  self.mjvIndex = {
+    "load": loadIndex,
+    "scan": scanRange
+  };
+  
+  if ((typeof document === "undefined") &&
+      (typeof importScripts === "function")) {
+    self.onmessage = handleMessage;
+  }
+  
+}());